@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <signal.h>
 #include "debug.h"
 #include "util.h"
 
@@ -32,6 +33,37 @@ static int fticks_syslogfacility = 0;
 static uint8_t debug_timestamp = 0;
 static uint8_t debug_tid = 0;
 
+/* Once debug_async_start() is called, messages are formatted into
+ * records of a ring and written by a separate thread, so that threads
+ * handling requests never wait for a slow disk or syslog socket. Any
+ * number of threads may add records; a slot is claimed by advancing
+ * debug_ringhead, and seq of the slot tells whether it is free, written
+ * or read, as in the bounded queue of Dmitry Vyukov. If the ring is full
+ * the message is dropped and counted. A record with a format function
+ * holds data that the writer formats into the message, so that F-Ticks
+ * records are hashed off the request path. */
+#define DEBUG_RECORD_LEN 1024
+#define DEBUG_BATCH_LEN 65536
+
+struct debug_record {
+    uint32_t seq;
+    uint8_t level;
+    struct timeval time;
+    void (*format)(char *buf, size_t len, const void *data);
+    char tid[32]; /* thread id of a record with a format function */
+    char msg[DEBUG_RECORD_LEN];
+};
+
+static struct debug_record *debug_ring = NULL;
+static uint32_t debug_ringmask;
+static uint32_t debug_ringhead = 0, debug_ringtail = 0;
+static uint64_t debug_dropped = 0, debug_fticksdropped = 0;
+static uint8_t debug_writersleeping = 0;
+/* held while the writer uses debug_file, and when reopening it */
+static pthread_mutex_t debug_filelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t debug_waitlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t debug_waitcond = PTHREAD_COND_INITIALIZER;
+
 void debug_init(char *ident) {
     debug_file = stderr;
     setvbuf(debug_file, NULL, _IONBF, 0);
@@ -136,18 +168,268 @@ void debug_reopen_log() {
 	return;
     }
 
+    pthread_mutex_lock(&debug_filelock);
     if (debug_file != stderr)
 	fclose(debug_file);
 
     debug_file = fopen(debug_filepath, "a");
-    if (debug_file)
-	debug(DBG_ERR, "Reopened logfile %s", debug_filepath);
-    else {
+    if (!debug_file)
 	debug_file = stderr;
+    setvbuf(debug_file, NULL, _IONBF, 0);
+    pthread_mutex_unlock(&debug_filelock);
+
+    if (debug_file != stderr)
+	debug(DBG_ERR, "Reopened logfile %s", debug_filepath);
+    else
 	debug(DBG_ERR, "Failed to open logfile %s, using stderr\n%s",
 	      debug_filepath, strerror(errno));
+}
+
+static int debug_priority(uint8_t level) {
+    switch (level) {
+    case DBG_DBG:
+	return LOG_DEBUG;
+    case DBG_INFO:
+	return LOG_INFO;
+    case DBG_NOTICE:
+	return LOG_NOTICE;
+    case DBG_WARN:
+	return LOG_WARNING;
+    case DBG_ERR:
+	return LOG_ERR;
+    default:
+	return LOG_DEBUG;
     }
-    setvbuf(debug_file, NULL, _IONBF, 0);
+}
+
+/* writes the thread id followed by a space to buf, returns its length */
+static int debug_formattid(char *buf, size_t len) {
+#ifdef __linux__
+    pid_t tid = syscall(SYS_gettid);
+    return snprintf(buf, len, "(%u) ", tid);
+#else
+    pthread_t tid = pthread_self();
+    uint8_t *ptid = (uint8_t *)&tid;
+    int i, n = 0;
+
+    n += snprintf(buf + n, len - n, "(");
+    for (i = sizeof(tid)-1; i >= 0; i--)
+	n += snprintf(buf + n, len - n, "%02x", ptid[i]);
+    n += snprintf(buf + n, len - n, ") ");
+    return n;
+#endif
+}
+
+/* claims the next free record of the ring and sets *pos to its position,
+ * returns NULL and counts the drop if the ring is full */
+static struct debug_record *debug_claim(uint8_t level, uint32_t *pos) {
+    struct debug_record *rec;
+    uint32_t seq;
+
+    *pos = __sync_fetch_and_add(&debug_ringhead, 0);
+    for (;;) {
+	rec = &debug_ring[*pos & debug_ringmask];
+	seq = __sync_fetch_and_add(&rec->seq, 0);
+	if (seq == *pos) {
+	    if (__sync_bool_compare_and_swap(&debug_ringhead, *pos, *pos + 1))
+		break;
+	    *pos = __sync_fetch_and_add(&debug_ringhead, 0);
+	} else if ((int32_t)(seq - *pos) < 0) {
+	    __sync_fetch_and_add(&debug_dropped, 1);
+	    if (level == 0xff)
+		__sync_fetch_and_add(&debug_fticksdropped, 1);
+	    return NULL;
+	} else
+	    *pos = __sync_fetch_and_add(&debug_ringhead, 0);
+    }
+
+    rec->level = level;
+    rec->format = NULL;
+    gettimeofday(&rec->time, NULL);
+    return rec;
+}
+
+/* hands a claimed record over to the writer */
+static void debug_publish(struct debug_record *rec, uint32_t pos) {
+    __sync_synchronize();
+    rec->seq = pos + 1;
+    __sync_synchronize();
+
+    if (debug_writersleeping) {
+	pthread_mutex_lock(&debug_waitlock);
+	pthread_cond_signal(&debug_waitcond);
+	pthread_mutex_unlock(&debug_waitlock);
+    }
+}
+
+/* adds a record to the ring, level 0xff is F-Ticks */
+static void debug_enqueue(uint8_t level, const char *format, va_list ap) {
+    struct debug_record *rec;
+    uint32_t pos;
+    int n = 0;
+
+    rec = debug_claim(level, &pos);
+    if (!rec)
+	return;
+    if (debug_tid)
+	n = debug_formattid(rec->msg, sizeof(rec->msg));
+    vsnprintf(rec->msg + n, sizeof(rec->msg) - n, format, ap);
+    debug_publish(rec, pos);
+}
+
+/* writes rec to syslog, or appends it to batch to be written to the file */
+static void debug_writerecord(struct debug_record *rec, char *batch, size_t *batchlen) {
+    char timebuf[32];
+    int n;
+
+    if (rec->level == 0xff ? debug_syslogfacility || fticks_syslogfacility : debug_syslogfacility) {
+	syslog(rec->level == 0xff ? LOG_DEBUG | fticks_syslogfacility : debug_priority(rec->level),
+	       "%s", rec->msg);
+	return;
+    }
+
+    if (*batchlen + sizeof(timebuf) + sizeof(rec->msg) + 1 > DEBUG_BATCH_LEN) {
+	fwrite(batch, 1, *batchlen, debug_file);
+	*batchlen = 0;
+    }
+    if (debug_timestamp) {
+	ctime_r(&rec->time.tv_sec, timebuf);
+	timebuf[strlen(timebuf) - 1] = '\0';
+	*batchlen += sprintf(batch + *batchlen, "%s: ", timebuf + 4);
+    }
+    n = strlen(rec->msg);
+    memcpy(batch + *batchlen, rec->msg, n);
+    *batchlen += n;
+    batch[(*batchlen)++] = '\n';
+}
+
+/* writes all records that are ready, returns how many */
+static uint32_t debug_drain(char *batch) {
+    struct debug_record *rec, note;
+    uint32_t count = 0;
+    int n;
+    uint64_t dropped, fticksdropped;
+    size_t batchlen = 0;
+
+    pthread_mutex_lock(&debug_filelock);
+    for (;;) {
+	rec = &debug_ring[debug_ringtail & debug_ringmask];
+	if (__sync_fetch_and_add(&rec->seq, 0) != debug_ringtail + 1)
+	    break;
+	if (rec->format) {
+	    n = snprintf(note.msg, sizeof(note.msg), "%s", rec->tid);
+	    rec->format(note.msg + n, sizeof(note.msg) - n, rec->msg);
+	    memcpy(rec->msg, note.msg, sizeof(rec->msg));
+	}
+	debug_writerecord(rec, batch, &batchlen);
+	__sync_synchronize();
+	rec->seq = debug_ringtail + debug_ringmask + 1;
+	debug_ringtail++;
+	count++;
+    }
+
+    dropped = __sync_fetch_and_and(&debug_dropped, 0);
+    fticksdropped = __sync_fetch_and_and(&debug_fticksdropped, 0);
+    if (dropped) {
+	note.level = DBG_WARN;
+	gettimeofday(&note.time, NULL);
+	snprintf(note.msg, sizeof(note.msg), "debug: log queue full, dropped %llu messages, %llu of them F-Ticks",
+		 (unsigned long long)dropped, (unsigned long long)fticksdropped);
+	debug_writerecord(&note, batch, &batchlen);
+    }
+
+    if (batchlen)
+	fwrite(batch, 1, batchlen, debug_file);
+    pthread_mutex_unlock(&debug_filelock);
+    return count;
+}
+
+static void *debug_writer(void *arg) {
+    char *batch = arg;
+    struct timespec timeout;
+
+    for (;;) {
+	if (debug_drain(batch))
+	    continue;
+
+	pthread_mutex_lock(&debug_waitlock);
+	debug_writersleeping = 1;
+	__sync_synchronize();
+	if (__sync_fetch_and_add(&debug_ring[debug_ringtail & debug_ringmask].seq, 0) != debug_ringtail + 1) {
+	    clock_gettime(CLOCK_REALTIME, &timeout);
+	    timeout.tv_sec++;
+	    pthread_cond_timedwait(&debug_waitcond, &debug_waitlock, &timeout);
+	}
+	debug_writersleeping = 0;
+	pthread_mutex_unlock(&debug_waitlock);
+    }
+    return NULL;
+}
+
+/* A child forked to run a command has no writer, and may have been forked
+ * while another thread held one of the locks. It logs directly */
+static void debug_atforkchild() {
+    debug_ring = NULL;
+    pthread_mutex_init(&debug_filelock, NULL);
+    pthread_mutex_init(&debug_waitlock, NULL);
+    pthread_cond_init(&debug_waitcond, NULL);
+}
+
+int debug_async_start(uint32_t size) {
+    pthread_t writer;
+    pthread_attr_t attr;
+    sigset_t sigset, oldset;
+    uint32_t n, i;
+    char *batch;
+
+    if (debug_ring || !size)
+	return 1;
+    for (n = 1; n < size; n <<= 1);
+
+    debug_ring = malloc(n * sizeof(struct debug_record));
+    batch = malloc(DEBUG_BATCH_LEN);
+    if (!debug_ring || !batch) {
+	free(debug_ring);
+	debug_ring = NULL;
+	free(batch);
+	return 0;
+    }
+    for (i = 0; i < n; i++)
+	debug_ring[i].seq = i;
+    debug_ringmask = n - 1;
+
+    /* signals are for the other threads */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    n = pthread_create(&writer, &attr, debug_writer, batch);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (n) {
+	free(debug_ring);
+	debug_ring = NULL;
+	free(batch);
+	return 0;
+    }
+    pthread_atfork(NULL, NULL, debug_atforkchild);
+    return 1;
+}
+
+/* waits a while for the writer to write what is in the ring */
+static void debug_flush() {
+    struct timespec interval = { 0, 1000000 };
+    int i;
+
+    if (!debug_ring)
+	return;
+    for (i = 0; i < 1000; i++) {
+	if (__sync_fetch_and_add(&debug_ringtail, 0) == __sync_fetch_and_add(&debug_ringhead, 0))
+	    break;
+	nanosleep(&interval, NULL);
+    }
+    pthread_mutex_lock(&debug_filelock);
+    pthread_mutex_unlock(&debug_filelock);
 }
 
 void debug_logit(uint8_t level, const char *format, va_list ap) {
@@ -155,6 +437,11 @@ void debug_logit(uint8_t level, const char *format, va_list ap) {
     char *timebuf, *tidbuf, *tmp = NULL;
     int priority;
 
+    if (debug_ring) {
+	debug_enqueue(level, format, ap);
+	return;
+    }
+
     if (debug_tid) {
 #ifdef __linux__
         pid_t tid = syscall(SYS_gettid);
@@ -178,25 +465,7 @@ void debug_logit(uint8_t level, const char *format, va_list ap) {
     }
 
     if (debug_syslogfacility) {
-	switch (level) {
-	case DBG_DBG:
-	    priority = LOG_DEBUG;
-	    break;
-	case DBG_INFO:
-	    priority = LOG_INFO;
-	    break;
-	case DBG_NOTICE:
-	    priority = LOG_NOTICE;
-	    break;
-	case DBG_WARN:
-	    priority = LOG_WARNING;
-	    break;
-	case DBG_ERR:
-	    priority = LOG_ERR;
-	    break;
-	default:
-	    priority = LOG_DEBUG;
-	}
+	priority = debug_priority(level);
 	vsyslog(priority, format, ap);
     } else {
 	if (debug_timestamp && (timebuf = malloc(256))) {
@@ -228,6 +497,7 @@ void debugx(int status, uint8_t level, char *format, ...) {
 	debug_logit(level, format, ap);
 	va_end(ap);
     }
+    debug_flush();
     exit(status);
 }
 
@@ -235,13 +505,17 @@ void debugerrno(int err, uint8_t level, char *format, ...) {
     if (level >= debug_level) {
 	va_list ap;
 	size_t len = strlen(format);
-	char *tmp = malloc(len + 1024 + 2);
-	assert(tmp);
-	strcpy(tmp, format);
-	tmp[len++] = ':';
-	tmp[len++] = ' ';
-	if (strerror_r(err, tmp + len, 1024))
+	char buf[DEBUG_RECORD_LEN], *tmp = buf;
+
+	if (len + 2 >= sizeof(buf))
 	    tmp = format;
+	else {
+	    strcpy(tmp, format);
+	    tmp[len++] = ':';
+	    tmp[len++] = ' ';
+	    if (strerror_r(err, tmp + len, sizeof(buf) - len))
+		tmp = format;
+	}
 	va_start(ap, format);
 	debug_logit(level, tmp, ap);
 	va_end(ap);
@@ -255,6 +529,7 @@ void debugerrnox(int err, uint8_t level, char *format, ...) {
 	debugerrno(err, level, format, ap);
 	va_end(ap);
     }
+    debug_flush();
     exit(err);
 }
 
@@ -262,7 +537,9 @@ void fticks_debug(const char *format, ...) {
     int priority;
     va_list ap;
     va_start(ap, format);
-    if (!debug_syslogfacility && !fticks_syslogfacility)
+    if (debug_ring)
+	debug_enqueue(0xff, format, ap);
+    else if (!debug_syslogfacility && !fticks_syslogfacility)
     	debug_logit(0xff, format, ap);
     else {
     	priority = LOG_DEBUG | fticks_syslogfacility;
@@ -270,6 +547,34 @@ void fticks_debug(const char *format, ...) {
     }
     va_end(ap);
 }
+
+void fticks_debug_deferred(void (*format)(char *buf, size_t len, const void *data),
+			   const void *data, size_t datalen) {
+    struct debug_record *rec;
+    char buf[DEBUG_RECORD_LEN];
+    uint32_t pos;
+
+    if (datalen > DEBUG_RECORD_LEN) {
+	debug(DBG_ERR, "fticks_debug_deferred: record of %zu bytes too long", datalen);
+	return;
+    }
+    if (!debug_ring) {
+	format(buf, sizeof(buf), data);
+	fticks_debug("%s", buf);
+	return;
+    }
+    rec = debug_claim(0xff, &pos);
+    if (!rec)
+	return;
+    memcpy(rec->msg, data, datalen);
+    rec->format = format;
+    /* the writer formats it, but the thread id is ours */
+    if (debug_tid)
+	debug_formattid(rec->tid, sizeof(rec->tid));
+    else
+	rec->tid[0] = '\0';
+    debug_publish(rec, pos);
+}
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
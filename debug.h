@@ -5,6 +5,7 @@
 #ifndef SYS_SOLARIS9
 #include <stdint.h>
 #endif
+#include <stddef.h>
 
 #define DBG_DBG 8
 #define DBG_INFO 16
@@ -27,6 +28,13 @@ void debugerrnox(int err, uint8_t level, char *format, ...);
 int debug_set_destination(char *dest, int log_type);
 void debug_reopen_log();
 void fticks_debug(const char *format, ...);
+/* logs an F-Ticks message that format() makes of datalen bytes of data,
+ * copied now and formatted by the log writer when there is one */
+void fticks_debug_deferred(void (*format)(char *buf, size_t len, const void *data),
+			   const void *data, size_t datalen);
+/* from now on, have a separate thread write the log messages, queueing
+ * up to size of them. Returns 0 on failure */
+int debug_async_start(uint32_t size);
 
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
@@ -22,6 +22,8 @@
 #include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
 #include "hash.h"
@@ -30,7 +32,9 @@
 #ifdef RADPROT_DTLS
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
 #include "hostport.h"
+#include "metrics.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
@@ -38,7 +42,7 @@ void *dtlslistener(void *arg);
 int dtlsconnect(struct server *server, int timeout, char *text);
 void *dtlsclientrd(void *arg);
 int clientradputdtls(struct server *server, unsigned char *rad);
-void addserverextradtls(struct clsrvconf *conf);
+void addserverextradtls(struct server *server);
 void dtlssetsrcres();
 void initextradtls();
 
@@ -58,6 +62,7 @@ static const struct protodefs protodefs = {
     dtlsconnect, /* connecter */
     dtlsclientrd, /* clientconnreader */
     clientradputdtls, /* clientradput */
+    NULL, /* clientradflush */
     NULL, /* addclient */
     NULL, /* addserverextra */
     dtlssetsrcres, /* setsrcres */
@@ -81,12 +86,6 @@ static char **getlistenerargs() {
     return protoopts ? protoopts->listenargs : NULL;
 }
 
-struct dtlsservernewparams {
-    struct sockaddr_storage addr;
-    struct sockaddr_storage bind;
-    SSL *ssl;
-};
-
 void dtlssetsrcres() {
     if (!srcres)
 	srcres =
@@ -176,7 +175,7 @@ unsigned char *raddtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
         pthread_mutex_unlock(lock);
         return NULL;
     }
-    rad = malloc(len);
+    rad = pool_bufalloc(len);
     if (!rad) {
         debug(DBG_ERR, "raddtlsget: malloc failed");
         return NULL;
@@ -185,7 +184,7 @@ unsigned char *raddtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
 
     cnt = dtlsread(ssl, rad + 4, len - 4, timeout, lock);
     if (cnt < 1) {
-        free(rad);
+        pool_buffree(rad);
         return NULL;
     }
 
@@ -193,261 +192,647 @@ unsigned char *raddtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
     return rad;
 }
 
-void *dtlsserverwr(void *arg) {
-    int cnt;
-    unsigned long error;
-    struct client *client = (struct client *)arg;
-    struct gqueue *replyq;
-    struct request *reply;
-    char tmp[INET6_ADDRSTRLEN];
+/* The DTLS server side. The listener thread of each socket reads all
+ * datagrams arriving on it and hands them to one of DTLS_WORKERS worker
+ * threads, chosen by hashing the socket and the peer address, so that all
+ * records from a peer are handled by the same worker and in order. Each
+ * worker keeps a hash of its peers with an SSL object per peer. The SSL
+ * objects use a BIO reading the datagram being handled from memory and
+ * sending records directly on the shared socket, so there is no socket or
+ * thread per peer. A peer is only added once its ClientHello has our
+ * cookie, see dtlslisten(). Replies are queued on the client replyq as
+ * usual, sendreply() wakes the worker through the queue wakeup hook. */
+
+#define DTLS_WORKERS 4
+#define DTLS_LINK_MTU 1500
+#define DTLS_MAXDATAGRAM 65536
+#define DTLS_MAXQUEUE 8192 /* datagrams waiting for a worker */
+#define DTLS_MAXHANDSHAKES 1024 /* peers in handshake per worker */
+#define DTLS_HANDSHAKE_TIMEOUT 30
+
+/* the listening socket and the peer address, identifying a peer */
+struct dtlspeerkey {
+    int sock;
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+};
 
-    debug(DBG_DBG, "dtlsserverwr: starting for %s", addr2string(client->addr, tmp, sizeof(tmp)));
-    replyq = client->replyq;
-    for (;;) {
-        pthread_mutex_lock(&replyq->mutex);
-        while (!list_first(replyq->entries)) {
-            if (client->ssl) {
-                debug(DBG_DBG, "dtlsserverwr: waiting for signal");
-                pthread_cond_wait(&replyq->cond, &replyq->mutex);
-                debug(DBG_DBG, "dtlsserverwr: got signal");
-            } else
-                break;
-        }
+struct dtlsdatagram {
+    struct dtlspeerkey key;
+    struct sockaddr_storage addr;
+    int len;
+    unsigned char data[];
+};
 
-        reply = (struct request *)list_shift(replyq->entries);
-        pthread_mutex_unlock(&replyq->mutex);
-
-        pthread_mutex_lock(&client->lock);
-        if (!client->ssl) {
-            /* ssl might have changed while waiting */
-            pthread_mutex_unlock(&client->lock);
-            if (reply)
-                freerq(reply);
-            debug(DBG_DBG, "tlsserverwr: exiting as requested");
-            pthread_exit(NULL);
-        }
+struct dtlsworker {
+    pthread_t thread;
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t cond;
+    struct list *datagrams;
+    uint32_t ndatagrams;
+    struct list *pending; /* peers with queued replies */
+    uint8_t woken;
+    /* only used by the worker thread */
+    struct hash *peers;
+    struct list *handshaking;
+    SSL *listenssl; /* checks cookies of new peers, see dtlslisten() */
+    SSL_CTX *listenctx;
+    unsigned char rbuf[SSL3_RT_MAX_PLAIN_LENGTH];
+};
 
-        while ((cnt = SSL_write(client->ssl, reply->replybuf, RADLEN(reply->replybuf))) <= 0) {
-            switch (SSL_get_error(client->ssl, cnt)) {
-                case SSL_ERROR_WANT_READ:
-                case SSL_ERROR_WANT_WRITE:
-                    continue;
-                default:
-                    while ((error = ERR_get_error()))
-                        debug(DBG_ERR, "dtlsserverwr: SSL: %s", ERR_error_string(error, NULL));
-                    pthread_mutex_unlock(&client->lock);
-                    freerq(reply);
-                    debug(DBG_DBG, "tlsserverwr: SSL error. exiting.");
-                    pthread_exit(NULL);
-            }
-        }
-        debug(DBG_DBG, "dtlsserverwr: sent %d bytes, Radius packet of length %d to %s",
-            cnt, RADLEN(reply->replybuf), addr2string(client->addr, tmp, sizeof(tmp)));
-        pthread_mutex_unlock(&client->lock);
-        freerq(reply);
+struct dtlspeer {
+    struct dtlsworker *worker;
+    struct dtlspeerkey key;
+    struct sockaddr_storage addr;
+    SSL *ssl;
+    struct clsrvconf *conf;
+    struct client *client; /* set once the handshake is done */
+    const unsigned char *in; /* the datagram being handled */
+    int inlen;
+    time_t created, lastread;
+    uint8_t pending; /* protected by worker lock */
+};
+
+static struct dtlsworker *dtlsworkers = NULL;
+static uint64_t dtlspeerhashkey[2];
+static BIO_METHOD *dtlsbiomethod = NULL;
+static pthread_once_t dtlsworkersonce = PTHREAD_ONCE_INIT;
+
+/* records are sent right away on the listening socket; as for UDP, a
+ * datagram that cannot be sent is lost */
+static int dtlsbiowrite(BIO *b, const char *buf, int len) {
+    struct dtlspeer *peer = (struct dtlspeer *)BIO_get_data(b);
+
+    if (sendto(peer->key.sock, buf, len, 0, (struct sockaddr *)&peer->addr, SOCKADDR_SIZE(peer->addr)) < 0)
+	debugerrno(errno, DBG_DBG, "dtlsbiowrite: sendto failed");
+    return len;
+}
+
+/* returns the datagram being handled, once */
+static int dtlsbioread(BIO *b, char *buf, int len) {
+    struct dtlspeer *peer = (struct dtlspeer *)BIO_get_data(b);
+    int cnt = peer->inlen;
+
+    BIO_clear_retry_flags(b);
+    if (!cnt) {
+	BIO_set_retry_read(b);
+	return -1;
     }
+    if (cnt > len)
+	cnt = len;
+    memcpy(buf, peer->in, cnt);
+    peer->inlen = 0;
+    return cnt;
 }
 
-void dtlsserverrd(struct client *client) {
-    struct request *rq;
-    uint8_t *buf;
-    pthread_t dtlsserverwrth;
+static long dtlsbioctrl(BIO *b, int cmd, long num, void *ptr) {
+    struct dtlspeer *peer = (struct dtlspeer *)BIO_get_data(b);
+
+    switch (cmd) {
+    case BIO_CTRL_FLUSH:
+	return 1;
+    case BIO_CTRL_DGRAM_GET_PEER:
+	/* used by the cookie callbacks */
+	memcpy(ptr, &peer->addr, SOCKADDR_SIZE(peer->addr));
+	return SOCKADDR_SIZE(peer->addr);
+    case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD:
+	return peer->addr.ss_family == AF_INET6 ? 48 : 28;
+    default:
+	return 0;
+    }
+}
+
+static int dtlsbiocreate(BIO *b) {
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+/* returns 0 if the address family is not supported */
+static int dtlspeerkeyset(struct dtlspeerkey *key, int sock, struct sockaddr *addr) {
+    memset(key, 0, sizeof(struct dtlspeerkey));
+    key->sock = sock;
+    key->family = addr->sa_family;
+    switch (addr->sa_family) {
+    case AF_INET:
+	key->port = ((struct sockaddr_in *)addr)->sin_port;
+	memcpy(key->addr, &((struct sockaddr_in *)addr)->sin_addr, 4);
+	return 1;
+    case AF_INET6:
+	key->port = ((struct sockaddr_in6 *)addr)->sin6_port;
+	memcpy(key->addr, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+	return 1;
+    }
+    return 0;
+}
+
+/* checks for a handshake record in epoch 0 holding a ClientHello */
+static int dtlsisclienthello(const unsigned char *buf, int len) {
+    return len > DTLS1_RT_HEADER_LENGTH && buf[0] == SSL3_RT_HANDSHAKE && !buf[3] && !buf[4] &&
+	buf[DTLS1_RT_HEADER_LENGTH] == SSL3_MT_CLIENT_HELLO;
+}
+
+/* called by sendreply() with the replyq mutex held */
+static void dtlspeerwakeup(void *arg) {
+    struct dtlspeer *peer = (struct dtlspeer *)arg;
+    struct dtlsworker *w = peer->worker;
+
+    pthread_mutex_lock(&w->lock);
+    if (!peer->pending) {
+	if (list_push(w->pending, peer))
+	    peer->pending = 1;
+	else
+	    debug(DBG_ERR, "dtlspeerwakeup: malloc failed");
+    }
+    if (!w->woken) {
+	w->woken = 1;
+	pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* checks the cookie of a ClientHello without keeping state for the
+ * peer, sending a HelloVerifyRequest if it has none or a wrong one, so
+ * that spoofed ClientHellos do not take handshake slots. Returns the SSL
+ * object holding the ClientHello once the cookie is right, else NULL */
+static SSL *dtlslisten(struct dtlsworker *w, struct clsrvconf *conf, struct dtlsdatagram *d) {
+    struct dtlspeer hello;
+    BIO_ADDR *client;
+    SSL_CTX *ctx;
+    SSL *ssl;
+    BIO *bio;
+    int ret;
+
+    pthread_mutex_lock(&conf->tlsconf->lock);
+    ctx = tlsgetctx(handle, conf->tlsconf);
+    if (ctx && ctx != w->listenctx) {
+	if (w->listenssl)
+	    SSL_free(w->listenssl);
+	w->listenssl = SSL_new(ctx);
+	w->listenctx = ctx;
+	if (w->listenssl) {
+	    bio = BIO_new(dtlsbiomethod);
+	    if (bio) {
+		SSL_set_bio(w->listenssl, bio, bio);
+		SSL_set_options(w->listenssl, SSL_OP_COOKIE_EXCHANGE | SSL_OP_NO_QUERY_MTU);
+		DTLS_set_link_mtu(w->listenssl, DTLS_LINK_MTU);
+	    } else {
+		SSL_free(w->listenssl);
+		w->listenssl = NULL;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&conf->tlsconf->lock);
+    ssl = w->listenssl;
+    if (!ctx || !ssl) {
+	debug(DBG_ERR, "dtlslisten: failed to set up DTLS for %s", conf->name);
+	w->listenctx = NULL;
+	return NULL;
+    }
+
+    /* the BIO only needs the socket, the address and the datagram */
+    memset(&hello, 0, sizeof(hello));
+    hello.key = d->key;
+    hello.addr = d->addr;
+    hello.in = d->data;
+    hello.inlen = d->len;
+    BIO_set_data(SSL_get_rbio(ssl), &hello);
+    client = BIO_ADDR_new();
+    ret = client ? DTLSv1_listen(ssl, client) : -1;
+    BIO_ADDR_free(client);
+    ERR_clear_error();
+    if (ret > 0) {
+	w->listenssl = NULL;
+	w->listenctx = NULL;
+	return ssl;
+    }
+    if (ret < 0) {
+	SSL_free(ssl);
+	w->listenssl = NULL;
+	w->listenctx = NULL;
+    } else
+	BIO_set_data(SSL_get_rbio(ssl), NULL);
+    return NULL;
+}
+
+/* takes ssl from dtlslisten(), which has read the ClientHello */
+static struct dtlspeer *dtlspeernew(struct dtlsworker *w, struct dtlsdatagram *d, struct clsrvconf *conf, SSL *ssl) {
+    struct dtlspeer *peer;
     char tmp[INET6_ADDRSTRLEN];
 
-    debug(DBG_DBG, "dtlsserverrd: starting for %s", addr2string(client->addr, tmp, sizeof(tmp)));
+    peer = calloc(1, sizeof(struct dtlspeer));
+    if (!peer) {
+	debug(DBG_ERR, "dtlspeernew: malloc failed");
+	SSL_free(ssl);
+	return NULL;
+    }
+    peer->worker = w;
+    peer->key = d->key;
+    peer->addr = d->addr;
+    peer->conf = conf;
+    peer->created = time(NULL);
+    peer->ssl = ssl;
+    BIO_set_data(SSL_get_rbio(ssl), peer);
+
+    if (!hash_insert(w->peers, &peer->key, sizeof(peer->key), peer))
+	goto errexit;
+    if (!list_push(w->handshaking, peer)) {
+	hash_extract(w->peers, &peer->key, sizeof(peer->key));
+	goto errexit;
+    }
+    return peer;
 
-    if (pthread_create(&dtlsserverwrth, &pthread_attr, dtlsserverwr, (void *)client)) {
-	debug(DBG_ERR, "dtlsserverrd: pthread_create failed");
-	return;
+errexit:
+    debug(DBG_ERR, "dtlspeernew: failed to set up DTLS for %s", addr2string((struct sockaddr *)&d->addr, tmp, sizeof(tmp)));
+    SSL_free(peer->ssl);
+    free(peer);
+    return NULL;
+}
+
+static void dtlspeerclose(struct dtlspeer *peer) {
+    struct dtlsworker *w = peer->worker;
+    char tmp[INET6_ADDRSTRLEN];
+
+    hash_extract(w->peers, &peer->key, sizeof(peer->key));
+    if (peer->client) {
+	debug(DBG_ERR, "dtlspeerclose: connection from %s lost", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+	/* no more wakeups once the client and its replyq are removed */
+	removeclient(peer->client);
+	pthread_mutex_lock(&w->lock);
+	if (peer->pending)
+	    list_removedata(w->pending, peer);
+	pthread_mutex_unlock(&w->lock);
+	SSL_shutdown(peer->ssl);
+    } else
+	list_removedata(w->handshaking, peer);
+    ERR_clear_error();
+    SSL_free(peer->ssl);
+    free(peer);
+}
+
+/* verifies the certificate of a peer that completed the handshake and
+ * adds the client; returns 0 if the connection should be closed */
+static int dtlspeeraccepted(struct dtlspeer *peer) {
+    struct clsrvconf *conf = peer->conf;
+    struct tls *accepted_tls = conf->tlsconf;
+    struct confcursor cur = {0, NULL};
+    struct gqueue *replyq;
+    X509 *cert;
+    char tmp[INET6_ADDRSTRLEN];
+
+    debug(DBG_WARN, "dtlspeeraccepted: incoming DTLS connection from %s", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+    tlscounthandshake(peer->ssl, conf->tlsconf, conf->name);
+
+    cert = verifytlscert(peer->ssl);
+    if (!cert)
+	return 0;
+    while (conf) {
+	if (accepted_tls == conf->tlsconf && verifyconfcert(cert, conf))
+	    break;
+	conf = find_clconf(handle, (struct sockaddr *)&peer->addr, &cur);
+    }
+    X509_free(cert);
+    if (!conf) {
+	debug(DBG_WARN, "dtlspeeraccepted: ignoring request, no matching TLS client");
+	return 0;
+    }
+
+    peer->client = addclient(conf, 1);
+    if (!peer->client) {
+	debug(DBG_WARN, "dtlspeeraccepted: failed to create new client instance");
+	return 0;
     }
+    peer->conf = conf;
+    peer->client->sock = -1;
+    peer->client->addr = addr_copy((struct sockaddr *)&peer->addr);
+    peer->client->ssl = peer->ssl;
+    peer->lastread = time(NULL);
+    list_removedata(peer->worker->handshaking, peer);
+
+    replyq = peer->client->replyq;
+    pthread_mutex_lock(&replyq->mutex);
+    replyq->wakeuparg = peer;
+    replyq->wakeup = dtlspeerwakeup;
+    if (list_first(replyq->entries))
+	dtlspeerwakeup(peer);
+    pthread_mutex_unlock(&replyq->mutex);
+    return 1;
+}
+
+/* handles the messages in the records read; returns 0 if the connection
+ * should be closed, else 1 */
+static int dtlspeerread(struct dtlspeer *peer) {
+    unsigned char *rbuf = peer->worker->rbuf, *buf;
+    struct request *rq;
+    int cnt, len, off;
+    unsigned long error;
+    char tmp[INET6_ADDRSTRLEN];
 
     for (;;) {
-	buf = raddtlsget(client->ssl, IDLE_TIMEOUT * 3, &client->lock);
-	if (!buf) {
-	    debug(DBG_ERR, "dtlsserverrd: connection from %s lost", addr2string(client->addr, tmp, sizeof(tmp)));
-	    break;
+	cnt = SSL_read(peer->ssl, rbuf, sizeof(peer->worker->rbuf));
+	if (cnt <= 0) {
+	    switch (SSL_get_error(peer->ssl, cnt)) {
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+		return 1;
+	    case SSL_ERROR_ZERO_RETURN:
+		debug(DBG_DBG, "dtlspeerread: got ssl shutdown");
+	    default:
+		while ((error = ERR_get_error()))
+		    debug(DBG_ERR, "dtlspeerread: SSL: %s", ERR_error_string(error, NULL));
+		return 0;
+	    }
 	}
-	debug(DBG_DBG, "dtlsserverrd: got Radius message from %s", addr2string(client->addr, tmp, sizeof(tmp)));
-	rq = newrequest();
-	if (!rq) {
-	    free(buf);
-	    continue;
-	}
-	rq->buf = buf;
-	rq->from = client;
-	if (!radsrv(rq)) {
-	    debug(DBG_ERR, "dtlsserverrd: message authentication/validation failed, closing connection from %s", addr2string(client->addr, tmp, sizeof(tmp)));
-	    break;
+	peer->lastread = time(NULL);
+
+	for (off = 0; off < cnt; off += len) {
+	    len = cnt - off < 4 ? 0 : RADLEN(rbuf + off);
+	    if (len < 20 || len > cnt - off) {
+		debug(DBG_ERR, "dtlspeerread: malformed packet from %s, closing connection", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+		return 0;
+	    }
+	    buf = pool_bufalloc(len);
+	    if (!buf) {
+		debug(DBG_ERR, "dtlspeerread: malloc failed");
+		continue;
+	    }
+	    memcpy(buf, rbuf + off, len);
+	    debug(DBG_DBG, "dtlspeerread: got Radius message from %s", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+	    rq = newrequest();
+	    if (!rq) {
+		pool_buffree(buf);
+		continue;
+	    }
+	    rq->buf = buf;
+	    rq->from = peer->client;
+	    /* the worker cannot wait for the reply queue, the client
+	     * retransmits instead */
+	    if (!queuewaitroom(peer->client->replyq, 0)) {
+		debug(DBG_DBG, "dtlspeerread: reply queue full, dropping request from %s", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+		metrics_inc(peer->client->conf->metrics, METRIC_DROPS_REPLYQ);
+		freerq(rq);
+		continue;
+	    }
+	    if (!radsrv(rq)) {
+		debug(DBG_ERR, "dtlspeerread: message authentication/validation failed, closing connection from %s", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+		return 0;
+	    }
 	}
     }
+}
+
+/* writes the queued replies; returns 0 if the connection should be
+ * closed, else 1 */
+static int dtlspeerwrite(struct dtlspeer *peer) {
+    struct gqueue *replyq = peer->client->replyq;
+    struct request *reply;
+    int cnt;
+    unsigned long error;
+    char tmp[INET6_ADDRSTRLEN];
 
-    /* stop writer by setting ssl to NULL and give signal in case waiting for data */
-    pthread_mutex_lock(&client->lock);
-    client->ssl = NULL;
-    pthread_mutex_unlock(&client->lock);
-    pthread_mutex_lock(&client->replyq->mutex);
-    pthread_cond_signal(&client->replyq->cond);
-    pthread_mutex_unlock(&client->replyq->mutex);
-    debug(DBG_DBG, "dtlsserverrd: waiting for writer to end");
-    pthread_join(dtlsserverwrth, NULL);
-    debug(DBG_DBG, "dtlsserverrd: reader for %s exiting", addr2string(client->addr, tmp, sizeof(tmp)));
+    for (;;) {
+	pthread_mutex_lock(&replyq->mutex);
+	reply = queueshift(replyq);
+	pthread_mutex_unlock(&replyq->mutex);
+	if (!reply)
+	    return 1;
+
+	cnt = SSL_write(peer->ssl, reply->replybuf, RADLEN(reply->replybuf));
+	if (cnt <= 0) {
+	    while ((error = ERR_get_error()))
+		debug(DBG_ERR, "dtlspeerwrite: SSL: %s", ERR_error_string(error, NULL));
+	    freerq(reply);
+	    return 0;
+	}
+	debug(DBG_DBG, "dtlspeerwrite: sent %d bytes, Radius packet of length %d to %s",
+	      cnt, RADLEN(reply->replybuf), addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+	freerq(reply);
+    }
 }
 
-void *dtlsservernew(void *arg) {
-    struct dtlsservernewparams *params = (struct dtlsservernewparams *)arg;
-    struct client *client;
+static void dtlsworkerinput(struct dtlsworker *w, struct dtlsdatagram *d) {
+    struct dtlspeer *peer;
     struct clsrvconf *conf;
-    struct list_node *cur = NULL;
-    X509 *cert = NULL;
-    struct tls *accepted_tls = NULL;
-    int s = -1;
+    SSL *ssl;
     unsigned long error;
-    struct timeval timeout;
-    struct addrinfo tmpsrvaddr;
+    int cnt;
     char tmp[INET6_ADDRSTRLEN];
 
-    debug(DBG_WARN, "dtlsservernew: incoming DTLS connection from %s", addr2string((struct sockaddr *)&params->addr, tmp, sizeof(tmp)));
-
-    conf = find_clconf(handle, (struct sockaddr *)&params->addr, NULL);
-    if (!conf)
-        goto exit;
+    peer = (struct dtlspeer *)hash_read(w->peers, &d->key, sizeof(d->key));
+    if (!peer || (peer->client && dtlsisclienthello(d->data, d->len))) {
+	if (!dtlsisclienthello(d->data, d->len)) {
+	    debug(DBG_DBG, "dtlsworkerinput: no DTLS connection with %s, ignoring datagram", addr2string((struct sockaddr *)&d->addr, tmp, sizeof(tmp)));
+	    return;
+	}
+	if (list_count(w->handshaking) >= DTLS_MAXHANDSHAKES) {
+	    debug(DBG_WARN, "dtlsworkerinput: too many DTLS handshakes, ignoring %s", addr2string((struct sockaddr *)&d->addr, tmp, sizeof(tmp)));
+	    return;
+	}
+	conf = find_clconf(handle, (struct sockaddr *)&d->addr, NULL);
+	if (!conf) {
+	    debug(DBG_INFO, "dtlsworkerinput: got UDP from unknown peer %s, ignoring", addr2string((struct sockaddr *)&d->addr, tmp, sizeof(tmp)));
+	    return;
+	}
+	ssl = dtlslisten(w, conf, d);
+	if (!ssl)
+	    return;
+	/* only a peer that got our cookie replaces an existing connection */
+	if (peer) {
+	    debug(DBG_INFO, "dtlsworkerinput: new DTLS handshake from %s, closing the old connection", addr2string((struct sockaddr *)&d->addr, tmp, sizeof(tmp)));
+	    dtlspeerclose(peer);
+	}
+	peer = dtlspeernew(w, d, conf, ssl);
+	if (!peer)
+	    return;
+    } else {
+	peer->in = d->data;
+	peer->inlen = d->len;
+    }
 
-    if (!srcres)
-        dtlssetsrcres();
-    memcpy(&tmpsrvaddr, srcres, sizeof(struct addrinfo));
-    tmpsrvaddr.ai_addr = (struct sockaddr *)&params->bind;
-    tmpsrvaddr.ai_addrlen = SOCKADDR_SIZE(params->bind);
-    if ((s = bindtoaddr(&tmpsrvaddr, params->addr.ss_family, 1)) < 0)
-        goto exit;
-    if (connect(s, (struct sockaddr *)&params->addr, SOCKADDR_SIZE(params->addr)))
-        goto exit;
-
-    BIO_set_fd(SSL_get_rbio(params->ssl), s, BIO_NOCLOSE);
-    BIO_ctrl(SSL_get_rbio(params->ssl), BIO_CTRL_DGRAM_SET_CONNECTED, 0,(struct sockaddr *)&params->addr);
-
-    if (sslaccepttimeout(params->ssl, 30) <= 0) {
-        while ((error = ERR_get_error()))
-            debug(DBG_ERR, "dtlsservernew: SSL accept from %s failed: %s", conf->name, ERR_error_string(error, NULL));
-        debug(DBG_ERR, "dtlsservernew: SSL_accept failed");
-        goto exit;
+    if (!peer->client) {
+	cnt = SSL_do_handshake(peer->ssl);
+	if (cnt <= 0) {
+	    switch (SSL_get_error(peer->ssl, cnt)) {
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+		return;
+	    default:
+		while ((error = ERR_get_error()))
+		    debug(DBG_ERR, "dtlsworkerinput: SSL accept from %s failed: %s", peer->conf->name, ERR_error_string(error, NULL));
+		dtlspeerclose(peer);
+		return;
+	    }
+	}
+	if (!dtlspeeraccepted(peer)) {
+	    dtlspeerclose(peer);
+	    return;
+	}
     }
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    if (BIO_ctrl(SSL_get_rbio(params->ssl), BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout) == -1)
-        debug(DBG_WARN, "dtlsservernew: BIO_CTRL_DGRAM_SET_RECV_TIMEOUT failed");
+    if (!dtlspeerread(peer))
+	dtlspeerclose(peer);
+}
 
-    cert = verifytlscert(params->ssl);
-    if (!cert)
-        goto exit;
-    accepted_tls = conf->tlsconf;
+/* handles handshake retransmissions and closes handshakes not
+ * completing in time */
+static void dtlsworkertimers(struct dtlsworker *w) {
+    struct list_node *entry, *next;
+    struct dtlspeer *peer;
+    time_t now = time(NULL);
+    char tmp[INET6_ADDRSTRLEN];
 
-    while (conf) {
-        if (accepted_tls == conf->tlsconf && verifyconfcert(cert, conf)) {
-            X509_free(cert);
-            client = addclient(conf, 1);
-            if (client) {
-                client->sock = s;
-                client->addr = addr_copy((struct sockaddr *)&params->addr);
-                client->ssl = params->ssl;
-                dtlsserverrd(client);
-                removeclient(client);
-            } else {
-                debug(DBG_WARN, "dtlsservernew: failed to create new client instance");
-            }
-            goto exit;
-        }
-        conf = find_clconf(handle, (struct sockaddr *)&params->addr, &cur);
+    for (entry = list_first(w->handshaking); entry; entry = next) {
+	next = list_next(entry);
+	peer = (struct dtlspeer *)entry->data;
+	if (now - peer->created > DTLS_HANDSHAKE_TIMEOUT || DTLSv1_handle_timeout(peer->ssl) < 0) {
+	    debug(DBG_ERR, "dtlsworkertimers: DTLS handshake with %s failed", addr2string((struct sockaddr *)&peer->addr, tmp, sizeof(tmp)));
+	    dtlspeerclose(peer);
+	}
     }
-    debug(DBG_WARN, "dtlsservernew: ignoring request, no matching TLS client");
-
-    if (cert)
-    X509_free(cert);
+}
 
-exit:
-    if (params->ssl) {
-        SSL_shutdown(params->ssl);
-        SSL_free(params->ssl);
+/* closes idle connections and those of clients removed from the
+ * configuration */
+static void dtlsworkerexpire(struct dtlsworker *w) {
+    struct hash_entry *entry;
+    struct list *expired;
+    struct dtlspeer *peer;
+    time_t now = time(NULL);
+
+    expired = list_create();
+    if (!expired) {
+	debug(DBG_ERR, "dtlsworkerexpire: malloc failed");
+	return;
+    }
+    for (entry = hash_first(w->peers); entry; entry = hash_next(entry)) {
+	peer = (struct dtlspeer *)entry->data;
+	if (peer->client && (now - peer->lastread > IDLE_TIMEOUT * 3 || peer->conf->retired))
+	    if (!list_push(expired, peer))
+		break;
     }
-    if(s >= 0)
-        close(s);
-    free(params);
-    debug(DBG_DBG, "dtlsservernew: exiting");
-    pthread_exit(NULL);
+    while ((peer = (struct dtlspeer *)list_shift(expired)))
+	dtlspeerclose(peer);
+    list_destroy(expired);
 }
 
-int getConnectionInfo(int socket, struct sockaddr *from, socklen_t fromlen, struct sockaddr *to, socklen_t tolen) {
-    uint8_t controlbuf[128];
-    int ret, toaddrfound = 0;
-    struct cmsghdr *ctrlhdr;
-    struct msghdr msghdr;
-    struct in6_pktinfo *info6;
-
-    char tmp[48];
-
-    msghdr.msg_name = from;
-    msghdr.msg_namelen = fromlen;
-    msghdr.msg_iov = NULL;
-    msghdr.msg_iovlen = 0;
-    msghdr.msg_control = controlbuf;
-    msghdr.msg_controllen = sizeof(controlbuf);
-    msghdr.msg_flags = 0;
-
-    if ((ret = recvmsg(socket, &msghdr, MSG_PEEK | MSG_TRUNC)) < 0)
-        return ret;
-
-    debug(DBG_DBG, "udp packet from %s", addr2string(from, tmp, sizeof(tmp)));
-
-    if (getsockname(socket, to, &tolen))
-        return -1;
-    for (ctrlhdr = CMSG_FIRSTHDR(&msghdr); ctrlhdr; ctrlhdr = CMSG_NXTHDR(&msghdr, ctrlhdr)) {
-#if defined(IP_PKTINFO)
-        if(ctrlhdr->cmsg_level == IPPROTO_IP && ctrlhdr->cmsg_type == IP_PKTINFO) {
-            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(ctrlhdr);
-            debug(DBG_DBG, "udp packet to: %s", inet_ntop(AF_INET, &(pktinfo->ipi_addr), tmp, sizeof(tmp)));
-
-            ((struct sockaddr_in *)to)->sin_addr = pktinfo->ipi_addr;
-            toaddrfound = 1;
-        }
-#elif defined(IP_RECVDSTADDR)
-        if(ctrlhdr->cmsg_level == IPPROTO_IP && ctrlhdr->cmsg_type == IP_RECVDSTADDR) {
-            struct in_addr *addr = (struct in_addr *)CMSG_DATA(ctrlhdr);
-            debug(DBG_DBG, "udp packet to: %s", inet_ntop(AF_INET, addr, tmp, sizeof(tmp)));
+static void *dtlsworkerloop(void *arg) {
+    struct dtlsworker *w = (struct dtlsworker *)arg;
+    struct list *datagrams = NULL, *pending = NULL;
+    struct list_node *entry;
+    struct dtlsdatagram *d;
+    struct dtlspeer *peer;
+    struct timeval now;
+    struct timespec wait;
+    time_t lastcheck = time(NULL);
 
-            ((struct sockaddr_in *)to)->sin_addr = *addr;
-            toaddrfound = 1;
-        }
-#endif
-        if(ctrlhdr->cmsg_level == IPPROTO_IPV6 && ctrlhdr->cmsg_type == IPV6_RECVPKTINFO) {
-            info6 = (struct in6_pktinfo *)CMSG_DATA(ctrlhdr);
-            debug(DBG_DBG, "udp packet to: %x", inet_ntop(AF_INET6, &info6->ipi6_addr, tmp, sizeof(tmp)));
+    for (;;) {
+	pthread_mutex_lock(&w->lock);
+	if (!w->woken) {
+	    /* retransmission timers are checked every 100ms during handshakes */
+	    gettimeofday(&now, NULL);
+	    if (list_first(w->handshaking)) {
+		wait.tv_sec = now.tv_sec + (now.tv_usec + 100000) / 1000000;
+		wait.tv_nsec = (now.tv_usec + 100000) % 1000000 * 1000;
+	    } else {
+		wait.tv_sec = now.tv_sec + 1;
+		wait.tv_nsec = now.tv_usec * 1000;
+	    }
+	    pthread_cond_timedwait(&w->cond, &w->lock, &wait);
+	}
+	w->woken = 0;
+	if (list_first(w->datagrams)) {
+	    datagrams = w->datagrams;
+	    w->datagrams = list_create();
+	    w->ndatagrams = 0;
+	}
+	if (list_first(w->pending)) {
+	    pending = w->pending;
+	    w->pending = list_create();
+	    for (entry = list_first(pending); entry; entry = list_next(entry))
+		((struct dtlspeer *)entry->data)->pending = 0;
+	}
+	if (!w->datagrams || !w->pending)
+	    debugx(1, DBG_ERR, "dtlsworkerloop: malloc failed");
+	pthread_mutex_unlock(&w->lock);
+
+	/* before the datagrams, which may close pending peers */
+	if (pending) {
+	    while ((peer = (struct dtlspeer *)list_shift(pending)))
+		if (!dtlspeerwrite(peer))
+		    dtlspeerclose(peer);
+	    list_destroy(pending);
+	    pending = NULL;
+	}
+	if (datagrams) {
+	    while ((d = (struct dtlsdatagram *)list_shift(datagrams))) {
+		dtlsworkerinput(w, d);
+		free(d);
+	    }
+	    list_destroy(datagrams);
+	    datagrams = NULL;
+	}
 
-            ((struct sockaddr_in6 *)to)->sin6_addr = info6->ipi6_addr;
-            ((struct sockaddr_in6 *)to)->sin6_scope_id = info6->ipi6_ifindex;
-            toaddrfound = 1;
-        }
+	dtlsworkertimers(w);
+	if (time(NULL) == lastcheck)
+	    continue;
+	lastcheck = time(NULL);
+	dtlsworkerexpire(w);
+    }
+    return NULL;
+}
+
+static void dtlsworkersinit() {
+    struct dtlsworker *w;
+    int i;
+
+    if (RAND_bytes((unsigned char *)dtlspeerhashkey, sizeof(dtlspeerhashkey)) != 1)
+	debugx(1, DBG_ERR, "dtlsworkersinit: failed to generate hash key");
+    dtlsbiomethod = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "radsecproxy dtls");
+    if (!dtlsbiomethod || !BIO_meth_set_write(dtlsbiomethod, dtlsbiowrite) ||
+	!BIO_meth_set_read(dtlsbiomethod, dtlsbioread) || !BIO_meth_set_ctrl(dtlsbiomethod, dtlsbioctrl) ||
+	!BIO_meth_set_create(dtlsbiomethod, dtlsbiocreate))
+	debugx(1, DBG_ERR, "dtlsworkersinit: failed to create BIO method");
+
+    dtlsworkers = calloc(DTLS_WORKERS, sizeof(struct dtlsworker));
+    if (!dtlsworkers)
+	debugx(1, DBG_ERR, "dtlsworkersinit: malloc failed");
+    for (i = 0; i < DTLS_WORKERS; i++) {
+	w = dtlsworkers + i;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->datagrams = list_create();
+	w->pending = list_create();
+	w->handshaking = list_create();
+	w->peers = hash_create();
+	if (!w->datagrams || !w->pending || !w->handshaking || !w->peers)
+	    debugx(1, DBG_ERR, "dtlsworkersinit: malloc failed");
+	if (pthread_create(&w->thread, &pthread_attr, dtlsworkerloop, (void *)w))
+	    debugx(1, DBG_ERR, "dtlsworkersinit: pthread_create failed");
+	pthread_detach(w->thread);
     }
-    return toaddrfound ? ret : -1;
+    debug(DBG_INFO, "dtlsworkersinit: started %d DTLS workers", DTLS_WORKERS);
 }
 
 void *dtlslistener(void *arg) {
-    int ndesc, flags, s = *(int *)arg;
-    unsigned char buf[4];
-    struct sockaddr_storage from, to;
-    struct dtlsservernewparams *params;
+    int ndesc, flags, len, s = *(int *)arg;
+    struct dtlspeerkey key;
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    struct dtlsdatagram *d;
+    struct dtlsworker *w;
     struct pollfd fds[1];
-    pthread_t dtlsserverth;
-    BIO *bio;
-    struct clsrvconf *conf;
-    SSL *ssl;
-    SSL_CTX *ctx;
+    unsigned char *buf;
     char tmp[INET6_ADDRSTRLEN];
 
     debug(DBG_DBG, "dtlslistener: starting");
+    pthread_once(&dtlsworkersonce, dtlsworkersinit);
 
     if ((flags = fcntl(s,F_GETFL)) == -1)
         debugx(1, DBG_ERR, "dtlslistener: failed to get socket flags");
     if (fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
         debugx(1, DBG_ERR, "dtlslistener: failed to set non-blocking");
+    buf = malloc(DTLS_MAXDATAGRAM);
+    if (!buf)
+        debugx(1, DBG_ERR, "dtlslistener: malloc failed");
 
     for (;;) {
         fds[0].fd = s;
@@ -456,60 +841,43 @@ void *dtlslistener(void *arg) {
         if (ndesc < 0)
             continue;
 
-        if (getConnectionInfo(s, (struct sockaddr *)&from, sizeof(from), (struct sockaddr *)&to, sizeof(to)) < 0) {
-            debug(DBG_DBG, "dtlslistener: getConnectionInfo failed");
-            continue;
-        }
-
-        conf = find_clconf(handle, (struct sockaddr *)&from, NULL);
-        if (!conf) {
-            debug(DBG_INFO, "dtlslistener: got UDP from unknown peer %s, ignoring", addr2string((struct sockaddr *)&from, tmp, sizeof(tmp)));
-            if (recv(s, buf, 4, 0) == -1)
-                debug(DBG_ERR, "dtlslistener: recv failed - %s", strerror(errno));
-            continue;
-        }
-
-        pthread_mutex_lock(&conf->tlsconf->lock);
-        if (!conf->tlsconf->dtlssslprep) {
-            debug(DBG_DBG, "dtlslistener: no cached ssl object for this context, create new");
-            ctx = tlsgetctx(handle, conf->tlsconf);
-            if (!ctx) {
-                pthread_mutex_unlock(&conf->tlsconf->lock);
+        for (;;) {
+            fromlen = sizeof(from);
+            len = recvfrom(s, buf, DTLS_MAXDATAGRAM, MSG_TRUNC, (struct sockaddr *)&from, &fromlen);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    debug(DBG_ERR, "dtlslistener: recv failed - %s", strerror(errno));
+                break;
+            }
+            if (len > DTLS_MAXDATAGRAM || !dtlspeerkeyset(&key, s, (struct sockaddr *)&from)) {
+                debug(DBG_DBG, "dtlslistener: ignoring datagram from %s", addr2string((struct sockaddr *)&from, tmp, sizeof(tmp)));
                 continue;
             }
-            ssl = SSL_new(ctx);
-            if (!ssl) {
-                pthread_mutex_unlock(&conf->tlsconf->lock);
+            d = malloc(sizeof(struct dtlsdatagram) + len);
+            if (!d) {
+                debug(DBG_ERR, "dtlslistener: malloc failed");
                 continue;
             }
-            bio = BIO_new_dgram(s, BIO_NOCLOSE);
-            SSL_set_bio(ssl, bio, bio);
-            SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
-            conf->tlsconf->dtlssslprep = ssl;
-        } else {
-            debug(DBG_DBG, "dtlslistener: reusing cached ssl object");
-            BIO_set_fd(SSL_get_rbio(conf->tlsconf->dtlssslprep), s, BIO_NOCLOSE);
-        }
-
-#if OPENSSL_VERSION_NUMBER < 0x10100000
-        if(DTLSv1_listen(conf->tlsconf->dtlssslprep, &from) > 0) {
-#else
-        if(DTLSv1_listen(conf->tlsconf->dtlssslprep, (BIO_ADDR *)&from) > 0) {
-#endif
-            params = malloc(sizeof(struct dtlsservernewparams));
-            memcpy(&params->addr, &from, sizeof(from));
-            memcpy(&params->bind, &to, sizeof(to));
-            params->ssl = conf->tlsconf->dtlssslprep;;
-            if (!pthread_create(&dtlsserverth, &pthread_attr, dtlsservernew, (void *)params)) {
-    		    pthread_detach(dtlsserverth);
-                conf->tlsconf->dtlssslprep = NULL;
-                pthread_mutex_unlock(&conf->tlsconf->lock);
+            d->key = key;
+            memcpy(&d->addr, &from, sizeof(from));
+            d->len = len;
+            memcpy(d->data, buf, len);
+
+            w = dtlsworkers + hash_siphash((uint8_t *)&key, sizeof(key), dtlspeerhashkey) % DTLS_WORKERS;
+            pthread_mutex_lock(&w->lock);
+            if (w->ndatagrams >= DTLS_MAXQUEUE || !list_push(w->datagrams, d)) {
+                pthread_mutex_unlock(&w->lock);
+                debug(DBG_DBG, "dtlslistener: worker busy, dropping datagram from %s", addr2string((struct sockaddr *)&from, tmp, sizeof(tmp)));
+                free(d);
                 continue;
-            } else {
-                free(params);
             }
+            w->ndatagrams++;
+            if (!w->woken) {
+                w->woken = 1;
+                pthread_cond_signal(&w->cond);
+            }
+            pthread_mutex_unlock(&w->lock);
         }
-        pthread_mutex_unlock(&conf->tlsconf->lock);
     }
     return NULL;
 }
@@ -555,6 +923,10 @@ int dtlsconnect(struct server *server, int timeout, char *text) {
             debug(DBG_DBG, "tlsconnect: timeout");
             return 0;
         }
+        if (server->conf->retired) {
+            server->sock = -1;
+            return 0;
+        }
 
         debug(DBG_INFO, "dtlsconnect: connecting to %s port %s", hp->host, hp->port);
 
@@ -573,6 +945,7 @@ int dtlsconnect(struct server *server, int timeout, char *text) {
         pthread_mutex_unlock(&server->conf->tlsconf->lock);
         if (!server->ssl)
             continue;
+        tlsusesession(server->ssl, server);
 
         bio = BIO_new_dgram(server->sock, BIO_CLOSE);
         BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, hp->addrinfo->ai_addr);
@@ -588,14 +961,18 @@ int dtlsconnect(struct server *server, int timeout, char *text) {
         if (BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &socktimeout) == -1)
             debug(DBG_WARN, "dtlsconnect: BIO_CTRL_DGRAM_SET_RECV_TIMEOUT failed");
 
+        tlscounthandshake(server->ssl, server->conf->tlsconf, server->conf->name);
         cert = verifytlscert(server->ssl);
-        if (!cert)
+        if (!cert) {
+            tlsdropsession(server);
             continue;
+        }
         if (verifyconfcert(cert, server->conf)) {
             X509_free(cert);
             break;
         }
         X509_free(cert);
+        tlsdropsession(server);
     }
     debug(DBG_WARN, "dtlsconnect: DTLS connection to %s up", server->conf->name);
 
@@ -652,18 +1029,23 @@ void *dtlsclientrd(void *arg) {
                 debug (DBG_WARN, "tlscleintrd: connection to server %s lost", server->conf->name);
             else if (server->lostrqs)
                 debug (DBG_WARN, "dtlsclientrd: server %s did not respond, closing connection.", server->conf->name);
-    	    dtlsconnect(server, 0, "dtlsclientrd");
+            if (server->conf->retired || !dtlsconnect(server, 0, "dtlsclientrd"))
+                break;
             server->lostrqs = 0;
         }
-	    continue;
+        if (server->conf->retired)
+            break;
+        continue;
 	}
-	replyh(server, buf);
+	replyhdispatch(server, buf);
     }
 
     debug(DBG_INFO, "dtlsclientrd: exiting for %s", server->conf->name);
     pthread_mutex_lock(&server->lock);
-    SSL_shutdown(server->ssl);
-    close(server->sock);
+    if (server->ssl)
+        SSL_shutdown(server->ssl);
+    if (server->sock >= 0)
+        close(server->sock);
 
     /* Wake up clientwr(). */
     server->clientrdgone = 1;
@@ -0,0 +1,200 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "hash.h"
+#include "dyncache.h"
+
+#define DYNCACHE_MAGICLEN (sizeof(DYNCACHE_MAGIC) - 1)
+#define DYNCACHE_RECHDR 16
+
+static uint64_t getbe(const unsigned char *p, int n) {
+    uint64_t v = 0;
+
+    while (n--)
+	v = v << 8 | *p++;
+    return v;
+}
+
+static void putbe(unsigned char *p, uint64_t v, int n) {
+    while (n--) {
+	p[n] = v & 0xff;
+	v >>= 8;
+    }
+}
+
+/* entries that can be written, the others are left out */
+static int packable(struct hash_entry *e, time_t now) {
+    struct dynlookup *entry = (struct dynlookup *)e->data;
+
+    return entry->expiry > now && e->keylen && e->keylen <= DYNCACHE_REALMMAX &&
+	entry->len <= DYNCACHE_CONFIGMAX;
+}
+
+int dyncache_load(const char *file, struct hash *cache, time_t now) {
+    int fd, n = 0;
+    struct stat st;
+    unsigned char *map, *p, *end, *realm;
+    struct dynlookup *entry, *old;
+    time_t expiry;
+    uint32_t len, realmlen;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+	if (errno == ENOENT)
+	    return 0;
+	debugerrno(errno, DBG_ERR, "dyncache_load: cannot open %s", file);
+	return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+	debugerrno(errno, DBG_ERR, "dyncache_load: cannot stat %s", file);
+	close(fd);
+	return -1;
+    }
+    if (st.st_size < DYNCACHE_MAGICLEN) {
+	debug(DBG_ERR, "dyncache_load: %s is not a dynamic lookup cache file", file);
+	close(fd);
+	return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	debugerrno(errno, DBG_ERR, "dyncache_load: cannot map %s", file);
+	return -1;
+    }
+    if (memcmp(map, DYNCACHE_MAGIC, DYNCACHE_MAGICLEN)) {
+	debug(DBG_ERR, "dyncache_load: %s is not a dynamic lookup cache file", file);
+	munmap(map, st.st_size);
+	return -1;
+    }
+
+    end = map + st.st_size;
+    for (p = map + DYNCACHE_MAGICLEN; end - p >= DYNCACHE_RECHDR; p = realm + realmlen + len) {
+	expiry = (time_t)getbe(p, 8);
+	len = getbe(p + 8, 4);
+	realmlen = getbe(p + 12, 2);
+	realm = p + DYNCACHE_RECHDR;
+	if (!realmlen || len > DYNCACHE_CONFIGMAX || end - realm < realmlen + len)
+	    break;
+	if (expiry <= now)
+	    continue;
+	old = hash_read(cache, realm, realmlen);
+	if (old && old->expiry >= expiry)
+	    continue;
+	entry = malloc(sizeof(struct dynlookup) + len);
+	if (!entry) {
+	    debug(DBG_ERR, "dyncache_load: malloc failed");
+	    break;
+	}
+	entry->expiry = expiry;
+	entry->failed = p[14];
+	entry->len = len;
+	memcpy(entry->config, realm + realmlen, len);
+	if (old)
+	    free(hash_extract(cache, realm, realmlen));
+	if (!hash_insert(cache, realm, realmlen, entry)) {
+	    debug(DBG_ERR, "dyncache_load: malloc failed");
+	    free(entry);
+	    break;
+	}
+	if (!old)
+	    n++;
+    }
+    if (p != end)
+	debug(DBG_WARN, "dyncache_load: ignoring %s from offset %ld on", file, (long)(p - map));
+    munmap(map, st.st_size);
+    return n;
+}
+
+unsigned char *dyncache_pack(struct hash *cache, time_t now, size_t *len) {
+    struct hash_entry *e;
+    struct dynlookup *entry;
+    unsigned char *buf, *p;
+    size_t size = DYNCACHE_MAGICLEN;
+
+    for (e = hash_first(cache); e; e = hash_next(e))
+	if (packable(e, now))
+	    size += DYNCACHE_RECHDR + e->keylen + ((struct dynlookup *)e->data)->len;
+    buf = malloc(size);
+    if (!buf)
+	return NULL;
+
+    memcpy(buf, DYNCACHE_MAGIC, DYNCACHE_MAGICLEN);
+    p = buf + DYNCACHE_MAGICLEN;
+    for (e = hash_first(cache); e; e = hash_next(e)) {
+	if (!packable(e, now))
+	    continue;
+	entry = (struct dynlookup *)e->data;
+	putbe(p, (uint64_t)entry->expiry, 8);
+	putbe(p + 8, entry->len, 4);
+	putbe(p + 12, e->keylen, 2);
+	p[14] = entry->failed ? 1 : 0;
+	p[15] = 0;
+	p += DYNCACHE_RECHDR;
+	memcpy(p, e->key, e->keylen);
+	p += e->keylen;
+	memcpy(p, entry->config, entry->len);
+	p += entry->len;
+    }
+    *len = size;
+    return buf;
+}
+
+int dyncache_write(const char *file, unsigned char *buf, size_t len) {
+    char *tmp;
+    int fd;
+    ssize_t cnt;
+    size_t done = 0;
+
+    tmp = malloc(strlen(file) + 8);
+    if (!tmp) {
+	debug(DBG_ERR, "dyncache_write: malloc failed");
+	return 0;
+    }
+    /* unique, so that proxies sharing the file do not write to each
+     * other's new file */
+    sprintf(tmp, "%s.XXXXXX", file);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+	debugerrno(errno, DBG_ERR, "dyncache_write: cannot create %s", tmp);
+	free(tmp);
+	return 0;
+    }
+    while (done < len) {
+	cnt = write(fd, buf + done, len - done);
+	if (cnt < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	done += cnt;
+    }
+    if (done < len || fsync(fd) < 0) {
+	debugerrno(errno, DBG_ERR, "dyncache_write: cannot write %s", tmp);
+	close(fd);
+	goto errexit;
+    }
+    if (close(fd) < 0 || rename(tmp, file) < 0) {
+	debugerrno(errno, DBG_ERR, "dyncache_write: cannot replace %s", file);
+	goto errexit;
+    }
+    free(tmp);
+    return 1;
+
+errexit:
+    unlink(tmp);
+    free(tmp);
+    return 0;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
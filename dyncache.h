@@ -0,0 +1,49 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <time.h>
+#include <sys/types.h>
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+/* A file with the results of DynamicLookupCommand, so that a proxy that
+ * is restarted, or another proxy using the same file, need not run the
+ * command again for realms whose results have not expired. The file is a
+ * magic followed by one record per realm: expiry in seconds since the
+ * epoch (8 bytes), length of the command output (4 bytes) and of the
+ * realm (2 bytes), whether the lookup failed (1 byte), a zero byte, the
+ * realm and the output. Numbers are in network byte order. */
+#define DYNCACHE_MAGIC "RSPDYNC1"
+#define DYNCACHE_REALMMAX 65535
+#define DYNCACHE_CONFIGMAX 65536
+
+struct hash;
+
+struct dynlookup {
+    time_t expiry;
+    uint8_t failed;
+    size_t len;
+    char config[]; /* command output */
+};
+
+/* adds the entries in file not expired at now to cache, keyed by realm.
+ * Returns the number added, 0 if there is no file and -1 if it could not
+ * be read or is not a cache file. A truncated file gives the entries
+ * before the damage */
+int dyncache_load(const char *file, struct hash *cache, time_t now);
+
+/* returns the entries of cache not expired at now in the file format in
+ * a malloc'ed buffer of *len bytes, or NULL if malloc fails */
+unsigned char *dyncache_pack(struct hash *cache, time_t now, size_t *len);
+
+/* replaces file with the len bytes in buf, writing a new file next to
+ * it and renaming it so that readers see the old or the new one.
+ * Returns 1 if ok */
+int dyncache_write(const char *file, unsigned char *buf, size_t len);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,531 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Event loop for accepted TLS and TCP client connections. Each worker
+ * thread multiplexes many connections with epoll and non-blocking
+ * SSL_read/SSL_write (or read/write for TCP, and write once the kernel
+ * does the TLS records of a connection), instead of running a
+ * reader and a writer thread per connection. Replies are queued on the
+ * client replyq as usual, sendreply() wakes the worker through the queue
+ * wakeup hook. */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#endif
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "radsecproxy.h"
+#include "debug.h"
+#include "util.h"
+#include "pool.h"
+#include "evloop.h"
+
+#if defined(HAVE_EPOLL_CREATE1)
+#define EVLOOP_MAXEVENTS 64
+
+struct evworker {
+    pthread_t thread;
+    int epfd;
+    int wakefd[2];
+    pthread_mutex_t lock; /* protects the fields below */
+    struct list *newconns;
+    struct list *pending; /* connections with queued replies */
+    uint8_t woken;
+};
+
+struct evconn {
+    struct evworker *worker;
+    struct client *client;
+    int sock;
+    SSL *ssl;
+    int idletimeout;
+    time_t lastread;
+    uint32_t events;
+    unsigned char hdr[4];
+    unsigned char *rbuf;
+    int rlen;
+    unsigned char *wbuf; /* replies being written, wsize bytes */
+    int wsize, wlen, woff;
+    uint8_t pending; /* protected by worker lock */
+    uint8_t paused; /* not reading requests while the reply queue is full */
+    uint8_t readwantswrite;
+    uint8_t writewantsread;
+    uint8_t ktls; /* the kernel encrypts what is written to sock */
+};
+
+static struct evworker *workers = NULL;
+static int nworkers = 0, nextworker = 0;
+static pthread_mutex_t nextworker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called by sendreply() with the replyq mutex held */
+static void evconnwakeup(void *arg) {
+    struct evconn *c = (struct evconn *)arg;
+    struct evworker *w = c->worker;
+
+    pthread_mutex_lock(&w->lock);
+    if (!c->pending) {
+	if (list_push(w->pending, c))
+	    c->pending = 1;
+	else
+	    debug(DBG_ERR, "evconnwakeup: malloc failed");
+    }
+    if (!w->woken) {
+	w->woken = 1;
+	if (write(w->wakefd[1], "", 1) < 0)
+	    debugerrno(errno, DBG_ERR, "evconnwakeup: write failed");
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void evconnsetevents(struct evconn *c) {
+    struct epoll_event ev;
+    uint32_t events = c->paused && !c->writewantsread ? 0 : EPOLLIN;
+
+    if (c->wlen || c->readwantswrite)
+	events |= EPOLLOUT;
+    if (events == c->events)
+	return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->sock, &ev))
+	debugerrno(errno, DBG_ERR, "evconnsetevents: epoll_ctl failed");
+    c->events = events;
+}
+
+static void evconnclose(struct evconn *c) {
+    struct evworker *w = c->worker;
+    char tmp[INET6_ADDRSTRLEN];
+
+    debug(DBG_ERR, "evloop: connection from %s lost", addr2string(c->client->addr, tmp, sizeof(tmp)));
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+
+    /* the workers may still reply until the client is removed, but
+     * without waking us, and a reload must not shut down the socket once
+     * it is closed */
+    pthread_mutex_lock(&c->client->replyq->mutex);
+    c->client->replyq->wakeup = NULL;
+    c->client->replyq->wakeuparg = NULL;
+    pthread_mutex_unlock(&c->client->replyq->mutex);
+    pthread_mutex_lock(c->client->conf->lock);
+    c->client->ssl = NULL;
+    c->client->sock = -1;
+    pthread_mutex_unlock(c->client->conf->lock);
+    removeclientlater(c->client);
+    pthread_mutex_lock(&w->lock);
+    if (c->pending)
+	list_removedata(w->pending, c);
+    pthread_mutex_unlock(&w->lock);
+
+    free(c->wbuf);
+    pool_buffree(c->rbuf);
+    if (c->ssl) {
+	SSL_shutdown(c->ssl);
+	SSL_free(c->ssl);
+    }
+    shutdown(c->sock, SHUT_RDWR);
+    close(c->sock);
+    free(c);
+}
+
+/* returns number of bytes read, 0 if it would block, -1 if the
+ * connection should be closed */
+static int evconnreadbytes(struct evconn *c, unsigned char *buf, int num) {
+    int cnt;
+    unsigned long error;
+
+    if (!c->ssl) {
+	cnt = read(c->sock, buf, num);
+	if (cnt > 0)
+	    return cnt;
+	if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	    return 0;
+	return -1;
+    }
+
+    c->readwantswrite = 0;
+    cnt = SSL_read(c->ssl, buf, num);
+    if (cnt > 0)
+	return cnt;
+    switch (SSL_get_error(c->ssl, cnt)) {
+    case SSL_ERROR_WANT_WRITE:
+	c->readwantswrite = 1;
+	return 0;
+    case SSL_ERROR_WANT_READ:
+	return 0;
+    case SSL_ERROR_ZERO_RETURN:
+	debug(DBG_DBG, "evconnreadbytes: got ssl shutdown");
+    default:
+	while ((error = ERR_get_error()))
+	    debug(DBG_ERR, "evconnreadbytes: SSL: %s", ERR_error_string(error, NULL));
+	return -1;
+    }
+}
+
+/* reads and handles as many messages as available; returns 0 if the
+ * connection should be closed, else 1 */
+static int evconnread(struct evconn *c) {
+    struct request *rq;
+    int cnt, len;
+    char tmp[INET6_ADDRSTRLEN];
+
+    for (;;) {
+	if (!c->rlen && !queuewaitroom(c->client->replyq, 0)) {
+	    c->paused = 1;
+	    return 1;
+	}
+	if (c->rlen < 4) {
+	    cnt = evconnreadbytes(c, c->hdr + c->rlen, 4 - c->rlen);
+	    if (cnt <= 0)
+		return cnt == 0;
+	    c->lastread = time(NULL);
+	    c->rlen += cnt;
+	    if (c->rlen < 4)
+		continue;
+	    len = RADLEN(c->hdr);
+	    if (len < 20) {
+		debug(DBG_ERR, "evconnread: length too small, malformed packet! closing connection!");
+		return 0;
+	    }
+	    c->rbuf = pool_bufalloc(len);
+	    if (!c->rbuf) {
+		debug(DBG_ERR, "evconnread: malloc failed");
+		return 0;
+	    }
+	    memcpy(c->rbuf, c->hdr, 4);
+	}
+
+	len = RADLEN(c->hdr);
+	cnt = evconnreadbytes(c, c->rbuf + c->rlen, len - c->rlen);
+	if (cnt <= 0)
+	    return cnt == 0;
+	c->lastread = time(NULL);
+	c->rlen += cnt;
+	if (c->rlen < len)
+	    continue;
+
+	debug(DBG_DBG, "evconnread: got Radius message from %s", addr2string(c->client->addr, tmp, sizeof(tmp)));
+	rq = newrequest();
+	if (!rq) {
+	    pool_buffree(c->rbuf);
+	} else {
+	    rq->buf = c->rbuf;
+	    rq->from = c->client;
+	}
+	c->rbuf = NULL;
+	c->rlen = 0;
+	if (rq && !radsrvdispatch(rq)) {
+	    debug(DBG_ERR, "evconnread: message authentication/validation failed, closing connection from %s", addr2string(c->client->addr, tmp, sizeof(tmp)));
+	    return 0;
+	}
+    }
+}
+
+/* writes queued replies until the queue is empty or the socket would
+ * block, as many at once as fit in the buffer; returns 0 if the
+ * connection should be closed, else 1 */
+static int evconnwrite(struct evconn *c) {
+    int cnt;
+    unsigned long error;
+    char tmp[INET6_ADDRSTRLEN];
+
+    for (;;) {
+	if (!c->wlen) {
+	    c->wlen = coalescereplies(c->client->replyq, &c->wbuf, 0, &c->wsize, 0);
+	    if (!c->wlen)
+		return 1;
+	    c->woff = 0;
+	}
+
+	if (c->ssl && !c->ktls) {
+	    c->writewantsread = 0;
+	    /* retried with the same buffer until written */
+	    cnt = SSL_write(c->ssl, c->wbuf, c->wlen);
+	    if (cnt <= 0) {
+		switch (SSL_get_error(c->ssl, cnt)) {
+		case SSL_ERROR_WANT_READ:
+		    c->writewantsread = 1;
+		case SSL_ERROR_WANT_WRITE:
+		    return 1;
+		default:
+		    while ((error = ERR_get_error()))
+			debug(DBG_ERR, "evconnwrite: SSL: %s", ERR_error_string(error, NULL));
+		    return 0;
+		}
+	    }
+	} else {
+	    cnt = write(c->sock, c->wbuf + c->woff, c->wlen - c->woff);
+	    if (cnt < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		    return 1;
+		debug(DBG_ERR, "evconnwrite: write error for %s", addr2string(c->client->addr, tmp, sizeof(tmp)));
+		return 0;
+	    }
+	    c->woff += cnt;
+	    if (c->woff < c->wlen)
+		continue;
+	}
+	debug(DBG_DBG, "evconnwrite: sent %d bytes of Radius packets to %s",
+	      c->wlen, addr2string(c->client->addr, tmp, sizeof(tmp)));
+	c->wlen = 0;
+    }
+}
+
+/* reads again once the reply queue is down to its low watermark; returns
+ * 0 if the connection should be closed, else 1 */
+static int evconnresume(struct evconn *c) {
+    if (!c->paused || !queuewaitroom(c->client->replyq, 0))
+	return 1;
+    c->paused = 0;
+    return evconnread(c);
+}
+
+/* returns 0 if the connection could not be added, else 1 */
+static int evworkeradd(struct evworker *w, struct evconn *c) {
+    struct epoll_event ev;
+    struct gqueue *replyq = c->client->replyq;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->sock, &ev)) {
+	debugerrno(errno, DBG_ERR, "evworkeradd: epoll_ctl failed");
+	return 0;
+    }
+    pthread_mutex_lock(&replyq->mutex);
+    replyq->wakeuparg = c;
+    replyq->wakeup = evconnwakeup;
+    if (list_first(replyq->entries))
+	evconnwakeup(c);
+    pthread_mutex_unlock(&replyq->mutex);
+    return 1;
+}
+
+static void *evworkerloop(void *arg) {
+    struct evworker *w = (struct evworker *)arg;
+    struct epoll_event events[EVLOOP_MAXEVENTS];
+    struct list *newconns, *pending, *conns;
+    struct list_node *entry, *next;
+    struct evconn *c;
+    unsigned char drain[64];
+    time_t now, lastcheck = time(NULL);
+    int i, n, woken;
+
+    conns = list_create();
+    if (!conns)
+	debugx(1, DBG_ERR, "evworkerloop: malloc failed");
+
+    for (;;) {
+	n = epoll_wait(w->epfd, events, EVLOOP_MAXEVENTS, 1000);
+	if (n < 0 && errno != EINTR)
+	    debugerrno(errno, DBG_ERR, "evworkerloop: epoll_wait failed");
+
+	woken = 0;
+	for (i = 0; i < n; i++) {
+	    c = (struct evconn *)events[i].data.ptr;
+	    if (!c) {
+		while (read(w->wakefd[0], drain, sizeof(drain)) == sizeof(drain));
+		woken = 1;
+		continue;
+	    }
+	    /* a paused connection is not read, so would be reported again */
+	    if (c->paused && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+		list_removedata(conns, c);
+		evconnclose(c);
+		continue;
+	    }
+	    if ((events[i].events & EPOLLIN) || (c->readwantswrite && (events[i].events & EPOLLOUT)) ||
+		(events[i].events & (EPOLLERR | EPOLLHUP))) {
+		if (!evconnread(c)) {
+		    list_removedata(conns, c);
+		    evconnclose(c);
+		    continue;
+		}
+	    }
+	    if ((c->wlen && (events[i].events & EPOLLOUT)) || (c->writewantsread && (events[i].events & EPOLLIN))) {
+		if (!evconnwrite(c)) {
+		    list_removedata(conns, c);
+		    evconnclose(c);
+		    continue;
+		}
+	    }
+	    if (!evconnresume(c)) {
+		list_removedata(conns, c);
+		evconnclose(c);
+		continue;
+	    }
+	    evconnsetevents(c);
+	}
+
+	if (woken) {
+	    pthread_mutex_lock(&w->lock);
+	    w->woken = 0;
+	    newconns = w->newconns;
+	    pending = w->pending;
+	    w->newconns = list_create();
+	    w->pending = list_create();
+	    if (!w->newconns || !w->pending)
+		debugx(1, DBG_ERR, "evworkerloop: malloc failed");
+	    for (entry = list_first(pending); entry; entry = list_next(entry))
+		((struct evconn *)entry->data)->pending = 0;
+	    pthread_mutex_unlock(&w->lock);
+
+	    while ((c = (struct evconn *)list_shift(newconns))) {
+		if (!evworkeradd(w, c)) {
+		    evconnclose(c);
+		    continue;
+		}
+		if (!list_push(conns, c)) {
+		    debug(DBG_ERR, "evworkerloop: malloc failed");
+		    evconnclose(c);
+		}
+	    }
+	    list_destroy(newconns);
+
+	    /* connections added above may already be pending again, they
+	     * are then also found in the new pending list */
+	    while ((c = (struct evconn *)list_shift(pending))) {
+		if (!evconnwrite(c) || !evconnresume(c)) {
+		    list_removedata(conns, c);
+		    evconnclose(c);
+		    continue;
+		}
+		evconnsetevents(c);
+	    }
+	    list_destroy(pending);
+	}
+
+	now = time(NULL);
+	if (now == lastcheck)
+	    continue;
+	lastcheck = now;
+	for (entry = list_first(conns); entry; entry = next) {
+	    next = list_next(entry);
+	    c = (struct evconn *)entry->data;
+	    if (c->idletimeout && now - c->lastread > c->idletimeout) {
+		list_removedata(conns, c);
+		evconnclose(c);
+	    }
+	}
+    }
+    return NULL;
+}
+
+int evloop_init(int n) {
+    struct epoll_event ev;
+    struct evworker *w;
+    int i;
+
+    if (n <= 0 || workers)
+	return 0;
+    workers = calloc(n, sizeof(struct evworker));
+    if (!workers)
+	debugx(1, DBG_ERR, "evloop_init: malloc failed");
+
+    for (i = 0; i < n; i++) {
+	w = workers + i;
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0)
+	    debugerrnox(errno, DBG_ERR, "evloop_init: epoll_create1 failed");
+	if (pipe(w->wakefd))
+	    debugerrnox(errno, DBG_ERR, "evloop_init: pipe failed");
+	if (fcntl(w->wakefd[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(w->wakefd[1], F_SETFL, O_NONBLOCK) == -1)
+	    debugerrnox(errno, DBG_ERR, "evloop_init: failed to set O_NONBLOCK");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd[0], &ev))
+	    debugerrnox(errno, DBG_ERR, "evloop_init: epoll_ctl failed");
+	pthread_mutex_init(&w->lock, NULL);
+	w->newconns = list_create();
+	w->pending = list_create();
+	if (!w->newconns || !w->pending)
+	    debugx(1, DBG_ERR, "evloop_init: malloc failed");
+	if (pthread_create(&w->thread, &pthread_attr, evworkerloop, (void *)w))
+	    debugx(1, DBG_ERR, "evloop_init: pthread_create failed");
+	pthread_detach(w->thread);
+    }
+    nworkers = n;
+    debug(DBG_INFO, "evloop_init: started %d event loop workers", n);
+    return n;
+}
+
+int evloop_addconn(struct client *client, int sock, SSL *ssl, int idletimeout) {
+    struct evconn *c;
+    struct evworker *w;
+    int flags;
+
+    if (!nworkers)
+	return 0;
+
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+	debugerrno(errno, DBG_WARN, "evloop_addconn: failed to set O_NONBLOCK");
+	return 0;
+    }
+    c = calloc(1, sizeof(struct evconn));
+    if (c && !(c->wbuf = malloc(STREAM_WRITE_SIZE))) {
+	free(c);
+	c = NULL;
+    }
+    if (c)
+	c->wsize = STREAM_WRITE_SIZE;
+    if (!c) {
+	debug(DBG_ERR, "evloop_addconn: malloc failed");
+	return 0;
+    }
+    c->client = client;
+    c->sock = sock;
+    c->ssl = ssl;
+#ifdef RADPROT_TLS
+    c->ktls = ssl && tlsktlssend(ssl);
+#endif
+    c->idletimeout = idletimeout;
+    c->lastread = time(NULL);
+
+    pthread_mutex_lock(&nextworker_lock);
+    w = workers + nextworker;
+    nextworker = (nextworker + 1) % nworkers;
+    pthread_mutex_unlock(&nextworker_lock);
+    c->worker = w;
+
+    pthread_mutex_lock(&w->lock);
+    if (!list_push(w->newconns, c)) {
+	pthread_mutex_unlock(&w->lock);
+	debug(DBG_ERR, "evloop_addconn: malloc failed");
+	free(c->wbuf);
+	free(c);
+	return 0;
+    }
+    if (!w->woken) {
+	w->woken = 1;
+	if (write(w->wakefd[1], "", 1) < 0)
+	    debugerrno(errno, DBG_ERR, "evloop_addconn: write failed");
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+#else
+int evloop_init(int n) {
+    if (n > 0)
+	debug(DBG_WARN, "evloop_init: event loop not available on this platform, using a thread per connection");
+    return 0;
+}
+
+int evloop_addconn(struct client *client, int sock, SSL *ssl, int idletimeout) {
+    return 0;
+}
+#endif
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,17 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* starts workers event loop threads for client connections; returns the
+ * number of workers started, 0 if the event loop is not used */
+int evloop_init(int workers);
+
+/* hands an established TLS or TCP client connection to one of the event
+ * loop workers. ssl is NULL for TCP. idletimeout is in seconds, 0 means
+ * none. On success the event loop owns sock, ssl and client and returns
+ * 1; it removes the client when the connection is closed. Returns 0 if
+ * the event loop is not used or on failure, the caller keeps ownership */
+int evloop_addconn(struct client *client, int sock, SSL *ssl, int idletimeout);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -61,6 +61,11 @@ fticks_configure(struct options *options,
 	if (options->fticks_mac != RSP_MAC_VENDOR_KEY_HASHED
 	    && options->fticks_mac != RSP_MAC_FULLY_KEY_HASHED)
 	    debugx(1, DBG_WARN, "config warning: FTicksKey not used");
+	else {
+	    options->fticks_hmac = fticks_hashmac_key(options->fticks_key);
+	    if (options->fticks_hmac == NULL)
+		debugx(1, DBG_ERR, "malloc failed");
+	}
     }
     else if (options->fticks_reporting != RSP_FTICKS_REPORTING_NONE
 	     && (options->fticks_mac == RSP_MAC_VENDOR_KEY_HASHED
@@ -83,55 +88,65 @@ fticks_configure(struct options *options,
     return r;
 }
 
-void
-fticks_log(const struct options *options,
-	   const struct client *client,
-	   const struct radmsg *msg,
-	   const struct request *rq)
+/* What fticks_log() copies of a reply for fticks_format() to make the
+   F-Ticks message of in the log writer thread.  The attribute values are
+   copied raw, the client config may be gone by the time it is logged. */
+struct fticks_record {
+    const struct options *options;
+    uint8_t ok;
+    uint8_t hascsi;
+    uint8_t realmlen;
+    uint8_t csilen;
+    char realm[253];
+    char csi[253];
+    char viscountry[128];
+    char visinst[40+1];
+};
+
+/* Return the value of the attribute of LEN bytes at V as for
+   radattr2ascii().  */
+static uint8_t *
+_value2ascii(const char *v, uint8_t len)
 {
-    uint8_t *username = NULL;
+    struct tlv attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.l = len;
+    attr.v = (uint8_t *) v;
+    return radattr2ascii(&attr);
+}
+
+static void
+fticks_format(char *buf, size_t len, const void *data)
+{
+    const struct fticks_record *r = (const struct fticks_record *) data;
+    const struct options *options = r->options;
     uint8_t *realm = NULL;
     uint8_t visinst[8+40+1+1]; /* Room for 40 octets of VISINST.  */
     uint8_t *macin = NULL;
     uint8_t macout[2*32+1]; /* Room for ASCII representation of SHA256.  */
 
-    username = radattr2ascii(radmsg_gettype(rq->msg,
-					    RAD_Attr_User_Name));
-    if (username != NULL) {
-	realm = (uint8_t *) strrchr((char *) username, '@');
-	if (realm != NULL)
-	    realm++;
-    }
-    if (realm == NULL)
-	realm = (uint8_t *) "";
+    realm = _value2ascii(r->realm, r->realmlen);
 
     memset(visinst, 0, sizeof(visinst));
-    if (options->fticks_reporting == RSP_FTICKS_REPORTING_FULL) {
-        if (client->conf->fticks_visinst != NULL ) {
-	    snprintf((char *) visinst, sizeof(visinst), "VISINST=%s#",
-                     client->conf->fticks_visinst);
-        } else {
-	    snprintf((char *) visinst, sizeof(visinst), "VISINST=%s#",
-                     client->conf->name);
-        }
-    }
+    if (options->fticks_reporting == RSP_FTICKS_REPORTING_FULL)
+	snprintf((char *) visinst, sizeof(visinst), "VISINST=%s#", r->visinst);
 
     memset(macout, 0, sizeof(macout));
     if (options->fticks_mac == RSP_MAC_STATIC) {
 	strncpy((char *) macout, "undisclosed", sizeof(macout) - 1);
     }
-    else {
-	macin = radattr2ascii(radmsg_gettype(rq->msg,
-					     RAD_Attr_Calling_Station_Id));
+    else if (r->hascsi) {
+	macin = _value2ascii(r->csi, r->csilen);
 	if (macin) {
 	    switch (options->fticks_mac)
 	    {
 	    case RSP_MAC_ORIGINAL:
-		memcpy(macout, macin, sizeof(macout));
+		strncpy((char *) macout, (char *) macin, sizeof(macout) - 1);
 		break;
 	    case RSP_MAC_VENDOR_HASHED:
 		memcpy(macout, macin, 9);
-		fticks_hashmac(macin, NULL, sizeof(macout) - 9, macout + 9);
+		fticks_hashmac_keyed(macin, NULL, sizeof(macout) - 9, macout + 9);
 		break;
 	    case RSP_MAC_VENDOR_KEY_HASHED:
 		memcpy(macout, macin, 9);
@@ -141,15 +156,15 @@ fticks_log(const struct options *options,
 		 * known plaintext attack on the key but the
 		 * consequences of that is considered outweighed by
 		 * the convenience gained.  */
-		fticks_hashmac(macin, options->fticks_key,
-			       sizeof(macout) - 9, macout + 9);
+		fticks_hashmac_keyed(macin, options->fticks_hmac,
+				     sizeof(macout) - 9, macout + 9);
 		break;
 	    case RSP_MAC_FULLY_HASHED:
-		fticks_hashmac(macin, NULL, sizeof(macout), macout);
+		fticks_hashmac_keyed(macin, NULL, sizeof(macout), macout);
 		break;
 	    case RSP_MAC_FULLY_KEY_HASHED:
-		fticks_hashmac(macin, options->fticks_key, sizeof(macout),
-			       macout);
+		fticks_hashmac_keyed(macin, options->fticks_hmac,
+				     sizeof(macout), macout);
 		break;
 	    default:
 		debugx(2, DBG_ERR, "invalid fticks mac configuration: %d",
@@ -157,18 +172,60 @@ fticks_log(const struct options *options,
 	    }
 	}
     }
-    fticks_debug(
-	  "%s#REALM=%s#VISCOUNTRY=%s#%sCSI=%s#RESULT=%s#",
-      options->fticksprefix,
-	  realm,
-	  client->conf->fticks_viscountry,
-	  visinst,
-	  macout,
-	  msg->code == RAD_Access_Accept ? "OK" : "FAIL");
+    snprintf(buf, len,
+	     "%s#REALM=%s#VISCOUNTRY=%s#%sCSI=%s#RESULT=%s#",
+	     options->fticksprefix,
+	     realm ? (char *) realm : "",
+	     r->viscountry,
+	     visinst,
+	     macout,
+	     r->ok ? "OK" : "FAIL");
     if (macin != NULL)
 	free(macin);
-    if (username != NULL)
-	free(username);
+    if (realm != NULL)
+	free(realm);
+}
+
+/* Copy what the F-Ticks message for the reply MSG to RQ needs and leave
+   the hashing, formatting and writing to the log writer.  */
+void
+fticks_log(const struct options *options,
+	   const struct client *client,
+	   const struct radmsg *msg,
+	   const struct request *rq)
+{
+    struct fticks_record r;
+    struct tlv *attr;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    r.options = options;
+    r.ok = msg->code == RAD_Access_Accept;
+
+    attr = radmsg_gettype(rq->msg, RAD_Attr_User_Name);
+    if (attr != NULL) {
+	for (i = attr->l - 1; i >= 0 && attr->v[i] != '@'; i--)
+	    ;
+	if (i >= 0) {
+	    r.realmlen = attr->l - i - 1;
+	    memcpy(r.realm, attr->v + i + 1, r.realmlen);
+	}
+    }
+
+    attr = radmsg_gettype(rq->msg, RAD_Attr_Calling_Station_Id);
+    if (attr != NULL) {
+	r.hascsi = 1;
+	r.csilen = attr->l;
+	memcpy(r.csi, attr->v, attr->l);
+    }
+
+    strncpy(r.viscountry, client->conf->fticks_viscountry,
+	    sizeof(r.viscountry) - 1);
+    strncpy(r.visinst, client->conf->fticks_visinst != NULL
+	    ? client->conf->fticks_visinst : client->conf->name,
+	    sizeof(r.visinst) - 1);
+
+    fticks_debug_deferred(fticks_format, &r, sizeof(r));
 }
 
 /* Local Variables: */
@@ -29,11 +29,11 @@ _format_hash(const uint8_t *hash, size_t out_len, uint8_t *out)
 
 static void
 _hash(const uint8_t *in,
-      const uint8_t *key,
+      const struct hmac_sha256_ctx *keyed,
       size_t out_len,
       uint8_t *out)
 {
-    if (key == NULL) {
+    if (keyed == NULL) {
 	struct sha256_ctx ctx;
 	uint8_t hash[SHA256_DIGEST_SIZE];
 
@@ -43,16 +43,36 @@ _hash(const uint8_t *in,
 	_format_hash(hash, out_len, out);
     }
     else {
-	struct hmac_sha256_ctx ctx;
+	/* a copy, so that threads may share the keyed context */
+	struct hmac_sha256_ctx ctx = *keyed;
 	uint8_t hash[SHA256_DIGEST_SIZE];
 
-	hmac_sha256_set_key(&ctx, strlen((char *) key), key);
 	hmac_sha256_update(&ctx, strlen((char *) in), in);
 	hmac_sha256_digest(&ctx, sizeof(hash), hash);
 	_format_hash(hash, out_len, out);
     }
 }
 
+/** Sanitise the Ethernet MAC address in \a IN into \a OUT, which
+    must have room for strlen(\a IN) + 1 bytes.  */
+static void
+_sanitise(const uint8_t *in, uint8_t *out)
+{
+    int i;
+
+    for (i = 0; in[i] != '\0'; i++) {
+	if (in[i] == ';')
+	    break;
+	if (in[i] >= '0' && in[i] <= '9') {
+	    *out++ = in[i];
+	}
+	else if (tolower(in[i]) >= 'a' && tolower(in[i]) <= 'f') {
+	    *out++ = tolower(in[i]);
+	}
+    }
+    *out = '\0';
+}
+
 /** Hash the Ethernet MAC address in \a IN, keying a HMAC with \a KEY
     unless \a KEY is NULL.  If \a KEY is null \a IN is hashed with an
     ordinary cryptographic hash function such as SHA-2.
@@ -82,33 +102,55 @@ fticks_hashmac(const uint8_t *in,
 	       size_t out_len,
 	       uint8_t *out)
 {
-    uint8_t *in_copy = NULL;
-    uint8_t *p = NULL;
-    int i;
+    struct hmac_sha256_ctx ctx;
 
-    in_copy = calloc(1, strlen((const char *) in) + 1);
-    if (in_copy == NULL)
-	return -ENOMEM;
+    if (key == NULL)
+	return fticks_hashmac_keyed(in, NULL, out_len, out);
+    hmac_sha256_set_key(&ctx, strlen((char *) key), key);
+    return fticks_hashmac_keyed(in, &ctx, out_len, out);
+}
 
-    /* Sanitise and lowercase 'in' into 'in_copy'.  */
-    for (i = 0, p = in_copy; in[i] != '\0'; i++) {
-	if (in[i] == ';') {
-	    *p++ = '\0';
-	    break;
-	}
-	if (in[i] >= '0' && in[i] <= '9') {
-	    *p++ = in[i];
-	}
-	else if (tolower(in[i]) >= 'a' && tolower(in[i]) <= 'f') {
-	    *p++ = tolower(in[i]);
-	}
+/** As fticks_hashmac() but with the HMAC keyed beforehand by
+    fticks_hashmac_key(), or an ordinary hash if \a KEYED is NULL.  */
+int
+fticks_hashmac_keyed(const uint8_t *in,
+		     const struct hmac_sha256_ctx *keyed,
+		     size_t out_len,
+		     uint8_t *out)
+{
+    uint8_t buf[256];
+    uint8_t *in_copy = buf;
+    size_t len = strlen((const char *) in);
+
+    /* attribute values fit in buf, anything longer is allocated */
+    if (len >= sizeof(buf)) {
+	in_copy = malloc(len + 1);
+	if (in_copy == NULL)
+	    return -ENOMEM;
     }
 
-    _hash(in_copy, key, out_len, out);
-    free(in_copy);
+    /* Sanitise and lowercase 'in' into 'in_copy'.  */
+    _sanitise(in, in_copy);
+
+    _hash(in_copy, keyed, out_len, out);
+    if (in_copy != buf)
+	free(in_copy);
     return 0;
 }
 
+/** Return a HMAC context keyed with the NUL terminated \a KEY for
+    fticks_hashmac_keyed(), or NULL on out of memory.  */
+struct hmac_sha256_ctx *
+fticks_hashmac_key(const uint8_t *key)
+{
+    struct hmac_sha256_ctx *ctx;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx != NULL)
+	hmac_sha256_set_key(ctx, strlen((const char *) key), key);
+    return ctx;
+}
+
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
@@ -4,10 +4,17 @@
 #include <stdint.h>
 #include <stddef.h>
 
+struct hmac_sha256_ctx;
+
 int fticks_hashmac(const uint8_t *in,
 		   const uint8_t *key,
 		   size_t out_len,
 		   uint8_t *out);
+int fticks_hashmac_keyed(const uint8_t *in,
+			 const struct hmac_sha256_ctx *keyed,
+			 size_t out_len,
+			 uint8_t *out);
+struct hmac_sha256_ctx *fticks_hashmac_key(const uint8_t *key);
 
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
@@ -3,41 +3,220 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
-#include "list.h"
 #include "hash.h"
 
-/* allocates and initialises hash structure; returns NULL if malloc fails */
-struct hash *hash_create() {
-    struct hash *h = malloc(sizeof(struct hash));
+#define HASH_INITSIZE 16
+/* old buckets moved to the new table per insert or extract while growing */
+#define HASH_MIGRATESTEP 4
+
+/* Entries are chained in buckets. When the load factor exceeds one the
+ * table is doubled, and the old buckets are moved over a few at a time
+ * so that no single insert pays for rehashing everything. */
+struct hash_stripe {
+    struct hash_entry **buckets, **oldbuckets;
+    uint32_t size, oldsize, migrated, count;
+    struct hash_entry *first, *last; /* in insertion order */
+    pthread_mutex_t mutex;
+};
+
+static uint64_t hashkey[2];
+static pthread_once_t hashkeyonce = PTHREAD_ONCE_INIT;
+
+/* random key for siphash so that peers cannot choose colliding keys */
+static void hashkeyinit() {
+    FILE *f;
+
+    f = fopen("/dev/urandom", "r");
+    if (!f || fread(hashkey, sizeof(hashkey), 1, f) != 1) {
+	hashkey[0] ^= (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid();
+	hashkey[1] ^= (uint64_t)(uintptr_t)&hashkey ^ (uint64_t)clock();
+    }
+    if (f)
+	fclose(f);
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do {							\
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);	\
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;				\
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;				\
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);	\
+    } while (0)
+
+/* SipHash-2-4 of len bytes at in with the 128 bit key k */
+uint64_t hash_siphash(const uint8_t *in, uint32_t len, const uint64_t k[2]) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ k[1];
+    uint64_t m, b = (uint64_t)len << 56;
+    const uint8_t *end = in + (len & ~7);
+    int i;
+
+    for (; in != end; in += 8) {
+	for (m = 0, i = 7; i >= 0; i--)
+	    m = m << 8 | in[i];
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+    }
+    for (i = len & 7; i > 0; i--)
+	b |= (uint64_t)in[i - 1] << (8 * (i - 1));
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static struct hash_stripe *hashstripe(struct hash *h, uint64_t hashval) {
+    return h->nstripes == 1 ? h->stripes : h->stripes + (uint32_t)(hashval >> 32) % h->nstripes;
+}
+
+/* moves some buckets from the old table, keeping the chain order */
+static void stripemigrate(struct hash_stripe *st, uint32_t steps) {
+    struct hash_entry *e, *chain, *head[2], *tail[2];
+    uint32_t i;
+    int half;
+
+    for (; st->oldbuckets && steps; steps--) {
+	head[0] = head[1] = tail[0] = tail[1] = NULL;
+	for (e = st->oldbuckets[st->migrated]; e; e = chain) {
+	    chain = e->chain;
+	    e->chain = NULL;
+	    half = (e->hashval & st->oldsize) != 0;
+	    if (tail[half])
+		tail[half]->chain = e;
+	    else
+		head[half] = e;
+	    tail[half] = e;
+	}
+	/* entries in the new buckets were inserted later, so go after */
+	for (half = 0; half < 2; half++) {
+	    if (!head[half])
+		continue;
+	    i = st->migrated + (half ? st->oldsize : 0);
+	    tail[half]->chain = st->buckets[i];
+	    st->buckets[i] = head[half];
+	}
+	if (++st->migrated == st->oldsize) {
+	    free(st->oldbuckets);
+	    st->oldbuckets = NULL;
+	}
+    }
+}
+
+static void stripegrow(struct hash_stripe *st) {
+    struct hash_entry **buckets;
+
+    if (st->oldbuckets || st->count <= st->size)
+	return;
+    buckets = calloc(st->size * 2, sizeof(struct hash_entry *));
+    if (!buckets)
+	return; /* keep going with longer chains */
+    st->oldbuckets = st->buckets;
+    st->oldsize = st->size;
+    st->migrated = 0;
+    st->buckets = buckets;
+    st->size *= 2;
+}
+
+/* returns the link pointing to the first entry with the key, or NULL */
+static struct hash_entry **stripefind(struct hash_stripe *st, uint64_t hashval, void *key, uint32_t keylen) {
+    struct hash_entry **link, *e;
+    uint32_t i;
+
+    /* entries still in the old table are older than those in the new */
+    if (st->oldbuckets) {
+	i = hashval & (st->oldsize - 1);
+	if (i >= st->migrated)
+	    for (link = &st->oldbuckets[i]; (e = *link); link = &e->chain)
+		if (e->hashval == hashval && e->keylen == keylen && !memcmp(e->key, key, keylen))
+		    return link;
+    }
+    for (link = &st->buckets[hashval & (st->size - 1)]; (e = *link); link = &e->chain)
+	if (e->hashval == hashval && e->keylen == keylen && !memcmp(e->key, key, keylen))
+	    return link;
+    return NULL;
+}
+
+/* as hash_create(), but splits the hash in stripes with separate locks */
+struct hash *hash_createstriped(uint32_t stripes) {
+    struct hash *h;
+    uint32_t i;
+
+    if (!stripes)
+	stripes = 1;
+    pthread_once(&hashkeyonce, hashkeyinit);
+    h = malloc(sizeof(struct hash));
     if (!h)
 	return NULL;
-    h->hashlist = list_create();
-    if (!h->hashlist) {
+    h->nstripes = stripes;
+    h->stripes = calloc(stripes, sizeof(struct hash_stripe));
+    if (!h->stripes) {
 	free(h);
 	return NULL;
     }
-    pthread_mutex_init(&h->mutex, NULL);
+    for (i = 0; i < stripes; i++) {
+	h->stripes[i].size = HASH_INITSIZE;
+	h->stripes[i].buckets = calloc(HASH_INITSIZE, sizeof(struct hash_entry *));
+	if (!h->stripes[i].buckets) {
+	    while (i--) {
+		free(h->stripes[i].buckets);
+		pthread_mutex_destroy(&h->stripes[i].mutex);
+	    }
+	    free(h->stripes);
+	    free(h);
+	    return NULL;
+	}
+	pthread_mutex_init(&h->stripes[i].mutex, NULL);
+    }
     return h;
 }
 
+/* allocates and initialises hash structure; returns NULL if malloc fails */
+struct hash *hash_create() {
+    return hash_createstriped(1);
+}
+
 /* frees all memory associated with the hash */
 void hash_destroy(struct hash *h) {
-    struct list_node *ln;
+    struct hash_stripe *st;
+    struct hash_entry *e, *next;
+    uint32_t i;
 
     if (!h)
 	return;
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	free(((struct hash_entry *)ln->data)->key);
-	free(((struct hash_entry *)ln->data)->data);
+    for (i = 0; i < h->nstripes; i++) {
+	st = h->stripes + i;
+	for (e = st->first; e; e = next) {
+	    next = e->next;
+	    free(e->key);
+	    free(e->data);
+	    free(e);
+	}
+	free(st->buckets);
+	free(st->oldbuckets);
+	pthread_mutex_destroy(&st->mutex);
     }
-    list_destroy(h->hashlist);
-    pthread_mutex_destroy(&h->mutex);
+    free(h->stripes);
+    free(h);
 }
 
 /* insert entry in hash; returns 1 if ok, 0 if malloc fails */
 int hash_insert(struct hash *h, void *key, uint32_t keylen, void *data) {
-    struct hash_entry *e;
+    struct hash_stripe *st;
+    struct hash_entry *e, **link;
 
     if (!h)
 	return 0;
@@ -53,79 +232,101 @@ int hash_insert(struct hash *h, void *key, uint32_t keylen, void *data) {
     memcpy(e->key, key, keylen);
     e->keylen = keylen;
     e->data = data;
-    pthread_mutex_lock(&h->mutex);
-    if (!list_push(h->hashlist, e)) {
-	pthread_mutex_unlock(&h->mutex);
-	free(e->key);
-	free(e);
-	return 0;
-    }
-    pthread_mutex_unlock(&h->mutex);
+    e->hash = h;
+    e->hashval = hash_siphash(key, keylen, hashkey);
+
+    st = hashstripe(h, e->hashval);
+    pthread_mutex_lock(&st->mutex);
+    stripemigrate(st, HASH_MIGRATESTEP);
+    /* append, hash_read() returns the first inserted of equal keys */
+    for (link = &st->buckets[e->hashval & (st->size - 1)]; *link; link = &(*link)->chain);
+    *link = e;
+    e->prev = st->last;
+    if (st->last)
+	st->last->next = e;
+    else
+	st->first = e;
+    st->last = e;
+    st->count++;
+    stripegrow(st);
+    pthread_mutex_unlock(&st->mutex);
     return 1;
 }
 
 /* reads entry from hash */
 void *hash_read(struct hash *h, void *key, uint32_t keylen) {
-    struct list_node *ln;
-    struct hash_entry *e;
+    struct hash_stripe *st;
+    struct hash_entry **link;
+    uint64_t hashval;
+    void *data = NULL;
 
     if (!h)
 	return 0;
-    pthread_mutex_lock(&h->mutex);
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	e = (struct hash_entry *)ln->data;
-	if (e->keylen == keylen && !memcmp(e->key, key, keylen)) {
-	    pthread_mutex_unlock(&h->mutex);
-	    return e->data;
-	}
-    }
-    pthread_mutex_unlock(&h->mutex);
-    return NULL;
+    hashval = hash_siphash(key, keylen, hashkey);
+    st = hashstripe(h, hashval);
+    pthread_mutex_lock(&st->mutex);
+    link = stripefind(st, hashval, key, keylen);
+    if (link)
+	data = (*link)->data;
+    pthread_mutex_unlock(&st->mutex);
+    return data;
 }
 
 /* extracts entry from hash */
 void *hash_extract(struct hash *h, void *key, uint32_t keylen) {
-    struct list_node *ln;
-    struct hash_entry *e;
-    void *data;
+    struct hash_stripe *st;
+    struct hash_entry **link, *e;
+    uint64_t hashval;
+    void *data = NULL;
 
     if (!h)
 	return 0;
-    pthread_mutex_lock(&h->mutex);
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	e = (struct hash_entry *)ln->data;
-	if (e->keylen == keylen && !memcmp(e->key, key, keylen)) {
-	    free(e->key);
-	    list_removedata(h->hashlist, e);
-	    data = e->data;
-	    free(e);
-	    pthread_mutex_unlock(&h->mutex);
-	    return data;
-	}
+    hashval = hash_siphash(key, keylen, hashkey);
+    st = hashstripe(h, hashval);
+    pthread_mutex_lock(&st->mutex);
+    stripemigrate(st, HASH_MIGRATESTEP);
+    link = stripefind(st, hashval, key, keylen);
+    if (link) {
+	e = *link;
+	*link = e->chain;
+	if (e->prev)
+	    e->prev->next = e->next;
+	else
+	    st->first = e->next;
+	if (e->next)
+	    e->next->prev = e->prev;
+	else
+	    st->last = e->prev;
+	st->count--;
+	data = e->data;
+	free(e->key);
+	free(e);
     }
-    pthread_mutex_unlock(&h->mutex);
+    pthread_mutex_unlock(&st->mutex);
+    return data;
+}
+
+static struct hash_entry *stripesfirst(struct hash *h, uint32_t i) {
+    for (; i < h->nstripes; i++)
+	if (h->stripes[i].first)
+	    return h->stripes[i].first;
     return NULL;
 }
 
 /* returns first entry */
 struct hash_entry *hash_first(struct hash *hash) {
-    struct list_node *ln;
-    struct hash_entry *e;
-    if (!hash || !((ln = list_first(hash->hashlist))))
+    if (!hash)
 	return NULL;
-    e = (struct hash_entry *)ln->data;
-    e->next = ln->next;
-    return e;
+    return stripesfirst(hash, 0);
 }
 
 /* returns the next node after the argument */
 struct hash_entry *hash_next(struct hash_entry *entry) {
-    struct hash_entry *e;
-    if (!entry || !entry->next)
+    if (!entry)
 	return NULL;
-    e = (struct hash_entry *)entry->next->data;
-    e->next = (struct list_node *)entry->next->next;
-    return e;
+    if (entry->next)
+	return entry->next;
+    return stripesfirst(entry->hash, hashstripe(entry->hash, entry->hashval) - entry->hash->stripes + 1);
 }
 
 /* Local Variables: */
@@ -5,21 +5,31 @@
 #include <stdint.h>
 #endif
 
+struct hash_stripe;
+
 struct hash {
-    struct list *hashlist;
-    pthread_mutex_t mutex;
+    struct hash_stripe *stripes;
+    uint32_t nstripes;
 };
 
 struct hash_entry {
     void *key;
     uint32_t keylen;
     void *data;
-    struct list_node *next; /* used when walking through hash */
+    struct hash_entry *next; /* used when walking through hash */
+    /* internal, used by the hash table itself */
+    struct hash_entry *prev, *chain;
+    struct hash *hash;
+    uint64_t hashval;
 };
 
 /* allocates and initialises hash structure; returns NULL if malloc fails */
 struct hash *hash_create();
 
+/* as hash_create(), but splits the hash in stripes with separate locks
+ * so that threads using different keys rarely wait for each other */
+struct hash *hash_createstriped(uint32_t stripes);
+
 /* frees all memory associated with the hash */
 void hash_destroy(struct hash *hash);
 
@@ -32,7 +42,11 @@ void *hash_read(struct hash *hash, void *key, uint32_t keylen);
 /* extracts (read and remove) entry from hash */
 void *hash_extract(struct hash *hash, void *key, uint32_t keylen);
 
-/* returns first entry */
+/* SipHash-2-4 of len bytes at in with the 128 bit key k */
+uint64_t hash_siphash(const uint8_t *in, uint32_t len, const uint64_t k[2]);
+
+/* returns first entry. Walking through the hash is not locked, entries
+ * must not be inserted or extracted at the same time */
 struct hash_entry *hash_first(struct hash *hash);
 
 /* returns the next entry after the argument */
@@ -326,6 +326,293 @@ int connecttcphostlist(struct list *hostports,  struct addrinfo *src) {
     return -1;
 }
 
+struct hostportindexentry {
+    void *data;
+    struct list *hostports; /* only for unindexed entries */
+    uint32_t order;
+    uint16_t port; /* network byte order */
+    uint8_t exact; /* full length address, port is compared if asked */
+};
+
+/* path compressed binary trie node, key is the first plen bits of addr */
+struct hostportindexnode {
+    uint8_t addr[16];
+    uint8_t plen;
+    struct hostportindexnode *child[2];
+    struct list *entries;
+};
+
+struct hostportindex {
+    struct hostportindexnode *root4, *root6;
+    struct list *unindexed; /* entries with unresolved hostports */
+    uint32_t count;
+};
+
+struct hostportindex *hostportindex_create() {
+    struct hostportindex *idx;
+
+    idx = malloc(sizeof(struct hostportindex));
+    if (!idx)
+	return NULL;
+    memset(idx, 0, sizeof(struct hostportindex));
+    idx->unindexed = list_create();
+    if (!idx->unindexed) {
+	free(idx);
+	return NULL;
+    }
+    return idx;
+}
+
+static void freeindexentries(struct list *entries) {
+    void *entry;
+
+    if (!entries)
+	return;
+    while ((entry = list_shift(entries)))
+	free(entry);
+    list_destroy(entries);
+}
+
+static void freeindexnode(struct hostportindexnode *node) {
+    if (!node)
+	return;
+    freeindexnode(node->child[0]);
+    freeindexnode(node->child[1]);
+    freeindexentries(node->entries);
+    free(node);
+}
+
+void hostportindex_free(struct hostportindex *idx) {
+    if (!idx)
+	return;
+    freeindexnode(idx->root4);
+    freeindexnode(idx->root6);
+    freeindexentries(idx->unindexed);
+    free(idx);
+}
+
+static uint8_t addrbit(uint8_t *addr, uint8_t n) {
+    return (addr[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/* returns the number of leading bits equal in a1 and a2, at most max */
+static uint8_t commonbits(uint8_t *a1, uint8_t *a2, uint8_t max) {
+    uint8_t n;
+
+    for (n = 0; n < max && a1[n / 8] == a2[n / 8]; n += 8);
+    for (n = n > max ? max - max % 8 : n; n < max && addrbit(a1, n) == addrbit(a2, n); n++);
+    return n;
+}
+
+static struct hostportindexnode *newindexnode(uint8_t *addr, uint8_t plen) {
+    struct hostportindexnode *node;
+
+    node = malloc(sizeof(struct hostportindexnode));
+    if (!node)
+	return NULL;
+    memset(node, 0, sizeof(struct hostportindexnode));
+    memcpy(node->addr, addr, (plen + 7) / 8);
+    node->plen = plen;
+    return node;
+}
+
+static int addindexentry(struct hostportindexnode *node, struct hostportindexentry *entry) {
+    if (!node->entries) {
+	node->entries = list_create();
+	if (!node->entries)
+	    return 0;
+    }
+    return list_push(node->entries, entry);
+}
+
+static int indexinsert(struct hostportindexnode **np, uint8_t *addr, uint8_t plen, struct hostportindexentry *entry) {
+    struct hostportindexnode *n, *m, *leaf;
+    uint8_t common;
+
+    for (;;) {
+	n = *np;
+	if (!n) {
+	    n = newindexnode(addr, plen);
+	    if (!n)
+		return 0;
+	    *np = n;
+	    return addindexentry(n, entry);
+	}
+	common = commonbits(n->addr, addr, n->plen < plen ? n->plen : plen);
+	if (common == n->plen && common == plen)
+	    return addindexentry(n, entry);
+	if (common == n->plen) {
+	    np = &n->child[addrbit(addr, n->plen)];
+	    continue;
+	}
+	m = newindexnode(addr, common);
+	if (!m)
+	    return 0;
+	m->child[addrbit(n->addr, common)] = n;
+	if (common == plen) {
+	    *np = m;
+	    return addindexentry(m, entry);
+	}
+	leaf = newindexnode(addr, plen);
+	if (!leaf) {
+	    free(m);
+	    return 0;
+	}
+	m->child[addrbit(addr, common)] = leaf;
+	*np = m;
+	return addindexentry(leaf, entry);
+    }
+}
+
+int hostportindex_add(struct hostportindex *idx, struct list *hostports, void *data) {
+    struct list_node *entry;
+    struct hostportres *hp;
+    struct addrinfo *res;
+    struct hostportindexentry *e;
+    uint8_t *addr, full, plen;
+    uint32_t order = idx->count++;
+
+    for (entry = list_first(hostports); entry; entry = list_next(entry))
+	if (!((struct hostportres *)entry->data)->addrinfo)
+	    break;
+    if (entry) {
+	/* not resolved yet, may be later, needs the slow path */
+	e = malloc(sizeof(struct hostportindexentry));
+	if (!e)
+	    return 0;
+	memset(e, 0, sizeof(struct hostportindexentry));
+	e->data = data;
+	e->hostports = hostports;
+	e->order = order;
+	if (!list_push(idx->unindexed, e)) {
+	    free(e);
+	    return 0;
+	}
+	return 1;
+    }
+
+    for (entry = list_first(hostports); entry; entry = list_next(entry)) {
+	hp = (struct hostportres *)entry->data;
+	for (res = hp->addrinfo; res; res = res->ai_next) {
+	    e = malloc(sizeof(struct hostportindexentry));
+	    if (!e)
+		return 0;
+	    memset(e, 0, sizeof(struct hostportindexentry));
+	    e->data = data;
+	    e->order = order;
+	    if (res->ai_family == AF_INET) {
+		addr = (uint8_t *)&((struct sockaddr_in *)res->ai_addr)->sin_addr;
+		e->port = ((struct sockaddr_in *)res->ai_addr)->sin_port;
+		full = 32;
+	    } else if (res->ai_family == AF_INET6) {
+		addr = (uint8_t *)&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+		e->port = ((struct sockaddr_in6 *)res->ai_addr)->sin6_port;
+		full = 128;
+	    } else {
+		free(e);
+		continue;
+	    }
+	    e->exact = hp->prefixlen >= full;
+	    plen = e->exact ? full : hp->prefixlen;
+	    if (!indexinsert(res->ai_family == AF_INET ? &idx->root4 : &idx->root6, addr, plen, e)) {
+		free(e);
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+/* calls f for each index entry matching addr, stops if f returns 0 */
+static void indexmatches(struct hostportindex *idx, struct sockaddr *addr, uint8_t checkport,
+			 int (*f)(struct hostportindexentry *, void *), void *arg) {
+    struct sockaddr_in6 *sa6;
+    struct hostportindexnode *node;
+    struct hostportindexentry *e;
+    struct list_node *entry;
+    uint8_t *a, full;
+    uint16_t port;
+
+    if (addr->sa_family == AF_INET6) {
+	sa6 = (struct sockaddr_in6 *)addr;
+	port = sa6->sin6_port;
+	if (IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
+	    a = &sa6->sin6_addr.s6_addr[12];
+	    node = idx->root4;
+	    full = 32;
+	} else {
+	    a = sa6->sin6_addr.s6_addr;
+	    node = idx->root6;
+	    full = 128;
+	}
+    } else if (addr->sa_family == AF_INET) {
+	a = (uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+	port = ((struct sockaddr_in *)addr)->sin_port;
+	node = idx->root4;
+	full = 32;
+    } else
+	return;
+
+    while (node && node->plen <= full && commonbits(node->addr, a, node->plen) == node->plen) {
+	for (entry = list_first(node->entries); entry; entry = list_next(entry)) {
+	    e = (struct hostportindexentry *)entry->data;
+	    if (e->exact && checkport && e->port != port)
+		continue;
+	    if (!f(e, arg))
+		return;
+	}
+	if (node->plen == full)
+	    break;
+	node = node->child[addrbit(a, node->plen)];
+    }
+
+    for (entry = list_first(idx->unindexed); entry; entry = list_next(entry)) {
+	e = (struct hostportindexentry *)entry->data;
+	if (!addressmatches(e->hostports, addr, checkport))
+	    continue;
+	if (!f(e, arg))
+	    return;
+    }
+}
+
+struct indexsearch {
+    void *after;
+    int64_t afterorder;
+    struct hostportindexentry *best;
+};
+
+static int findafter(struct hostportindexentry *e, void *arg) {
+    struct indexsearch *search = (struct indexsearch *)arg;
+
+    if (e->data != search->after)
+	return 1;
+    search->afterorder = e->order;
+    return 0;
+}
+
+static int findbest(struct hostportindexentry *e, void *arg) {
+    struct indexsearch *search = (struct indexsearch *)arg;
+
+    if (e->order > search->afterorder && (!search->best || e->order < search->best->order))
+	search->best = e;
+    return 1;
+}
+
+void *hostportindex_match(struct hostportindex *idx, struct sockaddr *addr, uint8_t checkport, void *after) {
+    struct indexsearch search;
+
+    memset(&search, 0, sizeof(search));
+    search.afterorder = -1;
+    if (after) {
+	search.after = after;
+	indexmatches(idx, addr, checkport, findafter, &search);
+	if (search.afterorder < 0)
+	    return NULL;
+    }
+    indexmatches(idx, addr, checkport, findbest, &search);
+    return search.best ? search.best->data : NULL;
+}
+
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
@@ -2,6 +2,8 @@
  * Copyright (c) 2012, NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+struct list;
+
 struct hostportres {
     char *host;
     char *port;
@@ -20,6 +22,18 @@ int hostportmatches(struct list *hostports, struct list *matchhostports, uint8_t
 int addressmatches(struct list *hostports, struct sockaddr *addr, uint8_t checkport);
 int connecttcphostlist(struct list *hostports,  struct addrinfo *src);
 
+/* index of the addresses and prefixes of several hostports lists, each
+ * with associated data. Lookups give the same result as calling
+ * addressmatches() on each list in the order they were added */
+struct hostportindex;
+struct hostportindex *hostportindex_create();
+void hostportindex_free(struct hostportindex *idx);
+/* adds the addresses of hostports with data; returns 0 if malloc fails */
+int hostportindex_add(struct hostportindex *idx, struct list *hostports, void *data);
+/* returns the data of the first added hostports matching addr, after the
+ * one with data after if after is not NULL; NULL if none */
+void *hostportindex_match(struct hostportindex *idx, struct sockaddr *addr, uint8_t checkport, void *after);
+
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
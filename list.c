@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "list.h"
+#include "pool.h"
 
 /* Private helper functions. */
 static void list_free_helper_(struct list *list, int free_data_flag) {
@@ -16,19 +17,16 @@ static void list_free_helper_(struct list *list, int free_data_flag) {
         if (free_data_flag)
             free(node->data);
 	next = node->next;
-	free(node);
+	pool_free(node, sizeof(struct list_node));
     }
-    free(list);
+    pool_free(list, sizeof(struct list));
 }
 
 /* Public functions. */
 
 /* allocates and initialises list structure; returns NULL if malloc fails */
 struct list *list_create() {
-    struct list *list = malloc(sizeof(struct list));
-    if (list)
-	memset(list, 0, sizeof(struct list));
-    return list;
+    return pool_zalloc(sizeof(struct list));
 }
 
 /* frees all memory associated with the list
@@ -49,7 +47,7 @@ void list_free(struct list *list) {
 int list_push(struct list *list, void *data) {
     struct list_node *node;
 
-    node = malloc(sizeof(struct list_node));
+    node = pool_malloc(sizeof(struct list_node));
     if (!node)
 	return 0;
 
@@ -79,7 +77,7 @@ void *list_shift(struct list *list) {
     if (!list->first)
 	list->last = NULL;
     data = node->data;
-    free(node);
+    pool_free(node, sizeof(struct list_node));
     list->count--;
     return data;
 }
@@ -94,7 +92,7 @@ void list_removedata(struct list *list, void *data) {
     node = list->first;
     while (node->data == data) {
 	list->first = node->next;
-	free(node);
+	pool_free(node, sizeof(struct list_node));
 	list->count--;
 	node = list->first;
 	if (!node) {
@@ -106,7 +104,7 @@ void list_removedata(struct list *list, void *data) {
 	if (node->next->data == data) {
 	    t = node->next;
 	    node->next = t->next;
-	    free(t);
+	    pool_free(t, sizeof(struct list_node));
 	    list->count--;
 	    if (!node->next) { /* we removed the last one */
 		list->last = node;
@@ -0,0 +1,491 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(HAVE_MALLINFO2)
+#include <malloc.h>
+#endif
+#include "radsecproxy.h"
+#include "debug.h"
+#include "util.h"
+#include "hostport.h"
+#include "pool.h"
+#include "metrics.h"
+
+#define METRICS_SHARDS 8
+#define METRICS_LINE 64
+#define METRICS_MAXSOCKS 8
+#define METRICS_MAXREQUEST 4096
+
+struct metricsshard {
+    uint64_t v[METRICS_N];
+    uint8_t pad[METRICS_LINE - METRICS_N * sizeof(uint64_t) % METRICS_LINE];
+};
+
+struct metrics {
+    struct metricsshard shard[METRICS_SHARDS];
+};
+
+/* bucket counts of each stage followed by their sum in microseconds */
+struct stageshard {
+    uint64_t v[RQ_STAGES + 1][METRICS_STAGE_BUCKETS + 1];
+    uint8_t pad[METRICS_LINE - sizeof(uint64_t[RQ_STAGES + 1][METRICS_STAGE_BUCKETS + 1]) % METRICS_LINE];
+};
+
+struct metricsample {
+    const char *kind;
+    char *name;
+    uint64_t v[METRICS_N];
+};
+
+struct metricsreport {
+    struct metricsample *samples;
+    int n, size;
+    uint64_t memory[METRIC_MEMORY_KINDS];
+};
+
+struct metricsserver {
+    int socks[METRICS_MAXSOCKS];
+    int nsocks;
+    void (*dump)(struct metricsreport *);
+};
+
+static const uint32_t rttbounds[METRICS_RTT_BUCKETS - 1] = { METRICS_RTT_BOUNDS };
+static const uint32_t stagebounds[METRICS_STAGE_BUCKETS - 1] = { METRICS_STAGE_BOUNDS };
+static struct stageshard stageshards[METRICS_SHARDS];
+
+static pthread_key_t shardkey;
+static pthread_once_t shardonce = PTHREAD_ONCE_INIT;
+static uint8_t shardkeyok;
+static uint32_t nextshard;
+
+static void shardinit() {
+    shardkeyok = !pthread_key_create(&shardkey, NULL);
+}
+
+/* threads are given shards round robin the first time they count */
+static int getshard() {
+    uintptr_t s;
+
+    pthread_once(&shardonce, shardinit);
+    if (!shardkeyok)
+	return 0;
+    s = (uintptr_t)pthread_getspecific(shardkey);
+    if (!s) {
+	s = __sync_fetch_and_add(&nextshard, 1) % METRICS_SHARDS + 1;
+	pthread_setspecific(shardkey, (void *)s);
+    }
+    return s - 1;
+}
+
+struct metrics *metrics_create() {
+    void *m;
+
+    if (posix_memalign(&m, METRICS_LINE, sizeof(struct metrics)))
+	return NULL;
+    memset(m, 0, sizeof(struct metrics));
+    return (struct metrics *)m;
+}
+
+void metrics_free(struct metrics *m) {
+    free(m);
+}
+
+void metrics_inc(struct metrics *m, enum metric_type type) {
+    if (m)
+	__sync_fetch_and_add(&m->shard[getshard()].v[type], 1);
+}
+
+void metrics_reply(struct metrics *m, uint8_t code) {
+    switch (code) {
+    case RAD_Access_Accept:
+	metrics_inc(m, METRIC_REPLIES_ACCEPT);
+	break;
+    case RAD_Access_Reject:
+	metrics_inc(m, METRIC_REPLIES_REJECT);
+	break;
+    case RAD_Access_Challenge:
+	metrics_inc(m, METRIC_REPLIES_CHALLENGE);
+	break;
+    case RAD_Accounting_Response:
+	metrics_inc(m, METRIC_REPLIES_ACCOUNTING);
+	break;
+    default:
+	metrics_inc(m, METRIC_REPLIES_OTHER);
+    }
+}
+
+void metrics_rtt(struct metrics *m, struct timeval *sent) {
+    struct metricsshard *shard;
+    struct timeval now;
+    int64_t us;
+    int i;
+
+    if (!m)
+	return;
+    gettimeofday(&now, NULL);
+    us = (int64_t)(now.tv_sec - sent->tv_sec) * 1000000 + now.tv_usec - sent->tv_usec;
+    if (us < 0)
+	us = 0;
+    for (i = 0; i < METRICS_RTT_BUCKETS - 1; i++)
+	if (us <= (int64_t)rttbounds[i] * 1000)
+	    break;
+    shard = m->shard + getshard();
+    __sync_fetch_and_add(&shard->v[METRIC_RTT_SUM], (uint64_t)us);
+    __sync_fetch_and_add(&shard->v[METRIC_RTT_BUCKET + i], 1);
+}
+
+void metrics_stage(int stage, uint32_t us) {
+    uint64_t *v;
+    int i;
+
+    for (i = 0; i < METRICS_STAGE_BUCKETS - 1; i++)
+	if (us <= stagebounds[i])
+	    break;
+    v = stageshards[getshard()].v[stage];
+    __sync_fetch_and_add(&v[i], 1);
+    __sync_fetch_and_add(&v[METRICS_STAGE_BUCKETS], us);
+}
+
+void metrics_read(struct metrics *m, uint64_t *values) {
+    int s, i;
+
+    memset(values, 0, METRICS_N * sizeof(uint64_t));
+    if (!m)
+	return;
+    for (s = 0; s < METRICS_SHARDS; s++)
+	for (i = 0; i < METRICS_N; i++)
+	    values[i] += __sync_add_and_fetch(&m->shard[s].v[i], 0);
+}
+
+void metrics_report(struct metricsreport *r, const char *kind, const char *name, struct metrics *m) {
+    struct metricsample *s;
+
+    if (!m || !name)
+	return;
+    if (r->n == r->size) {
+	s = realloc(r->samples, (r->size ? r->size * 2 : 64) * sizeof(struct metricsample));
+	if (!s) {
+	    debug(DBG_ERR, "metrics_report: malloc failed");
+	    return;
+	}
+	r->samples = s;
+	r->size = r->size ? r->size * 2 : 64;
+    }
+    s = r->samples + r->n;
+    s->name = stringcopy(name, 0);
+    if (!s->name) {
+	debug(DBG_ERR, "metrics_report: malloc failed");
+	return;
+    }
+    s->kind = kind;
+    metrics_read(m, s->v);
+    r->n++;
+}
+
+void metrics_memory(struct metricsreport *r, enum metric_memory kind, uint64_t bytes) {
+    r->memory[kind] += bytes;
+}
+
+/* label values may not contain unescaped backslash, quote or newline */
+static void printlabel(FILE *f, struct metricsample *s) {
+    char *c;
+
+    fprintf(f, "%s=\"", s->kind);
+    for (c = s->name; *c; c++) {
+	if (*c == '\\' || *c == '"')
+	    fputc('\\', f);
+	if (*c == '\n')
+	    fputs("\\n", f);
+	else
+	    fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+static void printcounter(FILE *f, struct metricsreport *r, const char *name, const char *help, int type) {
+    int i;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (i = 0; i < r->n; i++) {
+	fprintf(f, "%s{", name);
+	printlabel(f, r->samples + i);
+	fprintf(f, "} %llu\n", (unsigned long long)r->samples[i].v[type]);
+    }
+}
+
+static void printlabelled(FILE *f, struct metricsreport *r, const char *name, const char *help,
+			  const char *label, const char **values, int first, int n) {
+    int i, j;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (i = 0; i < r->n; i++)
+	for (j = 0; j < n; j++) {
+	    fprintf(f, "%s{", name);
+	    printlabel(f, r->samples + i);
+	    fprintf(f, ",%s=\"%s\"} %llu\n", label, values[j], (unsigned long long)r->samples[i].v[first + j]);
+	}
+}
+
+static void printrtt(FILE *f, struct metricsreport *r) {
+    const char *name = "radsecproxy_rtt_seconds";
+    struct metricsample *s;
+    uint64_t count;
+    int i, j;
+
+    fprintf(f, "# HELP %s Time from sending a request until the reply, for requests not retransmitted\n# TYPE %s histogram\n", name, name);
+    for (i = 0; i < r->n; i++) {
+	s = r->samples + i;
+	for (count = 0, j = 0; j < METRICS_RTT_BUCKETS; j++) {
+	    count += s->v[METRIC_RTT_BUCKET + j];
+	    fprintf(f, "%s_bucket{", name);
+	    printlabel(f, s);
+	    if (j < METRICS_RTT_BUCKETS - 1)
+		fprintf(f, ",le=\"%g\"} %llu\n", rttbounds[j] / 1000.0, (unsigned long long)count);
+	    else
+		fprintf(f, ",le=\"+Inf\"} %llu\n", (unsigned long long)count);
+	}
+	fprintf(f, "%s_sum{", name);
+	printlabel(f, s);
+	fprintf(f, "} %.6f\n", s->v[METRIC_RTT_SUM] / 1000000.0);
+	fprintf(f, "%s_count{", name);
+	printlabel(f, s);
+	fprintf(f, "} %llu\n", (unsigned long long)count);
+    }
+}
+
+static void printstages(FILE *f) {
+    static const char *stages[RQ_STAGES + 1] = { "parse", "route", "queue", "wait", "server", "reply", "total" };
+    const char *name = "radsecproxy_stage_seconds";
+    uint64_t v[METRICS_STAGE_BUCKETS + 1], count;
+    int i, j, s;
+
+    fprintf(f, "# HELP %s Time requests spent being parsed, routed, queued for a server, waiting to be sent, at the server and until their reply was dequeued to be written, and in total\n# TYPE %s histogram\n", name, name);
+    for (i = 0; i <= RQ_STAGES; i++) {
+	memset(v, 0, sizeof(v));
+	for (s = 0; s < METRICS_SHARDS; s++)
+	    for (j = 0; j <= METRICS_STAGE_BUCKETS; j++)
+		v[j] += __sync_add_and_fetch(&stageshards[s].v[i][j], 0);
+	for (count = 0, j = 0; j < METRICS_STAGE_BUCKETS; j++) {
+	    count += v[j];
+	    if (j < METRICS_STAGE_BUCKETS - 1)
+		fprintf(f, "%s_bucket{stage=\"%s\",le=\"%g\"} %llu\n", name, stages[i], stagebounds[j] / 1000000.0, (unsigned long long)count);
+	    else
+		fprintf(f, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name, stages[i], (unsigned long long)count);
+	}
+	fprintf(f, "%s_sum{stage=\"%s\"} %.6f\n", name, stages[i], v[METRICS_STAGE_BUCKETS] / 1000000.0);
+	fprintf(f, "%s_count{stage=\"%s\"} %llu\n", name, stages[i], (unsigned long long)count);
+    }
+}
+
+static void printmemory(FILE *f, struct metricsreport *r) {
+    static const char *kinds[METRIC_MEMORY_KINDS] = { "clients", "duplicates", "servers" };
+    const char *name = "radsecproxy_memory_bytes";
+    int i;
+#if defined(HAVE_MALLINFO2)
+    struct mallinfo2 mi = mallinfo2();
+#endif
+
+    fprintf(f, "# HELP %s Memory used for clients, their duplicate caches and server connections, kept in the pool depots, and in use from the heap in total\n# TYPE %s gauge\n", name, name);
+    for (i = 0; i < METRIC_MEMORY_KINDS; i++)
+	fprintf(f, "%s{kind=\"%s\"} %llu\n", name, kinds[i], (unsigned long long)r->memory[i]);
+    fprintf(f, "%s{kind=\"pool\"} %llu\n", name, (unsigned long long)pool_depotbytes());
+#if defined(HAVE_MALLINFO2)
+    fprintf(f, "%s{kind=\"heap\"} %llu\n", name, (unsigned long long)(mi.uordblks + mi.hblkhd));
+#endif
+}
+
+static void metricswrite(FILE *f, struct metricsreport *r) {
+    static const char *codes[] = { "Access-Accept", "Access-Reject", "Access-Challenge", "Accounting-Response", "other" };
+    static const char *reasons[] = { "noroom", "invalid", "ttl", "replyqueue", "ratelimit", "workers" };
+
+    printcounter(f, r, "radsecproxy_requests_received_total", "Requests received from a client, or for a realm", METRIC_REQUESTS_IN);
+    printcounter(f, r, "radsecproxy_requests_sent_total", "Requests sent to a server, or for a realm, not counting retransmissions", METRIC_REQUESTS_OUT);
+    printcounter(f, r, "radsecproxy_retransmissions_total", "Requests sent again to a server", METRIC_RETRANSMITS);
+    printlabelled(f, r, "radsecproxy_replies_total", "Replies sent to a client or for a realm, or received from a server",
+		  "code", codes, METRIC_REPLIES_ACCEPT, sizeof(codes) / sizeof(codes[0]));
+    printlabelled(f, r, "radsecproxy_drops_total", "Messages dropped since the server queue or the client reply queue was full, they failed validation, their TTL ran out, they were over a rate limit or too many were waiting for the workers",
+		  "reason", reasons, METRIC_DROPS_NOROOM, sizeof(reasons) / sizeof(reasons[0]));
+    printcounter(f, r, "radsecproxy_ratelimit_rejects_total", "Access requests over a client or realm rate limit answered with a reject", METRIC_RATELIMIT_REJECTS);
+    printcounter(f, r, "radsecproxy_lost_requests_total", "Requests a server did not answer", METRIC_LOST);
+    printcounter(f, r, "radsecproxy_read_pauses_total", "Times reading requests from a client stopped since its reply queue was full", METRIC_READ_PAUSES);
+    printrtt(f, r);
+    printstages(f);
+    printmemory(f, r);
+}
+
+static int sendall(int s, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len) {
+	n = send(s, buf, len, MSG_NOSIGNAL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 1;
+}
+
+static void metricsanswer(struct metricsserver *srv, int s) {
+    char req[METRICS_MAXREQUEST + 1], head[256], *body = NULL;
+    struct metricsreport report;
+    struct timeval timeout;
+    size_t bodylen = 0, len = 0;
+    ssize_t n;
+    FILE *f;
+    int i;
+
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* we only care about the request line, but read the whole head */
+    while (len < METRICS_MAXREQUEST) {
+	n = recv(s, req + len, METRICS_MAXREQUEST - len, 0);
+	if (n <= 0)
+	    break;
+	len += n;
+	req[len] = '\0';
+	if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+	    break;
+    }
+    req[len] = '\0';
+
+    if (strncmp(req, "GET ", 4) || (strncmp(req + 4, "/metrics", 8) && strncmp(req + 4, "/ ", 2))) {
+	snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	sendall(s, head, strlen(head));
+	return;
+    }
+
+    memset(&report, 0, sizeof(report));
+    srv->dump(&report);
+    f = open_memstream(&body, &bodylen);
+    if (f) {
+	metricswrite(f, &report);
+	fclose(f);
+    }
+    for (i = 0; i < report.n; i++)
+	free(report.samples[i].name);
+    free(report.samples);
+    if (!f || !body) {
+	debug(DBG_ERR, "metricsanswer: malloc failed");
+	snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	sendall(s, head, strlen(head));
+	free(body);
+	return;
+    }
+    snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", bodylen);
+    if (sendall(s, head, strlen(head)))
+	sendall(s, body, bodylen);
+    free(body);
+}
+
+static void *metricsserver(void *arg) {
+    struct metricsserver *srv = (struct metricsserver *)arg;
+    struct pollfd fds[METRICS_MAXSOCKS];
+    int i, s;
+
+    for (i = 0; i < srv->nsocks; i++) {
+	fds[i].fd = srv->socks[i];
+	fds[i].events = POLLIN;
+    }
+    for (;;) {
+	if (poll(fds, srv->nsocks, -1) < 0) {
+	    if (errno != EINTR)
+		debugerrno(errno, DBG_WARN, "metricsserver: poll failed");
+	    continue;
+	}
+	for (i = 0; i < srv->nsocks; i++) {
+	    if (!(fds[i].revents & POLLIN))
+		continue;
+	    s = accept(fds[i].fd, NULL, NULL);
+	    if (s < 0) {
+		debugerrno(errno, DBG_WARN, "metricsserver: accept failed");
+		continue;
+	    }
+	    metricsanswer(srv, s);
+	    shutdown(s, SHUT_RDWR);
+	    close(s);
+	}
+    }
+    return NULL;
+}
+
+int metrics_listen(char *arg, void (*dump)(struct metricsreport *)) {
+    struct metricsserver *srv;
+    struct hostportres *hp;
+    struct addrinfo *res;
+    pthread_t th;
+    int s, on = 1;
+
+    hp = newhostport(arg, NULL, 0);
+    if (!hp || !hp->port || !resolvehostport(hp, AF_UNSPEC, SOCK_STREAM, 1)) {
+	debug(DBG_ERR, "metrics_listen: failed to resolve %s, a port must be given", arg);
+	freehostport(hp);
+	return 0;
+    }
+    srv = malloc(sizeof(struct metricsserver));
+    if (!srv) {
+	debug(DBG_ERR, "metrics_listen: malloc failed");
+	freehostport(hp);
+	return 0;
+    }
+    memset(srv, 0, sizeof(struct metricsserver));
+    srv->dump = dump;
+
+    for (res = hp->addrinfo; res && srv->nsocks < METRICS_MAXSOCKS; res = res->ai_next) {
+	s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (s < 0) {
+	    debugerrno(errno, DBG_WARN, "metrics_listen: socket failed");
+	    continue;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+	    debugerrno(errno, DBG_WARN, "metrics_listen: SO_REUSEADDR");
+#ifdef IPV6_V6ONLY
+	if (res->ai_family == AF_INET6)
+	    if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1)
+		debugerrno(errno, DBG_WARN, "metrics_listen: IPV6_V6ONLY");
+#endif
+	if (bind(s, res->ai_addr, res->ai_addrlen) || listen(s, 16)) {
+	    debugerrno(errno, DBG_WARN, "metrics_listen: bind or listen failed");
+	    close(s);
+	    continue;
+	}
+	srv->socks[srv->nsocks++] = s;
+    }
+    freehostport(hp);
+
+    if (!srv->nsocks) {
+	debug(DBG_ERR, "metrics_listen: could not listen on %s", arg);
+	free(srv);
+	return 0;
+    }
+    if (pthread_create(&th, &pthread_attr, metricsserver, (void *)srv)) {
+	debugerrno(errno, DBG_ERR, "metrics_listen: pthread_create failed");
+	while (srv->nsocks)
+	    close(srv->socks[--srv->nsocks]);
+	free(srv);
+	return 0;
+    }
+    pthread_detach(th);
+    debug(DBG_WARN, "metrics_listen: serving metrics on %s", arg);
+    return 1;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,96 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <sys/time.h>
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+/* Counters kept for each client, server and realm. They are split in
+ * shards of their own cache lines, and a thread only updates the shard
+ * it was given, so threads handling requests for the same client or
+ * server rarely touch the same cache line. The shards are only summed
+ * when the metrics are scraped. */
+enum metric_type {
+    METRIC_REQUESTS_IN,
+    METRIC_REQUESTS_OUT,
+    METRIC_RETRANSMITS,
+    METRIC_REPLIES_ACCEPT,
+    METRIC_REPLIES_REJECT,
+    METRIC_REPLIES_CHALLENGE,
+    METRIC_REPLIES_ACCOUNTING,
+    METRIC_REPLIES_OTHER,
+    METRIC_DROPS_NOROOM,
+    METRIC_DROPS_INVALID,
+    METRIC_DROPS_TTL,
+    METRIC_DROPS_REPLYQ,
+    METRIC_DROPS_RATELIMIT,
+    METRIC_DROPS_WORKERS,
+    METRIC_RATELIMIT_REJECTS,
+    METRIC_READ_PAUSES,
+    METRIC_LOST,
+    METRIC_RTT_SUM, /* microseconds */
+    METRIC_RTT_BUCKET, /* first of METRICS_RTT_BUCKETS counters */
+};
+
+/* upper bounds of the RTT buckets in milliseconds, the last is +Inf */
+#define METRICS_RTT_BOUNDS 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+#define METRICS_RTT_BUCKETS 13
+#define METRICS_N (METRIC_RTT_BUCKET + METRICS_RTT_BUCKETS)
+
+/* upper bounds of the buckets of the request stage histograms in
+ * microseconds, the last is +Inf */
+#define METRICS_STAGE_BOUNDS 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 5000000
+#define METRICS_STAGE_BUCKETS 18
+
+/* what radsecproxy_memory_bytes is broken down into, besides the pool
+ * depots and the heap in total */
+enum metric_memory {
+    METRIC_MEMORY_CLIENTS, /* clients and their addresses */
+    METRIC_MEMORY_DUPLICATES, /* duplicate cache tables and the requests in them */
+    METRIC_MEMORY_SERVERS, /* server connections and their request tables */
+    METRIC_MEMORY_KINDS
+};
+
+struct metrics;
+struct metricsreport;
+
+/* returns NULL if out of memory; all functions accept a NULL metrics and
+ * then do nothing */
+struct metrics *metrics_create();
+void metrics_free(struct metrics *m);
+
+void metrics_inc(struct metrics *m, enum metric_type type);
+/* counts a reply of the given radius code */
+void metrics_reply(struct metrics *m, uint8_t code);
+/* records the time from sent until now */
+void metrics_rtt(struct metrics *m, struct timeval *sent);
+
+/* records that a request spent us microseconds in stage, one of enum
+ * rqstage, or RQ_STAGES for the time from receiving it until its reply
+ * was dequeued. These histograms are kept for all requests together */
+void metrics_stage(int stage, uint32_t us);
+
+/* sums the shards into values, which must have room for METRICS_N */
+void metrics_read(struct metrics *m, uint64_t *values);
+
+/* adds the current values of m to a report being scraped. kind is used
+ * as the label name, e.g. "client", and name as its value */
+void metrics_report(struct metricsreport *r, const char *kind, const char *name, struct metrics *m);
+
+/* adds bytes of memory used for kind to a report being scraped */
+void metrics_memory(struct metricsreport *r, enum metric_memory kind, uint64_t bytes);
+
+/* starts a thread answering HTTP requests on address arg with the
+ * metrics in the Prometheus text format. For each request dump is called
+ * to add the metrics of all clients, servers and realms with
+ * metrics_report() and the memory they use with metrics_memory().
+ * Returns 0 on failure */
+int metrics_listen(char *arg, void (*dump)(struct metricsreport *));
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
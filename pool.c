@@ -0,0 +1,212 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_MINSHIFT 5
+#define POOL_CLASSES 8 /* 32, 64, ... 4096 */
+/* objects per class a thread keeps, and how many move to or from the depot at a time */
+#define POOL_CACHEMAX 128
+#define POOL_BATCH 64
+/* bytes per class the depot keeps, the rest goes back to malloc */
+#define POOL_DEPOTBYTES (1024 * 1024)
+/* buffers store their size in front of the data */
+#define POOL_BUFHDR sizeof(uint64_t)
+
+struct poolobj {
+    struct poolobj *next;
+};
+
+struct poolcache {
+    struct poolobj *free[POOL_CLASSES];
+    uint32_t n[POOL_CLASSES];
+};
+
+struct pooldepot {
+    pthread_mutex_t mutex;
+    struct poolobj *free;
+    uint32_t n;
+};
+
+static struct pooldepot depots[POOL_CLASSES];
+static pthread_key_t cachekey;
+static pthread_once_t poolonce = PTHREAD_ONCE_INIT;
+static uint8_t poolok;
+
+static int sizeclass(size_t size) {
+    int c = 0;
+
+    while (((size_t)1 << (c + POOL_MINSHIFT)) < size)
+	c++;
+    return c;
+}
+
+/* moves all but keep objects of class c from the cache to the depot */
+static void cacheflush(struct poolcache *cache, int c, uint32_t keep) {
+    struct pooldepot *depot = depots + c;
+    struct poolobj *first, *last, *next;
+    uint32_t i, n;
+
+    if (cache->n[c] <= keep)
+	return;
+    n = cache->n[c] - keep;
+    first = last = cache->free[c];
+    for (i = 1; i < n; i++)
+	last = last->next;
+    cache->free[c] = last->next;
+    cache->n[c] = keep;
+
+    pthread_mutex_lock(&depot->mutex);
+    if (depot->n + n <= POOL_DEPOTBYTES >> (c + POOL_MINSHIFT)) {
+	last->next = depot->free;
+	depot->free = first;
+	depot->n += n;
+	first = NULL;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+
+    if (first)
+	last->next = NULL;
+    for (; first; first = next) {
+	next = first->next;
+	free(first);
+    }
+}
+
+/* fills an empty cache class with a batch from the depot */
+static void cacherefill(struct poolcache *cache, int c) {
+    struct pooldepot *depot = depots + c;
+    struct poolobj *last;
+    uint32_t n;
+
+    pthread_mutex_lock(&depot->mutex);
+    if (depot->free) {
+	last = depot->free;
+	for (n = 1; n < POOL_BATCH && last->next; n++)
+	    last = last->next;
+	cache->free[c] = depot->free;
+	cache->n[c] = n;
+	depot->free = last->next;
+	depot->n -= n;
+	last->next = NULL;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+/* thread exit, give the cached objects to the other threads */
+static void cachefree(void *arg) {
+    struct poolcache *cache = (struct poolcache *)arg;
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++)
+	cacheflush(cache, c, 0);
+    free(cache);
+}
+
+static void poolinit() {
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++)
+	pthread_mutex_init(&depots[c].mutex, NULL);
+    poolok = !pthread_key_create(&cachekey, cachefree);
+}
+
+static struct poolcache *getcache() {
+    struct poolcache *cache;
+
+    pthread_once(&poolonce, poolinit);
+    if (!poolok)
+	return NULL;
+    cache = (struct poolcache *)pthread_getspecific(cachekey);
+    if (cache)
+	return cache;
+    cache = calloc(1, sizeof(struct poolcache));
+    if (cache && pthread_setspecific(cachekey, cache)) {
+	free(cache);
+	return NULL;
+    }
+    return cache;
+}
+
+void *pool_malloc(size_t size) {
+    struct poolcache *cache;
+    struct poolobj *o;
+    int c;
+
+    if (size > POOL_MAXSIZE)
+	return malloc(size);
+    c = sizeclass(size);
+    cache = getcache();
+    if (cache && !cache->free[c])
+	cacherefill(cache, c);
+    if (!cache || !cache->free[c])
+	return malloc((size_t)1 << (c + POOL_MINSHIFT));
+    o = cache->free[c];
+    cache->free[c] = o->next;
+    cache->n[c]--;
+    return o;
+}
+
+void *pool_zalloc(size_t size) {
+    void *p = pool_malloc(size);
+
+    if (p)
+	memset(p, 0, size);
+    return p;
+}
+
+void pool_free(void *p, size_t size) {
+    struct poolcache *cache;
+    struct poolobj *o = (struct poolobj *)p;
+    int c;
+
+    if (!p)
+	return;
+    cache = size > POOL_MAXSIZE ? NULL : getcache();
+    if (!cache) {
+	free(p);
+	return;
+    }
+    c = sizeclass(size);
+    o->next = cache->free[c];
+    cache->free[c] = o;
+    if (++cache->n[c] > POOL_CACHEMAX)
+	cacheflush(cache, c, POOL_CACHEMAX - POOL_BATCH);
+}
+
+uint8_t *pool_bufalloc(size_t len) {
+    uint64_t size = len + POOL_BUFHDR;
+    uint8_t *p;
+
+    p = pool_malloc(size);
+    if (!p)
+	return NULL;
+    memcpy(p, &size, POOL_BUFHDR);
+    return p + POOL_BUFHDR;
+}
+
+void pool_buffree(uint8_t *buf) {
+    uint64_t size;
+
+    if (!buf)
+	return;
+    buf -= POOL_BUFHDR;
+    memcpy(&size, buf, POOL_BUFHDR);
+    pool_free(buf, size);
+}
+
+size_t pool_depotbytes() {
+    size_t bytes = 0;
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++)
+	bytes += (size_t)__atomic_load_n(&depots[c].n, __ATOMIC_RELAXED) << (c + POOL_MINSHIFT);
+    return bytes;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,38 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stddef.h>
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+/* Small objects are kept in power of two size classes from 32 up to
+ * POOL_MAXSIZE. Each thread caches freed objects and hands batches to a
+ * shared depot when it has too many, so a thread mostly allocating and
+ * another mostly freeing do not take a lock for every object. */
+#define POOL_MAXSIZE 4096
+
+/* returns size bytes, or NULL if malloc fails. Larger sizes than
+ * POOL_MAXSIZE are passed on to malloc */
+void *pool_malloc(size_t size);
+
+/* as pool_malloc(), but zeroes the memory */
+void *pool_zalloc(size_t size);
+
+/* returns memory from pool_malloc(); size must be the size asked for */
+void pool_free(void *p, size_t size);
+
+/* returns a buffer of len bytes for a radius message. The buffer remembers
+ * its size and must be released with pool_buffree() */
+uint8_t *pool_bufalloc(size_t len);
+void pool_buffree(uint8_t *buf);
+
+/* returns the bytes of freed objects kept in the shared depots, not
+ * counting those cached by the threads */
+size_t pool_depotbytes();
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
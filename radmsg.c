@@ -13,7 +13,7 @@
 #include "tlv11.h"
 #include "radmsg.h"
 #include "debug.h"
-#include <pthread.h>
+#include "pool.h"
 #include <nettle/hmac.h>
 #include <openssl/rand.h>
 
@@ -22,6 +22,7 @@
 void radmsg_free(struct radmsg *msg) {
     if (msg) {
         freetlvlist(msg->attrs);
+        free(msg->attrblock);
         free(msg);
     }
 }
@@ -54,7 +55,22 @@ int radmsg_add(struct radmsg *msg, struct tlv *attr) {
         return 1;
     if (!attr)
         return 0;
-    return list_push(msg->attrs, attr);
+    if (!list_push(msg->attrs, attr))
+        return 0;
+    msg->types[attr->t / 32] |= 1U << (attr->t % 32);
+    return 1;
+}
+
+/* removes and frees attr, and updates the type bitmap if it was the
+ * last of its type */
+void radmsg_del(struct radmsg *msg, struct tlv *attr) {
+    uint8_t type = attr->t;
+
+    list_removedata(msg->attrs, attr);
+    freetlv(attr);
+    msg->types[type / 32] &= ~(1U << (type % 32));
+    if (radmsg_gettype(msg, type))
+        msg->types[type / 32] |= 1U << (type % 32);
 }
 
 /** Return a new list with all tlv's in \a msg of type \a type. The
@@ -69,8 +85,8 @@ radmsg_getalltype(const struct radmsg *msg, uint8_t type)
     if (!msg || !msg->attrs)
         return NULL;
     list = list_create();
-    if (!list)
-        return NULL;
+    if (!list || !RADMSG_HASTYPE(msg, type))
+        return list;
 
     for (node = list_first(msg->attrs); node; node = list_next(node))
         if (((struct tlv *) node->data)->t == type)
@@ -86,7 +102,7 @@ struct tlv *radmsg_gettype(struct radmsg *msg, uint8_t type) {
     struct list_node *node;
     struct tlv *tlv;
 
-    if (!msg)
+    if (!msg || !RADMSG_HASTYPE(msg, type))
         return NULL;
     for (node = list_first(msg->attrs); node; node = list_next(node)) {
         tlv = (struct tlv *)node->data;
@@ -121,92 +137,75 @@ int radmsg_copy_attrs(struct radmsg *dst,
     return n;
 }
 
-int _checkmsgauth(unsigned char *rad, uint8_t *authattr, uint8_t *secret) {
-    int result = 0;             /* Fail. */
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct hmac_md5_ctx hmacctx;
-    uint8_t auth[16], hash[MD5_DIGEST_SIZE];
-
-    pthread_mutex_lock(&lock);
+void radsecret_init(struct radsecret *s, uint8_t *secret) {
+    s->secret = secret;
+    s->len = strlen((char *)secret);
+    hmac_md5_set_key(&s->hmac, s->len, secret);
+}
 
-   /* FIXME: Why clearing authattr during hashing? */
-    memcpy(auth, authattr, 16);
-    memset(authattr, 0, 16);
+/* checks the Message-Authenticator value authattr of rad, computed with
+ * the authenticator reqauth if set, else the one in rad, and with the
+ * value itself as zeros. The parts are hashed in turn so that rad is
+ * left as is */
+int _checkmsgauth(unsigned char *rad, unsigned char *reqauth, uint8_t *authattr, struct radsecret *secret) {
+    struct hmac_md5_ctx hmacctx = secret->hmac;
+    static const uint8_t zero[16];
+    uint8_t hash[MD5_DIGEST_SIZE];
+    const unsigned int len = RADLEN(rad);
 
-    hmac_md5_set_key(&hmacctx, strlen((char *) secret), secret);
-    hmac_md5_update(&hmacctx, RADLEN(rad), rad);
+    hmac_md5_update(&hmacctx, 4, rad);
+    hmac_md5_update(&hmacctx, 16, reqauth ? reqauth : rad + 4);
+    hmac_md5_update(&hmacctx, authattr - rad - 20, rad + 20);
+    hmac_md5_update(&hmacctx, 16, zero);
+    hmac_md5_update(&hmacctx, len - (authattr + 16 - rad), authattr + 16);
     hmac_md5_digest(&hmacctx, sizeof(hash), hash);
 
-    memcpy(authattr, auth, 16);
-
-    if (memcmp(auth, hash, 16)) {
+    if (memcmp(authattr, hash, 16)) {
 	debug(DBG_WARN, "message authenticator, wrong value");
-        goto out;
+	return 0;
     }
-    result = 1;                 /* Success. */
-
-out:
-    pthread_mutex_unlock(&lock);
-    return result;
+    return 1;
 }
 
-int _validauth(unsigned char *rad, unsigned char *reqauth, unsigned char *sec) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int _validauth(unsigned char *rad, unsigned char *reqauth, struct radsecret *secret) {
     struct md5_ctx mdctx;
     unsigned char hash[MD5_DIGEST_SIZE];
     const unsigned int len = RADLEN(rad);
-    int result = 0;             /* Fail. */
 
-    pthread_mutex_lock(&lock);
     md5_init(&mdctx);
-
     md5_update(&mdctx, 4, rad);
     md5_update(&mdctx, 16, reqauth);
     if (len > 20)
         md5_update(&mdctx, len - 20, rad + 20);
-    md5_update(&mdctx, strlen((char *) sec), sec);
+    md5_update(&mdctx, secret->len, secret->secret);
     md5_digest(&mdctx, sizeof(hash), hash);
 
-    result = !memcmp(hash, rad + 4, 16);
-
-    pthread_mutex_unlock(&lock);
-    return result;
+    return !memcmp(hash, rad + 4, 16);
 }
 
-int _createmessageauth(unsigned char *rad, unsigned char *authattrval, uint8_t *secret) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct hmac_md5_ctx hmacctx;
+int _createmessageauth(unsigned char *rad, unsigned char *authattrval, struct radsecret *secret) {
+    struct hmac_md5_ctx hmacctx = secret->hmac;
 
     if (!authattrval)
 	return 1;
 
-    pthread_mutex_lock(&lock);
-
     memset(authattrval, 0, 16);
-    hmac_md5_set_key(&hmacctx, strlen((char *) secret), secret);
     hmac_md5_update(&hmacctx, RADLEN(rad), rad);
     hmac_md5_digest(&hmacctx, MD5_DIGEST_SIZE, authattrval);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-int _radsign(unsigned char *rad, unsigned char *sec) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int _radsign(unsigned char *rad, struct radsecret *secret) {
     struct md5_ctx mdctx;
 
-    pthread_mutex_lock(&lock);
-
     md5_init(&mdctx);
     md5_update(&mdctx, RADLEN(rad), rad);
-    md5_update(&mdctx, strlen((char *) sec), sec);
+    md5_update(&mdctx, secret->len, secret->secret);
     md5_digest(&mdctx, MD5_DIGEST_SIZE, rad + 4);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
+uint8_t *radmsg2buf(struct radmsg *msg, struct radsecret *secret) {
     struct list_node *node;
     struct tlv *tlv;
     int size;
@@ -219,7 +218,7 @@ uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
         size += 2 + ((struct tlv *)node->data)->l;
     if (size > 65535)
         return NULL;
-    buf = malloc(size);
+    buf = pool_bufalloc(size);
     if (!buf)
         return NULL;
 
@@ -240,12 +239,12 @@ uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
         p += tlv->l;
     }
     if (msgauth && !_createmessageauth(buf, msgauth, secret)) {
-	free(buf);
+	pool_buffree(buf);
 	return NULL;
     }
     if (secret) {
 	if ((msg->code == RAD_Access_Accept || msg->code == RAD_Access_Reject || msg->code == RAD_Access_Challenge || msg->code == RAD_Accounting_Response || msg->code == RAD_Accounting_Request) && !_radsign(buf, secret)) {
-	    free(buf);
+	    pool_buffree(buf);
 	    return NULL;
 	}
 	if (msg->code == RAD_Accounting_Request)
@@ -254,11 +253,20 @@ uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
     return buf;
 }
 
-/* if secret set we also validate message authenticator if present */
-struct radmsg *buf2radmsg(uint8_t *buf, uint8_t *secret, uint8_t *rqauth) {
+int radmsg_signreply(uint8_t *buf, uint8_t *msgauth, struct radsecret *secret) {
+    return _createmessageauth(buf, msgauth, secret) && _radsign(buf, secret);
+}
+
+/* if secret set we also validate message authenticator if present.
+ * The attributes are parsed into a single block holding all the tlvs
+ * followed by a copy of the attribute area, which the values point into.
+ * Values may be modified in place; resizetlv() copies them out if they
+ * need to grow. */
+struct radmsg *buf2radmsg(uint8_t *buf, struct radsecret *secret, uint8_t *rqauth) {
     struct radmsg *msg;
-    uint8_t t, l, *v = NULL, *p, auth[16];
+    uint8_t t, l, *v = NULL, *p, *values, auth[16];
     uint16_t len;
+    int nattrs = 0;
     struct tlv *attr;
 
     len = RADLEN(buf);
@@ -303,23 +311,34 @@ struct radmsg *buf2radmsg(uint8_t *buf, uint8_t *secret, uint8_t *rqauth) {
         }
 
 	if (t == RAD_Attr_Message_Authenticator && secret) {
-	    if (rqauth)
-		memcpy(buf + 4, rqauth, 16);
-	    if (l != 16 || !_checkmsgauth(buf, v, secret)) {
+	    if (l != 16 || !_checkmsgauth(buf, rqauth, v, secret)) {
 		debug(DBG_WARN, "buf2radmsg: message authentication failed");
-		if (rqauth)
-		    memcpy(buf + 4, msg->auth, 16);
 		radmsg_free(msg);
 		return NULL;
 	    }
-	    if (rqauth)
-		memcpy(buf + 4, msg->auth, 16);
 	    debug(DBG_DBG, "buf2radmsg: message auth ok");
 	}
+	nattrs++;
+    }
 
-        attr = maketlv(t, l, v);
-        if (!attr || !radmsg_add(msg, attr)) {
-            freetlv(attr);
+    if (!nattrs)
+	return msg;
+
+    msg->attrblock = malloc(nattrs * sizeof(struct tlv) + (p - buf - 20));
+    if (!msg->attrblock) {
+	radmsg_free(msg);
+	return NULL;
+    }
+    attr = (struct tlv *)msg->attrblock;
+    values = (uint8_t *)(attr + nattrs);
+    memcpy(values, buf + 20, p - buf - 20);
+
+    for (p = values; nattrs--; p += attr->l, attr++) {
+	attr->t = *p++;
+	attr->l = *p++ - 2;
+	attr->v = attr->l ? p : NULL;
+	attr->flags = TLV_BORROWED | TLV_EMBEDDED;
+        if (!radmsg_add(msg, attr)) {
 	    radmsg_free(msg);
 	    return NULL;
         }
@@ -2,6 +2,8 @@
 /* Copyright (c) 2015, NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+#include <nettle/hmac.h>
+
 #define RAD_Access_Request 1
 #define RAD_Access_Accept 2
 #define RAD_Access_Reject 3
@@ -25,23 +27,42 @@
 #define RAD_VS_ATTR_MS_MPPE_Send_Key 16
 #define RAD_VS_ATTR_MS_MPPE_Recv_Key 17
 
+#define RADMSG_HASTYPE(msg, type) ((msg)->types[(type) / 32] & (1U << ((type) % 32)))
+
 struct radmsg {
     uint8_t code;
     uint8_t id;
     uint8_t auth[20];
     struct list *attrs;
+    uint32_t types[8]; /* bitmap of the attribute types in attrs */
+    void *attrblock; /* parsed tlvs and their values, see buf2radmsg() */
+};
+
+/* a shared secret with the HMAC-MD5 state after keying it with the
+ * secret, copied for each Message-Authenticator instead of keying again */
+struct radsecret {
+    uint8_t *secret;
+    size_t len;
+    struct hmac_md5_ctx hmac;
 };
 
 void radmsg_free(struct radmsg *);
 struct radmsg *radmsg_init(uint8_t, uint8_t, uint8_t *);
 int radmsg_add(struct radmsg *, struct tlv *);
+void radmsg_del(struct radmsg *, struct tlv *);
 struct tlv *radmsg_gettype(struct radmsg *, uint8_t);
 struct list *radmsg_getalltype(const struct radmsg *msg, uint8_t type);
 int radmsg_copy_attrs(struct radmsg *dst,
                       const struct radmsg *src,
                       uint8_t type);
-uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *);
-struct radmsg *buf2radmsg(uint8_t *, uint8_t *, uint8_t *);
+/* secret must stay allocated while s is used */
+void radsecret_init(struct radsecret *s, uint8_t *secret);
+uint8_t *radmsg2buf(struct radmsg *msg, struct radsecret *);
+struct radmsg *buf2radmsg(uint8_t *, struct radsecret *, uint8_t *);
+/* signs the reply in buf, which holds the request authenticator, setting
+ * the Message-Authenticator value at msgauth if not NULL and then the
+ * response authenticator */
+int radmsg_signreply(uint8_t *buf, uint8_t *msgauth, struct radsecret *secret);
 
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
@@ -48,6 +48,7 @@
 #endif
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -63,6 +64,7 @@
 #include "debug.h"
 #include "hash.h"
 #include "util.h"
+#include "pool.h"
 #include "hostport.h"
 #include "radsecproxy.h"
 #include "udp.h"
@@ -71,11 +73,76 @@
 #include "dtls.h"
 #include "fticks.h"
 #include "fticks_hashmac.h"
+#include "evloop.h"
+#include "metrics.h"
+#include "dyncache.h"
 
 static struct options options;
-static struct list *clconfs, *srvconfs;
-static struct list *realms;
-static struct hash *rewriteconfs;
+/* The clients, servers, realms and rewrites of one reading of the config.
+ * A reload reads a new generation into loadgen and swaps it in with
+ * confgenlock held for writing. Lookups hold it for reading, so no new
+ * request can reach what the swap left out. */
+struct confgen {
+    /* counts the generations from 1, for struct confcursor */
+    uint32_t id;
+    struct list *clconfs, *srvconfs;
+    /* per protocol address indexes of clconfs and srvconfs for find_conf() */
+    struct hostportindex *clconfindex[RAD_PROTOCOUNT], *srvconfindex[RAD_PROTOCOUNT];
+    struct list *realms;
+    /* suffix trie and regexp list for looking up realms in realms */
+    struct realmindex *realmindex;
+    struct hash *rewriteconfs;
+    /* confs new to this generation, resolved after reading the config */
+    struct list *unresolved;
+    /* keptconfs with the options for running confs in this generation */
+    struct list *kept;
+};
+/* a running conf kept by a reload and the conf read for it, whose options
+ * it takes over when the new generation is swapped in */
+struct keptconf {
+    struct clsrvconf *old, *conf;
+};
+static struct confgen *confgen, *loadgen;
+/* the generation before confgen, freed by the next reload since find_conf()
+ * callers may still walk its lists */
+static struct confgen *oldconfgen;
+/* preferring the writer, or a steady stream of requests would hold off a
+ * reload for good. A reader then must not take it again while holding it */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t confgenlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t confgenlock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+/* realms left out by a reload that still have dynamic subrealms */
+static struct list *retiredrealms;
+static pthread_mutex_t retiredrealmslock = PTHREAD_MUTEX_INITIALIZER;
+/* clients and servers left out by a reload, freed by a later reload once
+ * nothing uses them. Only the reloading thread uses the list */
+struct retiredconf {
+    struct clsrvconf *conf;
+    time_t at;
+};
+static struct list *retiredconfs;
+/* longer than an accept handshake holding a conf found before a reload */
+#define RETIRED_CONF_GRACE 60
+/* all reply queues, so that a reload can set their watermarks */
+static struct list *queues;
+static pthread_mutex_t queueslock = PTHREAD_MUTEX_INITIALIZER;
+/* time spent in each phase of starting up or reloading, for the log */
+enum startupphase {
+    PHASE_CONFIG = 0, PHASE_RESOLVE, PHASE_INDEX, PHASE_SERVERS, PHASE_LISTENERS, PHASE_COUNT
+};
+static const char *phasenames[PHASE_COUNT] = {"config", "resolve", "index", "servers", "listeners"};
+static uint32_t phasems[PHASE_COUNT];
+static struct timespec phasestart;
+/* absolute paths of the config and of ourselves, for reloading */
+static char *reloadconfigfile, *reloadbinary;
+/* LogLevel given with -d, not changed by reloading */
+static uint8_t argloglevel;
+/* requests slower than LogSlowRequests logged per second at most */
+#define SLOW_REQUESTS_LOGGED 10
+static struct ratelimit slowrqlimit;
+static const char *rqstagenames[RQ_STAGES] = {"parse", "route", "queue", "wait", "server", "reply"};
 
 #ifdef __CYGWIN__
 extern int __declspec(dllimport) optind;
@@ -88,13 +155,16 @@ static const struct protodefs *protodefs[RAD_PROTOCOUNT];
 
 /* minimum required declarations to avoid reordering code */
 struct realm *adddynamicrealmserver(struct realm *realm, char *id);
+struct realm *id2realm(struct list *realmlist, char *id);
 int dynamicconfig(struct server *server);
+void dynlookupfail(const char *realm);
+int dynlookupfailed(const char *realm);
 int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val);
 void freerealm(struct realm *realm);
 void freeclsrvconf(struct clsrvconf *conf);
 void freerq(struct request *rq);
 void freerqoutdata(struct rqout *rqout);
-void rmclientrq(struct request *rq, uint8_t id);
+void rmclientrq(struct request *rq);
 
 static const struct protodefs *(*protoinits[])(uint8_t) = { udpinit, tlsinit, tcpinit, dtlsinit };
 
@@ -120,10 +190,19 @@ int prefixmatch(void *a1, void *a2, uint8_t len) {
 }
 
 /* returns next config with matching address, or NULL */
-struct clsrvconf *find_conf(uint8_t type, struct sockaddr *addr, struct list *confs, struct list_node **cur, uint8_t server_p) {
+struct clsrvconf *find_conf(uint8_t type, struct sockaddr *addr, struct list *confs, struct hostportindex *idx, struct list_node **cur, uint8_t server_p) {
     struct list_node *entry;
     struct clsrvconf *conf;
 
+    if (idx) {
+	entry = (struct list_node *)hostportindex_match(idx, addr, server_p, cur ? *cur : NULL);
+	if (!entry)
+	    return NULL;
+	if (cur)
+	    *cur = entry;
+	return (struct clsrvconf *)entry->data;
+    }
+
     for (entry = (cur && *cur ? list_next(*cur) : list_first(confs)); entry; entry = list_next(entry)) {
 	conf = (struct clsrvconf *)entry->data;
 	if (conf->type == type && addressmatches(conf->hostports, addr, server_p)) {
@@ -135,28 +214,52 @@ struct clsrvconf *find_conf(uint8_t type, struct sockaddr *addr, struct list *co
     return NULL;
 }
 
-struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct list_node **cur) {
-    return find_conf(type, addr, clconfs, cur, 0);
+/* a cursor from an older generation is of no use in confgen's lists and
+ * indexes, the search starts over */
+static struct list_node **confcursornode(struct confcursor *cur) {
+    if (!cur)
+	return NULL;
+    if (cur->gen != confgen->id) {
+	cur->gen = confgen->id;
+	cur->node = NULL;
+    }
+    return &cur->node;
+}
+
+struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct confcursor *cur) {
+    struct clsrvconf *conf;
+
+    pthread_rwlock_rdlock(&confgenlock);
+    conf = find_conf(type, addr, confgen->clconfs, confgen->clconfindex[type], confcursornode(cur), 0);
+    pthread_rwlock_unlock(&confgenlock);
+    return conf;
 }
 
-struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct list_node **cur) {
-    return find_conf(type, addr, srvconfs, cur, 1);
+struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct confcursor *cur) {
+    struct clsrvconf *conf;
+
+    pthread_rwlock_rdlock(&confgenlock);
+    conf = find_conf(type, addr, confgen->srvconfs, confgen->srvconfindex[type], confcursornode(cur), 1);
+    pthread_rwlock_unlock(&confgenlock);
+    return conf;
 }
 
 /* returns next config of given type, or NULL */
 struct clsrvconf *find_clconf_type(uint8_t type, struct list_node **cur) {
     struct list_node *entry;
-    struct clsrvconf *conf;
+    struct clsrvconf *conf = NULL;
 
-    for (entry = (cur && *cur ? list_next(*cur) : list_first(clconfs)); entry; entry = list_next(entry)) {
+    pthread_rwlock_rdlock(&confgenlock);
+    for (entry = (cur && *cur ? list_next(*cur) : list_first(confgen->clconfs)); entry; entry = list_next(entry)) {
 	conf = (struct clsrvconf *)entry->data;
 	if (conf->type == type) {
 	    if (cur)
 		*cur = entry;
-	    return conf;
+	    break;
 	}
     }
-    return NULL;
+    pthread_rwlock_unlock(&confgenlock);
+    return entry ? conf : NULL;
 }
 
 struct gqueue *newqueue() {
@@ -170,19 +273,139 @@ struct gqueue *newqueue() {
 	debugx(1, DBG_ERR, "malloc failed");
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->cond, NULL);
+    pthread_cond_init(&q->room, NULL);
+    q->wakeup = NULL;
+    q->wakeuparg = NULL;
+    q->full = 0;
+    pthread_mutex_lock(&queueslock);
+    q->high = options.replyqueuehigh;
+    q->low = options.replyqueuelow;
+    if (!queues)
+	queues = list_create();
+    if (!queues || !list_push(queues, q))
+	debugx(1, DBG_ERR, "malloc failed");
+    pthread_mutex_unlock(&queueslock);
     return q;
 }
 
+/* sets the watermarks of all queues, and of those created from now on.
+ * Readers paused on a queue that is no longer full go on */
+static void setqueuewatermarks(uint32_t high, uint32_t low) {
+    struct list_node *entry;
+    struct gqueue *q;
+
+    pthread_mutex_lock(&queueslock);
+    options.replyqueuehigh = high;
+    options.replyqueuelow = low;
+    for (entry = list_first(queues); entry; entry = list_next(entry)) {
+	q = (struct gqueue *)entry->data;
+	pthread_mutex_lock(&q->mutex);
+	q->high = high;
+	q->low = low;
+	if (q->full && (!high || list_count(q->entries) <= low)) {
+	    q->full = 0;
+	    pthread_cond_broadcast(&q->room);
+	}
+	pthread_mutex_unlock(&q->mutex);
+    }
+    pthread_mutex_unlock(&queueslock);
+}
+
+static uint64_t monotonicus() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* records when rq reached stage, only the first time */
+static void rqstage(struct request *rq, enum rqstage stage) {
+    if (rq->stages & 1 << stage)
+	return;
+    rq->stagetime[stage] = monotonicus() - rq->received;
+    __sync_fetch_and_or(&rq->stages, 1 << stage);
+}
+
+/* Called when the reply to rq is dequeued to be written. Adds the time
+ * of each stage rq went through, since the one before it, to the stage
+ * histograms, and logs the stages of requests slower than
+ * LogSlowRequests. A reply sent again for a duplicate is not counted */
+static void rqdone(struct request *rq) {
+    uint32_t t[RQ_STAGES], prev = 0;
+    char buf[256];
+    int i, len = 0;
+
+    if (__sync_fetch_and_or(&rq->stages, 1 << RQ_DEQUEUED) & 1 << RQ_DEQUEUED)
+	return;
+    rq->stagetime[RQ_DEQUEUED] = monotonicus() - rq->received;
+    for (i = 0; i < RQ_STAGES; i++) {
+	if (!(rq->stages & 1 << i)) {
+	    t[i] = 0;
+	    continue;
+	}
+	t[i] = rq->stagetime[i] > prev ? rq->stagetime[i] - prev : 0;
+	prev = rq->stagetime[i] > prev ? rq->stagetime[i] : prev;
+	metrics_stage(i, t[i]);
+    }
+    metrics_stage(RQ_STAGES, prev);
+
+    if (!options.logslowrequests || prev < options.logslowrequests * 1000 ||
+	!ratelimit_take(&slowrqlimit))
+	return;
+    for (i = 0; i < RQ_STAGES && len < (int)sizeof(buf); i++)
+	len += snprintf(buf + len, sizeof(buf) - len, "%s%s %u", i ? ", " : "",
+			rqstagenames[i], t[i]);
+    debug(DBG_NOTICE, "slow request (id %d) from client %s for realm %s took %u us: %s us",
+	  rq->rqid, rq->from ? rq->from->conf->name : "", rq->realm ? rq->realm->name : "",
+	  prev, buf);
+}
+
+/* removes and returns the first entry of q, called with q->mutex held.
+ * Wakes the readers in queuewaitroom() when down to the low watermark */
+struct request *queueshift(struct gqueue *q) {
+    struct request *rq = (struct request *)list_shift(q->entries);
+
+    if (q->full && list_count(q->entries) <= q->low) {
+	q->full = 0;
+	pthread_cond_broadcast(&q->room);
+    }
+    if (rq)
+	rqdone(rq);
+    return rq;
+}
+
+/* Returns 1 if requests whose replies go to q may be read, waiting up to
+ * timeout seconds for the writer to get it down to the low watermark
+ * once it has reached the high one. Returns 0 if still full */
+int queuewaitroom(struct gqueue *q, int timeout) {
+    struct timespec deadline;
+    int room;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->full && timeout) {
+	deadline.tv_sec = time(NULL) + timeout;
+	deadline.tv_nsec = 0;
+	while (q->full && pthread_cond_timedwait(&q->room, &q->mutex, &deadline) != ETIMEDOUT);
+    }
+    room = !q->full;
+    pthread_mutex_unlock(&q->mutex);
+    return room;
+}
+
 void removequeue(struct gqueue *q) {
     struct list_node *entry;
 
     if (!q)
         return;
+    pthread_mutex_lock(&queueslock);
+    list_removedata(queues, q);
+    pthread_mutex_unlock(&queueslock);
     pthread_mutex_lock(&q->mutex);
     for (entry = list_first(q->entries); entry; entry = list_next(entry))
         freerq((struct request *)entry->data);
             list_free(q->entries);
     pthread_cond_destroy(&q->cond);
+    pthread_cond_destroy(&q->room);
     pthread_mutex_unlock(&q->mutex);
     pthread_mutex_destroy(&q->mutex);
     free(q);
@@ -222,6 +445,7 @@ struct client *addclient(struct clsrvconf *conf, uint8_t lock) {
     else
     new->replyq = newqueue();
     pthread_mutex_init(&new->lock, NULL);
+    workflow_init(&new->flow, 1);
     if (lock)
 	pthread_mutex_unlock(conf->lock);
     return new;
@@ -236,12 +460,92 @@ void removeclientrqs_sendrq_freeserver_lock(uint8_t wantlock) {
 	pthread_mutex_unlock(&lock);
 }
 
-void removeclientrq(struct client *client, int i) {
-    struct request *rq;
+static uint32_t duphash(uint8_t id, uint8_t *auth) {
+    uint32_t h;
+
+    /* the authenticator is random, so a few bytes of it will do */
+    memcpy(&h, auth, sizeof(h));
+    return h ^ id * 0x9e3779b1U;
+}
+
+/* returns the link pointing to the cached request with id and auth, or NULL */
+static struct request **dupfind(struct dupcache *dups, uint8_t id, uint8_t *auth) {
+    struct request **link;
+
+    if (!dups->buckets)
+	return NULL;
+    for (link = &dups->buckets[duphash(id, auth) & dups->mask]; *link; link = &(*link)->dupchain)
+	if ((*link)->rqid == id && !memcmp((*link)->rqauth, auth, 16))
+	    return link;
+    return NULL;
+}
+
+/* takes rq out of the hash and the arrival order list, keeping the reference */
+static void dupunlink(struct dupcache *dups, struct request *rq) {
+    struct request **link;
+
+    for (link = &dups->buckets[duphash(rq->rqid, rq->rqauth) & dups->mask]; *link != rq; link = &(*link)->dupchain);
+    *link = rq->dupchain;
+    if (rq->dupolder)
+	rq->dupolder->dupnewer = rq->dupnewer;
+    else
+	dups->oldest = rq->dupnewer;
+    if (rq->dupnewer)
+	rq->dupnewer->dupolder = rq->dupolder;
+    else
+	dups->newest = rq->dupolder;
+    rq->dupchain = rq->dupnewer = rq->dupolder = NULL;
+    rq->dupcached = 0;
+    dups->n--;
+}
+
+/* moves the cached requests to a table of n buckets; returns 0 if out
+ * of memory, leaving the table as it was */
+static int dupresize(struct dupcache *dups, uint32_t n) {
+    struct request **buckets, **link, *r;
+
+    buckets = calloc(n, sizeof(struct request *));
+    if (!buckets)
+	return 0;
+    for (r = dups->oldest; r; r = r->dupnewer) {
+	link = &buckets[duphash(r->rqid, r->rqauth) & (n - 1)];
+	r->dupchain = *link;
+	*link = r;
+    }
+    free(dups->buckets);
+    dups->buckets = buckets;
+    dups->mask = n - 1;
+    return 1;
+}
+
+/* the table starts with DUPCACHE_MINBUCKETS buckets and doubles while
+ * there are more requests than buckets, up to size */
+static int duplink(struct dupcache *dups, struct request *rq, uint32_t size) {
+    struct request **link;
+
+    if (!dups->buckets) {
+	if (!dupresize(dups, DUPCACHE_MINBUCKETS))
+	    return 0;
+    } else if (dups->n > dups->mask && dups->mask + 1 < size)
+	dupresize(dups, (dups->mask + 1) * 2); /* else longer chains */
+    for (link = &dups->buckets[duphash(rq->rqid, rq->rqauth) & dups->mask]; *link; link = &(*link)->dupchain);
+    *link = rq;
+    rq->dupolder = dups->newest;
+    if (dups->newest)
+	dups->newest->dupnewer = rq;
+    else
+	dups->oldest = rq;
+    dups->newest = rq;
+    rq->dupcached = 1;
+    dups->n++;
+    return 1;
+}
+
+/* removes rq from the duplicate cache of client, and stops sending it on */
+void removeclientrq(struct client *client, struct request *rq) {
     struct rqout *rqout;
 
-	rq = client->rqs[i];
-	if (!rq)
+    if (!rq || !rq->dupcached)
         return;
 
     removeclientrqs_sendrq_freeserver_lock(1);
@@ -252,16 +556,14 @@ void removeclientrq(struct client *client, int i) {
             freerqoutdata(rqout);
         pthread_mutex_unlock(rqout->lock);
     }
-    client->rqs[i] = NULL;
+    dupunlink(&client->dups, rq);
     freerq(rq);
     removeclientrqs_sendrq_freeserver_lock(0);
 }
 
 void removeclientrqs(struct client *client) {
-    int i;
-
-    for (i = 0; i < MAX_REQUESTS; i++)
-        removeclientrq(client, i);
+    while (client->dups.oldest)
+        removeclientrq(client, client->dups.oldest);
 }
 
 void removelockedclient(struct client *client) {
@@ -270,9 +572,11 @@ void removelockedclient(struct client *client) {
     conf = client->conf;
     if (conf->clients) {
 	removeclientrqs(client);
+	free(client->dups.buckets);
 	removequeue(client->replyq);
 	list_removedata(conf->clients, client);
     pthread_mutex_destroy(&client->lock);
+	workflow_destroy(&client->flow);
 	free(client->addr);
 	free(client);
     }
@@ -284,32 +588,63 @@ void removeclient(struct client *client) {
     if (!client)
 	return;
 
+    /* requests still with the workers refer to the client */
+    workflow_drain(&client->flow);
     conf = client->conf;
     pthread_mutex_lock(conf->lock);
     removelockedclient(client);
     pthread_mutex_unlock(conf->lock);
 }
 
+static void removeclientdone(void *arg) {
+    struct client *client = (struct client *)arg;
+    struct clsrvconf *conf = client->conf;
+
+    pthread_mutex_lock(conf->lock);
+    removelockedclient(client);
+    pthread_mutex_unlock(conf->lock);
+}
+
+/* as removeclient(), but instead of waiting for the workers the client is
+ * removed by the one finishing its last request. Replies may still be
+ * queued meanwhile, so the caller first stops the replyq wakeup */
+void removeclientlater(struct client *client) {
+    if (client)
+	workflow_release(&client->flow, removeclientdone, client);
+}
+
+/* memory of the server connections, for the metrics */
+#define SERVER_BYTES (sizeof(struct server) + MAX_REQUESTS * (sizeof(struct rqout) + sizeof(pthread_mutex_t)))
+static uint64_t serverbytes;
+
 void freeserver(struct server *server, uint8_t destroymutex) {
     struct rqout *rqout, *end;
 
     if (!server)
 	return;
 
+    workflow_destroy(&server->flow);
     removeclientrqs_sendrq_freeserver_lock(1);
     if (server->requests) {
 	rqout = server->requests;
 	for (end = rqout + MAX_REQUESTS; rqout < end; rqout++) {
 	    freerqoutdata(rqout);
-	    pthread_mutex_destroy(rqout->lock);
-	    free(rqout->lock);
+	    if (rqout->lock)
+		pthread_mutex_destroy(rqout->lock);
 	}
 	free(server->requests);
     }
+    if (server->rqlocks)
+	__atomic_sub_fetch(&serverbytes, SERVER_BYTES, __ATOMIC_RELAXED);
+    free(server->rqlocks);
+    pthread_mutex_destroy(&server->timers.lock);
     free(server->dynamiclookuparg);
+    free(server->wbuf);
     if (server->ssl) {
         SSL_free(server->ssl);
     }
+    if (server->tlssession)
+	SSL_SESSION_free(server->tlssession);
     if (destroymutex) {
 	pthread_mutex_destroy(&server->lock);
 	pthread_cond_destroy(&server->newrq_cond);
@@ -319,69 +654,98 @@ void freeserver(struct server *server, uint8_t destroymutex) {
     free(server);
 }
 
-int addserver(struct clsrvconf *conf) {
+/* allocates a server for conf, the caller links it into conf->servers */
+static struct server *newserver(struct clsrvconf *conf) {
+    struct server *server;
     int i;
 
-    if (conf->servers) {
-	debug(DBG_ERR, "addserver: currently works with just one server per conf");
-	return 0;
-    }
-    conf->servers = malloc(sizeof(struct server));
-    if (!conf->servers) {
+    server = malloc(sizeof(struct server));
+    if (!server) {
 	debug(DBG_ERR, "malloc failed");
-	return 0;
+	return NULL;
     }
-    memset(conf->servers, 0, sizeof(struct server));
-    conf->servers->conf = conf;
+    memset(server, 0, sizeof(struct server));
+    server->conf = conf;
+    for (i = 0; i < MAX_REQUESTS; i++)
+	server->timers.pos[i] = -1;
+    if (pthread_mutex_init(&server->timers.lock, NULL)) {
+	debugerrno(errno, DBG_ERR, "mutex init failed");
+	free(server);
+	return NULL;
+    }
+    workflow_init(&server->flow, 0);
 
     conf->pdef->setsrcres();
 
-    conf->servers->sock = -1;
+    server->sock = -1;
     if (conf->pdef->addserverextra)
-	conf->pdef->addserverextra(conf);
+	conf->pdef->addserverextra(server);
 
-    conf->servers->requests = calloc(MAX_REQUESTS, sizeof(struct rqout));
-    if (!conf->servers->requests) {
+    server->requests = calloc(MAX_REQUESTS, sizeof(struct rqout));
+    server->rqlocks = malloc(MAX_REQUESTS * sizeof(pthread_mutex_t));
+    if (!server->requests || !server->rqlocks) {
 	debug(DBG_ERR, "malloc failed");
+	free(server->rqlocks);
+	server->rqlocks = NULL;
 	goto errexit;
     }
+    __atomic_add_fetch(&serverbytes, SERVER_BYTES, __ATOMIC_RELAXED);
     for (i = 0; i < MAX_REQUESTS; i++) {
-	conf->servers->requests[i].lock = malloc(sizeof(pthread_mutex_t));
-	if (!conf->servers->requests[i].lock) {
-	    debug(DBG_ERR, "malloc failed");
-	    goto errexit;
-	}
-	if (pthread_mutex_init(conf->servers->requests[i].lock, NULL)) {
+	if (pthread_mutex_init(server->rqlocks + i, NULL)) {
 	    debugerrno(errno, DBG_ERR, "mutex init failed");
-	    free(conf->servers->requests[i].lock);
-	    conf->servers->requests[i].lock = NULL;
 	    goto errexit;
 	}
+	server->requests[i].lock = server->rqlocks + i;
     }
-    if (pthread_mutex_init(&conf->servers->lock, NULL)) {
+    if (pthread_mutex_init(&server->lock, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
 	goto errexit;
     }
-    conf->servers->newrq = 0;
-    conf->servers->conreset = 0;
-    if (pthread_mutex_init(&conf->servers->newrq_mutex, NULL)) {
+    server->newrq = 0;
+    server->conreset = 0;
+    if (pthread_mutex_init(&server->newrq_mutex, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
-	pthread_mutex_destroy(&conf->servers->lock);
+	pthread_mutex_destroy(&server->lock);
 	goto errexit;
     }
-    if (pthread_cond_init(&conf->servers->newrq_cond, NULL)) {
+    if (pthread_cond_init(&server->newrq_cond, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
-	pthread_mutex_destroy(&conf->servers->newrq_mutex);
-	pthread_mutex_destroy(&conf->servers->lock);
+	pthread_mutex_destroy(&server->newrq_mutex);
+	pthread_mutex_destroy(&server->lock);
 	goto errexit;
     }
 
-    return 1;
+    return server;
 
 errexit:
-    freeserver(conf->servers, 0);
-    conf->servers = NULL;
-    return 0;
+    freeserver(server, 0);
+    return NULL;
+}
+
+int addserver(struct clsrvconf *conf) {
+    struct server *server;
+    int i;
+
+    if (conf->servers) {
+	debug(DBG_ERR, "addserver: currently works with just one server per conf");
+	return 0;
+    }
+    conf->servers = newserver(conf);
+    if (!conf->servers)
+	return 0;
+    __atomic_add_fetch(&conf->nservers, 1, __ATOMIC_RELAXED);
+    /* more connections, each with its own id space; addserverextra() can
+     * tell them from the first one by conf->servers being set */
+    if (!conf->dynamiclookupcommand)
+	for (i = 1; i < conf->connections; i++) {
+	    server = newserver(conf);
+	    if (!server)
+		return 0;
+	    __atomic_add_fetch(&conf->nservers, 1, __ATOMIC_RELAXED);
+	    server->nextconn = conf->servers->nextconn;
+	    conf->servers->nextconn = server;
+	}
+    return 1;
 }
 
 unsigned char *attrget(unsigned char *attrs, int length, uint8_t type) {
@@ -395,72 +759,205 @@ unsigned char *attrget(unsigned char *attrs, int length, uint8_t type) {
 }
 
 struct request *newrqref(struct request *rq) {
-    if (rq) {
-        pthread_mutex_lock(&rq->refmutex);
-        rq->refcount++;
-        pthread_mutex_unlock(&rq->refmutex);
-    }
+    if (rq)
+        __sync_fetch_and_add(&rq->refcount, 1);
     return rq;
 }
 
 void freerq(struct request *rq) {
+    uint32_t refcount;
+
     if (!rq)
 	return;
-    pthread_mutex_lock(&rq->refmutex);
-    debug(DBG_DBG, "freerq: called with refcount %d", rq->refcount);
-    if (--rq->refcount) {
-        pthread_mutex_unlock(&rq->refmutex);
+    refcount = __sync_fetch_and_sub(&rq->refcount, 1);
+    debug(DBG_DBG, "freerq: called with refcount %d", refcount);
+    if (refcount > 1)
         return;
-    }
-    pthread_mutex_unlock(&rq->refmutex);
     if (rq->origusername)
 	free(rq->origusername);
-    if (rq->buf)
-	free(rq->buf);
-    if (rq->replybuf)
-	free(rq->replybuf);
+    pool_buffree(rq->buf);
+    pool_buffree(rq->replybuf);
     if (rq->msg)
 	radmsg_free(rq->msg);
-    pthread_mutex_destroy(&rq->refmutex);
-    free(rq);
+    freerealm(rq->realm);
+    pool_free(rq, sizeof(struct request));
+}
+
+/* Request ids are claimed in sendrq() with newrq_mutex held, but are
+ * released by freerqoutdata() holding only the rqout lock, so the bitmap
+ * is updated atomically. */
+static int claimrqid(struct server *to, int id) {
+    uint32_t bit = 1U << (id % 32);
+
+    return !(__sync_fetch_and_or(&to->usedids[id / 32], bit) & bit);
+}
+
+/* claims the first free id from start and up, wrapping around, never
+ * id 0 if reservezero; returns -1 if all are in use */
+static int claimfreerqid(struct server *to, int start, uint8_t reservezero) {
+    uint32_t free, bit;
+    int i, w, b;
+
+    for (i = 0; i <= MAX_REQUESTS / 32; i++) {
+	w = (start / 32 + i) % (MAX_REQUESTS / 32);
+	free = ~to->usedids[w];
+	if (i == 0)
+	    free &= ~0U << (start % 32);
+	else if (i == MAX_REQUESTS / 32)
+	    free &= (1U << (start % 32)) - 1;
+	if (!w && reservezero)
+	    free &= ~1U;
+	for (; free; free &= ~bit) {
+	    b = __builtin_ctz(free);
+	    bit = 1U << b;
+	    if (!(__sync_fetch_and_or(&to->usedids[w], bit) & bit))
+		return w * 32 + b;
+	}
+    }
+    return -1;
+}
+
+static void releaserqid(struct server *to, int id) {
+    __sync_fetch_and_and(&to->usedids[id / 32], ~(1U << (id % 32)));
+}
+
+static uint64_t timevalms(struct timeval *tv) {
+    return tv->tv_sec * 1000ULL + tv->tv_usec / 1000;
+}
+
+static void rqtimerswap(struct rqtimers *t, int i, int j) {
+    uint8_t id = t->heap[i];
+
+    t->heap[i] = t->heap[j];
+    t->heap[j] = id;
+    t->pos[t->heap[i]] = i;
+    t->pos[t->heap[j]] = j;
+}
+
+static void rqtimersift(struct rqtimers *t, int i) {
+    int c;
+
+    while (i && t->expiry[t->heap[i]] < t->expiry[t->heap[(i - 1) / 2]]) {
+	rqtimerswap(t, i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+    for (; (c = 2 * i + 1) < t->n; i = c) {
+	if (c + 1 < t->n && t->expiry[t->heap[c + 1]] < t->expiry[t->heap[c]])
+	    c++;
+	if (t->expiry[t->heap[i]] <= t->expiry[t->heap[c]])
+	    break;
+	rqtimerswap(t, i, c);
+    }
+}
+
+/* (re)schedules request id to be handled by clientwr() at expiry */
+static void rqtimerset(struct server *server, uint8_t id, uint64_t expiry) {
+    struct rqtimers *t = &server->timers;
+
+    pthread_mutex_lock(&t->lock);
+    t->expiry[id] = expiry;
+    if (t->pos[id] < 0) {
+	t->pos[id] = t->n;
+	t->heap[t->n++] = id;
+    }
+    rqtimersift(t, t->pos[id]);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void rqtimerdel(struct server *server, uint8_t id) {
+    struct rqtimers *t = &server->timers;
+    int i;
+
+    pthread_mutex_lock(&t->lock);
+    i = t->pos[id];
+    if (i >= 0) {
+	rqtimerswap(t, i, --t->n);
+	t->pos[id] = -1;
+	if (i < t->n)
+	    rqtimersift(t, i);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* removes and returns an id expiring at or before now, -1 if none */
+static int rqtimerpop(struct server *server, uint64_t now) {
+    struct rqtimers *t = &server->timers;
+    int id = -1;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->n && t->expiry[t->heap[0]] <= now) {
+	id = t->heap[0];
+	rqtimerswap(t, 0, --t->n);
+	t->pos[id] = -1;
+	rqtimersift(t, 0);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return id;
+}
+
+/* returns the earliest expiry, 0 if no requests are queued */
+static uint64_t rqtimernext(struct server *server) {
+    uint64_t next;
+
+    pthread_mutex_lock(&server->timers.lock);
+    next = server->timers.n ? server->timers.expiry[server->timers.heap[0]] : 0;
+    pthread_mutex_unlock(&server->timers.lock);
+    return next;
+}
+
+/* makes all queued requests expire now, e.g. to resend after reconnect */
+static void rqtimerexpireall(struct server *server) {
+    int i;
+
+    pthread_mutex_lock(&server->timers.lock);
+    for (i = 0; i < server->timers.n; i++)
+	server->timers.expiry[server->timers.heap[i]] = 0;
+    pthread_mutex_unlock(&server->timers.lock);
 }
 
 void freerqoutdata(struct rqout *rqout) {
+    struct server *to;
+    uint8_t id;
+
     if (!rqout)
 	return;
     if (rqout->rq) {
 	if (rqout->rq->buf) {
-	    free(rqout->rq->buf);
+	    pool_buffree(rqout->rq->buf);
 	    rqout->rq->buf = NULL;
 	}
+	to = rqout->rq->to;
+	id = rqout->rq->newid;
 	rqout->rq->to = NULL;
 	freerq(rqout->rq);
 	rqout->rq = NULL;
+	if (to) {
+	    rqtimerdel(to, id);
+	    releaserqid(to, id);
+	}
     }
     rqout->tries = 0;
     memset(&rqout->expiry, 0, sizeof(struct timeval));
 }
 
+/* id must be claimed, released again on failure */
 int _internal_sendrq(struct server *to, uint8_t id, struct request *rq) {
-    if (!to->requests[id].rq) {
-        pthread_mutex_lock(to->requests[id].lock);
-        if (!to->requests[id].rq) {
-            rq->newid = id;
-            rq->msg->id = id;
-            rq->buf = radmsg2buf(rq->msg, (uint8_t *)to->conf->secret);
-            if (!rq->buf) {
-                pthread_mutex_unlock(to->requests[id].lock);
-                debug(DBG_ERR, "sendrq: radmsg2buf failed");
-                return 0;
-            }
-            debug(DBG_DBG, "sendrq: inserting packet with id %d in queue for %s", id, to->conf->name);
-            to->requests[id].rq = rq;
-            pthread_mutex_unlock(to->requests[id].lock);
-            return 1;
-        }
+    pthread_mutex_lock(to->requests[id].lock);
+    rq->newid = id;
+    rq->msg->id = id;
+    rq->buf = radmsg2buf(rq->msg, &to->conf->radsecret);
+    if (!rq->buf) {
+	pthread_mutex_unlock(to->requests[id].lock);
+	releaserqid(to, id);
+	debug(DBG_ERR, "sendrq: radmsg2buf failed");
+	return 0;
     }
+    debug(DBG_DBG, "sendrq: inserting packet with id %d in queue for %s", id, to->conf->name);
+    to->requests[id].rq = rq;
+    rqstage(rq, RQ_QUEUED);
+    rqtimerset(to, id, 0);
     pthread_mutex_unlock(to->requests[id].lock);
-    return 0;
+    return 1;
 }
 
 void sendrq(struct request *rq) {
@@ -475,31 +972,24 @@ void sendrq(struct request *rq) {
     start = to->conf->statusserver == RSP_STATSRV_OFF ? 0 : 1;
     pthread_mutex_lock(&to->newrq_mutex);
     if (start && rq->msg->code == RAD_Status_Server) {
-        if (!_internal_sendrq(to, 0, rq)) {
+        if (!claimrqid(to, 0)) {
             debug(DBG_INFO, "sendrq: status server already in queue, dropping request");
             goto errexit;
         }
+        if (!_internal_sendrq(to, 0, rq))
+            goto errexit;
     } else {
-        if (!to->nextid)
-            to->nextid = start;
-        /* might simplify if only try nextid, might be ok */
-        for (i = to->nextid; i < MAX_REQUESTS; i++) {
-            if (_internal_sendrq(to, i, rq))
-                break;
-        }
-        if (i == MAX_REQUESTS) {
-            for (i = start; i < to->nextid; i++) {
-                if (_internal_sendrq(to, i, rq))
-                    break;
-            }
-            if (i == to->nextid) {
-                debug(DBG_WARN, "sendrq: no room in queue for server %s, dropping request", to->conf->name);
-                goto errexit;
-            }
+        i = claimfreerqid(to, to->nextid, start);
+        if (i < 0) {
+            debug(DBG_WARN, "sendrq: no room in queue for server %s, dropping request", to->conf->name);
+            metrics_inc(to->conf->metrics, METRIC_DROPS_NOROOM);
+            if (rq->realm)
+                metrics_inc(rq->realm->metrics, METRIC_DROPS_NOROOM);
+            goto errexit;
         }
-
-        if (i >= start) /* i is not reserved for statusserver */
-            to->nextid = i + 1;
+        if (!_internal_sendrq(to, i, rq))
+            goto errexit;
+        to->nextid = (i + 1) % MAX_REQUESTS;
     }
 
     if (!to->newrq) {
@@ -514,7 +1004,7 @@ void sendrq(struct request *rq) {
 
 errexit:
     if (rq->from)
-        rmclientrq(rq, rq->rqid);
+        rmclientrq(rq);
     freerq(rq);
     if (to)
         pthread_mutex_unlock(&to->newrq_mutex);
@@ -526,7 +1016,7 @@ void sendreply(struct request *rq) {
     struct client *to = rq->from;
 
     if (!rq->replybuf)
-	rq->replybuf = radmsg2buf(rq->msg, (uint8_t *)to->conf->secret);
+	rq->replybuf = radmsg2buf(rq->msg, &to->conf->radsecret);
     radmsg_free(rq->msg);
     rq->msg = NULL;
     if (!rq->replybuf) {
@@ -534,6 +1024,9 @@ void sendreply(struct request *rq) {
 	debug(DBG_ERR, "sendreply: radmsg2buf failed");
 	return;
     }
+    metrics_reply(to->conf->metrics, *rq->replybuf);
+    if (rq->realm)
+	metrics_reply(rq->realm->metrics, *rq->replybuf);
 
     pthread_mutex_lock(&to->replyq->mutex);
     first = list_first(to->replyq->entries) == NULL;
@@ -544,26 +1037,92 @@ void sendreply(struct request *rq) {
 	debug(DBG_ERR, "sendreply: malloc failed");
 	return;
     }
+    if (to->replyq->high && !to->replyq->full && list_count(to->replyq->entries) >= to->replyq->high) {
+	debug(DBG_DBG, "sendreply: reply queue full, pausing reading requests");
+	to->replyq->full = 1;
+	metrics_inc(to->conf->metrics, METRIC_READ_PAUSES);
+    }
 
     if (first) {
 	debug(DBG_DBG, "signalling server writer");
 	pthread_cond_signal(&to->replyq->cond);
+	if (to->replyq->wakeup)
+	    to->replyq->wakeup(to->replyq->wakeuparg);
     }
     pthread_mutex_unlock(&to->replyq->mutex);
 }
 
-static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, char *shared, uint8_t sharedlen, uint8_t *auth) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* sets ts to WriteCoalesceDelay milliseconds from now */
+static void coalescedeadline(struct timespec *ts) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    now.tv_usec += options.writecoalescedelay * 1000;
+    ts->tv_sec = now.tv_sec + now.tv_usec / 1000000;
+    ts->tv_nsec = now.tv_usec % 1000000 * 1000;
+}
+
+/* Appends the replies queued on replyq to the malloc'ed *buf holding len
+ * bytes, as long as they fit in *size bytes, so that stream writers can
+ * write them at once. A reply larger than an empty buffer grows it to
+ * the size of the reply. If wait is set, waits up to WriteCoalesceDelay
+ * for more replies. Returns the new length. */
+int coalescereplies(struct gqueue *replyq, unsigned char **buf, int len, int *size, uint8_t wait) {
+    struct request *reply;
+    struct timespec deadline;
+    unsigned char *grown;
+    int rlen;
+
+    wait = wait && options.writecoalescedelay;
+    if (wait)
+	coalescedeadline(&deadline);
+    pthread_mutex_lock(&replyq->mutex);
+    for (;;) {
+	if (!list_first(replyq->entries)) {
+	    if (!wait || pthread_cond_timedwait(&replyq->cond, &replyq->mutex, &deadline) == ETIMEDOUT)
+		break;
+	    continue;
+	}
+	reply = (struct request *)list_first(replyq->entries)->data;
+	rlen = RADLEN(reply->replybuf);
+	if (len + rlen > *size) {
+	    if (len)
+		break;
+	    grown = realloc(*buf, rlen);
+	    if (!grown) {
+		/* dropped rather than left for the writer to retry */
+		queueshift(replyq);
+		pthread_mutex_unlock(&replyq->mutex);
+		debug(DBG_ERR, "coalescereplies: malloc failed");
+		freerq(reply);
+		pthread_mutex_lock(&replyq->mutex);
+		continue;
+	    }
+	    *buf = grown;
+	    *size = rlen;
+	}
+	queueshift(replyq);
+	pthread_mutex_unlock(&replyq->mutex);
+	memcpy(*buf + len, reply->replybuf, rlen);
+	len += rlen;
+	freerq(reply);
+	pthread_mutex_lock(&replyq->mutex);
+    }
+    pthread_mutex_unlock(&replyq->mutex);
+    return len;
+}
+
+/* The MD5 state after hashing the secret is computed once per conf by
+ * setsecretmd5(); copying it lets each block skip rehashing the secret
+ * and keeps these functions reentrant. */
+static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, const struct md5_ctx *secretmd5, uint8_t *auth) {
     struct md5_ctx mdctx;
     unsigned char hash[MD5_DIGEST_SIZE], *input;
     uint8_t i, offset = 0, out[128];
 
-    pthread_mutex_lock(&lock);
-
-    md5_init(&mdctx);
     input = auth;
     for (;;) {
-	md5_update(&mdctx, sharedlen, (uint8_t *) shared);
+	mdctx = *secretmd5;
         md5_update(&mdctx, 16, input);
         md5_digest(&mdctx, sizeof(hash), hash);
 	for (i = 0; i < 16; i++)
@@ -577,27 +1136,21 @@ static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, char *shared, u
 	    break;
     }
     memcpy(in, out, len);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sharedlen, uint8_t *auth, uint8_t *salt) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int msmppencrypt(uint8_t *text, uint8_t len, const struct md5_ctx *secretmd5, uint8_t *auth, uint8_t *salt) {
     struct md5_ctx mdctx;
     unsigned char hash[MD5_DIGEST_SIZE];
     uint8_t i, offset;
 
-    pthread_mutex_lock(&lock);
-    md5_init(&mdctx);
-
 #if 0
     printfchars(NULL, "msppencrypt auth in", "%02x ", auth, 16);
     printfchars(NULL, "msppencrypt salt in", "%02x ", salt, 2);
     printfchars(NULL, "msppencrypt in", "%02x ", text, len);
 #endif
 
-    md5_update(&mdctx, sharedlen, shared);
+    mdctx = *secretmd5;
     md5_update(&mdctx, 16, auth);
     md5_update(&mdctx, 2, salt);
     md5_digest(&mdctx, sizeof(hash), hash);
@@ -614,7 +1167,7 @@ static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 	printf("text + offset - 16 c(%d): ", offset / 16);
 	printfchars(NULL, NULL, "%02x ", text + offset - 16, 16);
 #endif
-        md5_update(&mdctx, sharedlen, shared);
+	mdctx = *secretmd5;
         md5_update(&mdctx, 16, text + offset - 16);
         md5_digest(&mdctx, sizeof(hash), hash);
 #if 0
@@ -629,27 +1182,22 @@ static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
     printfchars(NULL, "msppencrypt out", "%02x ", text, len);
 #endif
 
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sharedlen, uint8_t *auth, uint8_t *salt) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int msmppdecrypt(uint8_t *text, uint8_t len, const struct md5_ctx *secretmd5, uint8_t *auth, uint8_t *salt) {
     struct md5_ctx mdctx;
     unsigned char hash[MD5_DIGEST_SIZE];
     uint8_t i, offset;
     char plain[255];
 
-    pthread_mutex_lock(&lock);
-    md5_init(&mdctx);
-
 #if 0
     printfchars(NULL, "msppdecrypt auth in", "%02x ", auth, 16);
     printfchars(NULL, "msppdecrypt salt in", "%02x ", salt, 2);
     printfchars(NULL, "msppdecrypt in", "%02x ", text, len);
 #endif
 
-    md5_update(&mdctx, sharedlen, shared);
+    mdctx = *secretmd5;
     md5_update(&mdctx, 16, auth);
     md5_update(&mdctx, 2, salt);
     md5_digest(&mdctx, sizeof(hash), hash);
@@ -666,7 +1214,7 @@ static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 	printf("text + offset - 16 c(%d): ", offset / 16);
 	printfchars(NULL, NULL, "%02x ", text + offset - 16, 16);
 #endif
-        md5_update(&mdctx, sharedlen, shared);
+	mdctx = *secretmd5;
         md5_update(&mdctx, 16, text + offset - 16);
         md5_digest(&mdctx, sizeof(hash), hash);
 #if 0
@@ -682,10 +1230,16 @@ static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
     printfchars(NULL, "msppdecrypt out", "%02x ", text, len);
 #endif
 
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
+/* to be called whenever conf->secret is set */
+static void setsecretmd5(struct clsrvconf *conf) {
+    md5_init(&conf->secretmd5);
+    md5_update(&conf->secretmd5, strlen(conf->secret), (uint8_t *)conf->secret);
+    radsecret_init(&conf->radsecret, (uint8_t *)conf->secret);
+}
+
 struct realm *newrealmref(struct realm *r) {
     if (r) {
         pthread_mutex_lock(&r->refmutex);
@@ -695,25 +1249,188 @@ struct realm *newrealmref(struct realm *r) {
     return r;
 }
 
+/* node in a trie of reversed realm suffixes, children are in a sibling list */
+struct realmtrie {
+    unsigned char c;
+    struct realmtrie *next, *child;
+    struct realm *realm; /* first realm in config order ending here */
+    int order;
+};
+
+struct realmindex {
+    struct realmtrie root;
+    struct realm **regexrealms; /* realms that need regexec, in config order */
+    int *regexorder;
+    int nregex;
+};
+
+/* returns the lower case suffix an id must end with to match the regexp
+ * addrealm() constructs from value, NULL if value is a real regexp */
+static char *realmsuffix(const char *value) {
+    const char *v = value;
+    char *suffix, *s;
+
+    if (*v == '/')
+	return NULL;
+    if (*v == '*')
+	v++;
+    if (strpbrk(v, "^$[]()|*+?{}\\"))
+	return NULL;
+    suffix = malloc(strlen(v) + 2);
+    if (!suffix)
+	return NULL;
+    s = suffix;
+    /* "*x" constructs "@*x$" which matches any id ending with x */
+    if (*value != '*')
+	*s++ = '@';
+    while (*v)
+	*s++ = tolower((unsigned char)*v++);
+    *s = '\0';
+    return suffix;
+}
+
+static int realmmatches(struct realm *realm, const char *id) {
+    size_t idlen, len;
+    const char *s, *t;
+
+    if (!realm->suffix)
+	return !regexec(&realm->regex, id, 0, NULL, 0);
+    idlen = strlen(id);
+    len = strlen(realm->suffix);
+    if (len > idlen)
+	return 0;
+    for (s = id + idlen - len, t = realm->suffix; *t; s++, t++)
+	if (tolower((unsigned char)*s) != *t)
+	    return 0;
+    return 1;
+}
+
+static void freerealmtrie(struct realmtrie *node) {
+    struct realmtrie *next;
+
+    for (; node; node = next) {
+	next = node->next;
+	freerealmtrie(node->child);
+	free(node);
+    }
+}
+
+static void freerealmindex(struct realmindex *idx) {
+    if (!idx)
+	return;
+    freerealmtrie(idx->root.child);
+    free(idx->regexrealms);
+    free(idx->regexorder);
+    free(idx);
+}
+
+static struct realmindex *buildrealmindex(struct list *realmlist) {
+    struct realmindex *idx;
+    struct realmtrie *node, *child;
+    struct list_node *entry;
+    struct realm *realm;
+    const char *s;
+    int n, order = 0;
+
+    idx = malloc(sizeof(struct realmindex));
+    if (!idx)
+	return NULL;
+    memset(idx, 0, sizeof(struct realmindex));
+    n = list_count(realmlist);
+    idx->regexrealms = malloc(n * sizeof(struct realm *) + 1);
+    idx->regexorder = malloc(n * sizeof(int) + 1);
+    if (!idx->regexrealms || !idx->regexorder)
+	goto errexit;
+
+    for (entry = list_first(realmlist); entry; entry = list_next(entry), order++) {
+	realm = (struct realm *)entry->data;
+	if (!realm->suffix) {
+	    idx->regexrealms[idx->nregex] = realm;
+	    idx->regexorder[idx->nregex++] = order;
+	    continue;
+	}
+	node = &idx->root;
+	for (s = realm->suffix + strlen(realm->suffix); s > realm->suffix;) {
+	    s--;
+	    for (child = node->child; child && child->c != (unsigned char)*s; child = child->next);
+	    if (!child) {
+		child = malloc(sizeof(struct realmtrie));
+		if (!child)
+		    goto errexit;
+		memset(child, 0, sizeof(struct realmtrie));
+		child->c = (unsigned char)*s;
+		child->next = node->child;
+		node->child = child;
+	    }
+	    node = child;
+	}
+	if (!node->realm) {
+	    node->realm = realm;
+	    node->order = order;
+	}
+    }
+    debug(DBG_DBG, "buildrealmindex: %d realms, %d need regexec", order, idx->nregex);
+    return idx;
+
+errexit:
+    debug(DBG_ERR, "malloc failed");
+    freerealmindex(idx);
+    return NULL;
+}
+
+/* returns the first realm in config order matching id, same as trying
+ * realmmatches() on each realm of the indexed list */
+static struct realm *realmindexmatch(struct realmindex *idx, const char *id) {
+    struct realmtrie *node = &idx->root;
+    struct realm *best = node->realm;
+    int i, bestorder = best ? node->order : INT_MAX;
+    const char *s;
+
+    for (s = id + strlen(id); s > id && node->child && bestorder;) {
+	s--;
+	for (node = node->child; node && node->c != tolower((unsigned char)*s); node = node->next);
+	if (!node)
+	    break;
+	if (node->realm && node->order < bestorder) {
+	    best = node->realm;
+	    bestorder = node->order;
+	}
+    }
+    for (i = 0; i < idx->nregex && idx->regexorder[i] < bestorder; i++)
+	if (!regexec(&idx->regexrealms[i]->regex, id, 0, NULL, 0))
+	    return idx->regexrealms[i];
+    return best;
+}
+
+/* returns with lock on realm */
+static struct realm *lockmatchedrealm(struct realm *realm, char *id) {
+    struct realm *subrealm;
+
+    /* need to do locking for subrealms and check subrealm timers */
+    pthread_mutex_lock(&realm->mutex);
+    if (realm->subrealms) {
+	subrealm = id2realm(realm->subrealms, id);
+	if (subrealm) {
+	    pthread_mutex_unlock(&realm->mutex);
+	    return subrealm;
+	}
+    }
+    return newrealmref(realm);
+}
+
 /* returns with lock on realm */
 struct realm *id2realm(struct list *realmlist, char *id) {
     struct list_node *entry;
-    struct realm *realm, *subrealm;
+    struct realm *realm;
 
-    /* need to do locking for subrealms and check subrealm timers */
+    if (realmlist == confgen->realms && confgen->realmindex) {
+	realm = realmindexmatch(confgen->realmindex, id);
+	return realm ? lockmatchedrealm(realm, id) : NULL;
+    }
     for (entry = list_first(realmlist); entry; entry = list_next(entry)) {
 	realm = (struct realm *)entry->data;
-	if (!regexec(&realm->regex, id, 0, NULL, 0)) {
-	    pthread_mutex_lock(&realm->mutex);
-	    if (realm->subrealms) {
-		subrealm = id2realm(realm->subrealms, id);
-		if (subrealm) {
-		    pthread_mutex_unlock(&realm->mutex);
-		    return subrealm;
-		}
-	    }
-	    return newrealmref(realm);
-	}
+	if (realmmatches(realm, id))
+	    return lockmatchedrealm(realm, id);
     }
     return NULL;
 }
@@ -806,34 +1523,34 @@ int attrvalidate(unsigned char *attrs, int length) {
     return 1;
 }
 
-int pwdrecrypt(uint8_t *pwd, uint8_t len, char *oldsecret, char *newsecret, uint8_t *oldauth, uint8_t *newauth) {
+int pwdrecrypt(uint8_t *pwd, uint8_t len, struct clsrvconf *oldconf, struct clsrvconf *newconf, uint8_t *oldauth, uint8_t *newauth) {
     if (len < 16 || len > 128 || len % 16) {
 	debug(DBG_WARN, "pwdrecrypt: invalid password length");
 	return 0;
     }
 
-    if (!pwdcrypt(0, pwd, len, oldsecret, strlen(oldsecret), oldauth)) {
+    if (!pwdcrypt(0, pwd, len, &oldconf->secretmd5, oldauth)) {
 	debug(DBG_WARN, "pwdrecrypt: cannot decrypt password");
 	return 0;
     }
 #ifdef DEBUG
     printfchars(NULL, "pwdrecrypt: password", "%02x ", pwd, len);
 #endif
-    if (!pwdcrypt(1, pwd, len, newsecret, strlen(newsecret), newauth)) {
+    if (!pwdcrypt(1, pwd, len, &newconf->secretmd5, newauth)) {
 	debug(DBG_WARN, "pwdrecrypt: cannot encrypt password");
 	return 0;
     }
     return 1;
 }
 
-int msmpprecrypt(uint8_t *msmpp, uint8_t len, char *oldsecret, char *newsecret, uint8_t *oldauth, uint8_t *newauth) {
+int msmpprecrypt(uint8_t *msmpp, uint8_t len, struct clsrvconf *oldconf, struct clsrvconf *newconf, uint8_t *oldauth, uint8_t *newauth) {
     if (len < 18)
 	return 0;
-    if (!msmppdecrypt(msmpp + 2, len - 2, (uint8_t *)oldsecret, strlen(oldsecret), oldauth, msmpp)) {
+    if (!msmppdecrypt(msmpp + 2, len - 2, &oldconf->secretmd5, oldauth, msmpp)) {
 	debug(DBG_WARN, "msmpprecrypt: failed to decrypt msppe key");
 	return 0;
     }
-    if (!msmppencrypt(msmpp + 2, len - 2, (uint8_t *)newsecret, strlen(newsecret), newauth, msmpp)) {
+    if (!msmppencrypt(msmpp + 2, len - 2, &newconf->secretmd5, newauth, msmpp)) {
 	debug(DBG_WARN, "msmpprecrypt: failed to encrypt msppe key");
 	return 0;
     }
@@ -841,44 +1558,39 @@ int msmpprecrypt(uint8_t *msmpp, uint8_t len, char *oldsecret, char *newsecret,
 }
 
 int msmppe(unsigned char *attrs, int length, uint8_t type, char *attrtxt, struct request *rq,
-	   char *oldsecret, char *newsecret) {
+	   struct clsrvconf *oldconf, struct clsrvconf *newconf) {
     unsigned char *attr;
 
     for (attr = attrs; (attr = attrget(attr, length - (attr - attrs), type)); attr += ATTRLEN(attr)) {
 	debug(DBG_DBG, "msmppe: Got %s", attrtxt);
-	if (!msmpprecrypt(ATTRVAL(attr), ATTRVALLEN(attr), oldsecret, newsecret, rq->buf + 4, rq->rqauth))
+	if (!msmpprecrypt(ATTRVAL(attr), ATTRVALLEN(attr), oldconf, newconf, rq->buf + 4, rq->rqauth))
 	    return 0;
     }
     return 1;
 }
 
-int findvendorsubattr(uint32_t *attrs, uint32_t vendor, uint32_t subattr) {
-    if (!attrs)
-	return 0;
+static int vendorrmcmp(const void *a, const void *b) {
+    uint32_t va = ((const struct vendorrm *)a)->vendor, vb = ((const struct vendorrm *)b)->vendor;
 
-    for (; attrs[0]; attrs += 2)
-	if (attrs[0] == vendor && attrs[1] == subattr)
-	    return 1;
-    return 0;
+    return va < vb ? -1 : va > vb;
 }
 
 /* returns 1 if entire element is to be removed, else 0 */
-int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
+int dovendorrewriterm(struct tlv *attr, struct vendorrm *rmv, int nrmv) {
     uint8_t alen, sublen;
-    uint32_t vendor;
+    struct vendorrm key, *vrm;
     uint8_t *subattrs;
 
-    if (!removevendorattrs || attr->l <= 4)
+    if (!rmv || attr->l <= 4)
 	return 0;
 
-    memcpy(&vendor, attr->v, 4);
-    vendor = ntohl(vendor);
-    while (*removevendorattrs && *removevendorattrs != vendor)
-	removevendorattrs += 2;
-    if (!*removevendorattrs)
+    memcpy(&key.vendor, attr->v, 4);
+    key.vendor = ntohl(key.vendor);
+    vrm = bsearch(&key, rmv, nrmv, sizeof(struct vendorrm), vendorrmcmp);
+    if (!vrm)
 	return 0;
 
-    if (findvendorsubattr(removevendorattrs, vendor, 256))
+    if (vrm->all)
 	return 1; /* remove entire vendor attribute */
 
     sublen = attr->l - 4;
@@ -892,7 +1604,7 @@ int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
     while (sublen > 1) {
 	alen = ATTRLEN(subattrs);
 	sublen -= alen;
-	if (findvendorsubattr(removevendorattrs, vendor, ATTRTYPE(subattrs))) {
+	if (vrm->subattrs[ATTRTYPE(subattrs) / 32] & (1U << (ATTRTYPE(subattrs) % 32))) {
 	    memmove(subattrs, subattrs + alen, sublen);
 	    attr->l -= alen;
 	} else
@@ -901,18 +1613,28 @@ int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
     return 0;
 }
 
-void dorewriterm(struct radmsg *msg, uint8_t *rmattrs, uint32_t *rmvattrs) {
+/* rmattrs is a bitmap of attribute types to remove */
+void dorewriterm(struct radmsg *msg, uint32_t *rmattrs, struct vendorrm *rmvattrs, int nrmvattrs) {
     struct list_node *n, *p;
     struct tlv *attr;
+    int i;
+
+    if (!rmvattrs || !RADMSG_HASTYPE(msg, RAD_Attr_Vendor_Specific)) {
+	rmvattrs = NULL;
+	for (i = 0; rmattrs && i < 8; i++)
+	    if (rmattrs[i] & msg->types[i])
+		break;
+	if (!rmattrs || i == 8)
+	    return;
+    }
 
     p = NULL;
     n = list_first(msg->attrs);
     while (n) {
 	attr = (struct tlv *)n->data;
-	if ((rmattrs && strchr((char *)rmattrs, attr->t)) ||
-	    (rmvattrs && attr->t == RAD_Attr_Vendor_Specific && dovendorrewriterm(attr, rmvattrs))) {
-	    list_removedata(msg->attrs, attr);
-	    freetlv(attr);
+	if ((rmattrs && rmattrs[attr->t / 32] & (1U << (attr->t % 32))) ||
+	    (rmvattrs && attr->t == RAD_Attr_Vendor_Specific && dovendorrewriterm(attr, rmvattrs, nrmvattrs))) {
+	    radmsg_del(msg, attr);
 	    n = p ? list_next(p) : list_first(msg->attrs);
 	} else {
 	    p = n;
@@ -937,87 +1659,84 @@ int dorewriteadd(struct radmsg *msg, struct list *addattrs) {
     return 1;
 }
 
-int resizeattr(struct tlv *attr, uint8_t newlen) {
-    uint8_t *newv;
+/* matches the prefix and suffix forms without regexec, the literal
+ * is compared case insensitively as the regex is REG_ICASE */
+static int matchliteral(struct modattr *modattr, char *in, size_t len, regmatch_t *pmatch) {
+    size_t l = modattr->literallen;
 
-    if (newlen != attr->l) {
-	newv = realloc(attr->v, newlen);
-	if (!newv)
+    if (len < l)
+	return 0;
+    if (modattr->match == MODATTR_SUFFIX) {
+	if (strncasecmp(in + len - l, modattr->literal, l))
+	    return 0;
+	pmatch[1].rm_so = 0;
+	pmatch[1].rm_eo = len - l;
+    } else {
+	if (strncasecmp(in, modattr->literal, l))
 	    return 0;
-	attr->v = newv;
-	attr->l = newlen;
+	pmatch[1].rm_so = l;
+	pmatch[1].rm_eo = len;
     }
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = len;
     return 1;
 }
 
 int dorewritemodattr(struct tlv *attr, struct modattr *modattr) {
-    size_t nmatch = 10, reslen = 0, start = 0;
-    regmatch_t pmatch[10], *pfield;
-    int i;
-    char *in, *out;
-
-    in = stringcopy((char *)attr->v, attr->l);
-    if (!in)
-	return 0;
-
-    if (regexec(modattr->regex, in, nmatch, pmatch, 0)) {
-	free(in);
+    regmatch_t pmatch[10];
+    struct modpart *part;
+    size_t reslen = 0, i;
+    char in[256];
+    uint8_t *out;
+
+    /* the value is copied since it is overwritten below, POSIX regexec
+     * only sees it up to the first NUL */
+    memcpy(in, attr->v, attr->l);
+    in[attr->l] = '\0';
+
+    for (i = 0; i < modattr->nmatch; i++)
+	pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+    if (modattr->match != MODATTR_REGEX && !memchr(in, '\0', attr->l)) {
+	if (!matchliteral(modattr, in, attr->l, pmatch))
+	    return 1;
+    } else if (regexec(modattr->regex, in, modattr->nmatch, modattr->nmatch ? pmatch : NULL, 0))
 	return 1;
-    }
 
-    out = modattr->replacement;
-
-    for (i = start; out[i]; i++) {
-	if (out[i] == '\\' && out[i + 1] >= '1' && out[i + 1] <= '9') {
-	    pfield = &pmatch[out[i + 1] - '0'];
-	    if (pfield->rm_so >= 0) {
-		reslen += i - start + pfield->rm_eo - pfield->rm_so;
-		start = i + 2;
-	    }
-	    i++;
-	}
-    }
-    reslen += i - start;
+    for (part = modattr->parts; part < modattr->parts + modattr->nparts; part++)
+	reslen += part->ref && pmatch[part->ref].rm_so >= 0
+	    ? (size_t)(pmatch[part->ref].rm_eo - pmatch[part->ref].rm_so) : part->len;
     if (reslen > 253) {
 	debug(DBG_INFO, "rewritten attribute length would be %d, max possible is 253, discarding message", reslen);
-	free(in);
 	return 0;
     }
 
-    if (!resizeattr(attr, reslen)) {
-	free(in);
+    if (!resizetlv(attr, reslen))
 	return 0;
-    }
 
-    start = 0;
-    reslen = 0;
-    for (i = start; out[i]; i++) {
-	if (out[i] == '\\' && out[i + 1] >= '1' && out[i + 1] <= '9') {
-	    pfield = &pmatch[out[i + 1] - '0'];
-	    if (pfield->rm_so >= 0) {
-		memcpy(attr->v + reslen, out + start, i - start);
-		reslen += i - start;
-		memcpy(attr->v + reslen, in + pfield->rm_so, pfield->rm_eo - pfield->rm_so);
-		reslen += pfield->rm_eo - pfield->rm_so;
-		start = i + 2;
-	    }
-	    i++;
+    out = attr->v;
+    for (part = modattr->parts; part < modattr->parts + modattr->nparts; part++) {
+	if (part->ref && pmatch[part->ref].rm_so >= 0) {
+	    memcpy(out, in + pmatch[part->ref].rm_so, pmatch[part->ref].rm_eo - pmatch[part->ref].rm_so);
+	    out += pmatch[part->ref].rm_eo - pmatch[part->ref].rm_so;
+	} else {
+	    memcpy(out, part->s, part->len);
+	    out += part->len;
 	}
     }
-    free(in);
-
-    memcpy(attr->v + reslen, out + start, i - start);
     return 1;
 }
 
 int dorewritemod(struct radmsg *msg, struct list *modattrs) {
     struct list_node *n, *m;
 
-    for (n = list_first(msg->attrs); n; n = list_next(n))
-	for (m = list_first(modattrs); m; m = list_next(m))
+    for (m = list_first(modattrs); m; m = list_next(m)) {
+	if (!RADMSG_HASTYPE(msg, ((struct modattr *)m->data)->t))
+	    continue;
+	for (n = list_first(msg->attrs); n; n = list_next(n))
 	    if (((struct tlv *)n->data)->t == ((struct modattr *)m->data)->t &&
 		!dorewritemodattr((struct tlv *)n->data, (struct modattr *)m->data))
 		return 0;
+    }
     return 1;
 }
 
@@ -1026,7 +1745,7 @@ int dorewrite(struct radmsg *msg, struct rewrite *rewrite) {
 
     if (rewrite) {
 	if (rewrite->removeattrs || rewrite->removevendorattrs)
-	    dorewriterm(msg, rewrite->removeattrs, rewrite->removevendorattrs);
+	    dorewriterm(msg, rewrite->removeattrs, rewrite->removevendorattrs, rewrite->nremovevendorattrs);
 	if (rewrite->modattrs)
 	    if (!dorewritemod(msg, rewrite->modattrs))
 		rv = 0;
@@ -1217,7 +1936,7 @@ uint8_t *radattr2ascii(struct tlv *attr) {
     return a;
 }
 
-void replylog(struct radmsg *msg, struct server *server, struct request *rq) {
+void replylog(uint8_t code, struct tlv *replymsgattr, struct server *server, struct request *rq) {
     uint8_t *username, *logusername = NULL, *stationid, *replymsg, *tmpmsg;
     char *servername, *logstationid = NULL;
     uint8_t level = DBG_NOTICE;
@@ -1253,7 +1972,7 @@ void replylog(struct radmsg *msg, struct server *server, struct request *rq) {
         }
         free(stationid);
     }
-    replymsg = radattr2ascii(radmsg_gettype(msg, RAD_Attr_Reply_Message));
+    replymsg = radattr2ascii(replymsgattr);
     if (replymsg) {
         if (asprintf((char **)&tmpmsg, " (%s)", replymsg) >= 0) {
             free(replymsg);
@@ -1261,22 +1980,22 @@ void replylog(struct radmsg *msg, struct server *server, struct request *rq) {
         }
     }
 
-    if (msg->code == RAD_Access_Accept || msg->code == RAD_Access_Reject || msg->code == RAD_Accounting_Response) {
-        if (msg->code == RAD_Accounting_Response)
+    if (code == RAD_Access_Accept || code == RAD_Access_Reject || code == RAD_Accounting_Response) {
+        if (code == RAD_Accounting_Response)
             level = DBG_INFO;
         if (logusername) {
             debug(level, "%s for user %s%s from %s%s to %s (%s)",
-                radmsgtype2string(msg->code), logusername, logstationid ? logstationid : "",
+                radmsgtype2string(code), logusername, logstationid ? logstationid : "",
                 servername, replymsg ? (char *)replymsg : "", rq->from->conf->name,
                 addr2string(rq->from->addr, tmp, sizeof(tmp)));
         } else {
-            debug(level, "%s (response to %s) from %s to %s (%s)", radmsgtype2string(msg->code),
+            debug(level, "%s (response to %s) from %s to %s (%s)", radmsgtype2string(code),
                 radmsgtype2string(rq->msg->code), servername,
                 rq->from->conf->name, addr2string(rq->from->addr, tmp, sizeof(tmp)));
         }
-    } else if(msg->code == RAD_Access_Request) {
+    } else if(code == RAD_Access_Request) {
         debug(level, "missing response to %s for user %s%s from %s (%s) to %s",
-            radmsgtype2string(msg->code), logusername, logstationid ? logstationid : "",
+            radmsgtype2string(code), logusername, logstationid ? logstationid : "",
             rq->from->conf->name, addr2string(rq->from->addr, tmp, sizeof(tmp)), servername);
     }
     free(username);
@@ -1284,13 +2003,117 @@ void replylog(struct radmsg *msg, struct server *server, struct request *rq) {
     free(replymsg);
 }
 
+/* returns the cached template for a reply, adding it if there is
+ * room, or NULL if there is none */
+static struct replytemplate *getreplytemplate(struct clsrvconf *conf, uint8_t code, char *message, int add_msg_auth) {
+    struct replytemplate *t;
+    size_t msglen = message ? strlen(message) : 0;
+    uint8_t *p;
+    int i;
+
+    if (msglen > 253)
+	return NULL;
+    for (i = 0; i < REPLY_TEMPLATES; i++) {
+	t = __atomic_load_n(&conf->replytemplates[i], __ATOMIC_ACQUIRE);
+	if (!t) {
+	    t = calloc(1, sizeof(struct replytemplate) + 20 + 18 + 2 + msglen);
+	    if (!t)
+		return NULL;
+	    t->code = code;
+	    p = t->buf + 20;
+	    if (add_msg_auth) {
+		*p++ = RAD_Attr_Message_Authenticator;
+		*p++ = 18;
+		t->msgauth = p - t->buf;
+		p += 16;
+	    }
+	    if (msglen) {
+		t->replymsg.t = RAD_Attr_Reply_Message;
+		t->replymsg.l = msglen;
+		t->replymsg.v = p + 2;
+		*p++ = RAD_Attr_Reply_Message;
+		*p++ = 2 + msglen;
+		memcpy(p, message, msglen);
+		p += msglen;
+	    }
+	    t->buf[0] = code;
+	    t->len = p - t->buf;
+	    if (__sync_bool_compare_and_swap(&conf->replytemplates[i], NULL, t))
+		return t;
+	    /* another thread added one first */
+	    free(t);
+	    t = __atomic_load_n(&conf->replytemplates[i], __ATOMIC_ACQUIRE);
+	}
+	if (t->code == code && !t->msgauth == !add_msg_auth &&
+	    t->replymsg.l == msglen && (!msglen || !memcmp(t->replymsg.v, message, msglen)))
+	    return t;
+    }
+    return NULL;
+}
+
+/* serializes a reply from t, with the id, authenticator and Proxy-State
+ * attributes of the request, and signs it */
+static uint8_t *replyfromtemplate(struct replytemplate *t, struct radmsg *rqmsg, int copy_proxystate_flag, struct radsecret *secret) {
+    struct list_node *node;
+    struct tlv *attr;
+    size_t len = t->len;
+    uint8_t *buf, *p;
+
+    copy_proxystate_flag = copy_proxystate_flag && RADMSG_HASTYPE(rqmsg, RAD_Attr_Proxy_State);
+    if (copy_proxystate_flag)
+	for (node = list_first(rqmsg->attrs); node; node = list_next(node))
+	    if (((struct tlv *)node->data)->t == RAD_Attr_Proxy_State)
+		len += 2 + ((struct tlv *)node->data)->l;
+    if (len > 65535)
+	return NULL;
+    buf = pool_bufalloc(len);
+    if (!buf)
+	return NULL;
+
+    memcpy(buf, t->buf, t->len);
+    buf[1] = rqmsg->id;
+    *(uint16_t *)(buf + 2) = htons(len);
+    memcpy(buf + 4, rqmsg->auth, 16);
+    p = buf + t->len;
+    if (copy_proxystate_flag)
+	for (node = list_first(rqmsg->attrs); node; node = list_next(node)) {
+	    attr = (struct tlv *)node->data;
+	    if (attr->t != RAD_Attr_Proxy_State)
+		continue;
+	    p = tlv2buf(p, attr);
+	    p[-1] += 2;
+	    p += attr->l;
+	}
+    if (!radmsg_signreply(buf, t->msgauth ? buf + t->msgauth : NULL, secret)) {
+	pool_buffree(buf);
+	return NULL;
+    }
+    return buf;
+}
+
 void respond(struct request *rq, uint8_t code, char *message,
              int copy_proxystate_flag, int add_msg_auth)
 {
     struct radmsg *msg;
     struct tlv *attr;
+    struct replytemplate *t;
     char tmp[INET6_ADDRSTRLEN];
 
+    if (message && !*message)
+	message = NULL;
+    t = getreplytemplate(rq->from->conf, code, message, add_msg_auth);
+    if (t) {
+	rq->replybuf = replyfromtemplate(t, rq->msg, copy_proxystate_flag, &rq->from->conf->radsecret);
+	if (!rq->replybuf) {
+	    debug(DBG_ERR, "respond: malloc failed");
+	    return;
+	}
+	replylog(code, message ? &t->replymsg : NULL, NULL, rq);
+	debug(DBG_DBG, "respond: sending %s (id %d) to %s (%s)", radmsgtype2string(code), rq->msg->id, rq->from->conf->name, addr2string(rq->from->addr, tmp, sizeof(tmp)));
+	sendreply(newrqref(rq));
+	return;
+    }
+
     msg = radmsg_init(code, rq->msg->id, rq->msg->auth);
     if (!msg) {
         debug(DBG_ERR, "respond: malloc failed");
@@ -1306,7 +2129,7 @@ void respond(struct request *rq, uint8_t code, char *message,
             return;
         }
     }
-    if (message && *message) {
+    if (message) {
         attr = maketlv(RAD_Attr_Reply_Message, strlen(message), message);
         if (!attr || !radmsg_add(msg, attr)) {
             freetlv(attr);
@@ -1322,7 +2145,7 @@ void respond(struct request *rq, uint8_t code, char *message,
         }
     }
 
-    replylog(msg, NULL, rq);
+    replylog(msg->code, radmsg_gettype(msg, RAD_Attr_Reply_Message), NULL, rq);
     debug(DBG_DBG, "respond: sending %s (id %d) to %s (%s)", radmsgtype2string(msg->code), msg->id, rq->from->conf->name, addr2string(rq->from->addr, tmp, sizeof(tmp)));
 
     radmsg_free(rq->msg);
@@ -1330,51 +2153,237 @@ void respond(struct request *rq, uint8_t code, char *message,
     sendreply(newrqref(rq));
 }
 
-struct clsrvconf *choosesrvconf(struct list *srvconfs) {
+/* the server state used for load balancing is read without locks */
+#define LBREAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+/* servers having lost this many requests in a row are left to the
+ * priority order, other policies avoid them */
+#define LB_MAX_LOSTRQS 4
+
+/* picks the first usable server in the configured order, preferring
+ * those that have not lost requests */
+static struct clsrvconf *choosesrvconfpriority(struct list *srvconfs) {
     struct list_node *entry;
     struct clsrvconf *server, *best = NULL, *first = NULL;
+    enum rsp_server_state state;
+    uint8_t lost;
 
     for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
         server = (struct clsrvconf *)entry->data;
         if (!server->servers)
             return server;
-            if (server->servers->state == RSP_SERVER_STATE_FAILING)
-                continue;
+        state = LBREAD(server->servers->state);
+        if (state == RSP_SERVER_STATE_FAILING)
+            continue;
         if (!first)
             first = server;
-        if (server->servers->state == RSP_SERVER_STATE_STARTUP || server->servers->state == RSP_SERVER_STATE_RECONNECTING)
+        if (state == RSP_SERVER_STATE_STARTUP || state == RSP_SERVER_STATE_RECONNECTING)
             continue;
-        if (!server->servers->lostrqs)
+        lost = LBREAD(server->servers->lostrqs);
+        if (!lost)
             return server;
-        if (!best) {
-            best = server;
-            continue;
-        }
-        if (server->servers->lostrqs < best->servers->lostrqs)
+        if (!best || lost < LBREAD(best->servers->lostrqs))
             best = server;
     }
-    if (best && best->servers->lostrqs == MAX_LOSTRQS)
+    if (best && LBREAD(best->servers->lostrqs) == MAX_LOSTRQS)
         for (entry = list_first(srvconfs); entry; entry = list_next(entry))
-            if (((struct clsrvconf *)entry->data)->servers->lostrqs == MAX_LOSTRQS)
-                ((struct clsrvconf *)entry->data)->servers->lostrqs--;
+            if (LBREAD(((struct clsrvconf *)entry->data)->servers->lostrqs) == MAX_LOSTRQS)
+                __sync_fetch_and_sub(&((struct clsrvconf *)entry->data)->servers->lostrqs, 1);
     return best ? best : first;
 }
 
-/* returns with lock on realm, protects from server changes while in use by radsrv/sendrq */
-struct server *findserver(struct realm **realm, struct tlv *username, uint8_t acc) {
+/* returns the number of requests sent to server waiting for a reply */
+static int outstandingrqs(struct server *server) {
+    int i, n;
+
+    for (i = n = 0; i < MAX_REQUESTS / 32; i++)
+	n += __builtin_popcount(LBREAD(server->usedids[i]));
+    return n;
+}
+
+/* returns the connection to conf with the fewest outstanding requests,
+ * preferring connected ones. This is conf->servers unless the server
+ * has more than one connection */
+static struct server *choosesrvconn(struct clsrvconf *conf) {
+    struct server *server, *best = conf->servers;
+    int n, bestn = INT_MAX;
+
+    if (!best || !best->nextconn)
+	return best;
+    for (server = conf->servers; server; server = server->nextconn) {
+	n = outstandingrqs(server);
+	if (LBREAD(server->state) != RSP_SERVER_STATE_CONNECTED)
+	    n += MAX_REQUESTS;
+	if (n < bestn) {
+	    best = server;
+	    bestn = n;
+	}
+    }
+    return best;
+}
+
+/* adds the time of a reply to the smoothed reply time and its deviation
+ * as TCP does (RFC 6298), used by RSP_LB_RTT and serverrto() */
+static void updatertt(struct server *server, struct timeval *sent) {
+    struct timeval now;
+    int64_t sample, rtt, rttvar;
+
+    gettimeofday(&now, NULL);
+    sample = (now.tv_sec - sent->tv_sec) * 1000000LL + now.tv_usec - sent->tv_usec;
+    if (sample < 1)
+	sample = 1;
+    else if (sample > UINT32_MAX)
+	sample = UINT32_MAX;
+    rtt = LBREAD(server->rtt);
+    if (rtt) {
+	rttvar = LBREAD(server->rttvar);
+	rttvar += ((sample > rtt ? sample - rtt : rtt - sample) - rttvar) / 4;
+	rtt += (sample - rtt) / 8;
+    } else {
+	rttvar = sample / 2;
+	rtt = sample;
+    }
+    __atomic_store_n(&server->rttvar, (uint32_t)rttvar, __ATOMIC_RELAXED);
+    __atomic_store_n(&server->rtt, (uint32_t)rtt, __ATOMIC_RELAXED);
+}
+
+/* Returns the milliseconds to wait for a reply to try number tries of a
+ * request to server. This is the retransmission timeout SRTT + 4 * RTTVAR
+ * of at least REQUEST_RTO_MIN, doubled for each retry, and at most
+ * RetryInterval. RetryInterval is used as is until a reply has been timed,
+ * and for TCP and TLS that leave retransmitting to the transport. */
+static uint64_t serverrto(struct server *server, uint8_t tries) {
+    uint64_t rto, max = server->conf->retryinterval * 1000ULL;
+    uint32_t rtt = LBREAD(server->rtt);
+
+    if (!rtt || !server->conf->pdef->retrycountmax)
+	return max;
+    rto = (rtt + 4ULL * LBREAD(server->rttvar)) / 1000;
+    if (rto < REQUEST_RTO_MIN)
+	rto = REQUEST_RTO_MIN;
+    if (tries > 1)
+	rto <<= tries - 1 < 16 ? tries - 1 : 16;
+    return rto < max ? rto : max;
+}
+
+/* the attribute requests are hashed on for RSP_LB_HASH, so that all
+ * requests of an EAP session go to the same server */
+static struct tlv *lbhashattr(struct radmsg *msg) {
+    struct tlv *attr = radmsg_gettype(msg, RAD_Attr_Calling_Station_Id);
+
+    return attr && attr->l ? attr : radmsg_gettype(msg, RAD_Attr_User_Name);
+}
+
+/* whether server is connected and not losing requests */
+static int lbusable(struct server *server) {
+    return LBREAD(server->state) == RSP_SERVER_STATE_CONNECTED && LBREAD(server->lostrqs) < LB_MAX_LOSTRQS;
+}
+
+/* Returns the average reply time of the usable servers timed so far, for
+ * RSP_LB_RTT to score those not timed yet as typical ones, so that they
+ * get their share of requests until they are timed. With none timed it
+ * is 1, scoring all by the requests waiting */
+static uint64_t lbuntimedrtt(struct list *srvconfs) {
+    struct list_node *entry;
+    struct clsrvconf *conf;
+    struct server *server;
+    uint64_t sum = 0, rtt;
+    uint32_t n = 0;
+
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (!conf->servers)
+	    continue;
+	server = choosesrvconn(conf);
+	if (!lbusable(server) || !(rtt = LBREAD(server->rtt)))
+	    continue;
+	sum += rtt;
+	n++;
+    }
+    return n ? sum / n : 1;
+}
+
+/* Picks a server according to the realm's load balancing policy among
+ * those connected and not losing requests, by the lowest score:
+ * RSP_LB_LEASTOUTSTANDING the requests waiting for a reply,
+ * RSP_LB_RTT the average reply time times the requests waiting plus one,
+ * servers not timed yet counting as an average one,
+ * RSP_LB_HASH the highest hash of the attribute and the server name
+ * (rendezvous hashing, so only the sessions of a server going down move).
+ * Returns NULL if no server is usable, the caller then uses the priority
+ * order. */
+static struct clsrvconf *choosesrvconfpolicy(struct list *srvconfs, enum rsp_loadbalance policy, struct radmsg *msg) {
+    struct list_node *entry;
+    struct clsrvconf *conf, *best = NULL;
+    struct server *server;
+    struct tlv *attr = NULL;
+    uint64_t score, bestscore = 0, key[2], rtt, untimedrtt = 0;
+
+    if (policy == RSP_LB_HASH && (!msg || !(attr = lbhashattr(msg))))
+	return NULL;
+    if (policy == RSP_LB_RTT)
+	untimedrtt = lbuntimedrtt(srvconfs);
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (!conf->servers)
+	    return conf;
+	server = choosesrvconn(conf);
+	if (!lbusable(server))
+	    continue;
+	switch (policy) {
+	case RSP_LB_LEASTOUTSTANDING:
+	    score = outstandingrqs(server);
+	    break;
+	case RSP_LB_RTT:
+	    rtt = LBREAD(server->rtt);
+	    score = (rtt ? rtt : untimedrtt) * (outstandingrqs(server) + 1);
+	    break;
+	case RSP_LB_HASH:
+	    key[0] = hash_siphash((uint8_t *)conf->name, strlen(conf->name), (uint64_t[2]){0, 0});
+	    key[1] = 0;
+	    score = ~hash_siphash(attr->v, attr->l, key);
+	    break;
+	default:
+	    return NULL;
+	}
+	if (!best || score < bestscore) {
+	    best = conf;
+	    bestscore = score;
+	}
+    }
+    return best;
+}
+
+struct clsrvconf *choosesrvconf(struct list *srvconfs, enum rsp_loadbalance policy, struct radmsg *msg) {
+    struct clsrvconf *conf = NULL;
+
+    if (policy != RSP_LB_PRIORITY)
+	conf = choosesrvconfpolicy(srvconfs, policy, msg);
+    return conf ? conf : choosesrvconfpriority(srvconfs);
+}
+
+/* returns with lock on realm, protects from server changes while in use by radsrv/sendrq.
+ * The caller holds confgenlock for reading. If limited is not NULL and the
+ * realm is over its rate limit, sets *limited and returns NULL before
+ * choosing a server */
+struct server *findserver(struct realm **realm, struct tlv *username, struct radmsg *msg, uint8_t *limited) {
     struct clsrvconf *srvconf;
     struct realm *subrealm;
     struct server *server = NULL;
     char *id = (char *)tlv2str(username);
+    uint8_t acc = msg->code == RAD_Accounting_Request;
 
     if (!id)
 	return NULL;
     /* returns with lock on realm */
-    *realm = id2realm(realms, id);
+    *realm = id2realm(confgen->realms, id);
     if (!*realm)
 	goto exit;
     debug(DBG_DBG, "found matching realm: %s", (*realm)->name);
-    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
+    if (limited && !ratelimit_take(&(*realm)->ratelimit)) {
+	*limited = 1;
+	goto exit;
+    }
+    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs, (*realm)->loadbalance, msg);
     if (srvconf && !(*realm)->parent && !srvconf->servers && srvconf->dynamiclookupcommand) {
 	subrealm = adddynamicrealmserver(*realm, id);
 	if (subrealm) {
@@ -1383,13 +2392,13 @@ struct server *findserver(struct realm **realm, struct tlv *username, uint8_t ac
 	    freerealm(*realm);
 	    *realm = subrealm;
             debug(DBG_DBG, "added realm: %s", (*realm)->name);
-	    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
+	    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs, (*realm)->loadbalance, msg);
             debug(DBG_DBG, "found conf for new realm: %s", srvconf->name);
 	}
     }
     if (srvconf) {
         debug(DBG_DBG, "found matching conf: %s", srvconf->name);
-	server = srvconf->servers;
+	server = choosesrvconn(srvconf);
     }
 
 exit:
@@ -1401,71 +2410,110 @@ exit:
 struct request *newrequest() {
     struct request *rq;
 
-    rq = malloc(sizeof(struct request));
+    rq = pool_zalloc(sizeof(struct request));
     if (!rq) {
 	debug(DBG_ERR, "newrequest: malloc failed");
 	return NULL;
     }
-    memset(rq, 0, sizeof(struct request));
     rq->refcount = 1;
-    pthread_mutex_init(&rq->refmutex, NULL);
-    gettimeofday(&rq->created, NULL);
+    rqreceived(rq);
     return rq;
 }
 
+void rqreceived(struct request *rq) {
+    gettimeofday(&rq->created, NULL);
+    rq->received = monotonicus();
+}
+
+/* expires the oldest requests, so each request is looked at once */
 static void
 purgedupcache(struct client *client) {
     struct request *r;
     struct timeval now;
-    int i;
 
     gettimeofday(&now, NULL);
-    for (i = 0; i < MAX_REQUESTS; i++) {
-	r = client->rqs[i];
-	if (r && now.tv_sec - r->created.tv_sec > r->from->conf->dupinterval) {
-        removeclientrq(client, i);
-	}
+    if (!(r = client->dups.oldest) || now.tv_sec - r->created.tv_sec <= client->conf->dupinterval)
+	return;
+    do
+        removeclientrq(client, r);
+    while ((r = client->dups.oldest) && now.tv_sec - r->created.tv_sec > client->conf->dupinterval);
+    /* a client idle for dupinterval gives back its table */
+    if (!client->dups.n) {
+	free(client->dups.buckets);
+	client->dups.buckets = NULL;
+	client->dups.mask = 0;
     }
 }
 
 int addclientrq(struct request *rq) {
-    struct request *r;
+    struct client *from = rq->from;
+    struct request **link, *r;
     struct timeval now;
     char tmp[INET6_ADDRSTRLEN];
 
-    r = rq->from->rqs[rq->rqid];
-    if (r) {
-	if (!memcmp(rq->rqauth, r->rqauth, 16)) {
-	    gettimeofday(&now, NULL);
-	    if (now.tv_sec - r->created.tv_sec < r->from->conf->dupinterval) {
-		if (r->replybuf) {
-		    debug(DBG_INFO, "addclientrq: already sent reply to request with id %d from %s, resending", rq->rqid, addr2string(r->from->addr, tmp, sizeof(tmp)));
-		    sendreply(newrqref(r));
-		} else
-		    debug(DBG_INFO, "addclientrq: already got request with id %d from %s, ignoring", rq->rqid, addr2string(r->from->addr, tmp, sizeof(tmp)));
-		return 0;
-	    }
+    link = dupfind(&from->dups, rq->rqid, rq->rqauth);
+    if (link) {
+	r = *link;
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - r->created.tv_sec < from->conf->dupinterval) {
+	    if (r->replybuf) {
+		debug(DBG_INFO, "addclientrq: already sent reply to request with id %d from %s, resending", rq->rqid, addr2string(from->addr, tmp, sizeof(tmp)));
+		sendreply(newrqref(r));
+	    } else
+		debug(DBG_INFO, "addclientrq: already got request with id %d from %s, ignoring", rq->rqid, addr2string(from->addr, tmp, sizeof(tmp)));
+	    return 0;
 	}
-    removeclientrq(rq->from, rq->rqid);
+	removeclientrq(from, r);
+    }
+    if (from->dups.n >= from->conf->dupcachesize) {
+	from->dups.evicted++;
+	/* log on the first eviction and then less and less often */
+	if (!(from->dups.evicted & (from->dups.evicted - 1)))
+	    debug(DBG_WARN, "addclientrq: duplicate cache of client %s full with %u requests, %u removed early so far, consider raising DuplicateCacheSize", from->conf->name, from->dups.n, from->dups.evicted);
+	removeclientrq(from, from->dups.oldest);
+    }
+    if (!duplink(&from->dups, newrqref(rq), from->conf->dupcachesize)) {
+	debug(DBG_ERR, "addclientrq: malloc failed, not checking for duplicates");
+	freerq(rq);
     }
-    rq->from->rqs[rq->rqid] = newrqref(rq);
     return 1;
 }
 
-void rmclientrq(struct request *rq, uint8_t id) {
-    struct request *r;
+/* removes rq from the duplicate cache, it is not sent on */
+void rmclientrq(struct request *rq) {
+    if (rq->dupcached) {
+	dupunlink(&rq->from->dups, rq);
+	freerq(rq);
+    }
+}
 
-    r = rq->from->rqs[id];
-    if (r) {
-	freerq(r);
-	rq->from->rqs[id] = NULL;
+/* drops a request over a rate limit, or answers an access request with
+ * a reject if configured to. Returns 1 if it was answered */
+static int ratelimitexceeded(struct request *rq, struct metrics *metrics, uint8_t reject, char *message) {
+    if (reject && rq->msg->code == RAD_Access_Request) {
+	metrics_inc(metrics, METRIC_RATELIMIT_REJECTS);
+	respond(rq, RAD_Access_Reject, message, 1, 1);
+	return 1;
     }
+    metrics_inc(metrics, METRIC_DROPS_RATELIMIT);
+    return 0;
 }
 
 /* Called from server readers, handling incoming requests from
  * clients. */
 /* returns 0 if validation/authentication fails, else 1 */
 int radsrv(struct request *rq) {
+    unsigned char *buf = rq->buf;
+    int r;
+
+    rq->buf = NULL;
+    r = radsrvbuf(rq, buf);
+    pool_buffree(buf);
+    return r;
+}
+
+/* as radsrv(), but buf is owned by the caller and only read during the call */
+int radsrvbuf(struct request *rq, unsigned char *buf) {
     struct radmsg *msg = NULL;
     struct tlv *attr;
     uint8_t *userascii = NULL;
@@ -1473,21 +2521,23 @@ int radsrv(struct request *rq) {
     struct server *to = NULL;
     struct client *from = rq->from;
     int ttlres;
+    uint8_t limited = 0;
     char tmp[INET6_ADDRSTRLEN];
 
-    msg = buf2radmsg(rq->buf, (uint8_t *)from->conf->secret, NULL);
-    free(rq->buf);
-    rq->buf = NULL;
+    msg = buf2radmsg(buf, &from->conf->radsecret, NULL);
 
     if (!msg) {
 	debug(DBG_NOTICE, "radsrv: ignoring request from %s (%s), validation failed.", from->conf->name, addr2string(from->addr, tmp, sizeof(tmp)));
+	metrics_inc(from->conf->metrics, METRIC_DROPS_INVALID);
 	freerq(rq);
 	return 0;
     }
 
+    rqstage(rq, RQ_PARSED);
     rq->msg = msg;
     rq->rqid = msg->id;
     memcpy(rq->rqauth, msg->auth, 16);
+    metrics_inc(from->conf->metrics, METRIC_REQUESTS_IN);
 
     debug(DBG_DBG, "radsrv: code %d, id %d", msg->code, msg->id);
     if (msg->code != RAD_Access_Request && msg->code != RAD_Status_Server && msg->code != RAD_Accounting_Request) {
@@ -1506,12 +2556,20 @@ int radsrv(struct request *rq) {
 
     /* below: code == RAD_Access_Request || code == RAD_Accounting_Request */
 
+    if (!ratelimit_take(&from->conf->ratelimit)) {
+	debug(DBG_INFO, "radsrv: client %s (%s) is over its rate limit", from->conf->name, addr2string(from->addr, tmp, sizeof(tmp)));
+	if (ratelimitexceeded(rq, from->conf->metrics, from->conf->ratelimitreject, NULL))
+	    goto exit;
+	goto rmclrqexit;
+    }
+
     if (from->conf->rewritein && !dorewrite(msg, from->conf->rewritein))
 	goto rmclrqexit;
 
     ttlres = checkttl(msg, options.ttlattrtype);
     if (!ttlres) {
 	debug(DBG_INFO, "radsrv: ignoring request from client %s (%s), ttl exceeded", from->conf->name, addr2string(from->addr, tmp, sizeof(tmp)));
+	metrics_inc(from->conf->metrics, METRIC_DROPS_TTL);
 	goto exit;
     }
 
@@ -1535,11 +2593,23 @@ int radsrv(struct request *rq) {
     debug(DBG_INFO, "radsrv: got %s (id %d) with username: %s from client %s (%s)", radmsgtype2string(msg->code), msg->id, userascii, from->conf->name, addr2string(from->addr, tmp, sizeof(tmp)));
 
     /* will return with lock on the realm */
-    to = findserver(&realm, attr, msg->code == RAD_Accounting_Request);
+    pthread_rwlock_rdlock(&confgenlock);
+    to = findserver(&realm, attr, msg, &limited);
+    rqstage(rq, RQ_ROUTED);
     if (!realm) {
+	pthread_rwlock_unlock(&confgenlock);
 	debug(DBG_INFO, "radsrv: ignoring request, don't know where to send it");
 	goto exit;
     }
+    rq->realm = newrealmref(realm);
+    metrics_inc(realm->metrics, METRIC_REQUESTS_IN);
+
+    if (limited) {
+	debug(DBG_INFO, "radsrv: realm %s is over its rate limit", realm->name);
+	if (ratelimitexceeded(rq, realm->metrics, realm->ratelimitreject, realm->message))
+	    goto exit;
+	goto rmclrqexit;
+    }
 
     if (!to) {
 	if (realm->message && msg->code == RAD_Access_Request) {
@@ -1595,14 +2665,14 @@ int radsrv(struct request *rq) {
     attr = radmsg_gettype(msg, RAD_Attr_User_Password);
     if (attr) {
 	debug(DBG_DBG, "radsrv: found userpwdattr with value length %d", attr->l);
-	if (!pwdrecrypt(attr->v, attr->l, from->conf->secret, to->conf->secret, rq->rqauth, msg->auth))
+	if (!pwdrecrypt(attr->v, attr->l, from->conf, to->conf, rq->rqauth, msg->auth))
 	    goto rmclrqexit;
     }
 
     attr = radmsg_gettype(msg, RAD_Attr_Tunnel_Password);
     if (attr) {
 	debug(DBG_DBG, "radsrv: found tunnelpwdattr with value length %d", attr->l);
-	if (!pwdrecrypt(attr->v, attr->l, from->conf->secret, to->conf->secret, rq->rqauth, msg->auth))
+	if (!pwdrecrypt(attr->v, attr->l, from->conf, to->conf, rq->rqauth, msg->auth))
 	    goto rmclrqexit;
     }
 
@@ -1614,25 +2684,34 @@ int radsrv(struct request *rq) {
 
     free(userascii);
     rq->to = to;
+    metrics_inc(realm->metrics, METRIC_REQUESTS_OUT);
     sendrq(rq);
     pthread_mutex_unlock(&realm->mutex);
     freerealm(realm);
+    pthread_rwlock_unlock(&confgenlock);
     return 1;
 
 rmclrqexit:
-    rmclientrq(rq, msg->id);
+    rmclientrq(rq);
 exit:
     freerq(rq);
     free(userascii);
     if (realm) {
 	pthread_mutex_unlock(&realm->mutex);
 	freerealm(realm);
+	pthread_rwlock_unlock(&confgenlock);
     }
     return 1;
 }
 
 /* Called from client readers, handling replies from servers. */
 void replyh(struct server *server, unsigned char *buf) {
+    replyhbuf(server, buf);
+    pool_buffree(buf);
+}
+
+/* as replyh(), but buf is owned by the caller and only read during the call */
+void replyhbuf(struct server *server, unsigned char *buf) {
     struct client *from;
     struct rqout *rqout;
     int sublen, ttlres;
@@ -1647,20 +2726,17 @@ void replyh(struct server *server, unsigned char *buf) {
     rqout = server->requests + buf[1];
     pthread_mutex_lock(rqout->lock);
     if (!rqout->tries) {
-	free(buf);
-	buf = NULL;
 	debug(DBG_INFO, "replyh: no outstanding request with this id, ignoring reply");
 	goto errunlock;
     }
 
-    msg = buf2radmsg(buf, (uint8_t *)server->conf->secret, rqout->rq->msg->auth);
+    msg = buf2radmsg(buf, &server->conf->radsecret, rqout->rq->msg->auth);
 #ifdef DEBUG
     printfchars(NULL, "origauth/buf+4", "%02x ", buf + 4, 16);
 #endif
-    free(buf);
-    buf = NULL;
     if (!msg) {
         debug(DBG_NOTICE, "replyh: ignoring message from server %s, validation failed", server->conf->name);
+	metrics_inc(server->conf->metrics, METRIC_DROPS_INVALID);
 	goto errunlock;
     }
     if (msg->code != RAD_Access_Accept && msg->code != RAD_Access_Reject && msg->code != RAD_Access_Challenge
@@ -1671,6 +2747,15 @@ void replyh(struct server *server, unsigned char *buf) {
     debug(DBG_DBG, "got %s message with id %d", radmsgtype2string(msg->code), msg->id);
 
     gettimeofday(&server->lastrcv, NULL);
+    rqstage(rqout->rq, RQ_REPLIED);
+    metrics_reply(server->conf->metrics, msg->code);
+    /* the reply may be to any of the tries, only time the first */
+    if (rqout->tries == 1) {
+	updatertt(server, &rqout->sent);
+	metrics_rtt(server->conf->metrics, &rqout->sent);
+	if (rqout->rq->realm)
+	    metrics_rtt(rqout->rq->realm->metrics, &rqout->sent);
+    }
 
     if (rqout->rq->msg->code == RAD_Status_Server) {
         freerqoutdata(rqout);
@@ -1690,6 +2775,7 @@ void replyh(struct server *server, unsigned char *buf) {
     ttlres = checkttl(msg, options.ttlattrtype);
     if (!ttlres) {
 	debug(DBG_INFO, "replyh: ignoring reply from server %s, ttl exceeded", server->conf->name);
+	metrics_inc(server->conf->metrics, METRIC_DROPS_TTL);
 	goto errunlock;
     }
 
@@ -1709,9 +2795,9 @@ void replyh(struct server *server, unsigned char *buf) {
 	subattrs = attr->v + 4;
 	if (!attrvalidate(subattrs, sublen) ||
 	    !msmppe(subattrs, sublen, RAD_VS_ATTR_MS_MPPE_Send_Key, "MS MPPE Send Key",
-		    rqout->rq, server->conf->secret, from->conf->secret) ||
+		    rqout->rq, server->conf, from->conf) ||
 	    !msmppe(subattrs, sublen, RAD_VS_ATTR_MS_MPPE_Recv_Key, "MS MPPE Recv Key",
-		    rqout->rq, server->conf->secret, from->conf->secret))
+		    rqout->rq, server->conf, from->conf))
 	    break;
     }
     if (node) {
@@ -1719,7 +2805,7 @@ void replyh(struct server *server, unsigned char *buf) {
 	goto errunlock;
     }
 
-    replylog(msg, server, rqout->rq);
+    replylog(msg->code, radmsg_gettype(msg, RAD_Attr_Reply_Message), server, rqout->rq);
 
     if (msg->code == RAD_Access_Accept || msg->code == RAD_Access_Reject)
     if (options.fticks_reporting && from->conf->fticks_viscountry != NULL)
@@ -1729,7 +2815,7 @@ void replyh(struct server *server, unsigned char *buf) {
     memcpy(msg->auth, rqout->rq->rqauth, 16);
 
     if (rqout->rq->origusername && (attr = radmsg_gettype(msg, RAD_Attr_User_Name))) {
-	if (!resizeattr(attr, strlen(rqout->rq->origusername))) {
+	if (!resizetlv(attr, strlen(rqout->rq->origusername))) {
 	    debug(DBG_WARN, "replyh: malloc failed, ignoring reply");
 	    goto errunlock;
 	}
@@ -1753,10 +2839,54 @@ void replyh(struct server *server, unsigned char *buf) {
     pthread_mutex_unlock(rqout->lock);
     return;
 
-errunlock:
-    radmsg_free(msg);
-    pthread_mutex_unlock(rqout->lock);
-    return;
+errunlock:
+    radmsg_free(msg);
+    pthread_mutex_unlock(rqout->lock);
+    return;
+}
+
+static void radsrvwork(void *arg, unsigned char *buf) {
+    struct request *rq = (struct request *)arg;
+    struct client *from = rq->from;
+
+    if (!radsrv(rq))
+	__atomic_store_n(&from->invalid, 1, __ATOMIC_RELAXED);
+}
+
+/* Called from server readers with a request read into rq->buf. With
+ * RequestWorkers the request is handed to a worker, which handles the
+ * requests of a client one at a time in the order they were read, else
+ * it is handled here. Returns 0 if the request, or with workers an
+ * earlier one from the same client, failed validation */
+int radsrvdispatch(struct request *rq) {
+    struct client *from = rq->from;
+
+    if (!workers_count())
+	return radsrv(rq);
+    if (!workers_submit(&from->flow, radsrvwork, rq, NULL)) {
+	debug(DBG_INFO, "radsrvdispatch: workers busy, dropping request from client %s", from->conf->name);
+	metrics_inc(from->conf->metrics, METRIC_DROPS_WORKERS);
+	freerq(rq);
+    }
+    return !__atomic_load_n(&from->invalid, __ATOMIC_RELAXED);
+}
+
+static void replyhwork(void *arg, unsigned char *buf) {
+    replyh((struct server *)arg, buf);
+}
+
+/* Called from client readers with a reply read into buf, handled by a
+ * worker with RequestWorkers, else here */
+void replyhdispatch(struct server *server, unsigned char *buf) {
+    if (!workers_count()) {
+	replyh(server, buf);
+	return;
+    }
+    if (!workers_submit(&server->flow, replyhwork, server, buf)) {
+	debug(DBG_INFO, "replyhdispatch: workers busy, dropping reply from server %s", server->conf->name);
+	metrics_inc(server->conf->metrics, METRIC_DROPS_WORKERS);
+	pool_buffree(buf);
+    }
 }
 
 struct request *createstatsrvrq() {
@@ -1784,15 +2914,26 @@ exit:
 }
 
 /* code for removing state not finished */
+/* returns 1 if server has requests waiting for a reply */
+static int hasoutstandingrqs(struct server *server) {
+    int i;
+
+    for (i = 0; i < MAX_REQUESTS / 32; i++)
+	if (server->usedids[i])
+	    return 1;
+    return 0;
+}
+
 void *clientwr(void *arg) {
     struct server *server = (struct server *)arg;
     struct rqout *rqout = NULL;
     pthread_t clientrdth;
     int i, dynconffail = 0;
     time_t secs;
-    uint8_t rnd, do_resend = 0, statusserver_requested = 0;
+    uint64_t expiry;
+    uint8_t rnd, do_resend = 0, statusserver_requested = 0, retiring = 0, unflushed = 0;
     struct timeval now, laststatsrv;
-    struct timespec timeout;
+    struct timespec timeout, flushat;
     struct request *statsrvrq;
     struct clsrvconf *conf;
 
@@ -1801,26 +2942,33 @@ void *clientwr(void *arg) {
 
 #define ZZZ 900
 
+    /* A dynamic server that fails is removed at once. Its realm is then
+     * not looked up again for a while, see dynlookupfail() */
     server->state = RSP_SERVER_STATE_STARTUP;
     if (server->dynamiclookuparg && !dynamicconfig(server)) {
 	dynconffail = 1;
 	server->state = RSP_SERVER_STATE_FAILING;
-	debug(DBG_WARN, "%s: dynamicconfig(%s: %s) failed, sleeping %ds",
-              __func__, server->conf->name, server->dynamiclookuparg, ZZZ);
-	sleep(ZZZ);
+	debug(DBG_WARN, "%s: dynamicconfig(%s: %s) failed",
+              __func__, server->conf->name, server->dynamiclookuparg);
 	goto errexit;
     }
     /* FIXME: Is resolving not always done by compileserverconfig(),
      * either as part of static configuration setup or by
      * dynamicconfig() above?  */
     if (!resolvehostports(conf->hostports, conf->hostaf, conf->pdef->socktype)) {
-        debug(DBG_WARN, "%s: resolve failed, sleeping %ds", __func__, ZZZ);
 	server->state = RSP_SERVER_STATE_FAILING;
-        sleep(ZZZ);
+	if (server->dynamiclookuparg) {
+	    debug(DBG_WARN, "%s: resolve failed", __func__);
+	    dynlookupfail(server->dynamiclookuparg);
+	} else {
+	    debug(DBG_WARN, "%s: resolve failed, sleeping %ds", __func__, ZZZ);
+	    sleep(ZZZ);
+	}
         goto errexit;
     }
 
     memset(&timeout, 0, sizeof(struct timespec));
+    memset(&flushat, 0, sizeof(struct timespec));
 
     gettimeofday(&server->lastreply, NULL);
     server->lastrcv = server->lastreply;
@@ -1830,9 +2978,8 @@ void *clientwr(void *arg) {
 	if (!conf->pdef->connecter(server, server->dynamiclookuparg ? 5 : 0, "clientwr")) {
 	    server->state = RSP_SERVER_STATE_FAILING;
 	    if (server->dynamiclookuparg) {
-                debug(DBG_WARN, "%s: connect failed, sleeping %ds",
-                      __func__, ZZZ);
-		sleep(ZZZ);
+                debug(DBG_WARN, "%s: connect failed", __func__);
+		dynlookupfail(server->dynamiclookuparg);
 	    }
 	    goto errexit;
 	}
@@ -1855,18 +3002,23 @@ void *clientwr(void *arg) {
 		secs = server->lastrcv.tv_sec > laststatsrv.tv_sec ? server->lastrcv.tv_sec : laststatsrv.tv_sec;
 		if (now.tv_sec - secs > STATUS_SERVER_PERIOD)
 		    secs = now.tv_sec;
-		if (!timeout.tv_sec || timeout.tv_sec > secs + STATUS_SERVER_PERIOD + rnd)
+		if (!timeout.tv_sec || timeout.tv_sec > secs + STATUS_SERVER_PERIOD + rnd) {
 		    timeout.tv_sec = secs + STATUS_SERVER_PERIOD + rnd;
+		    timeout.tv_nsec = 0;
+		}
 	    } else {
-		if (!timeout.tv_sec || timeout.tv_sec > now.tv_sec + STATUS_SERVER_PERIOD + rnd)
+		if (!timeout.tv_sec || timeout.tv_sec > now.tv_sec + STATUS_SERVER_PERIOD + rnd) {
 		    timeout.tv_sec = now.tv_sec + STATUS_SERVER_PERIOD + rnd;
+		    timeout.tv_nsec = 0;
+		}
 	    }
 #if 0
 	    if (timeout.tv_sec > now.tv_sec)
 		debug(DBG_DBG, "clientwr: waiting up to %ld secs for new request", timeout.tv_sec - now.tv_sec);
 #endif
-	    pthread_cond_timedwait(&server->newrq_cond, &server->newrq_mutex, &timeout);
+	    pthread_cond_timedwait(&server->newrq_cond, &server->newrq_mutex, unflushed ? &flushat : &timeout);
 	    timeout.tv_sec = 0;
+	    timeout.tv_nsec = 0;
 	}
 	if (server->newrq) {
 	    debug(DBG_DBG, "clientwr: got new request");
@@ -1883,7 +3035,22 @@ void *clientwr(void *arg) {
 #endif
 	pthread_mutex_unlock(&server->newrq_mutex);
 
-	for (i = 0; i < MAX_REQUESTS; i++) {
+	/* left out by a reload, no new requests come, so stop when the
+	 * outstanding ones are done */
+	if (server->retired && !retiring && !hasoutstandingrqs(server)) {
+	    debug(DBG_INFO, "clientwr: server %s removed from the configuration, closing", conf->name);
+	    retiring = 1;
+	    server->state = RSP_SERVER_STATE_FAILING;
+	    if (!conf->pdef->connecter)
+		goto errexit;
+	    /* the TLS and DTLS readers time out by themselves */
+	    if (conf->type == RAD_TCP)
+		shutdown(server->sock, SHUT_RDWR);
+	}
+
+	if (do_resend)
+	    rqtimerexpireall(server);
+	for (;;) {
 	    if (server->clientrdgone) {
 		server->state = RSP_SERVER_STATE_FAILING;
                 if (conf->pdef->connecter)
@@ -1891,38 +3058,35 @@ void *clientwr(void *arg) {
 		goto errexit;
 	    }
 
-	    for (; i < MAX_REQUESTS; i++) {
-		rqout = server->requests + i;
-		if (rqout->rq) {
-		    pthread_mutex_lock(rqout->lock);
-		    if (rqout->rq)
-			break;
-		    pthread_mutex_unlock(rqout->lock);
-		}
-	    }
-
-	    if (i == MAX_REQUESTS)
+	    gettimeofday(&now, NULL);
+	    i = rqtimerpop(server, timevalms(&now));
+	    if (i < 0)
 		break;
+	    rqout = server->requests + i;
+	    pthread_mutex_lock(rqout->lock);
+	    if (!rqout->rq) {
+		pthread_mutex_unlock(rqout->lock);
+		continue;
+	    }
 
-        gettimeofday(&now, NULL);
         if (do_resend) {
             if (rqout->tries > 0)
                 rqout->tries--;
-        } else if (now.tv_sec < rqout->expiry.tv_sec) {
-            if (!timeout.tv_sec || rqout->expiry.tv_sec < timeout.tv_sec)
-                timeout.tv_sec = rqout->expiry.tv_sec;
+        } else if (timevalms(&now) < timevalms(&rqout->expiry)) {
+            rqtimerset(server, i, timevalms(&rqout->expiry));
             pthread_mutex_unlock(rqout->lock);
             continue;
         }
 
-        if (rqout->tries > 0 && now.tv_sec - server->lastrcv.tv_sec > conf->retryinterval)
+        if (rqout->tries > 0 && timevalms(&now) - timevalms(&server->lastrcv) > serverrto(server, 1))
             statusserver_requested = 1;
         if (rqout->tries == (*rqout->rq->buf == RAD_Status_Server ? 1 : conf->retrycount + 1)) {
             debug(DBG_DBG, "clientwr: removing expired packet from queue");
-            replylog(rqout->rq->msg, server, rqout->rq);
+            replylog(rqout->rq->msg->code, NULL, server, rqout->rq);
             if (conf->statusserver == RSP_STATSRV_ON || conf->statusserver == RSP_STATSRV_MINIMAL) {
                 if (*rqout->rq->buf == RAD_Status_Server) {
                     debug(DBG_WARN, "clientwr: no status server response, %s dead?", conf->name);
+                    metrics_inc(conf->metrics, METRIC_LOST);
                     if (server->lostrqs < MAX_LOSTRQS)
                         server->lostrqs++;
                 }
@@ -1934,6 +3098,7 @@ void *clientwr(void *arg) {
                     }
                 } else {
                     debug(DBG_WARN, "clientwr: no server response, %s dead?", conf->name);
+                    metrics_inc(conf->metrics, METRIC_LOST);
                     if (server->lostrqs < MAX_LOSTRQS)
                         server->lostrqs++;
                 }
@@ -1943,19 +3108,46 @@ void *clientwr(void *arg) {
             continue;
         }
 
-	    rqout->expiry.tv_sec = now.tv_sec + conf->retryinterval;
-	    if (!timeout.tv_sec || rqout->expiry.tv_sec < timeout.tv_sec)
-		timeout.tv_sec = rqout->expiry.tv_sec;
+	    expiry = timevalms(&now) + serverrto(server, rqout->tries + 1);
+	    rqout->expiry.tv_sec = expiry / 1000;
+	    rqout->expiry.tv_usec = expiry % 1000 * 1000;
+	    rqtimerset(server, i, expiry);
+	    if (rqout->tries) {
+		metrics_inc(conf->metrics, METRIC_RETRANSMITS);
+	    } else {
+		rqout->sent = now;
+		rqstage(rqout->rq, RQ_SENT);
+		metrics_inc(conf->metrics, METRIC_REQUESTS_OUT);
+	    }
 	    rqout->tries++;
 	    if (!conf->pdef->clientradput(server, rqout->rq->buf)) {
             debug(DBG_WARN, "clientwr: could not send request to server %s", conf->name);
             if (server->lostrqs < MAX_LOSTRQS)
                 server->lostrqs++;
-        }
+        } else if (conf->pdef->clientradflush && !unflushed) {
+		unflushed = 1;
+		coalescedeadline(&flushat);
+	    }
 	    pthread_mutex_unlock(rqout->lock);
 	}
+	/* stream transports buffer the requests, written together once no
+	 * more are ready and the WriteCoalesceDelay has passed */
+	if (unflushed) {
+	    gettimeofday(&now, NULL);
+	    if (now.tv_sec > flushat.tv_sec || (now.tv_sec == flushat.tv_sec && now.tv_usec * 1000 >= flushat.tv_nsec)) {
+		unflushed = 0;
+		if (!conf->pdef->clientradflush(server)) {
+		    debug(DBG_WARN, "clientwr: could not send requests to server %s", conf->name);
+		    if (server->lostrqs < MAX_LOSTRQS)
+			server->lostrqs++;
+		}
+	    }
+	}
+	expiry = rqtimernext(server);
+	timeout.tv_sec = expiry / 1000;
+	timeout.tv_nsec = expiry % 1000 * 1000000;
     do_resend = 0;
-    if (server->state == RSP_SERVER_STATE_CONNECTED && !(conf->statusserver == RSP_STATSRV_OFF)) {
+    if (server->state == RSP_SERVER_STATE_CONNECTED && !(conf->statusserver == RSP_STATSRV_OFF) && !server->retired) {
         gettimeofday(&now, NULL);
         if ((conf->statusserver == RSP_STATSRV_ON && now.tv_sec - (laststatsrv.tv_sec ? server->lastrcv.tv_sec : laststatsrv.tv_sec) > STATUS_SERVER_PERIOD) ||
             (conf->statusserver == RSP_STATSRV_MINIMAL && statusserver_requested && now.tv_sec - laststatsrv.tv_sec > STATUS_SERVER_PERIOD) ||
@@ -1974,26 +3166,42 @@ void *clientwr(void *arg) {
     }
 errexit:
     if (server->dynamiclookuparg) {
-	removeserversubrealms(realms, conf);
+	pthread_rwlock_rdlock(&confgenlock);
+	removeserversubrealms(confgen->realms, conf);
+	pthread_rwlock_unlock(&confgenlock);
+	pthread_mutex_lock(&retiredrealmslock);
+	removeserversubrealms(retiredrealms, conf);
+	pthread_mutex_unlock(&retiredrealmslock);
 	if (dynconffail)
 	    free(conf);
-	else
+	else {
+	    /* the metrics are those of the server block */
+	    conf->metrics = NULL;
 	    freeclsrvconf(conf);
+	}
+	freeserver(server, 1);
+	return NULL;
     }
     freeserver(server, 1);
+    /* conf may be freed from now on if retired */
+    __atomic_sub_fetch(&conf->nservers, 1, __ATOMIC_RELEASE);
     return NULL;
 }
 
 void createlistener(uint8_t type, char *arg) {
     pthread_t th;
     struct addrinfo *res;
-    int s = -1, on = 1, *sp = NULL;
+    int s = -1, on = 1, *sp = NULL, i, nsocks;
     struct hostportres *hp = newhostport(arg, protodefs[type]->portdefault, 0);
 
     if (!hp || !resolvehostport(hp, AF_UNSPEC, protodefs[type]->socktype, 1))
 	debugx(1, DBG_ERR, "createlistener: failed to resolve %s", arg);
 
+    /* several sockets sharing the address, each with its own reader */
+    nsocks = type == RAD_UDP && options.listenudpthreads > 1 ? options.listenudpthreads : 1;
+
     for (res = hp->addrinfo; res; res = res->ai_next) {
+      for (i = 0; i < nsocks; i++) {
         s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
         if (s < 0) {
             debugerrno(errno, DBG_WARN, "createlistener: socket failed");
@@ -2001,6 +3209,11 @@ void createlistener(uint8_t type, char *arg) {
         }
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
             debugerrno(errno, DBG_WARN, "createlistener: SO_REUSEADDR");
+#ifdef SO_REUSEPORT
+	if (nsocks > 1)
+	    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+		debugerrno(errno, DBG_WARN, "createlistener: SO_REUSEPORT");
+#endif
 
 	disable_DF_bit(s, res);
 
@@ -2036,11 +3249,15 @@ void createlistener(uint8_t type, char *arg) {
 	if (pthread_create(&th, &pthread_attr, protodefs[type]->listener, (void *)sp))
             debugerrnox(errno, DBG_ERR, "pthread_create failed");
 	pthread_detach(th);
+      }
     }
     if (!sp)
 	debugx(1, DBG_ERR, "createlistener: socket/bind failed");
 
-    debug(DBG_WARN, "createlistener: listening for %s on %s:%s", protodefs[type]->name, hp->host ? hp->host : "*", hp->port);
+    if (nsocks > 1)
+	debug(DBG_WARN, "createlistener: listening for %s on %s:%s with %d sockets", protodefs[type]->name, hp->host ? hp->host : "*", hp->port, nsocks);
+    else
+	debug(DBG_WARN, "createlistener: listening for %s on %s:%s", protodefs[type]->name, hp->host ? hp->host : "*", hp->port);
     freehostport(hp);
 }
 
@@ -2056,6 +3273,59 @@ void createlisteners(uint8_t type) {
 	createlistener(type, NULL);
 }
 
+/* adds the memory of the clients of conf to r. Their duplicate caches
+ * change under us, but the clients stay while conf->lock is held */
+static void clientsmemory(struct metricsreport *r, struct clsrvconf *conf) {
+    struct list_node *entry;
+    struct client *client;
+    uint64_t clients = 0, dups = 0;
+
+    pthread_mutex_lock(conf->lock);
+    for (entry = list_first(conf->clients); entry; entry = list_next(entry)) {
+	client = (struct client *)entry->data;
+	clients += sizeof(struct client);
+	if (client->addr)
+	    clients += SOCKADDRP_SIZE(client->addr);
+	if (client->dups.buckets)
+	    dups += (client->dups.mask + 1) * sizeof(struct request *);
+	dups += client->dups.n * sizeof(struct request);
+    }
+    pthread_mutex_unlock(conf->lock);
+    metrics_memory(r, METRIC_MEMORY_CLIENTS, clients);
+    metrics_memory(r, METRIC_MEMORY_DUPLICATES, dups);
+}
+
+/* called by the metrics thread for each scrape */
+static void metricsdump(struct metricsreport *r) {
+    struct list_node *entry, *subentry;
+    struct clsrvconf *conf;
+    struct realm *realm, *subrealm;
+
+    metrics_memory(r, METRIC_MEMORY_SERVERS, __atomic_load_n(&serverbytes, __ATOMIC_RELAXED));
+    pthread_rwlock_rdlock(&confgenlock);
+    for (entry = list_first(confgen->clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	metrics_report(r, "client", conf->name, conf->metrics);
+	clientsmemory(r, conf);
+    }
+    for (entry = list_first(confgen->srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	metrics_report(r, "server", conf->name, conf->metrics);
+    }
+    for (entry = list_first(confgen->realms); entry; entry = list_next(entry)) {
+	realm = (struct realm *)entry->data;
+	metrics_report(r, "realm", realm->name, realm->metrics);
+	/* dynamic realms come and go with realm->mutex held */
+	pthread_mutex_lock(&realm->mutex);
+	for (subentry = list_first(realm->subrealms); subentry; subentry = list_next(subentry)) {
+	    subrealm = (struct realm *)subentry->data;
+	    metrics_report(r, "realm", subrealm->name, subrealm->metrics);
+	}
+	pthread_mutex_unlock(&realm->mutex);
+    }
+    pthread_rwlock_unlock(&confgenlock);
+}
+
 void randinit() {
     time_t t;
     pid_t pid;
@@ -2084,7 +3354,7 @@ struct list *addsrvconfs(char *value, char **names) {
     }
 
     for (n = 0; names[n]; n++) {
-	for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	for (entry = list_first(loadgen->srvconfs); entry; entry = list_next(entry)) {
 	    conf = (struct clsrvconf *)entry->data;
 	    if (!strcasecmp(names[n], conf->name))
 		break;
@@ -2117,7 +3387,10 @@ void freerealm(struct realm *realm) {
 
     free(realm->name);
     free(realm->message);
-    regfree(&realm->regex);
+    if (realm->suffix)
+	free(realm->suffix);
+    else
+	regfree(&realm->regex);
     pthread_mutex_destroy(&realm->refmutex);
     pthread_mutex_destroy(&realm->mutex);
     /* if refcount == 0, all subrealms gone */
@@ -2126,6 +3399,7 @@ void freerealm(struct realm *realm) {
     list_destroy(realm->srvconfs);
     /* if refcount == 0, all accsrvconfs gone */
     list_destroy(realm->accsrvconfs);
+    metrics_free(realm->metrics);
     freerealm(realm->parent);
     free(realm);
 }
@@ -2174,9 +3448,17 @@ struct realm *addrealm(struct list *realmlist, char *value, char **servers, char
     }
     memset(realm, 0, sizeof(struct realm));
 
+    realm->metrics = metrics_create();
+    if (!realm->metrics) {
+	debug(DBG_ERR, "malloc failed");
+	free(realm);
+	realm = NULL;
+	goto exit;
+    }
     if (pthread_mutex_init(&realm->mutex, NULL) ||
         pthread_mutex_init(&realm->refmutex, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
+	metrics_free(realm->metrics);
 	free(realm);
 	realm = NULL;
 	goto exit;
@@ -2195,7 +3477,12 @@ struct realm *addrealm(struct list *realmlist, char *value, char **servers, char
     realm->message = message;
     realm->accresp = accresp;
 
-    if (regcomp(&realm->regex, regex ? regex : value + 1, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
+    /* most realms are plain suffixes that can be matched without regexec,
+     * those never need the regexp compiled */
+    if (regex)
+	realm->suffix = realmsuffix(value);
+    if (!realm->suffix &&
+        regcomp(&realm->regex, regex ? regex : value + 1, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
 	debug(DBG_ERR, "addrealm: failed to compile regular expression %s", regex ? regex : value + 1);
 	goto errexit;
     }
@@ -2308,6 +3595,10 @@ struct realm *adddynamicrealmserver(struct realm *realm, char *id) {
     for (s = realmname; *s; s++)
 	if (*s != '.' && *s != '-' && !isalnum((int)*s))
 	    return NULL;
+    if (dynlookupfailed(realmname)) {
+	debug(DBG_DBG, "adddynamicrealmserver: lookup of %s failed recently, not trying again yet", realmname);
+	return NULL;
+    }
 
     if (!realm->subrealms)
 	realm->subrealms = list_create();
@@ -2322,31 +3613,227 @@ struct realm *adddynamicrealmserver(struct realm *realm, char *id) {
     }
 
     newrealm->parent = newrealmref(realm);
+    newrealm->loadbalance = realm->loadbalance;
+    ratelimit_init(&newrealm->ratelimit, realm->ratelimit.rate, realm->ratelimit.burst);
+    newrealm->ratelimitreject = realm->ratelimitreject;
     /* add server and accserver to newrealm */
     newrealm->srvconfs = createsubrealmservers(newrealm, realm->srvconfs);
     newrealm->accsrvconfs = createsubrealmservers(newrealm, realm->accsrvconfs);
     return newrealm;
 }
 
-int dynamicconfig(struct server *server) {
-    int ok, fd[2], status;
+/* Results of DynamicLookupCommand by realm. A realm found is not looked
+ * up again until the TTL given by the command runs out, and a realm whose
+ * lookup or server failed is not tried again for DYNAMIC_LOOKUP_FAILTTL
+ * seconds. The cache is emptied when it gets too big. With a
+ * DynamicLookupCacheFile it is kept in that file, see dynlookupsync() */
+#define DYNAMIC_LOOKUP_CACHEMAX 4096
+#define DYNAMIC_LOOKUP_OUTPUTMAX DYNCACHE_CONFIGMAX
+
+static struct hash *dynlookupcache;
+static uint32_t dynlookupcount;
+static uint8_t dynlookupdirty; /* changed since it was written to the file */
+static struct stat dynlookupfilestat; /* of the file when last read or written */
+static int dynlookuprunning;
+static pthread_mutex_t dynlookupmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dynlookupcond = PTHREAD_COND_INITIALIZER;
+
+/* returns an unexpired copy of the cached result for realm, or NULL */
+static struct dynlookup *dynlookupget(const char *realm) {
+    struct dynlookup *entry, *copy = NULL;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&dynlookupmutex);
+    entry = hash_read(dynlookupcache, (void *)realm, strlen(realm));
+    if (entry && entry->expiry <= now.tv_sec) {
+	free(hash_extract(dynlookupcache, (void *)realm, strlen(realm)));
+	dynlookupcount--;
+	entry = NULL;
+    }
+    if (entry) {
+	copy = malloc(sizeof(struct dynlookup) + entry->len);
+	if (copy)
+	    memcpy(copy, entry, sizeof(struct dynlookup) + entry->len);
+    }
+    pthread_mutex_unlock(&dynlookupmutex);
+    return copy;
+}
+
+static void dynlookupput(const char *realm, uint32_t ttl, const char *config, size_t len) {
+    struct dynlookup *entry;
+    struct timeval now;
+
+    if (!ttl)
+	return;
+    entry = malloc(sizeof(struct dynlookup) + len);
+    if (!entry)
+	return;
+    gettimeofday(&now, NULL);
+    entry->expiry = now.tv_sec + ttl;
+    entry->failed = !config;
+    entry->len = len;
+    if (len)
+	memcpy(entry->config, config, len);
+
+    pthread_mutex_lock(&dynlookupmutex);
+    if (dynlookupcache && dynlookupcount >= DYNAMIC_LOOKUP_CACHEMAX) {
+	debug(DBG_INFO, "dynlookupput: %u realms in cache, emptying it", dynlookupcount);
+	hash_destroy(dynlookupcache);
+	dynlookupcache = NULL;
+	dynlookupcount = 0;
+    }
+    if (!dynlookupcache)
+	dynlookupcache = hash_create();
+    if (dynlookupcache) {
+	if (hash_read(dynlookupcache, (void *)realm, strlen(realm))) {
+	    free(hash_extract(dynlookupcache, (void *)realm, strlen(realm)));
+	    dynlookupcount--;
+	}
+	if (hash_insert(dynlookupcache, (void *)realm, strlen(realm), entry)) {
+	    dynlookupcount++;
+	    dynlookupdirty = 1;
+	    entry = NULL;
+	}
+    }
+    pthread_mutex_unlock(&dynlookupmutex);
+    free(entry);
+}
+
+/* returns 1 if file is not the one last read or written by us */
+static int dynlookupfilechanged(const char *file, struct stat *st) {
+    if (stat(file, st) < 0)
+	return 0;
+    return st->st_ino != dynlookupfilestat.st_ino || st->st_dev != dynlookupfilestat.st_dev ||
+	st->st_mtime != dynlookupfilestat.st_mtime || st->st_size != dynlookupfilestat.st_size;
+}
+
+/* adds the results in file that expire later than those cached. Only the
+ * merge is done with the lock held, not reading the file. If the file
+ * lacks some of the cached results, or has them expiring earlier, the
+ * cache is marked to be written back */
+static void dynlookupload(const char *file) {
+    struct hash *loaded;
+    struct hash_entry *e;
+    struct dynlookup *entry, *old, *copy;
+    struct timeval now;
+    int n;
+
+    loaded = hash_create();
+    if (!loaded) {
+	debug(DBG_ERR, "dynlookupload: malloc failed");
+	return;
+    }
+    gettimeofday(&now, NULL);
+    n = dyncache_load(file, loaded, now.tv_sec);
+
+    pthread_mutex_lock(&dynlookupmutex);
+    if (!dynlookupcache)
+	dynlookupcache = hash_create();
+    for (e = n >= 0 && dynlookupcache ? hash_first(dynlookupcache) : NULL; e && !dynlookupdirty; e = hash_next(e)) {
+	entry = (struct dynlookup *)e->data;
+	copy = hash_read(loaded, e->key, e->keylen);
+	if (entry->expiry > now.tv_sec && (!copy || copy->expiry < entry->expiry))
+	    dynlookupdirty = 1;
+    }
+    for (e = hash_first(loaded); e && dynlookupcache; e = hash_next(e)) {
+	entry = (struct dynlookup *)e->data;
+	old = hash_read(dynlookupcache, e->key, e->keylen);
+	if (old ? old->expiry >= entry->expiry : dynlookupcount >= DYNAMIC_LOOKUP_CACHEMAX)
+	    continue;
+	if (old) {
+	    free(hash_extract(dynlookupcache, e->key, e->keylen));
+	    dynlookupcount--;
+	}
+	if (hash_insert(dynlookupcache, e->key, e->keylen, entry)) {
+	    dynlookupcount++;
+	    e->data = NULL;
+	}
+    }
+    pthread_mutex_unlock(&dynlookupmutex);
+    hash_destroy(loaded);
+    if (n > 0)
+	debug(DBG_INFO, "dynlookupload: read %d dynamic lookup results from %s", n, file);
+}
+
+/* reads the cache file if another proxy has written to it, and writes
+ * the cache to it if it changed. Found servers are shared this way by
+ * proxies using the same file, on a shared file system or copied, and a
+ * restarted proxy starts with the results it had */
+static void dynlookupsync(const char *file) {
+    struct stat st;
+    struct timeval now;
+    unsigned char *buf = NULL;
+    size_t len;
+
+    if (dynlookupfilechanged(file, &st)) {
+	dynlookupload(file);
+	dynlookupfilestat = st;
+    }
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&dynlookupmutex);
+    if (dynlookupdirty) {
+	buf = dyncache_pack(dynlookupcache, now.tv_sec, &len);
+	if (buf)
+	    dynlookupdirty = 0;
+    }
+    pthread_mutex_unlock(&dynlookupmutex);
+    if (!buf)
+	return;
+
+    if (dyncache_write(file, buf, len)) {
+	if (stat(file, &st) == 0)
+	    dynlookupfilestat = st;
+    } else {
+	pthread_mutex_lock(&dynlookupmutex);
+	dynlookupdirty = 1;
+	pthread_mutex_unlock(&dynlookupmutex);
+    }
+    free(buf);
+}
+
+/* remembers that realm failed, so it is not tried again for a while */
+void dynlookupfail(const char *realm) {
+    debug(DBG_INFO, "dynlookupfail: not looking up realm %s for %d seconds", realm, DYNAMIC_LOOKUP_FAILTTL);
+    dynlookupput(realm, DYNAMIC_LOOKUP_FAILTTL, NULL, 0);
+}
+
+/* returns 1 if realm recently failed */
+int dynlookupfailed(const char *realm) {
+    struct dynlookup *entry = dynlookupget(realm);
+    int failed = entry && entry->failed;
+
+    free(entry);
+    return failed;
+}
+
+/* runs the lookup command for arg, returning its output in a malloc'ed
+ * buffer, or NULL if it fails. At most DynamicLookupConcurrency commands
+ * run at a time, others wait for their turn. */
+static char *dynamiclookuprun(struct clsrvconf *conf, char *arg, size_t *len) {
+    int fd[2], status;
+    ssize_t cnt = 0;
     pid_t pid;
-    struct clsrvconf *conf = server->conf;
-    struct gconffile *cf = NULL;
+    char *out = NULL, *newout;
 
-    /* for now we only learn hostname/address */
-    debug(DBG_DBG, "dynamicconfig: need dynamic server config for %s", server->dynamiclookuparg);
+    pthread_mutex_lock(&dynlookupmutex);
+    while (dynlookuprunning >= options.dynamiclookupconcurrency)
+	pthread_cond_wait(&dynlookupcond, &dynlookupmutex);
+    dynlookuprunning++;
+    pthread_mutex_unlock(&dynlookupmutex);
 
-    if (pipe(fd) > 0) {
+    *len = 0;
+    if (pipe(fd) < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: pipe error");
-	goto errexit;
+	goto exit;
     }
     pid = fork();
     if (pid < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: fork error");
 	close(fd[0]);
 	close(fd[1]);
-	goto errexit;
+	goto exit;
     } else if (pid == 0) {
 	/* child */
 	close(fd[0]);
@@ -2355,29 +3842,96 @@ int dynamicconfig(struct server *server) {
 		debugx(1, DBG_ERR, "dynamicconfig: dup2 error for command %s", conf->dynamiclookupcommand);
 	    close(fd[1]);
 	}
-	if (execlp(conf->dynamiclookupcommand, conf->dynamiclookupcommand, server->dynamiclookuparg, NULL) < 0)
+	if (execlp(conf->dynamiclookupcommand, conf->dynamiclookupcommand, arg, NULL) < 0)
 	    debugx(1, DBG_ERR, "dynamicconfig: exec error for command %s", conf->dynamiclookupcommand);
     }
 
     close(fd[1]);
-    pushgconffile(&cf, fdopen(fd[0], "r"), conf->dynamiclookupcommand);
-    ok = getgenericconfig(&cf, NULL, "Server", CONF_CBK, confserver_cb,
-			  (void *) conf, NULL);
-    freegconf(&cf);
+    out = malloc(DYNAMIC_LOOKUP_OUTPUTMAX);
+    while (out && (cnt = read(fd[0], out + *len, DYNAMIC_LOOKUP_OUTPUTMAX - *len)) != 0) {
+	if (cnt < 0) {
+	    if (errno == EINTR)
+		continue;
+	    debugerrno(errno, DBG_ERR, "dynamicconfig: read error");
+	    break;
+	}
+	*len += cnt;
+	if (*len == DYNAMIC_LOOKUP_OUTPUTMAX) {
+	    debug(DBG_ERR, "dynamicconfig: more than %d bytes of output from command %s", DYNAMIC_LOOKUP_OUTPUTMAX, conf->dynamiclookupcommand);
+	    break;
+	}
+    }
+    if (!out || cnt)
+	*len = 0;
+    close(fd[0]);
 
     if (waitpid(pid, &status, 0) < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: wait error");
-	goto errexit;
-    }
-
-    if (status) {
+	*len = 0;
+    } else if (status) {
         debug(DBG_INFO, "dynamicconfig: command exited with status %d",
               WEXITSTATUS(status));
-        goto errexit;
+	*len = 0;
+    }
+    if (!*len) {
+	free(out);
+	out = NULL;
+    } else if ((newout = realloc(out, *len)))
+	out = newout;
+
+exit:
+    pthread_mutex_lock(&dynlookupmutex);
+    dynlookuprunning--;
+    pthread_cond_signal(&dynlookupcond);
+    pthread_mutex_unlock(&dynlookupmutex);
+    return out;
+}
+
+/* reads the server config output by the lookup command into conf. The
+ * output may also give a TTL option, saying for how long it is valid */
+static int dynamicparse(struct clsrvconf *conf, char *out, size_t len, long int *ttl) {
+    struct gconffile *cf = NULL;
+    int ok;
+
+    pushgconffile(&cf, fmemopen(out, len, "r"), conf->dynamiclookupcommand);
+    ok = getgenericconfig(&cf, NULL, "Server", CONF_CBK, confserver_cb,
+			  (void *) conf, "TTL", CONF_LINT, ttl, NULL);
+    freegconf(&cf);
+    return ok;
+}
+
+int dynamicconfig(struct server *server) {
+    struct clsrvconf *conf = server->conf;
+    struct dynlookup *cached;
+    long int ttl = LONG_MIN;
+    char *out;
+    size_t len;
+    int ok;
+
+    /* for now we only learn hostname/address */
+    cached = dynlookupget(server->dynamiclookuparg);
+    if (cached) {
+	debug(DBG_DBG, "dynamicconfig: using cached %s for %s", cached->failed ? "failure" : "server config", server->dynamiclookuparg);
+	ok = !cached->failed && dynamicparse(conf, cached->config, cached->len, &ttl);
+	free(cached);
+	if (ok)
+	    return 1;
+	goto errexit;
     }
 
+    debug(DBG_DBG, "dynamicconfig: need dynamic server config for %s", server->dynamiclookuparg);
+    out = dynamiclookuprun(conf, server->dynamiclookuparg, &len);
+    ok = out && dynamicparse(conf, out, len, &ttl);
+    if (ok && ttl != LONG_MIN) {
+	if (ttl < 0 || ttl > 86400 * 7)
+	    debug(DBG_WARN, "dynamicconfig: ignoring TTL %ld from command %s, must be 0-604800", ttl, conf->dynamiclookupcommand);
+	else
+	    dynlookupput(server->dynamiclookuparg, ttl, out, len);
+    }
+    free(out);
     if (ok)
 	return 1;
+    dynlookupfail(server->dynamiclookuparg);
 
 errexit:
     debug(DBG_WARN, "dynamicconfig: failed to obtain dynamic server config");
@@ -2443,24 +3997,91 @@ struct tlv *extractattr(char *nameval, char vendor_flag) {
 
     if (name < 1 || name > 255)
 	return NULL;
-    a = malloc(sizeof(struct tlv));
+    a = maketlv(name, len, s + 1);
     if (!a)
 	return NULL;
 
-    a->v = (uint8_t *)stringcopy(s + 1, 0);
-    if (!a->v) {
-	free(a);
-	return NULL;
-    }
-    a->t = name;
-    a->l = len;
-
     if (vendor_flag)
  	a = makevendortlv(vendor, a);
 
     return a;
 }
 
+/* splits replacement into literal text and \1 to \9 back-references */
+static int tokenizereplacement(struct modattr *m) {
+    char *r = m->replacement, *start = r;
+    int n = 0;
+
+    m->parts = malloc((strlen(r) + 1) * sizeof(struct modpart));
+    if (!m->parts)
+	return 0;
+    m->nmatch = 0;
+    for (; *r; r++) {
+	if (*r == '\\' && r[1] >= '1' && r[1] <= '9') {
+	    if (r > start) {
+		m->parts[n].s = start;
+		m->parts[n].len = r - start;
+		m->parts[n++].ref = 0;
+	    }
+	    m->parts[n].s = r;
+	    m->parts[n].len = 2;
+	    m->parts[n++].ref = r[1] - '0';
+	    if (r[1] - '0' + 1 > m->nmatch)
+		m->nmatch = r[1] - '0' + 1;
+	    start = ++r + 1;
+	}
+    }
+    if (r > start) {
+	m->parts[n].s = start;
+	m->parts[n].len = r - start;
+	m->parts[n++].ref = 0;
+    }
+    m->nparts = n;
+    return 1;
+}
+
+/* copies the literal part of an extended regex to lit, returns its
+ * length or -1 if it contains anything but plain or escaped characters */
+static int regexliteral(const char *re, size_t len, char *lit) {
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < len; i++) {
+	if (re[i] == '\\') {
+	    /* other escapes are back-references or GNU operators */
+	    if (++i == len || isalnum((unsigned char)re[i]) || strchr("<>`'", re[i]))
+		return -1;
+	} else if (strchr(".[]()*+?{}|^$", re[i]))
+	    return -1;
+	lit[n++] = re[i];
+    }
+    return n;
+}
+
+/* recognises ^(.*)literal$ and ^literal(.*)$ so that the common realm
+ * strip and append rewrites need no regexec */
+static void matchform(struct modattr *m, const char *re) {
+    size_t len = strlen(re);
+    int l;
+
+    m->match = MODATTR_REGEX;
+    if (len < 6 || re[0] != '^' || re[len - 1] != '$' || re[len - 2] == '\\')
+	return;
+    m->literal = malloc(len);
+    if (!m->literal)
+	return;
+    if (!strncmp(re, "^(.*)", 5) && (l = regexliteral(re + 5, len - 6, m->literal)) >= 0)
+	m->match = MODATTR_SUFFIX;
+    else if (len >= 6 && !strcmp(re + len - 5, "(.*)$") && (l = regexliteral(re + 1, len - 6, m->literal)) >= 0)
+	m->match = MODATTR_PREFIX;
+    else {
+	free(m->literal);
+	m->literal = NULL;
+	return;
+    }
+    m->literallen = l;
+}
+
 /* should accept both names and numeric values, only numeric right now */
 struct modattr *extractmodattr(char *nameval) {
     int name = 0;
@@ -2489,7 +4110,7 @@ struct modattr *extractmodattr(char *nameval) {
     *t = '\0';
     t++;
 
-    m = malloc(sizeof(struct modattr));
+    m = calloc(1, sizeof(struct modattr));
     if (!m) {
 	debug(DBG_ERR, "malloc failed");
 	return NULL;
@@ -2504,7 +4125,8 @@ struct modattr *extractmodattr(char *nameval) {
     }
 
     m->regex = malloc(sizeof(regex_t));
-    if (!m->regex) {
+    if (!m->regex || !tokenizereplacement(m)) {
+	free(m->regex);
 	free(m->replacement);
 	free(m);
 	debug(DBG_ERR, "malloc failed");
@@ -2512,62 +4134,84 @@ struct modattr *extractmodattr(char *nameval) {
     }
 
     if (regcomp(m->regex, s, REG_ICASE | REG_EXTENDED)) {
+	free(m->parts);
 	free(m->regex);
 	free(m->replacement);
 	free(m);
 	debug(DBG_ERR, "failed to compile regular expression %s", s);
 	return NULL;
     }
+    /* the regex is kept for values containing NUL */
+    matchform(m, s);
 
     return m;
 }
 
-struct rewrite *getrewrite(char *alt1, char *alt2) {
-    struct rewrite *r;
+/* looks in the config being read, or in the running one for dynamic
+ * servers. The running rewrites are read with confgenlock held since a
+ * reload may swap it meanwhile, they are never freed */
+struct rewrite *getrewrite(char *alt1, char *alt2, uint8_t running) {
+    struct hash *rewriteconfs;
+    struct rewrite *r = NULL;
 
+    if (running)
+	pthread_rwlock_rdlock(&confgenlock);
+    rewriteconfs = running ? confgen->rewriteconfs : loadgen->rewriteconfs;
     if (alt1)
-	if ((r = hash_read(rewriteconfs,  alt1, strlen(alt1))))
-	    return r;
-    if (alt2)
-	if ((r = hash_read(rewriteconfs,  alt2, strlen(alt2))))
-	    return r;
-    return NULL;
+	r = hash_read(rewriteconfs, alt1, strlen(alt1));
+    if (!r && alt2)
+	r = hash_read(rewriteconfs, alt2, strlen(alt2));
+    if (running)
+	pthread_rwlock_unlock(&confgenlock);
+    return r;
 }
 
 void addrewrite(char *value, char **rmattrs, char **rmvattrs, char **addattrs, char **addvattrs, char **modattrs)
 {
     struct rewrite *rewrite = NULL;
-    int i, n;
-    uint8_t *rma = NULL;
-    uint32_t *p, *rmva = NULL;
+    int i, n, nrmva = 0;
+    uint8_t t;
+    uint32_t *rma = NULL, subattr;
+    struct vendorrm key, *vrm, *rmva = NULL;
     struct list *adda = NULL, *moda = NULL;
     struct tlv *a;
     struct modattr *m;
 
     if (rmattrs) {
-	for (n = 0; rmattrs[n]; n++);
-	rma = calloc(n + 1, sizeof(uint8_t));
+	rma = calloc(8, sizeof(uint32_t));
 	if (!rma)
 	    debugx(1, DBG_ERR, "malloc failed");
 
-	for (i = 0; i < n; i++)
-	    if (!(rma[i] = attrname2val(rmattrs[i])))
+	for (i = 0; rmattrs[i]; i++) {
+	    if (!(t = attrname2val(rmattrs[i])))
 		debugx(1, DBG_ERR, "addrewrite: removing invalid attribute %s", rmattrs[i]);
+	    rma[t / 32] |= 1U << (t % 32);
+	}
 	freegconfmstr(rmattrs);
-	rma[i] = 0;
     }
 
     if (rmvattrs) {
 	for (n = 0; rmvattrs[n]; n++);
-	rmva = calloc(2 * n + 1, sizeof(uint32_t));
+	rmva = calloc(n, sizeof(struct vendorrm));
 	if (!rmva)
 	    debugx(1, DBG_ERR, "malloc failed");
 
-	for (p = rmva, i = 0; i < n; i++, p += 2)
-	    if (!vattrname2val(rmvattrs[i], p, p + 1))
+	for (i = 0; i < n; i++) {
+	    if (!vattrname2val(rmvattrs[i], &key.vendor, &subattr))
 		debugx(1, DBG_ERR, "addrewrite: removing invalid vendor attribute %s", rmvattrs[i]);
+	    vrm = bsearch(&key, rmva, nrmva, sizeof(struct vendorrm), vendorrmcmp);
+	    if (!vrm) {
+		vrm = rmva + nrmva++;
+		vrm->vendor = key.vendor;
+		qsort(rmva, nrmva, sizeof(struct vendorrm), vendorrmcmp);
+		vrm = bsearch(&key, rmva, nrmva, sizeof(struct vendorrm), vendorrmcmp);
+	    }
+	    if (subattr == 256)
+		vrm->all = 1;
+	    else
+		vrm->subattrs[subattr / 32] |= 1U << (subattr % 32);
+	}
 	freegconfmstr(rmvattrs);
-	*p = 0;
     }
 
     if (addattrs) {
@@ -2619,11 +4263,12 @@ void addrewrite(char *value, char **rmattrs, char **rmvattrs, char **addattrs, c
 	    debugx(1, DBG_ERR, "malloc failed");
 	rewrite->removeattrs = rma;
 	rewrite->removevendorattrs = rmva;
+	rewrite->nremovevendorattrs = nrmva;
 	rewrite->addattrs = adda;
 	rewrite->modattrs = moda;
     }
 
-    if (!hash_insert(rewriteconfs, value, strlen(value), rewrite))
+    if (!hash_insert(loadgen->rewriteconfs, value, strlen(value), rewrite))
 	debugx(1, DBG_ERR, "malloc failed");
     debug(DBG_DBG, "addrewrite: added rewrite block %s", value);
 }
@@ -2639,6 +4284,8 @@ int setttlattr(struct options *opts, char *defaultattr) {
 }
 
 void freeclsrvconf(struct clsrvconf *conf) {
+    int i;
+
     assert(conf);
     debug(DBG_DBG, "%s: freeing %p (%s)", __func__, conf, conf->name ? conf->name : "incomplete");
     free(conf->name);
@@ -2658,8 +4305,12 @@ void freeclsrvconf(struct clsrvconf *conf) {
 	if (conf->rewriteusername->regex)
 	    regfree(conf->rewriteusername->regex);
 	free(conf->rewriteusername->replacement);
+	free(conf->rewriteusername->parts);
+	free(conf->rewriteusername->literal);
 	free(conf->rewriteusername);
     }
+    for (i = 0; i < REPLY_TEMPLATES; i++)
+	free(conf->replytemplates[i]);
     free(conf->dynamiclookupcommand);
     conf->rewritein=NULL;
     conf->rewriteout=NULL;
@@ -2669,6 +4320,8 @@ void freeclsrvconf(struct clsrvconf *conf) {
 	pthread_mutex_destroy(conf->lock);
 	free(conf->lock);
     }
+    /* scrapes only see the confs of the running generation */
+    metrics_free(conf->metrics);
     /* not touching ssl_ctx, clients and servers */
     free(conf);
 }
@@ -2759,32 +4412,178 @@ int mergesrvconf(struct clsrvconf *dst, struct clsrvconf *src) {
     return 1;
 }
 
-/** Set *AF according to IPV4ONLY and IPV6ONLY:
-    - If both are set, the function fails.
-    - If exactly one is set, *AF is set accordingly.
-    - If none is set, *AF is not affected.
-    Return 0 on success and !0 on failure.
-    In the case of an error, *AF is not affected.  */
-int config_hostaf(const char *desc, int ipv4only, int ipv6only, int *af) {
-    assert(af != NULL);
-    if (ipv4only && ipv6only) {
-	debug(DBG_ERR, "error in block %s, at most one of IPv4Only and "
-              "IPv6Only can be enabled", desc);
-        return -1;
-    }
-    if (ipv4only)
-        *af = AF_INET;
-    if (ipv6only)
-        *af = AF_INET6;
-    return 0;
+/** Set *AF according to IPV4ONLY and IPV6ONLY:
+    - If both are set, the function fails.
+    - If exactly one is set, *AF is set accordingly.
+    - If none is set, *AF is not affected.
+    Return 0 on success and !0 on failure.
+    In the case of an error, *AF is not affected.  */
+int config_hostaf(const char *desc, int ipv4only, int ipv6only, int *af) {
+    assert(af != NULL);
+    if (ipv4only && ipv6only) {
+	debug(DBG_ERR, "error in block %s, at most one of IPv4Only and "
+              "IPv6Only can be enabled", desc);
+        return -1;
+    }
+    if (ipv4only)
+        *af = AF_INET;
+    if (ipv6only)
+        *af = AF_INET6;
+    return 0;
+}
+
+static int samestring(const char *a, const char *b) {
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+/* returns 1 if a and b differ only in options that can be changed while
+ * the client or server is in use */
+static int sameclsrvconf(struct clsrvconf *a, struct clsrvconf *b) {
+    int i;
+
+    if (a->type != b->type || a->hostaf != b->hostaf || a->certnamecheck != b->certnamecheck ||
+	a->connections != b->connections || a->dupcachesize != b->dupcachesize ||
+	a->keepalive != b->keepalive)
+	return 0;
+    if (!samestring(a->name, b->name) || !samestring(a->portsrc, b->portsrc) ||
+	!samestring(a->secret, b->secret) || !samestring(a->tls, b->tls) ||
+	!samestring(a->matchcertattr, b->matchcertattr) ||
+	!samestring(a->confrewriteusername, b->confrewriteusername) ||
+	!samestring(a->dynamiclookupcommand, b->dynamiclookupcommand) ||
+	!samestring(a->fticks_viscountry, b->fticks_viscountry) ||
+	!samestring(a->fticks_visinst, b->fticks_visinst))
+	return 0;
+    if (!a->hostsrc || !b->hostsrc)
+	return a->hostsrc == b->hostsrc;
+    for (i = 0; a->hostsrc[i] && b->hostsrc[i]; i++)
+	if (strcmp(a->hostsrc[i], b->hostsrc[i]))
+	    return 0;
+    return !a->hostsrc[i] && !b->hostsrc[i];
+}
+
+static int listhasdata(struct list *list, void *data) {
+    struct list_node *entry;
+
+    for (entry = list_first(list); entry; entry = list_next(entry))
+	if (entry->data == data)
+	    return 1;
+    return 0;
+}
+
+/* On reload, finds the running config in oldconfs that conf can replace
+ * without disturbing its clients or server connections, and not already
+ * kept in newconfs. The options that may change are taken over from conf
+ * by takeoverclsrvconf() when loadgen is swapped in, since the running
+ * config is in use until then. Returns NULL if there is none. */
+static struct clsrvconf *keepclsrvconf(struct list *oldconfs, struct list *newconfs, struct clsrvconf *conf) {
+    struct list_node *entry;
+    struct clsrvconf *old;
+    struct keptconf *kept;
+
+    for (entry = list_first(oldconfs); entry; entry = list_next(entry)) {
+	old = (struct clsrvconf *)entry->data;
+	if (!sameclsrvconf(old, conf) || listhasdata(newconfs, old))
+	    continue;
+	kept = malloc(sizeof(struct keptconf));
+	if (!kept || !list_push(loadgen->kept, kept))
+	    debugx(1, DBG_ERR, "malloc failed");
+	kept->old = old;
+	kept->conf = conf;
+	debug(DBG_DBG, "keepclsrvconf: keeping %s", old->name);
+	return old;
+    }
+    return NULL;
+}
+
+/* gives a kept conf the options of the conf read for it, with confgenlock
+ * held for writing */
+static void takeoverclsrvconf(struct clsrvconf *old, struct clsrvconf *conf) {
+    old->statusserver = conf->statusserver;
+    old->retryinterval = conf->retryinterval;
+    old->retrycount = conf->retrycount;
+    old->dupinterval = conf->dupinterval;
+    old->addttl = conf->addttl;
+    old->loopprevention = conf->loopprevention;
+    old->ratelimitreject = conf->ratelimitreject;
+    ratelimit_init(&old->ratelimit, conf->ratelimit.rate, conf->ratelimit.burst);
+    /* rewrites are never freed, the old ones may still be in use */
+    old->rewritein = conf->rewritein;
+    old->rewriteout = conf->rewriteout;
+}
+
+/* releases a realm of the config with the references of its server lists */
+static void freeconfrealm(struct realm *realm) {
+    pthread_mutex_lock(&realm->mutex);
+    while (list_shift(realm->srvconfs))
+	freerealm(realm);
+    while (list_shift(realm->accsrvconfs))
+	freerealm(realm);
+    pthread_mutex_unlock(&realm->mutex);
+    freerealm(realm);
+}
+
+static int samesrvconfs(struct list *a, struct list *b) {
+    struct list_node *ea, *eb;
+
+    for (ea = list_first(a), eb = list_first(b); ea && eb; ea = list_next(ea), eb = list_next(eb))
+	if (ea->data != eb->data)
+	    return 0;
+    return !ea && !eb;
+}
+
+/* On reload, replaces realm, just added to realms, with the running realm
+ * of the same name if it has the same servers. This keeps its dynamic
+ * subrealms and counters */
+static void keeprealm(struct list *oldrealms, struct list *realms, struct realm *realm) {
+    struct list_node *entry, *sub;
+    struct realm *old;
+
+    for (entry = list_first(oldrealms); entry; entry = list_next(entry)) {
+	old = (struct realm *)entry->data;
+	if (strcmp(old->name, realm->name) || old->accresp != realm->accresp ||
+	    old->loadbalance != realm->loadbalance ||
+	    !samestring(old->message, realm->message) ||
+	    !samesrvconfs(old->srvconfs, realm->srvconfs) ||
+	    !samesrvconfs(old->accsrvconfs, realm->accsrvconfs) ||
+	    listhasdata(realms, old))
+	    continue;
+	/* the rate limit may change, the dynamic subrealms follow */
+	pthread_mutex_lock(&old->mutex);
+	ratelimit_init(&old->ratelimit, realm->ratelimit.rate, realm->ratelimit.burst);
+	old->ratelimitreject = realm->ratelimitreject;
+	for (sub = list_first(old->subrealms); sub; sub = list_next(sub)) {
+	    ratelimit_init(&((struct realm *)sub->data)->ratelimit, realm->ratelimit.rate, realm->ratelimit.burst);
+	    ((struct realm *)sub->data)->ratelimitreject = realm->ratelimitreject;
+	}
+	pthread_mutex_unlock(&old->mutex);
+	list_removedata(realms, realm);
+	freeconfrealm(realm);
+	if (!list_push(realms, newrealmref(old)))
+	    debugx(1, DBG_ERR, "malloc failed");
+	debug(DBG_DBG, "keeprealm: keeping %s", old->name);
+	return;
+    }
+}
+
+/* checks the RateLimit and RateLimitBurst options of a block, setting
+ * those not given to 0 */
+static void checkratelimit(const char *block, long int *rate, long int *burst) {
+    if (*rate == LONG_MIN)
+	*rate = 0;
+    else if (*rate < 0 || *rate > 1000000)
+	debugx(1, DBG_ERR, "error in block %s, value of option RateLimit is %d, must be 0-1000000", block, *rate);
+    if (*burst == LONG_MIN)
+	*burst = 0;
+    else if (*burst < 1 || *burst > 1000000)
+	debugx(1, DBG_ERR, "error in block %s, value of option RateLimitBurst is %d, must be 1-1000000", block, *burst);
 }
 
 int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
-    struct clsrvconf *conf, *existing;
+    struct clsrvconf *conf, *keepconf;
     char *conftype = NULL, *rewriteinalias = NULL;
-    long int dupinterval = LONG_MIN, addttl = LONG_MIN;
+    long int dupinterval = LONG_MIN, dupcachesize = LONG_MIN, addttl = LONG_MIN;
+    long int ratelimit = LONG_MIN, ratelimitburst = LONG_MIN;
     uint8_t ipv4only = 0, ipv6only = 0;
-    struct list_node *entry;
 
     debug(DBG_DBG, "confclient_cb called for %s", block);
 
@@ -2807,8 +4606,12 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	    "CertificateNameCheck", CONF_BLN, &conf->certnamecheck,
 #endif
 	    "DuplicateInterval", CONF_LINT, &dupinterval,
+	    "DuplicateCacheSize", CONF_LINT, &dupcachesize,
 	    "addTTL", CONF_LINT, &addttl,
         "tcpKeepalive", CONF_BLN, &conf->keepalive,
+	    "RateLimit", CONF_LINT, &ratelimit,
+	    "RateLimitBurst", CONF_LINT, &ratelimitburst,
+	    "RateLimitReject", CONF_BLN, &conf->ratelimitreject,
 	    "rewrite", CONF_STR, &rewriteinalias,
 	    "rewriteIn", CONF_STR, &conf->confrewritein,
 	    "rewriteOut", CONF_STR, &conf->confrewriteout,
@@ -2863,21 +4666,31 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
     } else
 	conf->dupinterval = conf->pdef->duplicateintervaldefault;
 
+    if (dupcachesize != LONG_MIN) {
+	if (dupcachesize < 1 || dupcachesize > 65536)
+	    debugx(1, DBG_ERR, "error in block %s, value of option DuplicateCacheSize is %d, must be 1-65536", block, dupcachesize);
+	conf->dupcachesize = (uint32_t)dupcachesize;
+    } else
+	conf->dupcachesize = DUPLICATE_CACHE_SIZE;
+
     if (addttl != LONG_MIN) {
 	if (addttl < 1 || addttl > 255)
 	    debugx(1, DBG_ERR, "error in block %s, value of option addTTL is %d, must be 1-255", block, addttl);
 	conf->addttl = (uint8_t)addttl;
     }
 
+    checkratelimit(block, &ratelimit, &ratelimitburst);
+    ratelimit_init(&conf->ratelimit, ratelimit, ratelimitburst);
+
     if (!conf->confrewritein)
 	conf->confrewritein = rewriteinalias;
     else
 	free(rewriteinalias);
     conf->rewritein = conf->confrewritein
-        ? getrewrite(conf->confrewritein, NULL)
-        : getrewrite("defaultClient", "default");
+        ? getrewrite(conf->confrewritein, NULL, 0)
+        : getrewrite("defaultClient", "default", 0);
     if (conf->confrewriteout)
-	conf->rewriteout = getrewrite(conf->confrewriteout, NULL);
+	conf->rewriteout = getrewrite(conf->confrewriteout, NULL, 0);
 
     if (conf->confrewriteusername) {
 	conf->rewriteusername = extractmodattr(conf->confrewriteusername);
@@ -2885,9 +4698,8 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	    debugx(1, DBG_ERR, "error in block %s, invalid RewriteAttributeValue", block);
     }
 
-    if (!addhostport(&conf->hostports, conf->hostsrc, conf->pdef->portdefault, 1) ||
-	!resolvehostports(conf->hostports, conf->hostaf, conf->pdef->socktype))
-	debugx(1, DBG_ERR, "%s: resolve failed, exiting", __func__);
+    if (!addhostport(&conf->hostports, conf->hostsrc, conf->pdef->portdefault, 1))
+	debugx(1, DBG_ERR, "error in block %s, failed to parse %s", block, *conf->hostsrc);
 
     if (!conf->secret) {
 	if (!conf->pdef->secretdefault)
@@ -2896,18 +4708,15 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	if (!conf->secret)
 	    debugx(1, DBG_ERR, "malloc failed");
     }
+    setsecretmd5(conf);
 
-    if (conf->tlsconf) {
-        for (entry = list_first(clconfs); entry; entry = list_next(entry)) {
-            existing = (struct clsrvconf *)entry->data;
-
-            if (existing->type == conf->type &&
-                existing->tlsconf != conf->tlsconf &&
-                hostportmatches(existing->hostports, conf->hostports, 0)) {
-
-                debugx(1, DBG_ERR, "error in block %s, overlapping clients must reference the same tls block", block);
-            }
-        }
+    if (confgen) {
+	keepconf = keepclsrvconf(confgen->clconfs, loadgen->clconfs, conf);
+	if (keepconf) {
+	    if (!list_push(loadgen->clconfs, keepconf))
+		debugx(1, DBG_ERR, "malloc failed");
+	    return 1;
+	}
     }
 
     conf->lock = malloc(sizeof(pthread_mutex_t));
@@ -2915,12 +4724,16 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	debugx(1, DBG_ERR, "malloc failed");
 
     pthread_mutex_init(conf->lock, NULL);
-    if (!list_push(clconfs, conf))
+    conf->metrics = metrics_create();
+    if (!conf->metrics || !list_push(loadgen->clconfs, conf) ||
+	!list_push(loadgen->unresolved, conf))
 	debugx(1, DBG_ERR, "malloc failed");
     return 1;
 }
 
-int compileserverconfig(struct clsrvconf *conf, const char *block) {
+/* resolving is left to resolveconfs() unless resolve is set, as for
+ * dynamic servers that are compiled at run time */
+int compileserverconfig(struct clsrvconf *conf, const char *block, uint8_t resolve) {
 #if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
     if (conf->type == RAD_TLS || conf->type == RAD_DTLS) {
     	conf->tlsconf = conf->tls
@@ -2951,17 +4764,17 @@ int compileserverconfig(struct clsrvconf *conf, const char *block) {
 	conf->retrycount = conf->pdef->retrycountdefault;
 
     conf->rewritein = conf->confrewritein
-        ? getrewrite(conf->confrewritein, NULL)
-        : getrewrite("defaultServer", "default");
+        ? getrewrite(conf->confrewritein, NULL, resolve)
+        : getrewrite("defaultServer", "default", resolve);
     if (conf->confrewriteout)
-	conf->rewriteout = getrewrite(conf->confrewriteout, NULL);
+	conf->rewriteout = getrewrite(conf->confrewriteout, NULL, resolve);
 
     if (!addhostport(&conf->hostports, conf->hostsrc, conf->portsrc, 0)) {
 	debug(DBG_ERR, "error in block %s, failed to parse %s", block, *conf->hostsrc);
 	return 0;
     }
 
-    if (!conf->dynamiclookupcommand &&
+    if (resolve && !conf->dynamiclookupcommand &&
         !resolvehostports(conf->hostports, conf->hostaf,
                           conf->pdef->socktype)) {
 	debug(DBG_ERR, "%s: resolve failed", __func__);
@@ -2971,9 +4784,9 @@ int compileserverconfig(struct clsrvconf *conf, const char *block) {
 }
 
 int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
-    struct clsrvconf *conf, *resconf;
+    struct clsrvconf *conf, *resconf, *keepconf;
     char *conftype = NULL, *rewriteinalias = NULL, *statusserver = NULL;
-    long int retryinterval = LONG_MIN, retrycount = LONG_MIN, addttl = LONG_MIN;
+    long int retryinterval = LONG_MIN, retrycount = LONG_MIN, addttl = LONG_MIN, connections = LONG_MIN;
     uint8_t ipv4only = 0, ipv6only = 0, confmerged = 0;
 
     debug(DBG_DBG, "confserver_cb called for %s", block);
@@ -3013,6 +4826,7 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 			  "StatusServer", CONF_STR, &statusserver,
 			  "RetryInterval", CONF_LINT, &retryinterval,
 			  "RetryCount", CONF_LINT, &retrycount,
+			  "Connections", CONF_LINT, &connections,
 			  "DynamicLookupCommand", CONF_STR, &conf->dynamiclookupcommand,
 			  "LoopPrevention", CONF_BLN, &conf->loopprevention,
 			  NULL
@@ -3086,6 +4900,15 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	conf->addttl = (uint8_t)addttl;
     }
 
+    conf->connections = 1;
+    if (connections != LONG_MIN) {
+	if (connections < 1 || connections > 16) {
+	    debug(DBG_ERR, "error in block %s, value of option Connections is %d, must be 1-16", block, connections);
+	    goto errexit;
+	}
+	conf->connections = (uint8_t)connections;
+    }
+
     if (statusserver) {
         if (strcasecmp(statusserver, "Off") == 0)
             conf->statusserver = RSP_STATSRV_OFF;
@@ -3112,7 +4935,7 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
     }
 
     if (resconf || !conf->dynamiclookupcommand) {
-	if (!compileserverconfig(conf, block))
+	if (!compileserverconfig(conf, block, resconf != NULL))
             goto errexit;
     }
 
@@ -3127,14 +4950,31 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	    goto errexit;
 	}
     }
+    setsecretmd5(conf);
 
     if (resconf)
 	return 1;
 
-    if (!list_push(srvconfs, conf)) {
+    if (confgen) {
+	keepconf = keepclsrvconf(confgen->srvconfs, loadgen->srvconfs, conf);
+	if (keepconf) {
+	    if (!list_push(loadgen->srvconfs, keepconf)) {
+		debug(DBG_ERR, "malloc failed");
+		return 0;
+	    }
+	    return 1;
+	}
+    }
+
+    conf->metrics = metrics_create();
+    if (!conf->metrics || !list_push(loadgen->srvconfs, conf)) {
 	debug(DBG_ERR, "malloc failed");
 	goto errexit;
     }
+    if (!conf->dynamiclookupcommand && !list_push(loadgen->unresolved, conf)) {
+	debug(DBG_ERR, "malloc failed");
+	return 0;
+    }
     return 1;
 
 errexit:
@@ -3147,8 +4987,11 @@ errexit:
 }
 
 int confrealm_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
-    char **servers = NULL, **accservers = NULL, *msg = NULL;
-    uint8_t accresp = 0;
+    char **servers = NULL, **accservers = NULL, *msg = NULL, *lb = NULL;
+    uint8_t accresp = 0, ratelimitreject = 0;
+    long int ratelimit = LONG_MIN, ratelimitburst = LONG_MIN;
+    enum rsp_loadbalance loadbalance = RSP_LB_PRIORITY;
+    struct realm *realm;
 
     debug(DBG_DBG, "confrealm_cb called for %s", block);
 
@@ -3157,11 +5000,37 @@ int confrealm_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 			  "accountingServer", CONF_MSTR, &accservers,
 			  "ReplyMessage", CONF_STR, &msg,
 			  "AccountingResponse", CONF_BLN, &accresp,
+			  "LoadBalance", CONF_STR, &lb,
+			  "RateLimit", CONF_LINT, &ratelimit,
+			  "RateLimitBurst", CONF_LINT, &ratelimitburst,
+			  "RateLimitReject", CONF_BLN, &ratelimitreject,
 			  NULL
 	    ))
 	debugx(1, DBG_ERR, "configuration error");
 
-    addrealm(realms, val, servers, accservers, msg, accresp);
+    if (lb) {
+	if (strcasecmp(lb, "Priority") == 0)
+	    loadbalance = RSP_LB_PRIORITY;
+	else if (strcasecmp(lb, "LeastOutstanding") == 0)
+	    loadbalance = RSP_LB_LEASTOUTSTANDING;
+	else if (strcasecmp(lb, "RTT") == 0)
+	    loadbalance = RSP_LB_RTT;
+	else if (strcasecmp(lb, "Hash") == 0)
+	    loadbalance = RSP_LB_HASH;
+	else
+	    debugx(1, DBG_ERR, "error in block %s, invalid LoadBalance value %s, must be Priority, LeastOutstanding, RTT or Hash", block, lb);
+	free(lb);
+    }
+    checkratelimit(block, &ratelimit, &ratelimitburst);
+
+    realm = addrealm(loadgen->realms, val, servers, accservers, msg, accresp);
+    if (realm) {
+	realm->loadbalance = loadbalance;
+	ratelimit_init(&realm->ratelimit, ratelimit, ratelimitburst);
+	realm->ratelimitreject = ratelimitreject;
+    }
+    if (realm && confgen)
+	keeprealm(confgen->realms, loadgen->realms, realm);
     return 1;
 }
 
@@ -3185,7 +5054,25 @@ int confrewrite_cb(struct gconffile **cf, void *arg, char *block, char *opt, cha
     return 1;
 }
 
-int setprotoopts(uint8_t type, char **listenargs, char *sourcearg) {
+/* indexes the addresses of the configs of each protocol, in list order */
+static void buildconfindexes(struct list *confs, struct hostportindex **indexes) {
+    struct list_node *entry;
+    struct clsrvconf *conf;
+    int i;
+
+    for (i = 0; i < RAD_PROTOCOUNT; i++) {
+	indexes[i] = hostportindex_create();
+	if (!indexes[i])
+	    debugx(1, DBG_ERR, "malloc failed");
+    }
+    for (entry = list_first(confs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (!hostportindex_add(indexes[conf->type], conf->hostports, entry))
+	    debugx(1, DBG_ERR, "malloc failed");
+    }
+}
+
+int setprotoopts(uint8_t type, char **listenargs, char **listenbatchargs, char *sourcearg) {
     struct commonprotoopts *protoopts;
 
     protoopts = malloc(sizeof(struct commonprotoopts));
@@ -3193,15 +5080,24 @@ int setprotoopts(uint8_t type, char **listenargs, char *sourcearg) {
 	return 0;
     memset(protoopts, 0, sizeof(struct commonprotoopts));
     protoopts->listenargs = listenargs;
+    protoopts->listenbatchargs = listenbatchargs;
     protoopts->sourcearg = sourcearg;
     protodefs[type]->setprotoopts(protoopts);
     return 1;
 }
 
-void getmainconfig(const char *configfile) {
-    long int addttl = LONG_MIN, loglevel = LONG_MIN;
+/* reads configfile into opts and the clients, servers, realms and rewrites
+ * into loadgen. On reload, the listen and F-Ticks options are not used */
+static void readmainconfig(const char *configfile, struct options *opts, uint8_t reload) {
+    long int addttl = LONG_MIN, loglevel = LONG_MIN, listenudpthreads = LONG_MIN;
+    long int eventloopworkers = LONG_MIN, dynamiclookupconcurrency = LONG_MIN;
+    long int requestworkers = LONG_MIN;
+    long int logqueuesize = LONG_MIN, writecoalescedelay = LONG_MIN;
+    long int replyqueuehigh = LONG_MIN, replyqueuelow = LONG_MIN;
+    long int logslowrequests = LONG_MIN;
     struct gconffile *cfs;
     char **listenargs[RAD_PROTOCOUNT];
+    char **listenbatchargs[RAD_PROTOCOUNT];
     char *sourcearg[RAD_PROTOCOUNT];
     char *log_mac_str = NULL;
     char *log_key_str = NULL;
@@ -3211,31 +5107,18 @@ void getmainconfig(const char *configfile) {
     int i;
 
     cfs = openconfigfile(configfile);
-    memset(&options, 0, sizeof(options));
+    memset(opts, 0, sizeof(struct options));
     memset(&listenargs, 0, sizeof(listenargs));
+    memset(&listenbatchargs, 0, sizeof(listenbatchargs));
     memset(&sourcearg, 0, sizeof(sourcearg));
-    options.logfullusername = 1;
-
-    clconfs = list_create();
-    if (!clconfs)
-	debugx(1, DBG_ERR, "malloc failed");
-
-    srvconfs = list_create();
-    if (!srvconfs)
-	debugx(1, DBG_ERR, "malloc failed");
-
-    realms = list_create();
-    if (!realms)
-	debugx(1, DBG_ERR, "malloc failed");
-
-    rewriteconfs = hash_create();
-    if (!rewriteconfs)
-	debugx(1, DBG_ERR, "malloc failed");
+    opts->logfullusername = 1;
 
     if (!getgenericconfig(
 	    &cfs, NULL,
 #ifdef RADPROT_UDP
 	    "ListenUDP", CONF_MSTR, &listenargs[RAD_UDP],
+	    "ListenUDPBatch", CONF_MSTR, &listenbatchargs[RAD_UDP],
+	    "ListenUDPThreads", CONF_LINT, &listenudpthreads,
 	    "SourceUDP", CONF_STR, &sourcearg[RAD_UDP],
 #endif
 #ifdef RADPROT_TCP
@@ -3250,16 +5133,28 @@ void getmainconfig(const char *configfile) {
 	    "ListenDTLS", CONF_MSTR, &listenargs[RAD_DTLS],
 	    "SourceDTLS", CONF_STR, &sourcearg[RAD_DTLS],
 #endif
-            "PidFile", CONF_STR, &options.pidfile,
-	    "TTLAttribute", CONF_STR, &options.ttlattr,
+#if defined(RADPROT_TCP) || defined(RADPROT_TLS)
+	    "EventLoopWorkers", CONF_LINT, &eventloopworkers,
+	    "WriteCoalesceDelay", CONF_LINT, &writecoalescedelay,
+#endif
+	    "RequestWorkers", CONF_LINT, &requestworkers,
+	    "DynamicLookupConcurrency", CONF_LINT, &dynamiclookupconcurrency,
+	    "ListenMetrics", CONF_STR, &opts->listenmetrics,
+	    "DynamicLookupCacheFile", CONF_STR, &opts->dynamiclookupcachefile,
+            "PidFile", CONF_STR, &opts->pidfile,
+	    "TTLAttribute", CONF_STR, &opts->ttlattr,
 	    "addTTL", CONF_LINT, &addttl,
 	    "LogLevel", CONF_LINT, &loglevel,
-	    "LogDestination", CONF_STR, &options.logdestination,
-        "LogThreadId", CONF_BLN, &options.logtid,
+	    "LogDestination", CONF_STR, &opts->logdestination,
+	    "LogQueueSize", CONF_LINT, &logqueuesize,
+	    "ReplyQueueHighWatermark", CONF_LINT, &replyqueuehigh,
+	    "ReplyQueueLowWatermark", CONF_LINT, &replyqueuelow,
+        "LogThreadId", CONF_BLN, &opts->logtid,
         "LogMAC", CONF_STR, &log_mac_str,
         "LogKey", CONF_STR, &log_key_str,
-        "LogFullUsername", CONF_BLN, &options.logfullusername,
-	    "LoopPrevention", CONF_BLN, &options.loopprevention,
+        "LogFullUsername", CONF_BLN, &opts->logfullusername,
+        "LogSlowRequests", CONF_LINT, &logslowrequests,
+	    "LoopPrevention", CONF_BLN, &opts->loopprevention,
 	    "Client", CONF_CBK, confclient_cb, NULL,
 	    "Server", CONF_CBK, confserver_cb, NULL,
 	    "Realm", CONF_CBK, confrealm_cb, NULL,
@@ -3270,10 +5165,10 @@ void getmainconfig(const char *configfile) {
 	    "FTicksReporting", CONF_STR, &fticks_reporting_str,
 	    "FTicksMAC", CONF_STR, &fticks_mac_str,
 	    "FTicksKey", CONF_STR, &fticks_key_str,
-	    "FTicksSyslogFacility", CONF_STR, &options.ftickssyslogfacility,
-        "FTicksPrefix", CONF_STR, &options.fticksprefix,
-        "IPv4Only", CONF_BLN, &options.ipv4only,
-        "IPv6Only", CONF_BLN, &options.ipv6only,
+	    "FTicksSyslogFacility", CONF_STR, &opts->ftickssyslogfacility,
+        "FTicksPrefix", CONF_STR, &opts->fticksprefix,
+        "IPv4Only", CONF_BLN, &opts->ipv4only,
+        "IPv6Only", CONF_BLN, &opts->ipv6only,
 	    NULL
 	    ))
 	debugx(1, DBG_ERR, "configuration error");
@@ -3281,51 +5176,296 @@ void getmainconfig(const char *configfile) {
     if (loglevel != LONG_MIN) {
 	if (loglevel < 1 || loglevel > 5)
 	    debugx(1, DBG_ERR, "error in %s, value of option LogLevel is %d, must be 1, 2, 3, 4 or 5", configfile, loglevel);
-	options.loglevel = (uint8_t)loglevel;
+	opts->loglevel = (uint8_t)loglevel;
     }
     if (log_mac_str != NULL) {
         if (strcasecmp(log_mac_str, "Static") == 0)
-            options.log_mac = RSP_MAC_STATIC;
+            opts->log_mac = RSP_MAC_STATIC;
         else if (strcasecmp(log_mac_str, "Original") == 0)
-            options.log_mac = RSP_MAC_ORIGINAL;
+            opts->log_mac = RSP_MAC_ORIGINAL;
         else if (strcasecmp(log_mac_str, "VendorHashed") == 0)
-            options.log_mac = RSP_MAC_VENDOR_HASHED;
+            opts->log_mac = RSP_MAC_VENDOR_HASHED;
         else if (strcasecmp(log_mac_str, "VendorKeyHashed") == 0)
-            options.log_mac = RSP_MAC_VENDOR_KEY_HASHED;
+            opts->log_mac = RSP_MAC_VENDOR_KEY_HASHED;
         else if (strcasecmp(log_mac_str, "FullyHashed") == 0)
-            options.log_mac = RSP_MAC_FULLY_HASHED;
+            opts->log_mac = RSP_MAC_FULLY_HASHED;
         else if (strcasecmp(log_mac_str, "FullyKeyHashed") == 0)
-            options.log_mac = RSP_MAC_FULLY_KEY_HASHED;
+            opts->log_mac = RSP_MAC_FULLY_KEY_HASHED;
         else {
             debugx(1, DBG_ERR, "config error: invalid LogMAC value: %s", log_mac_str);
         }
         if (log_key_str != NULL) {
-            options.log_key = (uint8_t *)log_key_str;
-        } else if ((options.log_mac == RSP_MAC_VENDOR_KEY_HASHED
-                 || options.log_mac == RSP_MAC_FULLY_KEY_HASHED)) {
+            opts->log_key = (uint8_t *)log_key_str;
+        } else if ((opts->log_mac == RSP_MAC_VENDOR_KEY_HASHED
+                 || opts->log_mac == RSP_MAC_FULLY_KEY_HASHED)) {
             debugx(1, DBG_ERR, "config error: LogMAC %s requires LogKey to be set.", log_mac_str);
         }
         free(log_mac_str);
     } else {
-        options.log_mac = RSP_MAC_ORIGINAL;
+        opts->log_mac = RSP_MAC_ORIGINAL;
+    }
+
+    if (listenudpthreads != LONG_MIN) {
+	if (listenudpthreads < 1 || listenudpthreads > 64)
+	    debugx(1, DBG_ERR, "error in %s, value of option ListenUDPThreads is %d, must be 1-64", configfile, listenudpthreads);
+#ifndef SO_REUSEPORT
+	if (listenudpthreads > 1)
+	    debugx(1, DBG_ERR, "error in %s, ListenUDPThreads requires SO_REUSEPORT, not available on this platform", configfile);
+#endif
+	opts->listenudpthreads = (uint8_t)listenudpthreads;
+    }
+
+    if (eventloopworkers != LONG_MIN) {
+	if (eventloopworkers < 0 || eventloopworkers > 64)
+	    debugx(1, DBG_ERR, "error in %s, value of option EventLoopWorkers is %d, must be 0-64", configfile, eventloopworkers);
+	opts->eventloopworkers = (uint8_t)eventloopworkers;
+    }
+
+    if (requestworkers != LONG_MIN) {
+	if (requestworkers < 0 || requestworkers > 64)
+	    debugx(1, DBG_ERR, "error in %s, value of option RequestWorkers is %d, must be 0-64", configfile, requestworkers);
+	opts->requestworkers = (uint8_t)requestworkers;
+    }
+
+    if (writecoalescedelay != LONG_MIN) {
+	if (writecoalescedelay < 0 || writecoalescedelay > 100)
+	    debugx(1, DBG_ERR, "error in %s, value of option WriteCoalesceDelay is %d, must be 0-100", configfile, writecoalescedelay);
+	opts->writecoalescedelay = (uint8_t)writecoalescedelay;
+    }
+
+    if (dynamiclookupconcurrency != LONG_MIN) {
+	if (dynamiclookupconcurrency < 1 || dynamiclookupconcurrency > 1024)
+	    debugx(1, DBG_ERR, "error in %s, value of option DynamicLookupConcurrency is %d, must be 1-1024", configfile, dynamiclookupconcurrency);
+	opts->dynamiclookupconcurrency = (uint16_t)dynamiclookupconcurrency;
+    } else
+	opts->dynamiclookupconcurrency = DYNAMIC_LOOKUP_CONCURRENCY;
+
+    if (logqueuesize != LONG_MIN) {
+	if (logqueuesize < 0 || logqueuesize > 65536)
+	    debugx(1, DBG_ERR, "error in %s, value of option LogQueueSize is %d, must be 0-65536", configfile, logqueuesize);
+	opts->logqueuesize = (uint32_t)logqueuesize;
+    } else
+	opts->logqueuesize = LOG_QUEUE_SIZE;
+
+    if (replyqueuehigh != LONG_MIN) {
+	if (replyqueuehigh < 0 || replyqueuehigh > 65536)
+	    debugx(1, DBG_ERR, "error in %s, value of option ReplyQueueHighWatermark is %d, must be 0-65536", configfile, replyqueuehigh);
+	opts->replyqueuehigh = (uint32_t)replyqueuehigh;
+    } else
+	opts->replyqueuehigh = REPLY_QUEUE_HIGH;
+    if (replyqueuelow != LONG_MIN) {
+	if (replyqueuelow < 0 || (opts->replyqueuehigh && replyqueuelow >= opts->replyqueuehigh))
+	    debugx(1, DBG_ERR, "error in %s, value of option ReplyQueueLowWatermark is %d, must be 0-%d", configfile, replyqueuelow, opts->replyqueuehigh ? opts->replyqueuehigh - 1 : 0);
+	opts->replyqueuelow = (uint32_t)replyqueuelow;
+    } else
+	opts->replyqueuelow = opts->replyqueuehigh / 2;
+
+    if (logslowrequests != LONG_MIN) {
+	if (logslowrequests < 0 || logslowrequests > 600000)
+	    debugx(1, DBG_ERR, "error in %s, value of option LogSlowRequests is %d, must be 0-600000", configfile, logslowrequests);
+	opts->logslowrequests = (uint32_t)logslowrequests;
     }
 
     if (addttl != LONG_MIN) {
 	if (addttl < 1 || addttl > 255)
 	    debugx(1, DBG_ERR, "error in %s, value of option addTTL is %d, must be 1-255", configfile, addttl);
-	options.addttl = (uint8_t)addttl;
+	opts->addttl = (uint8_t)addttl;
     }
-    if (!setttlattr(&options, DEFAULT_TTL_ATTR))
+    if (!setttlattr(opts, DEFAULT_TTL_ATTR))
     	debugx(1, DBG_ERR, "Failed to set TTLAttribute, exiting");
 
-    if (!options.fticksprefix)
-        options.fticksprefix = DEFAULT_FTICKS_PREFIX;
-    fticks_configure(&options, &fticks_reporting_str, &fticks_mac_str,
+    if (reload) {
+	for (i = 0; i < RAD_PROTOCOUNT; i++) {
+	    freegconfmstr(listenargs[i]);
+	    freegconfmstr(listenbatchargs[i]);
+	    free(sourcearg[i]);
+	}
+	free(fticks_reporting_str);
+	free(fticks_mac_str);
+	free(fticks_key_str);
+	return;
+    }
+
+    if (!opts->fticksprefix)
+        opts->fticksprefix = DEFAULT_FTICKS_PREFIX;
+    fticks_configure(opts, &fticks_reporting_str, &fticks_mac_str,
 		     &fticks_key_str);
 
     for (i = 0; i < RAD_PROTOCOUNT; i++)
-	if (listenargs[i] || sourcearg[i])
-	    setprotoopts(i, listenargs[i], sourcearg[i]);
+	if (listenargs[i] || listenbatchargs[i] || sourcearg[i])
+	    setprotoopts(i, listenargs[i], listenbatchargs[i], sourcearg[i]);
+}
+
+static struct confgen *newconfgen() {
+    static uint32_t lastid;
+    struct confgen *gen;
+
+    gen = malloc(sizeof(struct confgen));
+    if (!gen)
+	debugx(1, DBG_ERR, "malloc failed");
+    memset(gen, 0, sizeof(struct confgen));
+    gen->id = ++lastid;
+    gen->clconfs = list_create();
+    gen->srvconfs = list_create();
+    gen->realms = list_create();
+    gen->rewriteconfs = hash_create();
+    gen->unresolved = list_create();
+    gen->kept = list_create();
+    if (!gen->clconfs || !gen->srvconfs || !gen->realms || !gen->rewriteconfs ||
+	!gen->unresolved || !gen->kept)
+	debugx(1, DBG_ERR, "malloc failed");
+    return gen;
+}
+
+struct resolvejob {
+    struct clsrvconf **confs;
+    uint32_t n, next;
+    struct clsrvconf *failed;
+};
+
+static void *resolvejobs(void *arg) {
+    struct resolvejob *job = (struct resolvejob *)arg;
+    struct clsrvconf *conf;
+    uint32_t i;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+	conf = job->confs[i];
+	if (!resolvehostports(conf->hostports, conf->hostaf, conf->pdef->socktype))
+	    __sync_bool_compare_and_swap(&job->failed, NULL, conf);
+    }
+    return NULL;
+}
+
+/* resolves the hosts of the confs new to gen. getaddrinfo() blocks, so
+ * with many servers this is done by up to RESOLVE_THREADS threads */
+static void resolveconfs(struct confgen *gen) {
+    struct resolvejob job;
+    pthread_t th[RESOLVE_THREADS - 1];
+    struct list_node *entry;
+    int i, n;
+
+    memset(&job, 0, sizeof(job));
+    job.confs = malloc(list_count(gen->unresolved) * sizeof(struct clsrvconf *) + 1);
+    if (!job.confs)
+	debugx(1, DBG_ERR, "malloc failed");
+    for (entry = list_first(gen->unresolved); entry; entry = list_next(entry))
+	job.confs[job.n++] = (struct clsrvconf *)entry->data;
+    list_free(gen->unresolved);
+    gen->unresolved = NULL;
+
+    for (n = 0; n < RESOLVE_THREADS - 1 && n + 1 < (int)job.n; n++)
+	if (pthread_create(&th[n], &pthread_attr, resolvejobs, (void *)&job))
+	    break;
+    resolvejobs(&job);
+    for (i = 0; i < n; i++)
+	pthread_join(th[i], NULL);
+    free(job.confs);
+    if (job.failed)
+	debugx(1, DBG_ERR, "%s: resolve failed for %s, exiting", __func__, job.failed->name);
+    debug(DBG_DBG, "%s: resolved %u confs with %d threads", __func__, job.n, n + 1);
+}
+
+/* needs the addresses of the clients, so done once they are resolved */
+static void checkclientoverlaps(struct list *clconfs) {
+    struct list_node *entry, *prev;
+    struct clsrvconf *conf, *existing;
+
+    for (entry = list_first(clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (!conf->tlsconf)
+	    continue;
+	for (prev = list_first(clconfs); prev != entry; prev = list_next(prev)) {
+	    existing = (struct clsrvconf *)prev->data;
+	    if (existing->type == conf->type &&
+		existing->tlsconf != conf->tlsconf &&
+		hostportmatches(existing->hostports, conf->hostports, 0))
+		debugx(1, DBG_ERR, "error in block client %s, overlapping clients must reference the same tls block", conf->name);
+	}
+    }
+}
+
+static void indexconfgen(struct confgen *gen) {
+    gen->realmindex = buildrealmindex(gen->realms);
+    if (!gen->realmindex)
+	debugx(1, DBG_ERR, "failed to index realms, exiting");
+    buildconfindexes(gen->clconfs, gen->clconfindex);
+    buildconfindexes(gen->srvconfs, gen->srvconfindex);
+}
+
+/* frees the lists and indexes of gen, but not what they hold. The rewrites
+ * are kept since dynamic servers may still use them */
+static void freeconfgen(struct confgen *gen) {
+    int i;
+
+    if (!gen)
+	return;
+    list_free(gen->clconfs);
+    list_free(gen->srvconfs);
+    list_free(gen->realms);
+    list_free(gen->unresolved);
+    list_free(gen->kept);
+    freerealmindex(gen->realmindex);
+    for (i = 0; i < RAD_PROTOCOUNT; i++) {
+	hostportindex_free(gen->clconfindex[i]);
+	hostportindex_free(gen->srvconfindex[i]);
+    }
+    free(gen);
+}
+
+/* restarts the clock for the next phase */
+static void startphase() {
+    clock_gettime(CLOCK_MONOTONIC, &phasestart);
+}
+
+/* adds the time since the last phase ended to phase */
+static void endphase(enum startupphase phase) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    phasems[phase] += (now.tv_sec - phasestart.tv_sec) * 1000 +
+	(now.tv_nsec - phasestart.tv_nsec) / 1000000;
+    phasestart = now;
+}
+
+/* logs how long the first n phases took */
+static void logphases(const char *who, int n) {
+    char buf[256];
+    int i, len = 0;
+    uint32_t total = 0;
+
+    for (i = 0; i < n && len < (int)sizeof(buf); i++) {
+	total += phasems[i];
+	len += snprintf(buf + len, sizeof(buf) - len, "%s%s %u ms", i ? ", " : "", phasenames[i], phasems[i]);
+    }
+    debug(DBG_INFO, "%s: took %u ms: %s", who, total, buf);
+}
+
+/* reads configfile into loadgen and gets it ready to be swapped in */
+static void loadconfig(const char *configfile, struct options *opts, uint8_t reload) {
+    memset(phasems, 0, sizeof(phasems));
+    startphase();
+    loadgen = newconfgen();
+    readmainconfig(configfile, opts, reload);
+    endphase(PHASE_CONFIG);
+    resolveconfs(loadgen);
+    checkclientoverlaps(loadgen->clconfs);
+    endphase(PHASE_RESOLVE);
+    indexconfgen(loadgen);
+    endphase(PHASE_INDEX);
+}
+
+void getmainconfig(const char *configfile) {
+    loadconfig(configfile, &options, 0);
+    confgen = loadgen;
+    loadgen = NULL;
+}
+
+/* sets up the protocols, needed before reading the config */
+void initprotodefs() {
+    int i;
+
+    for (i = 0; i < RAD_PROTOCOUNT; i++)
+	protodefs[i] = protoinits[i](i);
 }
 
 void getargs(int argc, char **argv, uint8_t *foreground, uint8_t *pretend, uint8_t *loglevel, char **configfile, char **pidfile) {
@@ -3394,6 +5534,261 @@ int daemon(int a, int b) {
 }
 #endif
 
+/* Runs ourselves with -p on the config, since reading a config with errors
+ * exits. Returns 1 if the config is OK, else logs the errors the check
+ * printed and returns 0 */
+static int checkconfig() {
+    int fd[2], status;
+    pid_t pid;
+    FILE *f;
+    char line[1024];
+
+    if (pipe(fd) < 0) {
+	debugerrno(errno, DBG_ERR, "checkconfig: pipe error");
+	return 0;
+    }
+    pid = fork();
+    if (pid < 0) {
+	debugerrno(errno, DBG_ERR, "checkconfig: fork error");
+	close(fd[0]);
+	close(fd[1]);
+	return 0;
+    } else if (pid == 0) {
+	/* child */
+	close(fd[0]);
+	dup2(fd[1], STDOUT_FILENO);
+	dup2(fd[1], STDERR_FILENO);
+	if (fd[1] != STDOUT_FILENO && fd[1] != STDERR_FILENO)
+	    close(fd[1]);
+	execlp(reloadbinary, reloadbinary, "-f", "-p", "-d", "1", "-c", reloadconfigfile, NULL);
+	_exit(1);
+    }
+
+    close(fd[1]);
+    f = fdopen(fd[0], "r");
+    if (!f)
+	close(fd[0]);
+    /* only errors are printed, but the last line says all is OK */
+    while (f && fgets(line, sizeof(line), f)) {
+	line[strcspn(line, "\n")] = '\0';
+	if (*line && !strstr(line, "only pretending"))
+	    debug(DBG_ERR, "checkconfig: %s", line);
+    }
+    if (f)
+	fclose(f);
+
+    if (waitpid(pid, &status, 0) < 0) {
+	debugerrno(errno, DBG_ERR, "checkconfig: wait error");
+	return 0;
+    }
+    return !status;
+}
+
+static void retireconf(struct clsrvconf *conf) {
+    struct retiredconf *retired;
+
+    conf->retired = 1;
+    if (!retiredconfs && !(retiredconfs = list_create()))
+	debugx(1, DBG_ERR, "malloc failed");
+    retired = malloc(sizeof(struct retiredconf));
+    if (!retired || !list_push(retiredconfs, retired))
+	debugx(1, DBG_ERR, "malloc failed");
+    retired->conf = conf;
+    retired->at = time(NULL);
+}
+
+/* returns 1 if a realm in realms sends requests to conf */
+static int realmsuseconf(struct list *realms, struct clsrvconf *conf) {
+    struct list_node *entry;
+    struct realm *realm;
+
+    for (entry = list_first(realms); entry; entry = list_next(entry)) {
+	realm = (struct realm *)entry->data;
+	if (listhasdata(realm->srvconfs, conf) || listhasdata(realm->accsrvconfs, conf))
+	    return 1;
+    }
+    return 0;
+}
+
+/* frees the retired confs with no clients or servers left, the servers
+ * of a dynamic server block going with the realms in retiredrealms.
+ * retiredrealmslock must be held */
+static void freeretiredconfs() {
+    struct list_node *entry, *next;
+    struct retiredconf *retired;
+    struct clsrvconf *conf;
+    time_t now = time(NULL);
+    int inuse;
+
+    for (entry = list_first(retiredconfs); entry; entry = next) {
+	next = list_next(entry);
+	retired = (struct retiredconf *)entry->data;
+	conf = retired->conf;
+	if (now - retired->at < RETIRED_CONF_GRACE)
+	    continue;
+	inuse = __atomic_load_n(&conf->nservers, __ATOMIC_ACQUIRE) || realmsuseconf(retiredrealms, conf);
+	if (!inuse && conf->lock) {
+	    pthread_mutex_lock(conf->lock);
+	    inuse = list_first(conf->clients) != NULL;
+	    pthread_mutex_unlock(conf->lock);
+	}
+	if (inuse)
+	    continue;
+	list_removedata(retiredconfs, retired);
+	free(retired);
+	list_free(conf->clients);
+	freeclsrvconf(conf);
+    }
+}
+
+/* Rereads the config on SIGHUP. Clients, servers and realms that did not
+ * change are kept as they are, with their connections, dynamic subrealms
+ * and counters. The others are replaced. Requests are routed with the new
+ * config once it is swapped in, and what it left out is retired: the
+ * connections of removed clients are closed, and removed servers close
+ * once their outstanding requests are done. A later reload frees them
+ * when nothing uses them any more. Of the other options only
+ * LogLevel takes effect, and TLS blocks can only be added */
+static void reloadconfig() {
+    struct options newopts;
+    struct confgen *old;
+    struct list_node *entry, *node;
+    struct clsrvconf *conf;
+    struct keptconf *kept;
+    struct server *server, *next;
+    struct client *client;
+    struct realm *realm;
+    int added = 0, removed = 0, fd;
+
+    debug(DBG_INFO, "reloadconfig: reading %s", reloadconfigfile);
+    if (!checkconfig()) {
+	debug(DBG_ERR, "reloadconfig: error in %s, keeping the running configuration", reloadconfigfile);
+	return;
+    }
+    loadconfig(reloadconfigfile, &newopts, 1);
+    logphases(__func__, PHASE_SERVERS);
+
+    /* new servers must be there before realms can send them requests */
+    for (entry = list_first(loadgen->srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (listhasdata(confgen->srvconfs, conf))
+	    continue;
+	added++;
+	if (conf->dynamiclookupcommand)
+	    continue;
+	if (!addserver(conf)) {
+	    debug(DBG_ERR, "reloadconfig: failed to add server %s", conf->name);
+	    continue;
+	}
+	for (server = conf->servers; server; server = server->nextconn)
+	    if (pthread_create(&server->clientth, &pthread_attr, clientwr, (void *)server))
+		debugerrno(errno, DBG_ERR, "reloadconfig: pthread_create failed");
+    }
+    for (entry = list_first(loadgen->clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (listhasdata(confgen->clconfs, conf))
+	    continue;
+	added++;
+	if (!find_clconf_type(conf->type, NULL))
+	    debug(DBG_WARN, "reloadconfig: not listening for %s client %s, needs a restart", conf->pdef->name, conf->name);
+    }
+
+    pthread_rwlock_wrlock(&confgenlock);
+    for (entry = list_first(loadgen->kept); entry; entry = list_next(entry))
+	takeoverclsrvconf(((struct keptconf *)entry->data)->old, ((struct keptconf *)entry->data)->conf);
+    old = confgen;
+    confgen = loadgen;
+    pthread_rwlock_unlock(&confgenlock);
+    loadgen = NULL;
+    while ((kept = (struct keptconf *)list_shift(confgen->kept))) {
+	freeclsrvconf(kept->conf);
+	free(kept);
+    }
+
+    for (entry = list_first(old->clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (listhasdata(confgen->clconfs, conf))
+	    continue;
+	removed++;
+	retireconf(conf);
+	if (conf->type == RAD_UDP)
+	    continue;
+	pthread_mutex_lock(conf->lock);
+	for (node = list_first(conf->clients); node; node = list_next(node)) {
+	    client = (struct client *)node->data;
+	    fd = client->ssl ? SSL_get_fd(client->ssl) : client->sock;
+	    if (fd > 0)
+		shutdown(fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(conf->lock);
+    }
+    for (entry = list_first(old->srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (listhasdata(confgen->srvconfs, conf))
+	    continue;
+	removed++;
+	/* a connection may be freed as soon as it knows, and the readers
+	 * only look at conf */
+	for (server = conf->servers; server; server = next) {
+	    next = server->nextconn;
+	    pthread_mutex_lock(&server->newrq_mutex);
+	    server->retired = 1;
+	    pthread_cond_signal(&server->newrq_cond);
+	    pthread_mutex_unlock(&server->newrq_mutex);
+	}
+	retireconf(conf);
+    }
+
+    pthread_mutex_lock(&retiredrealmslock);
+    if (!retiredrealms && !(retiredrealms = list_create()))
+	debugx(1, DBG_ERR, "malloc failed");
+    for (entry = list_first(retiredrealms); entry; entry = node) {
+	node = list_next(entry);
+	realm = (struct realm *)entry->data;
+	if (!realm->subrealms) {
+	    list_removedata(retiredrealms, realm);
+	    freeconfrealm(realm);
+	}
+    }
+    for (entry = list_first(old->realms); entry; entry = list_next(entry)) {
+	realm = (struct realm *)entry->data;
+	if (listhasdata(confgen->realms, realm))
+	    freerealm(realm);
+	else if (realm->subrealms) {
+	    if (!list_push(retiredrealms, realm))
+		debugx(1, DBG_ERR, "malloc failed");
+	} else
+	    freeconfrealm(realm);
+    }
+    freeretiredconfs();
+    pthread_mutex_unlock(&retiredrealmslock);
+
+    freeconfgen(oldconfgen);
+    oldconfgen = old;
+
+    if (newopts.loglevel && !argloglevel) {
+	options.loglevel = newopts.loglevel;
+	debug_set_level(options.loglevel);
+    }
+    options.writecoalescedelay = newopts.writecoalescedelay;
+    options.logslowrequests = newopts.logslowrequests;
+    setqueuewatermarks(newopts.replyqueuehigh, newopts.replyqueuelow);
+    free(newopts.listenmetrics);
+    if ((newopts.dynamiclookupcachefile || options.dynamiclookupcachefile) &&
+	(!newopts.dynamiclookupcachefile || !options.dynamiclookupcachefile ||
+	 strcmp(newopts.dynamiclookupcachefile, options.dynamiclookupcachefile)))
+	debug(DBG_WARN, "reloadconfig: not changing DynamicLookupCacheFile, needs a restart");
+    free(newopts.dynamiclookupcachefile);
+    free(newopts.pidfile);
+    free(newopts.ttlattr);
+    free(newopts.logdestination);
+    free(newopts.log_key);
+    free(newopts.ftickssyslogfacility);
+    free(newopts.fticksprefix);
+    debug(DBG_NOTICE, "reloadconfig: %u clients, %u servers and %u realms, %d added and %d removed",
+	  list_count(confgen->clconfs), list_count(confgen->srvconfs), list_count(confgen->realms), added, removed);
+}
+
 void *sighandler(void *arg) {
     sigset_t sigset;
     int sig;
@@ -3413,6 +5808,7 @@ void *sighandler(void *arg) {
 #if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
 	    tlsreloadcrls();
 #endif
+	    reloadconfig();
             break;
         case SIGPIPE:
             debug(DBG_WARN, "sighandler: got SIGPIPE, TLS write error?");
@@ -3438,6 +5834,7 @@ int radsecproxy_main(int argc, char **argv) {
     uint8_t foreground = 0, pretend = 0, loglevel = 0;
     char *configfile = NULL, *pidfile = NULL;
     struct clsrvconf *srvconf;
+    struct server *server;
     int i;
 
     debug_init("radsecproxy");
@@ -3452,8 +5849,7 @@ int radsecproxy_main(int argc, char **argv) {
 	debugx(1, DBG_ERR, "mallopt failed");
 #endif
 
-    for (i = 0; i < RAD_PROTOCOUNT; i++)
-	protodefs[i] = protoinits[i](i);
+    initprotodefs();
 
     /* needed even if no TLS/DTLS transport */
     randinit();
@@ -3466,6 +5862,12 @@ int radsecproxy_main(int argc, char **argv) {
     if (loglevel)
 	debug_set_level(loglevel);
     getmainconfig(configfile ? configfile : CONFIG_MAIN);
+    /* daemon() changes directory, so keep the paths absolute */
+    reloadconfigfile = realpath(configfile ? configfile : CONFIG_MAIN, NULL);
+    reloadbinary = strchr(argv[0], '/') ? realpath(argv[0], NULL) : stringcopy(argv[0], 0);
+    if (!reloadconfigfile || !reloadbinary)
+	debugx(1, DBG_ERR, "failed to get the paths for reloading the configuration");
+    argloglevel = loglevel;
     if (loglevel)
 	options.loglevel = loglevel;
     else if (options.loglevel)
@@ -3483,10 +5885,11 @@ int radsecproxy_main(int argc, char **argv) {
     free(options.logdestination);
     if (options.logtid)
         debug_tid_on();
+    ratelimit_init(&slowrqlimit, SLOW_REQUESTS_LOGGED, SLOW_REQUESTS_LOGGED);
 
-    if (!list_first(clconfs))
+    if (!list_first(confgen->clconfs))
 	debugx(1, DBG_ERR, "No clients configured, nothing to do, exiting");
-    if (!list_first(realms))
+    if (!list_first(confgen->realms))
 	debugx(1, DBG_ERR, "No realms configured, nothing to do, exiting");
 
     if (pretend)
@@ -3496,6 +5899,8 @@ int radsecproxy_main(int argc, char **argv) {
 	debugx(1, DBG_ERR, "daemon() failed: %s", strerror(errno));
 
     debug_timestamp_on();
+    if (!debug_async_start(options.logqueuesize))
+	debugx(1, DBG_ERR, "failed to start log writer");
     debug(DBG_INFO, "radsecproxy %s starting", PACKAGE_VERSION);
     if (!pidfile)
         pidfile = options.pidfile;
@@ -3509,16 +5914,27 @@ int radsecproxy_main(int argc, char **argv) {
     pthread_sigmask(SIG_BLOCK, &sigset, NULL);
     pthread_create(&sigth, &pthread_attr, sighandler, NULL);
 
-    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+    /* before the servers, whose readers may hand replies to them */
+    workers_init(options.requestworkers);
+
+    if (options.dynamiclookupcachefile)
+	dynlookupsync(options.dynamiclookupcachefile);
+
+    startphase();
+    for (entry = list_first(confgen->srvconfs); entry; entry = list_next(entry)) {
 	srvconf = (struct clsrvconf *)entry->data;
 	if (srvconf->dynamiclookupcommand)
 	    continue;
 	if (!addserver(srvconf))
 	    debugx(1, DBG_ERR, "failed to add server");
-	if (pthread_create(&srvconf->servers->clientth, &pthread_attr, clientwr,
-			   (void *)(srvconf->servers)))
-	    debugx(1, DBG_ERR, "pthread_create failed");
+	for (server = srvconf->servers; server; server = server->nextconn)
+	    if (pthread_create(&server->clientth, &pthread_attr, clientwr,
+			       (void *)server))
+		debugx(1, DBG_ERR, "pthread_create failed");
     }
+    endphase(PHASE_SERVERS);
+
+    evloop_init(options.eventloopworkers);
 
     for (i = 0; i < RAD_PROTOCOUNT; i++) {
 	if (!protodefs[i])
@@ -3529,9 +5945,20 @@ int radsecproxy_main(int argc, char **argv) {
 	    createlisteners(i);
     }
 
-    /* just hang around doing nothing, anything to do here? */
-    for (;;)
-	sleep(1000);
+    if (options.listenmetrics && !metrics_listen(options.listenmetrics, metricsdump))
+	debugx(1, DBG_ERR, "failed to serve metrics on %s", options.listenmetrics);
+    endphase(PHASE_LISTENERS);
+    logphases("radsecproxy_main", PHASE_COUNT);
+
+    /* just hang around, keeping the dynamic lookup cache file if any */
+    for (;;) {
+	if (!options.dynamiclookupcachefile) {
+	    sleep(1000);
+	    continue;
+	}
+	sleep(DYNAMIC_LOOKUP_SYNCINTERVAL);
+	dynlookupsync(options.dynamiclookupcachefile);
+    }
 }
 
 /* Local Variables: */
@@ -6,10 +6,15 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <regex.h>
+#include <nettle/md5.h>
 #include "list.h"
 #include "tlv11.h"
 #include "radmsg.h"
 #include "gconfig.h"
+#include "ratelimit.h"
+#include "workers.h"
+
+struct metrics;
 
 #define DEBUG_LEVEL 2
 
@@ -20,10 +25,28 @@
 #define MAX_LOSTRQS 16
 #define REQUEST_RETRY_INTERVAL 5
 #define REQUEST_RETRY_COUNT 2
+#define REQUEST_RTO_MIN 500 /* milliseconds, see serverrto() */
 #define DUPLICATE_INTERVAL REQUEST_RETRY_INTERVAL * REQUEST_RETRY_COUNT
+#define DUPLICATE_CACHE_SIZE MAX_REQUESTS
+/* buckets of a new duplicate cache table, see duplink() */
+#define DUPCACHE_MINBUCKETS 16
 #define MAX_CERT_DEPTH 5
 #define STATUS_SERVER_PERIOD 25
 #define IDLE_TIMEOUT 300
+#define DYNAMIC_LOOKUP_CONCURRENCY 16
+#define LOG_QUEUE_SIZE 2048
+/* replies queued for a client before its requests are no longer read */
+#define REPLY_QUEUE_HIGH 1024
+/* threads resolving the hosts of the config, see resolveconfs() */
+#define RESOLVE_THREADS 16
+/* kinds of replies of our own cached per client, see respond() */
+#define REPLY_TEMPLATES 4
+/* packets written at once to a TLS or TCP connection, one TLS record */
+#define STREAM_WRITE_SIZE 16384
+/* how long a realm is not looked up again after failing */
+#define DYNAMIC_LOOKUP_FAILTTL 900
+/* how often the DynamicLookupCacheFile is read and written */
+#define DYNAMIC_LOOKUP_SYNCINTERVAL 10
 
 /* We want PTHREAD_STACK_SIZE to be 32768, but some platforms
  * have a higher minimum value defined in PTHREAD_STACK_MIN. */
@@ -80,6 +103,13 @@ enum rsp_statsrv {
 	RSP_STATSRV_AUTO
 };
 
+enum rsp_loadbalance {
+    RSP_LB_PRIORITY = 0, /* default */
+    RSP_LB_LEASTOUTSTANDING,
+    RSP_LB_RTT,
+    RSP_LB_HASH
+};
+
 struct options {
     char *pidfile;
     char *logdestination;
@@ -97,28 +127,61 @@ struct options {
     enum rsp_fticks_reporting_type fticks_reporting;
     enum rsp_mac_type fticks_mac;
     uint8_t *fticks_key;
+    /* HMAC keyed with fticks_key, see fticks_hashmac_keyed() */
+    struct hmac_sha256_ctx *fticks_hmac;
     uint8_t ipv4only;
     uint8_t ipv6only;
+    uint8_t listenudpthreads;
+    uint8_t eventloopworkers;
+    uint8_t requestworkers;
+    uint8_t writecoalescedelay;
+    uint32_t logslowrequests; /* milliseconds */
+    uint16_t dynamiclookupconcurrency;
+    uint32_t logqueuesize;
+    uint32_t replyqueuehigh;
+    uint32_t replyqueuelow;
+    char *listenmetrics;
+    char *dynamiclookupcachefile;
 };
 
 struct commonprotoopts {
     char **listenargs;
+    char **listenbatchargs;
     char *sourcearg;
 };
 
+/* stages a request is timed at, each the end of the one before it */
+enum rqstage {
+    RQ_PARSED = 0,	/* buf2radmsg() done by radsrv() */
+    RQ_ROUTED,		/* findserver() done */
+    RQ_QUEUED,		/* in the queue of the server */
+    RQ_SENT,		/* first sent by clientwr() */
+    RQ_REPLIED,		/* reply matched by replyh() */
+    RQ_DEQUEUED,	/* reply taken off the client queue to be written */
+    RQ_STAGES
+};
+
 struct request {
     struct timeval created;
-    uint32_t refcount;
-	pthread_mutex_t refmutex;
+    /* CLOCK_MONOTONIC microseconds when received, and the microseconds
+     * from then until each stage set in stages, see rqstage() */
+    uint64_t received;
+    uint32_t stagetime[RQ_STAGES];
+    uint8_t stages; /* updated atomically */
+    uint32_t refcount; /* updated atomically */
     uint8_t *buf, *replybuf;
     struct radmsg *msg;
     struct client *from;
     struct server *to;
+    struct realm *realm; /* holds a reference, for counting in its metrics */
     char *origusername;
     uint8_t rqid;
     uint8_t rqauth[16];
     uint8_t newid;
     int udpsock; /* only for UDP */
+    /* links in the duplicate cache of the client, see struct dupcache */
+    struct request *dupchain, *dupnewer, *dupolder;
+    uint8_t dupcached;
 };
 
 /* requests that our client will send */
@@ -127,12 +190,40 @@ struct rqout {
     struct request *rq;
     uint8_t tries;
     struct timeval expiry;
+    struct timeval sent; /* first try */
+};
+
+/* ids of the outstanding requests of a server in a min-heap ordered on
+ * rqout expiry, so that clientwr() need not look at every slot */
+struct rqtimers {
+    pthread_mutex_t lock;
+    int n;
+    uint8_t heap[MAX_REQUESTS];
+    int16_t pos[MAX_REQUESTS]; /* index in heap, -1 if not queued */
+    uint64_t expiry[MAX_REQUESTS]; /* milliseconds */
 };
 
 struct gqueue {
     struct list *entries;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    void (*wakeup)(void *); /* if set, called with mutex held when entries becomes non-empty */
+    void *wakeuparg;
+    /* with high set, readers stop reading requests once that many
+     * entries are queued until they are down to low, see queuewaitroom() */
+    uint32_t high, low;
+    uint8_t full;
+    pthread_cond_t room;
+};
+
+/* A reply of our own without the Proxy-State attributes, serialized
+ * once. Only the id, length and authenticators differ between copies */
+struct replytemplate {
+    uint8_t code;
+    uint8_t msgauth; /* offset of the Message-Authenticator value, or 0 */
+    struct tlv replymsg; /* the Reply-Message, if any, for logging */
+    uint16_t len;
+    uint8_t buf[];
 };
 
 struct clsrvconf {
@@ -144,6 +235,8 @@ struct clsrvconf {
     char *portsrc;
     struct list *hostports;
     char *secret;
+    struct md5_ctx secretmd5; /* md5 state after hashing secret */
+    struct radsecret radsecret; /* for signing and checking messages */
     char *tls;
     char *matchcertattr;
     regex_t *certcnregex;
@@ -156,7 +249,9 @@ struct clsrvconf {
     enum rsp_statsrv statusserver;
     uint8_t retryinterval;
     uint8_t retrycount;
+    uint8_t connections;
     uint8_t dupinterval;
+    uint32_t dupcachesize;
     uint8_t certnamecheck;
     uint8_t addttl;
     uint8_t keepalive;
@@ -169,47 +264,80 @@ struct clsrvconf {
     struct server *servers;
     char *fticks_viscountry;
     char *fticks_visinst;
+    struct metrics *metrics; /* shared by the dynamic servers of a server block */
+    struct replytemplate *replytemplates[REPLY_TEMPLATES]; /* added, but never replaced, without lock */
+    struct ratelimit ratelimit; /* requests accepted from the clients */
+    uint8_t ratelimitreject;
+    uint8_t retired; /* left out of the configuration by a reload */
+    uint32_t nservers; /* in servers and not yet freed, for freeing a retired conf */
 };
 
 #include "tlscommon.h"
 
+/* requests recently received from a client, for detecting duplicates.
+ * Requests are hashed on id and authenticator, and also kept in arrival
+ * order. All requests of a client are kept for the same interval, so the
+ * oldest always expires first. */
+struct dupcache {
+    struct request **buckets; /* allocated on first use, freed when all expired */
+    uint32_t mask;
+    struct request *oldest, *newest;
+    uint32_t n;
+    uint32_t evicted; /* removed before expiry because the cache was full */
+};
+
 struct client {
     struct clsrvconf *conf;
     int sock;
     SSL *ssl;
 	pthread_mutex_t lock;
-    struct request *rqs[MAX_REQUESTS];
+    struct dupcache dups;
     struct gqueue *replyq;
     struct sockaddr *addr;
     time_t expiry; /* for udp */
+    struct workflow flow; /* requests handed to the workers */
+    uint8_t invalid; /* a request handled by a worker failed validation */
 };
 
 struct server {
     struct clsrvconf *conf;
     int sock;
     SSL *ssl;
+    SSL_SESSION *tlssession; /* for resuming the TLS or DTLS session */
     pthread_mutex_t lock;
     pthread_t clientth;
     uint8_t clientrdgone;
+    uint8_t retired; /* conf was left out by a reload */
     struct timeval connecttime;
     struct timeval lastreply;
     enum rsp_server_state state;
     uint8_t lostrqs;
+    uint32_t rtt; /* smoothed reply time (SRTT) in microseconds */
+    uint32_t rttvar; /* mean deviation of the reply times (RTTVAR) */
     char *dynamiclookuparg;
     int nextid;
     struct timeval lastrcv;
     struct rqout *requests;
+    pthread_mutex_t *rqlocks; /* the locks of requests, in one allocation */
+    uint32_t usedids[MAX_REQUESTS / 32]; /* bit set if requests[id].rq is in use */
+    struct rqtimers timers;
+    struct server *nextconn; /* next connection to the same server */
+    unsigned char *wbuf; /* requests not yet written, see clientradflush */
+    int wlen;
     uint8_t newrq;
 	uint8_t conreset;
     pthread_mutex_t newrq_mutex;
     pthread_cond_t newrq_cond;
+    struct workflow flow; /* replies handed to the workers */
 };
 
 struct realm {
     char *name;
     char *message;
     uint8_t accresp;
+    enum rsp_loadbalance loadbalance;
     regex_t regex;
+    char *suffix; /* lower case suffix matching the same ids as regex, or NULL */
     uint32_t refcount;
     pthread_mutex_t refmutex;
     pthread_mutex_t mutex;
@@ -217,17 +345,49 @@ struct realm {
     struct list *subrealms;
     struct list *srvconfs;
     struct list *accsrvconfs;
+    struct metrics *metrics;
+    struct ratelimit ratelimit;
+    uint8_t ratelimitreject;
+};
+
+/* a piece of a modattr replacement, either literal text or, if ref
+ * is non-zero, back-reference \ref (s then points at "\N", which is
+ * copied when the group did not match) */
+struct modpart {
+    char *s;
+    size_t len;
+    uint8_t ref;
+};
+
+enum modattr_match {
+    MODATTR_REGEX = 0,
+    MODATTR_SUFFIX, /* ^(.*)literal$ */
+    MODATTR_PREFIX  /* ^literal(.*)$ */
 };
 
 struct modattr {
     uint8_t t;
     char *replacement;
     regex_t *regex;
+    struct modpart *parts;
+    int nparts;
+    uint8_t nmatch; /* 1 + highest back-reference in replacement */
+    enum modattr_match match;
+    char *literal;
+    size_t literallen;
+};
+
+/* subattributes of one vendor to remove, sorted by vendor */
+struct vendorrm {
+    uint32_t vendor;
+    uint32_t subattrs[8]; /* bitmap of subattribute types */
+    uint8_t all;	  /* remove the entire vendor attribute */
 };
 
 struct rewrite {
-    uint8_t *removeattrs;
-    uint32_t *removevendorattrs;
+    uint32_t *removeattrs; /* bitmap of attribute types */
+    struct vendorrm *removevendorattrs;
+    int nremovevendorattrs;
     struct list *addattrs;
     struct list *modattrs;
 };
@@ -248,8 +408,9 @@ struct protodefs {
     int (*connecter)(struct server *, int, char *);
     void *(*clientconnreader)(void*);
     int (*clientradput)(struct server *, unsigned char *);
+    int (*clientradflush)(struct server *);
     void (*addclient)(struct client *);
-    void (*addserverextra)(struct clsrvconf *);
+    void (*addserverextra)(struct server *);
     void (*setsrcres)();
     void (*initextra)();
 };
@@ -261,19 +422,43 @@ struct protodefs {
 #define ATTRVAL(x) ((x) + 2)
 #define ATTRVALLEN(x) ((x)[1] - 2)
 
-struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct list_node **cur);
-struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct list_node **cur);
+/* how far find_clconf() or find_srvconf() got in the confs of one config
+ * generation, so that after a reload the next call starts over in the
+ * new one. Start with all zeroes */
+struct confcursor {
+    uint32_t gen;
+    struct list_node *node;
+};
+
+struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct confcursor *cur);
+struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct confcursor *cur);
 struct clsrvconf *find_clconf_type(uint8_t type, struct list_node **cur);
 struct client *addclient(struct clsrvconf *conf, uint8_t lock);
 void removelockedclient(struct client *client);
 void removeclient(struct client *client);
+void removeclientlater(struct client *client);
 struct gqueue *newqueue();
+struct request *queueshift(struct gqueue *q);
+int queuewaitroom(struct gqueue *q, int timeout);
 struct request *newrequest();
+/* stamps rq as received now, for listeners that create it before reading */
+void rqreceived(struct request *rq);
 void freerq(struct request *rq);
 int radsrv(struct request *rq);
+int radsrvbuf(struct request *rq, unsigned char *buf);
 void replyh(struct server *server, unsigned char *buf);
+void replyhbuf(struct server *server, unsigned char *buf);
+int radsrvdispatch(struct request *rq);
+void replyhdispatch(struct server *server, unsigned char *buf);
+int coalescereplies(struct gqueue *replyq, unsigned char **buf, int len, int *size, uint8_t wait);
 struct addrinfo *resolve_hostport_addrinfo(uint8_t type, char *hostport);
 uint8_t *radattr2ascii(struct tlv *attr);
+void initprotodefs();
+void getmainconfig(const char *configfile);
+struct server *findserver(struct realm **realm, struct tlv *username, struct radmsg *msg, uint8_t *limited);
+void freerealm(struct realm *realm);
+int dorewrite(struct radmsg *msg, struct rewrite *rewrite);
+int pwdrecrypt(uint8_t *pwd, uint8_t len, struct clsrvconf *oldconf, struct clsrvconf *newconf, uint8_t *oldauth, uint8_t *newauth);
 pthread_attr_t pthread_attr;
 
 /* Local Variables: */
@@ -0,0 +1,45 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <time.h>
+#include "ratelimit.h"
+
+static uint64_t nowns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void ratelimit_init(struct ratelimit *rl, uint32_t rate, uint32_t burst) {
+    uint64_t interval = 0, tolerance = 0;
+
+    if (rate) {
+	interval = 1000000000 / rate;
+	tolerance = interval * ((burst ? burst : rate) - 1);
+    }
+    rl->rate = rate;
+    rl->burst = burst;
+    __atomic_store_n(&rl->tolerance, tolerance, __ATOMIC_RELAXED);
+    __atomic_store_n(&rl->interval, interval, __ATOMIC_RELAXED);
+}
+
+int ratelimit_take(struct ratelimit *rl) {
+    uint64_t now, tat, start;
+
+    if (!__atomic_load_n(&rl->interval, __ATOMIC_RELAXED))
+	return 1;
+    now = nowns();
+    do {
+	tat = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED);
+	/* a bucket that has been full since tat starts from now */
+	start = tat > now ? tat : now;
+	if (start - now > __atomic_load_n(&rl->tolerance, __ATOMIC_RELAXED))
+	    return 0;
+    } while (!__sync_bool_compare_and_swap(&rl->tat, tat, start + __atomic_load_n(&rl->interval, __ATOMIC_RELAXED)));
+    return 1;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,33 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+/* A token bucket of burst tokens refilled at rate tokens per second,
+ * kept as the time the bucket would be full again (the generic cell
+ * rate algorithm). Taking a token is a single compare and swap of that
+ * time, so threads handling requests for the same client or realm need
+ * no lock and refilling needs no timer. */
+struct ratelimit {
+    uint64_t interval;	/* nanoseconds per token */
+    uint64_t tolerance;	/* nanoseconds of tokens beyond one */
+    uint64_t tat;	/* theoretical arrival time, CLOCK_MONOTONIC ns */
+    uint32_t rate, burst; /* as configured */
+};
+
+/* sets the bucket to rate tokens per second, 0 meaning no limit, and
+ * burst tokens, 0 meaning rate. Only the rate changes if the bucket is
+ * in use, so it may be called again on reload */
+void ratelimit_init(struct ratelimit *rl, uint32_t rate, uint32_t burst);
+
+/* returns 1 if a token was taken or there is no limit, 0 if the bucket
+ * is empty */
+int ratelimit_take(struct ratelimit *rl);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
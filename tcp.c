@@ -12,6 +12,7 @@
 #ifdef SYS_SOLARIS9
 #include <fcntl.h>
 #endif
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <poll.h>
@@ -22,16 +23,19 @@
 #include <pthread.h>
 #include "radsecproxy.h"
 #include "hostport.h"
+#include "evloop.h"
 
 #ifdef RADPROT_TCP
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
 void *tcplistener(void *arg);
 int tcpconnect(struct server *server, int timeout, char * text);
 void *tcpclientrd(void *arg);
 int clientradputtcp(struct server *server, unsigned char *rad);
+int clientradflushtcp(struct server *server);
 void tcpsetsrcres();
 
 static const struct protodefs protodefs = {
@@ -50,6 +54,7 @@ static const struct protodefs protodefs = {
     tcpconnect, /* connecter */
     tcpclientrd, /* clientconnreader */
     clientradputtcp, /* clientradput */
+    clientradflushtcp, /* clientradflush */
     NULL, /* addclient */
     NULL, /* addserverextra */
     tcpsetsrcres, /* setsrcres */
@@ -108,6 +113,8 @@ int tcpconnect(struct server *server, int timeout, char *text) {
             debug(DBG_DBG, "tcpconnect: timeout");
             return 0;
         }
+        if (server->conf->retired)
+            return 0;
         pthread_mutex_lock(&server->lock);
 
         debug(DBG_INFO, "tcpconnect: connecting to %s", server->conf->name);
@@ -171,7 +178,7 @@ unsigned char *radtcpget(int s, int timeout) {
 	    debug(DBG_ERR, "radtcpget: length too small");
 	    continue;
 	}
-	rad = malloc(len);
+	rad = pool_bufalloc(len);
 	if (!rad) {
 	    debug(DBG_ERR, "radtcpget: malloc failed");
 	    continue;
@@ -181,14 +188,14 @@ unsigned char *radtcpget(int s, int timeout) {
 	cnt = tcpreadtimeout(s, rad + 4, len - 4, timeout);
 	if (cnt < 1) {
 	    debug(DBG_DBG, cnt ? "radtcpget: connection lost" : "radtcpget: timeout");
-	    free(rad);
+	    pool_buffree(rad);
 	    return NULL;
 	}
 
 	if (len >= 20)
 	    break;
 
-	free(rad);
+	pool_buffree(rad);
 	debug(DBG_WARN, "radtcpget: packet smaller than minimum radius size");
     }
 
@@ -196,22 +203,54 @@ unsigned char *radtcpget(int s, int timeout) {
     return rad;
 }
 
+/* writes len bytes of requests to the server */
+static int tcpwrite(struct server *server, unsigned char *buf, int len) {
+    int cnt, off;
+
+    if (server->state != RSP_SERVER_STATE_CONNECTED)
+	return 0;
+    for (off = 0; off < len; off += cnt) {
+	if ((cnt = write(server->sock, buf + off, len - off)) <= 0) {
+	    debug(DBG_ERR, "clientradflushtcp: write error");
+	    return 0;
+	}
+    }
+    debug(DBG_DBG, "clientradflushtcp: Sent %d bytes to TCP peer %s", len, server->conf->name);
+    return 1;
+}
+
+/* buffers the packet, clientwr() calls clientradflushtcp() when no more
+ * requests are ready, so that they are written with a single write. A
+ * packet larger than the buffer is written on its own */
 int clientradputtcp(struct server *server, unsigned char *rad) {
-    int cnt;
     size_t len;
-    struct clsrvconf *conf = server->conf;
 
     if (server->state != RSP_SERVER_STATE_CONNECTED)
 	return 0;
     len = RADLEN(rad);
-    if ((cnt = write(server->sock, rad, len)) <= 0) {
-	debug(DBG_ERR, "clientradputtcp: write error");
+    if (!server->wbuf && !(server->wbuf = malloc(STREAM_WRITE_SIZE))) {
+	debug(DBG_ERR, "clientradputtcp: malloc failed");
 	return 0;
     }
-    debug(DBG_DBG, "clientradputtcp: Sent %d bytes, Radius packet of length %d to TCP peer %s", cnt, len, conf->name);
+    if (server->wlen + len > STREAM_WRITE_SIZE && !clientradflushtcp(server))
+	return 0;
+    if (len > STREAM_WRITE_SIZE)
+	return tcpwrite(server, rad, len);
+    memcpy(server->wbuf + server->wlen, rad, len);
+    server->wlen += len;
+    debug(DBG_DBG, "clientradputtcp: Radius packet of length %d to TCP peer %s buffered", len, server->conf->name);
     return 1;
 }
 
+int clientradflushtcp(struct server *server) {
+    int len = server->wlen;
+
+    if (!len)
+	return 1;
+    server->wlen = 0;
+    return tcpwrite(server, server->wbuf, len);
+}
+
 void *tcpclientrd(void *arg) {
     struct server *server = (struct server *)arg;
     unsigned char *buf;
@@ -219,13 +258,14 @@ void *tcpclientrd(void *arg) {
     for (;;) {
 	buf = radtcpget(server->sock, server->dynamiclookuparg ? IDLE_TIMEOUT : 0);
 	if (!buf) {
-        if (server->dynamiclookuparg)
+        if (server->dynamiclookuparg || server->conf->retired)
+		break;
+	    if (!tcpconnect(server, 0, "tcpclientrd"))
 		break;
-	    tcpconnect(server, 0, "tcpclientrd");
 	    continue;
 	}
 
-	replyh(server, buf);
+	replyhdispatch(server, buf);
     }
     server->clientrdgone = 1;
     pthread_mutex_lock(&server->newrq_mutex);
@@ -235,14 +275,19 @@ void *tcpclientrd(void *arg) {
 }
 
 void *tcpserverwr(void *arg) {
-    int cnt;
+    int cnt, len, done, size = STREAM_WRITE_SIZE;
     struct client *client = (struct client *)arg;
     struct gqueue *replyq;
-    struct request *reply;
+    unsigned char *buf;
     char tmp[INET6_ADDRSTRLEN];
 
     debug(DBG_DBG, "tcpserverwr: starting for %s", addr2string(client->addr, tmp, sizeof(tmp)));
     replyq = client->replyq;
+    buf = malloc(STREAM_WRITE_SIZE);
+    if (!buf) {
+	debug(DBG_ERR, "tcpserverwr: malloc failed");
+	pthread_exit(NULL);
+    }
     for (;;) {
 	pthread_mutex_lock(&replyq->mutex);
 	while (!list_first(replyq->entries)) {
@@ -254,19 +299,26 @@ void *tcpserverwr(void *arg) {
 	    if (client->sock < 0) {
 		/* s might have changed while waiting */
 		pthread_mutex_unlock(&replyq->mutex);
+		free(buf);
 		debug(DBG_DBG, "tcpserverwr: exiting as requested");
 		pthread_exit(NULL);
 	    }
 	}
-	reply = (struct request *)list_shift(replyq->entries);
 	pthread_mutex_unlock(&replyq->mutex);
-	cnt = write(client->sock, reply->replybuf, RADLEN(reply->replybuf));
-	if (cnt > 0)
-	    debug(DBG_DBG, "tcpserverwr: sent %d bytes, Radius packet of length %d to %s",
-		  cnt, RADLEN(reply->replybuf), addr2string(client->addr, tmp, sizeof(tmp)));
+	len = coalescereplies(replyq, &buf, 0, &size, 1);
+	/* a write may be short, the rest must follow before other replies */
+	for (done = 0; done < len; done += cnt) {
+	    cnt = write(client->sock, buf + done, len - done);
+	    if (cnt < 0 && errno == EINTR)
+		cnt = 0;
+	    else if (cnt <= 0)
+		break;
+	}
+	if (done == len)
+	    debug(DBG_DBG, "tcpserverwr: sent %d bytes of Radius packets to %s",
+		  len, addr2string(client->addr, tmp, sizeof(tmp)));
 	else
-	    debug(DBG_ERR, "tcpserverwr: write error for %s", addr2string(client->addr, tmp, sizeof(tmp)));
-	freerq(reply);
+	    debugerrno(errno, DBG_ERR, "tcpserverwr: write error for %s", addr2string(client->addr, tmp, sizeof(tmp)));
     }
 }
 
@@ -284,6 +336,10 @@ void tcpserverrd(struct client *client) {
     }
 
     for (;;) {
+	if (!queuewaitroom(client->replyq, IDLE_TIMEOUT * 3)) {
+	    debug(DBG_ERR, "tcpserverrd: %s is not reading replies, closing connection", addr2string(client->addr, tmp, sizeof(tmp)));
+	    break;
+	}
 	buf = radtcpget(client->sock, 0);
 	if (!buf) {
 	    debug(DBG_ERR, "tcpserverrd: connection from %s lost", addr2string(client->addr, tmp, sizeof(tmp)));
@@ -292,12 +348,12 @@ void tcpserverrd(struct client *client) {
 	debug(DBG_DBG, "tcpserverrd: got Radius message from %s", addr2string(client->addr, tmp, sizeof(tmp)));
 	rq = newrequest();
 	if (!rq) {
-	    free(buf);
+	    pool_buffree(buf);
 	    continue;
 	}
 	rq->buf = buf;
 	rq->from = client;
-	if (!radsrv(rq)) {
+	if (!radsrvdispatch(rq)) {
 	    debug(DBG_ERR, "tcpserverrd: message authentication/validation failed, closing connection from %s", addr2string(client->addr, tmp, sizeof(tmp)));
 	    break;
 	}
@@ -336,6 +392,8 @@ void *tcpservernew(void *arg) {
                 enable_keepalive(s);
             client->sock = s;
             client->addr = addr_copy((struct sockaddr *)&from);
+            if (evloop_addconn(client, s, NULL, 0))
+                pthread_exit(NULL);
             tcpserverrd(client);
             removeclient(client);
         } else
@@ -0,0 +1,363 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Times the functions every request passes through, on packets like
+ * those seen in eduroam and with a config of many clients, servers and
+ * realms. Not run by make check, but by make bench. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../radsecproxy.h"
+#include "../debug.h"
+#include "../pool.h"
+
+int _checkmsgauth(unsigned char *rad, unsigned char *reqauth, uint8_t *authattr, struct radsecret *secret);
+
+#define NCLIENTS 2000
+#define NSERVERS 100
+#define NREALMS 5000
+#define SECRET "benchsecret"
+
+static struct radsecret secret;
+static double bench_time = 0.5;
+static struct timespec start;
+static unsigned long long ops;
+
+static double
+_elapsed(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* for (BENCH_START; BENCH_RUNNING;) { ... } runs the body for bench_time */
+#define BENCH_START (ops = 0, clock_gettime(CLOCK_MONOTONIC, &start))
+#define BENCH_RUNNING ((++ops & 1023) || _elapsed() < bench_time)
+
+static void
+_report(const char *name)
+{
+  printf("%-24s %10llu ops %10.1f ns/op\n", name, ops, _elapsed() * 1e9 / ops);
+}
+
+static char *
+_writeconfig(void)
+{
+  static char path[] = "/tmp/bench_pipelineXXXXXX";
+  FILE *f;
+  int fd, i;
+
+  fd = mkstemp(path);
+  if (fd < 0 || !(f = fdopen(fd, "w")))
+    return NULL;
+
+  fprintf(f, "LogLevel 1\n");
+  fprintf(f, "rewrite bench {\n"
+          "    removeAttribute 25\n"
+          "    modifyAttribute 1:/^(.*)@(.*)$/\\1@\\2/\n"
+          "}\n");
+  for (i = 0; i < NCLIENTS; i++)
+    fprintf(f, "client 10.%d.%d.%d {\n"
+            "    type udp\n    secret " SECRET "\n    rewriteIn bench\n}\n",
+            i >> 16 & 0xff, i >> 8 & 0xff, i & 0xff);
+  fprintf(f, "client 172.16.0.0/12 {\n    type udp\n    secret " SECRET "\n}\n");
+  for (i = 0; i < NSERVERS; i++)
+    fprintf(f, "server 192.0.2.%d {\n    type udp\n    secret " SECRET "-%d\n}\n",
+            i + 1, i);
+  for (i = 0; i < NREALMS; i++)
+    fprintf(f, "realm example%d.org {\n    server 192.0.2.%d\n}\n",
+            i, i % NSERVERS + 1);
+  fprintf(f, "realm /@.*\\.edu$/ {\n    server 192.0.2.1\n}\n");
+  fprintf(f, "realm * {\n    server 192.0.2.2\n}\n");
+  fclose(f);
+  return path;
+}
+
+static void
+_addattr(struct radmsg *msg, uint8_t type, uint8_t len, void *val)
+{
+  if (!radmsg_add(msg, maketlv(type, len, val)))
+    exit(!!fprintf(stderr, "radmsg_add failed\n"));
+}
+
+static void
+_addstr(struct radmsg *msg, uint8_t type, char *val)
+{
+  _addattr(msg, type, strlen(val), val);
+}
+
+static void
+_addint(struct radmsg *msg, uint8_t type, uint32_t val)
+{
+  val = htonl(val);
+  _addattr(msg, type, 4, &val);
+}
+
+/* an Access-Request carrying a fragment of an EAP-TLS handshake */
+static uint8_t *
+_eaprequest(void)
+{
+  uint8_t auth[16], eap[253], state[16], zero[16];
+  struct radmsg *msg;
+  uint8_t *buf;
+  int i;
+
+  memset(auth, 0x5a, sizeof(auth));
+  memset(eap, 0x17, sizeof(eap));
+  memset(state, 0x33, sizeof(state));
+  memset(zero, 0, sizeof(zero));
+  msg = radmsg_init(RAD_Access_Request, 42, auth);
+  _addstr(msg, RAD_Attr_User_Name, "anonymous@example4711.org");
+  _addint(msg, 4, 0xc0000201);              /* NAS-IP-Address */
+  _addint(msg, 5, 17);                      /* NAS-Port */
+  _addint(msg, 6, 2);                       /* Service-Type */
+  _addint(msg, 12, 1400);                   /* Framed-MTU */
+  _addstr(msg, 30, "00-11-22-33-44-55:eduroam");
+  _addstr(msg, RAD_Attr_Calling_Station_Id, "66-77-88-99-AA-BB");
+  _addint(msg, 61, 19);                     /* NAS-Port-Type */
+  _addstr(msg, 77, "CONNECT 54Mbps");     /* Connect-Info */
+  for (i = 0; i < 4; i++)
+    _addattr(msg, 79, sizeof(eap), eap);    /* EAP-Message */
+  _addattr(msg, 24, sizeof(state), state);  /* State */
+  _addstr(msg, 25, "class-01");           /* Class */
+  _addattr(msg, RAD_Attr_Message_Authenticator, sizeof(zero), zero);
+  buf = radmsg2buf(msg, &secret);
+  radmsg_free(msg);
+  return buf;
+}
+
+static uint8_t *
+_paprequest(void)
+{
+  uint8_t auth[16], pwd[16];
+  struct radmsg *msg;
+  uint8_t *buf;
+
+  memset(auth, 0xa5, sizeof(auth));
+  memset(pwd, 0x42, sizeof(pwd));
+  msg = radmsg_init(RAD_Access_Request, 43, auth);
+  _addstr(msg, RAD_Attr_User_Name, "user@example1.org");
+  _addattr(msg, RAD_Attr_User_Password, sizeof(pwd), pwd);
+  _addint(msg, 4, 0xc0000201);
+  buf = radmsg2buf(msg, &secret);
+  radmsg_free(msg);
+  return buf;
+}
+
+/* an Interim-Update */
+static uint8_t *
+_acctrequest(void)
+{
+  uint8_t auth[16];
+  struct radmsg *msg;
+  uint8_t *buf;
+
+  memset(auth, 0, sizeof(auth));
+  msg = radmsg_init(RAD_Accounting_Request, 44, auth);
+  _addstr(msg, RAD_Attr_User_Name, "student@example2000.org");
+  _addint(msg, 40, 3);                      /* Acct-Status-Type */
+  _addstr(msg, 44, "5B3C2A1F00000042");   /* Acct-Session-Id */
+  _addint(msg, 42, 123456789);              /* Acct-Input-Octets */
+  _addint(msg, 43, 987654321);              /* Acct-Output-Octets */
+  _addint(msg, 46, 3600);                   /* Acct-Session-Time */
+  _addint(msg, 47, 100000);                 /* Acct-Input-Packets */
+  _addint(msg, 48, 200000);                 /* Acct-Output-Packets */
+  _addint(msg, 55, 1530000000);             /* Event-Timestamp */
+  _addint(msg, 4, 0xc0000201);
+  _addint(msg, 8, 0x0a000001);              /* Framed-IP-Address */
+  _addstr(msg, 30, "00-11-22-33-44-55:eduroam");
+  _addstr(msg, RAD_Attr_Calling_Station_Id, "66-77-88-99-AA-BB");
+  _addstr(msg, 25, "class-01");
+  buf = radmsg2buf(msg, &secret);
+  radmsg_free(msg);
+  return buf;
+}
+
+static uint8_t *
+_findattr(uint8_t *buf, uint8_t type)
+{
+  uint8_t *p;
+
+  for (p = buf + 20; p < buf + RADLEN(buf); p += ATTRLEN(p))
+    if (ATTRTYPE(p) == type)
+      return p;
+  return NULL;
+}
+
+static void
+_bench_parse(const char *name, uint8_t *buf)
+{
+  struct radmsg *msg;
+
+  for (BENCH_START; BENCH_RUNNING;) {
+    msg = buf2radmsg(buf, &secret, NULL);
+    if (!msg)
+      exit(!!fprintf(stderr, "%s: buf2radmsg failed\n", name));
+    radmsg_free(msg);
+  }
+  _report(name);
+}
+
+static void
+_bench_build(const char *name, uint8_t *buf)
+{
+  struct radmsg *msg;
+  uint8_t *out;
+
+  msg = buf2radmsg(buf, &secret, NULL);
+  for (BENCH_START; BENCH_RUNNING;) {
+    out = radmsg2buf(msg, &secret);
+    if (!out)
+      exit(!!fprintf(stderr, "%s: radmsg2buf failed\n", name));
+    pool_buffree(out);
+  }
+  _report(name);
+  radmsg_free(msg);
+}
+
+static void
+_bench_msgauth(uint8_t *buf)
+{
+  uint8_t *attr = _findattr(buf, RAD_Attr_Message_Authenticator);
+
+  for (BENCH_START; BENCH_RUNNING;)
+    if (!_checkmsgauth(buf, NULL, ATTRVAL(attr), &secret))
+      exit(!!fprintf(stderr, "_checkmsgauth failed\n"));
+  _report("_checkmsgauth");
+}
+
+/* the rewrite changes the message, so it is parsed again every time */
+static void
+_bench_rewrite(uint8_t *buf, struct clsrvconf *conf)
+{
+  struct radmsg *msg;
+
+  for (BENCH_START; BENCH_RUNNING;) {
+    msg = buf2radmsg(buf, &secret, NULL);
+    if (!dorewrite(msg, conf->rewritein))
+      exit(!!fprintf(stderr, "dorewrite failed\n"));
+    radmsg_free(msg);
+  }
+  _report("buf2radmsg+dorewrite");
+}
+
+static void
+_bench_pwdrecrypt(uint8_t *buf, struct clsrvconf *from, struct clsrvconf *to)
+{
+  uint8_t *attr = _findattr(buf, RAD_Attr_User_Password), newauth[16];
+
+  memset(newauth, 0x11, sizeof(newauth));
+  for (BENCH_START; BENCH_RUNNING;)
+    if (!pwdrecrypt(ATTRVAL(attr), ATTRVALLEN(attr), from, to, buf + 4, newauth))
+      exit(!!fprintf(stderr, "pwdrecrypt failed\n"));
+  _report("pwdrecrypt");
+}
+
+/* looks up a mix of plain, wildcard and unknown realms */
+static void
+_bench_realms(void)
+{
+  static char *names[] = { "user@example0.org", "user@example4999.org",
+                           "user@cs.example.edu", "user@unknown.net" };
+  uint8_t auth[16] = { 0 };
+  struct radmsg *msg = radmsg_init(RAD_Access_Request, 0, auth);
+  struct tlv *users[4];
+  struct realm *realm;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    users[i] = maketlv(RAD_Attr_User_Name, strlen(names[i]), names[i]);
+  i = 0;
+  for (BENCH_START; BENCH_RUNNING; i++) {
+    findserver(&realm, users[i & 3], msg, NULL);
+    if (!realm)
+      exit(!!fprintf(stderr, "no realm for %.*s\n", users[i & 3]->l,
+                     users[i & 3]->v));
+    pthread_mutex_unlock(&realm->mutex);
+    freerealm(realm);
+  }
+  _report("findserver (id2realm)");
+  for (i = 0; i < 4; i++)
+    freetlv(users[i]);
+  radmsg_free(msg);
+}
+
+static struct sockaddr *
+_addr(struct sockaddr_in *sin, uint32_t a)
+{
+  memset(sin, 0, sizeof(*sin));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(a);
+  sin->sin_port = htons(1812);
+  return (struct sockaddr *)sin;
+}
+
+static void
+_bench_clients(void)
+{
+  struct sockaddr_in sins[4];
+  struct sockaddr *addrs[4];
+  int i = 0;
+
+  addrs[0] = _addr(sins, 0x0a000000);
+  addrs[1] = _addr(sins + 1, 0x0a000000 + NCLIENTS - 1);
+  addrs[2] = _addr(sins + 2, 0xac100001);
+  addrs[3] = _addr(sins + 3, 0x0b000001);
+  for (BENCH_START; BENCH_RUNNING; i++)
+    if (!find_clconf(RAD_UDP, addrs[i & 3], NULL) != ((i & 3) == 3))
+      exit(!!fprintf(stderr, "find_clconf gave the wrong client\n"));
+  _report("find_clconf");
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct sockaddr_in sin;
+  struct clsrvconf *client, *server;
+  uint8_t *eap, *pap, *acct;
+  char *config;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:")) != -1)
+    if (c != 't' || (bench_time = atof(optarg)) <= 0)
+      return !!fprintf(stderr, "usage: %s [-t seconds per benchmark]\n", argv[0]);
+
+  debug_init("bench_pipeline");
+  debug_set_level(1);
+  radsecret_init(&secret, (uint8_t *)SECRET);
+  initprotodefs();
+  config = _writeconfig();
+  if (!config)
+    return !!fprintf(stderr, "failed to write config\n");
+  getmainconfig(config);
+  unlink(config);
+
+  client = find_clconf(RAD_UDP, _addr(&sin, 0x0a000001), NULL);
+  server = find_srvconf(RAD_UDP, _addr(&sin, 0xc0000201), NULL);
+  if (!client || !server)
+    return !!fprintf(stderr, "client or server not configured\n");
+
+  eap = _eaprequest();
+  pap = _paprequest();
+  acct = _acctrequest();
+  printf("%d clients, %d servers, %d realms, eap request of %d bytes\n",
+         NCLIENTS, NSERVERS, NREALMS, RADLEN(eap));
+
+  _bench_parse("buf2radmsg eap", eap);
+  _bench_parse("buf2radmsg acct", acct);
+  _bench_build("radmsg2buf eap", eap);
+  _bench_build("radmsg2buf acct", acct);
+  _bench_msgauth(eap);
+  _bench_rewrite(eap, client);
+  _bench_pwdrecrypt(pap, client, server);
+  _bench_realms();
+  _bench_clients();
+  return 0;
+}
@@ -0,0 +1,429 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Sends Access-Requests to a radsecproxy over UDP, TLS or DTLS and
+ * reports throughput and reply latency. Optionally also acts as the home
+ * server, answering every request it gets on a UDP port with an
+ * Access-Accept, so that radsecproxy can be measured on its own:
+ *
+ *   loadgen -l 127.0.0.1:11814 -k homesecret -n 100000 127.0.0.1 1812
+ *
+ * with radsecproxy listening on 1812 and forwarding to 127.0.0.1:11814. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include "../radsecproxy.h"
+#include "../debug.h"
+#include "../pool.h"
+
+#define LOST_TIMEOUT 5 /* seconds until a request is counted as lost */
+
+enum transport { T_UDP, T_TLS, T_DTLS };
+
+static enum transport transport = T_UDP;
+static char *host, *port, *secret, *realm = "example.org";
+static char *homeaddr, *homesecret = "secret";
+static struct radsecret radsecret, homeradsecret;
+static char *certfile, *keyfile, *cafile;
+static int nconns = 4, window = 32;
+static long nrequests = 10000;
+static SSL_CTX *ctx;
+
+struct conn {
+  pthread_t thread;
+  int sock;
+  SSL *ssl;
+  long quota, sent, replies, lost, bad;
+  int outstanding;
+  uint8_t busy[256];
+  uint8_t auth[256][16];
+  struct timespec senttime[256];
+  uint32_t *latency; /* microseconds, one for each reply */
+  uint8_t buf[65536];
+  int buflen; /* of a partly read TLS record */
+};
+
+static double
+_diff(struct timespec *a, struct timespec *b)
+{
+  return b->tv_sec - a->tv_sec + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static int
+_connect(struct conn *c)
+{
+  struct addrinfo hints, *res;
+  struct timeval tv = { 1, 0 };
+  BIO *bio;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = transport == T_TLS ? SOCK_STREAM : SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &res))
+    return 0;
+  c->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (c->sock < 0 || connect(c->sock, res->ai_addr, res->ai_addrlen))
+    goto errexit;
+  setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (transport == T_UDP) {
+    freeaddrinfo(res);
+    return 1;
+  }
+
+  c->ssl = SSL_new(ctx);
+  if (!c->ssl)
+    goto errexit;
+  if (transport == T_DTLS) {
+    bio = BIO_new_dgram(c->sock, BIO_NOCLOSE);
+    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, res->ai_addr);
+    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &tv);
+    SSL_set_bio(c->ssl, bio, bio);
+  } else
+    SSL_set_fd(c->ssl, c->sock);
+  freeaddrinfo(res);
+  if (SSL_connect(c->ssl) != 1) {
+    ERR_print_errors_fp(stderr);
+    return 0;
+  }
+  return 1;
+
+errexit:
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int
+_send(struct conn *c, uint8_t id)
+{
+  struct radmsg *msg;
+  uint8_t *buf, zero[16];
+  char user[256];
+  int len, n;
+
+  RAND_bytes(c->auth[id], 16);
+  memset(zero, 0, sizeof(zero));
+  len = snprintf(user, sizeof(user), "load%ld@%s", c->sent, realm);
+  msg = radmsg_init(RAD_Access_Request, id, c->auth[id]);
+  if (!msg || !radmsg_add(msg, maketlv(RAD_Attr_User_Name, len, user))
+    || !radmsg_add(msg, maketlv(RAD_Attr_Calling_Station_Id, 17, "02-00-00-00-00-01"))
+    || !radmsg_add(msg, maketlv(RAD_Attr_Message_Authenticator, 16, zero)))
+    return 0;
+  buf = radmsg2buf(msg, &radsecret);
+  radmsg_free(msg);
+  if (!buf)
+    return 0;
+
+  len = RADLEN(buf);
+  n = c->ssl ? SSL_write(c->ssl, buf, len) : send(c->sock, buf, len, 0);
+  pool_buffree(buf);
+  if (n != len)
+    return 0;
+  c->busy[id] = 1;
+  clock_gettime(CLOCK_MONOTONIC, &c->senttime[id]);
+  c->sent++;
+  c->outstanding++;
+  return 1;
+}
+
+/* returns 1 when a whole reply is in c->buf, 0 on timeout, -1 on error */
+static int
+_read(struct conn *c)
+{
+  int n, want;
+
+  if (transport != T_TLS) {
+    n = c->ssl ? SSL_read(c->ssl, c->buf, sizeof(c->buf)) : recv(c->sock, c->buf, sizeof(c->buf), 0);
+    if (n >= 20 && RADLEN(c->buf) <= n)
+      return 1;
+    if (n > 0)
+      return 0; /* too short, ignored */
+    if (c->ssl)
+      return SSL_get_error(c->ssl, n) == SSL_ERROR_WANT_READ ? 0 : -1;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+
+  for (;;) {
+    want = c->buflen < 4 ? 4 : RADLEN(c->buf);
+    if (c->buflen >= 4 && want < 20)
+      return -1;
+    if (c->buflen == want) {
+      c->buflen = 0;
+      return 1;
+    }
+    n = SSL_read(c->ssl, c->buf + c->buflen, want - c->buflen);
+    if (n <= 0)
+      return SSL_get_error(c->ssl, n) == SSL_ERROR_WANT_READ ? 0 : -1;
+    c->buflen += n;
+  }
+}
+
+static void
+_expire(struct conn *c)
+{
+  struct timespec now;
+  int id;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (id = 0; id < 256; id++)
+    if (c->busy[id] && _diff(&c->senttime[id], &now) > LOST_TIMEOUT) {
+      c->busy[id] = 0;
+      c->outstanding--;
+      c->lost++;
+    }
+}
+
+static void *
+_client(void *arg)
+{
+  struct conn *c = arg;
+  struct radmsg *msg;
+  struct timespec now;
+  uint8_t id, next = 0;
+  int r;
+
+  while (c->sent < c->quota || c->outstanding) {
+    while (c->outstanding < window && c->sent < c->quota) {
+      for (id = next; c->busy[id]; id++);
+      next = id + 1;
+      if (!_send(c, id)) {
+        fprintf(stderr, "loadgen: failed to send request\n");
+        return NULL;
+      }
+    }
+
+    r = _read(c);
+    if (r < 0) {
+      fprintf(stderr, "loadgen: connection failed\n");
+      return NULL;
+    }
+    if (!r) {
+      _expire(c);
+      continue;
+    }
+
+    id = c->buf[1];
+    if (!c->busy[id])
+      continue; /* late reply to a lost request */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    msg = buf2radmsg(c->buf, &radsecret, c->auth[id]);
+    if (!msg) {
+      c->bad++;
+      continue;
+    }
+    radmsg_free(msg);
+    c->latency[c->replies++] = _diff(&c->senttime[id], &now) * 1e6;
+    c->busy[id] = 0;
+    c->outstanding--;
+  }
+  return NULL;
+}
+
+/* answers every request with an Access-Accept or Accounting-Response */
+static void *
+_homeserver(void *arg)
+{
+  char *listen = strdup(homeaddr), *p;
+  struct addrinfo hints, *res;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct radmsg *msg, *reply;
+  uint8_t buf[4096], *out, zero[16];
+  int sock, n;
+
+  p = strrchr(listen, ':');
+  if (!p)
+    return NULL;
+  *p++ = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(listen, p, &hints, &res))
+    return NULL;
+  sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sock < 0 || bind(sock, res->ai_addr, res->ai_addrlen)) {
+    fprintf(stderr, "loadgen: failed to listen on %s:%s\n", listen, p);
+    exit(1);
+  }
+  freeaddrinfo(res);
+  memset(zero, 0, sizeof(zero));
+
+  for (;;) {
+    fromlen = sizeof(from);
+    n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen);
+    if (n < 20 || RADLEN(buf) > n)
+      continue;
+    msg = buf2radmsg(buf, &homeradsecret, NULL);
+    if (!msg)
+      continue;
+    reply = radmsg_init(msg->code == RAD_Accounting_Request ? RAD_Accounting_Response : RAD_Access_Accept,
+              msg->id, msg->auth);
+    radmsg_free(msg);
+    if (!reply)
+      continue;
+    if (reply->code == RAD_Access_Accept)
+      radmsg_add(reply, maketlv(RAD_Attr_Message_Authenticator, 16, zero));
+    out = radmsg2buf(reply, &homeradsecret);
+    radmsg_free(reply);
+    if (!out)
+      continue;
+    sendto(sock, out, RADLEN(out), 0, (struct sockaddr *)&from, fromlen);
+    pool_buffree(out);
+  }
+  return NULL;
+}
+
+static int
+_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+_usage(char *name)
+{
+  fprintf(stderr, "usage: %s [-t udp|tls|dtls] [-c connections] [-w window] [-n requests]\n"
+      "    [-s secret] [-r realm] [-C certfile -K keyfile] [-A cafile]\n"
+      "    [-l address:port -k secret] host port\n", name);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct conn *conns;
+  struct timespec start, end;
+  pthread_t home;
+  uint32_t *latency;
+  long sent = 0, replies = 0, lost = 0, bad = 0;
+  double elapsed;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "t:c:w:n:s:r:C:K:A:l:k:")) != -1) {
+    switch (c) {
+    case 't':
+      if (!strcasecmp(optarg, "udp"))
+        transport = T_UDP;
+      else if (!strcasecmp(optarg, "tls"))
+        transport = T_TLS;
+      else if (!strcasecmp(optarg, "dtls"))
+        transport = T_DTLS;
+      else
+        _usage(argv[0]);
+      break;
+    case 'c':
+      nconns = atoi(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'n':
+      nrequests = atol(optarg);
+      break;
+    case 's':
+      secret = optarg;
+      break;
+    case 'r':
+      realm = optarg;
+      break;
+    case 'C':
+      certfile = optarg;
+      break;
+    case 'K':
+      keyfile = optarg;
+      break;
+    case 'A':
+      cafile = optarg;
+      break;
+    case 'l':
+      homeaddr = optarg;
+      break;
+    case 'k':
+      homesecret = optarg;
+      break;
+    default:
+      _usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || nconns < 1 || window < 1 || window > 256 || nrequests < 1)
+    _usage(argv[0]);
+  host = argv[optind];
+  port = argv[optind + 1];
+
+  debug_init("loadgen");
+  debug_set_level(1);
+  if (!secret)
+    secret = transport == T_UDP ? "secret" : "radsec";
+  radsecret_init(&radsecret, (uint8_t *)secret);
+  radsecret_init(&homeradsecret, (uint8_t *)homesecret);
+  if (transport != T_UDP) {
+    ctx = SSL_CTX_new(transport == T_TLS ? TLS_client_method() : DTLS_client_method());
+    if (!ctx
+      || (certfile && SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1)
+      || (keyfile && SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) != 1)
+      || (cafile && SSL_CTX_load_verify_locations(ctx, cafile, NULL) != 1)) {
+      ERR_print_errors_fp(stderr);
+      return 1;
+    }
+    SSL_CTX_set_verify(ctx, cafile ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+  }
+
+  if (homeaddr) {
+    if (pthread_create(&home, NULL, _homeserver, NULL))
+      return 1;
+    usleep(100000);
+  }
+
+  conns = calloc(nconns, sizeof(struct conn));
+  if (!conns)
+    return 1;
+  for (i = 0; i < nconns; i++) {
+    conns[i].quota = nrequests / nconns + (i < nrequests % nconns);
+    conns[i].latency = malloc(conns[i].quota * sizeof(uint32_t));
+    if (!conns[i].latency || !_connect(&conns[i])) {
+      fprintf(stderr, "loadgen: failed to connect to %s port %s\n", host, port);
+      return 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nconns; i++)
+    if (pthread_create(&conns[i].thread, NULL, _client, &conns[i]))
+      return 1;
+  for (i = 0; i < nconns; i++)
+    pthread_join(conns[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = _diff(&start, &end);
+
+  latency = malloc(nrequests * sizeof(uint32_t));
+  if (!latency)
+    return 1;
+  for (i = 0; i < nconns; i++) {
+    memcpy(latency + replies, conns[i].latency, conns[i].replies * sizeof(uint32_t));
+    sent += conns[i].sent;
+    replies += conns[i].replies;
+    lost += conns[i].lost;
+    bad += conns[i].bad;
+  }
+  qsort(latency, replies, sizeof(uint32_t), _cmp);
+
+  printf("%ld requests, %ld replies, %ld lost, %ld invalid in %.2f s: %.0f requests/s\n",
+     sent, replies, lost, bad, elapsed, replies / elapsed);
+  if (replies)
+    printf("latency ms: p50 %.3f p99 %.3f p999 %.3f max %.3f\n",
+       latency[replies / 2] / 1e3, latency[replies * 99 / 100] / 1e3,
+       latency[replies * 999 / 1000] / 1e3, latency[replies - 1] / 1e3);
+  return sent != replies;
+}
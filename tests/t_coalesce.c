@@ -0,0 +1,71 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Checks that coalescereplies() takes the queued replies in order, also
+ * those larger than the buffer of the stream writers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../radsecproxy.h"
+#include "../debug.h"
+#include "../pool.h"
+
+void removequeue(struct gqueue *q);
+
+static void
+_queue(struct gqueue *q, uint8_t id, int len)
+{
+  struct request *rq = newrequest();
+
+  rq->replybuf = pool_bufalloc(len);
+  memset(rq->replybuf, 0, len);
+  rq->replybuf[0] = RAD_Access_Reject;
+  rq->replybuf[1] = id;
+  rq->replybuf[2] = len >> 8;
+  rq->replybuf[3] = len & 0xff;
+  pthread_mutex_lock(&q->mutex);
+  list_push(q->entries, rq);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct gqueue *q;
+  unsigned char *buf;
+  int len, size = STREAM_WRITE_SIZE, rv = 0;
+
+  debug_init("t_coalesce");
+  q = newqueue();
+  buf = malloc(size);
+
+  /* 1: small replies are written together */
+  _queue(q, 1, 100);
+  _queue(q, 2, 200);
+  len = coalescereplies(q, &buf, 0, &size, 0);
+  if (len != 300 || buf[1] != 1 || buf[101] != 2)
+    rv = !!fprintf(stderr, "small replies coalesced to %d bytes\n", len);
+
+  /* 2: a reply larger than the buffer is taken on its own, in order */
+  _queue(q, 3, 100);
+  _queue(q, 4, 20000);
+  _queue(q, 5, 100);
+  len = coalescereplies(q, &buf, 0, &size, 0);
+  if (len != 100 || buf[1] != 3)
+    rv = !!fprintf(stderr, "reply before the big one gave %d bytes\n", len);
+  len = coalescereplies(q, &buf, 0, &size, 0);
+  if (len != 20000 || buf[1] != 4 || size < 20000)
+    rv = !!fprintf(stderr, "big reply gave %d bytes in a buffer of %d\n", len, size);
+  len = coalescereplies(q, &buf, 0, &size, 0);
+  if (len != 100 || buf[1] != 5)
+    rv = !!fprintf(stderr, "reply after the big one gave %d bytes\n", len);
+
+  /* 3: nothing left */
+  if (coalescereplies(q, &buf, 0, &size, 0) || list_first(q->entries))
+    rv = !!fprintf(stderr, "replies left in the queue\n");
+
+  free(buf);
+  removequeue(q);
+  return rv;
+}
@@ -0,0 +1,116 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../debug.h"
+#include "../hash.h"
+#include "../dyncache.h"
+
+#define NOW 1000000
+
+static void
+_put(struct hash *h, const char *realm, time_t expiry, const char *config)
+{
+  size_t len = config ? strlen(config) : 0;
+  struct dynlookup *e = malloc(sizeof(struct dynlookup) + len);
+
+  e->expiry = expiry;
+  e->failed = !config;
+  e->len = len;
+  if (len)
+    memcpy(e->config, config, len);
+  hash_insert(h, (void *)realm, strlen(realm), e);
+}
+
+static int
+_check(struct hash *h, const char *realm, time_t expiry, const char *config)
+{
+  struct dynlookup *e = hash_read(h, (void *)realm, strlen(realm));
+
+  if (!e)
+    return !!fprintf(stderr, "%s not loaded\n", realm);
+  if (e->expiry != expiry || e->failed != !config)
+    return !!fprintf(stderr, "%s loaded with expiry %ld and failed %d\n", realm, (long)e->expiry, e->failed);
+  if (config && (e->len != strlen(config) || memcmp(e->config, config, e->len)))
+    return !!fprintf(stderr, "%s loaded with wrong config\n", realm);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct hash *h, *l;
+  unsigned char *buf;
+  size_t len;
+  char file[] = "/tmp/t_dyncache.XXXXXX";
+  FILE *f;
+  int fd, rv = 0;
+
+  debug_init("t_dyncache");
+  fd = mkstemp(file);
+  if (fd < 0)
+    return !!fprintf(stderr, "mkstemp failed\n");
+  close(fd);
+
+  h = hash_create();
+  _put(h, "example.org", NOW + 3600, "server {\n\thost 192.0.2.1\n\ttype tls\n}\nTTL 3600\n");
+  _put(h, "failed.example", NOW + 900, NULL);
+  _put(h, "expired.example", NOW, "server {\n\thost 192.0.2.2\n}\n");
+
+  /* 1: round trip, expired entries left out */
+  buf = dyncache_pack(h, NOW, &len);
+  if (!buf || !dyncache_write(file, buf, len))
+    return !!fprintf(stderr, "writing %s failed\n", file);
+  free(buf);
+  l = hash_create();
+  if (dyncache_load(file, l, NOW) != 2)
+    rv = !!fprintf(stderr, "loaded wrong number of entries\n");
+  rv |= _check(l, "example.org", NOW + 3600, "server {\n\thost 192.0.2.1\n\ttype tls\n}\nTTL 3600\n");
+  rv |= _check(l, "failed.example", NOW + 900, NULL);
+  if (hash_read(l, "expired.example", strlen("expired.example")))
+    rv = !!fprintf(stderr, "expired entry written\n");
+
+  /* 2: entries expired by the time of loading are skipped, those in the
+   * cache expiring later are kept */
+  _put(h, "later.example", NOW + 7200, "server {\n}\n");
+  buf = dyncache_pack(h, NOW, &len);
+  dyncache_write(file, buf, len);
+  free(buf);
+  hash_destroy(l);
+  l = hash_create();
+  _put(l, "later.example", NOW + 9000, NULL);
+  if (dyncache_load(file, l, NOW + 1000) != 1)
+    rv = !!fprintf(stderr, "loaded wrong number of entries when merging\n");
+  rv |= _check(l, "later.example", NOW + 9000, NULL);
+  if (hash_read(l, "failed.example", strlen("failed.example")))
+    rv = !!fprintf(stderr, "entry expired at loading added\n");
+
+  /* 3: truncated file gives the entries before the damage */
+  buf = dyncache_pack(h, NOW, &len);
+  f = fopen(file, "w");
+  fwrite(buf, 1, len - 3, f);
+  fclose(f);
+  free(buf);
+  hash_destroy(l);
+  l = hash_create();
+  if (dyncache_load(file, l, NOW) < 1 || dyncache_load(file, l, NOW) != 0)
+    rv = !!fprintf(stderr, "truncated file not loaded up to the damage\n");
+
+  /* 4: other files are refused, a missing file is empty */
+  f = fopen(file, "w");
+  fputs("not a cache file\n", f);
+  fclose(f);
+  if (dyncache_load(file, l, NOW) != -1)
+    rv = !!fprintf(stderr, "loaded a file that is not a cache file\n");
+  unlink(file);
+  if (dyncache_load(file, l, NOW) != 0)
+    rv = !!fprintf(stderr, "missing file not empty\n");
+
+  hash_destroy(l);
+  hash_destroy(h);
+  return rv;
+}
@@ -2,6 +2,7 @@
 /* See LICENSE for licensing information. */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "../radsecproxy.h"
@@ -26,6 +27,27 @@ _check_hash(const char *mac, const char *key, const char *hash, const char*hmac)
   return rv;
 }
 
+/* the keyed context must give the same hmac every time it is used */
+static int
+_check_keyed(const char *mac, const char *key, const char *hmac)
+{
+  struct hmac_sha256_ctx *keyed;
+  uint8_t buf[64+1];
+  int i, rv = 0;
+
+  keyed = fticks_hashmac_key((const uint8_t *) key);
+  if (!keyed)
+    return -ENOMEM;
+  for (i = 0; i < 2; i++) {
+    if (fticks_hashmac_keyed((const uint8_t *) mac, keyed, sizeof(buf), buf) != 0)
+      rv = -ENOMEM;
+    else if (strcmp(hmac, (const char *) buf) != 0)
+      rv = !!fprintf(stderr, "%s: bad keyed hash (key=\"%s\"): %s\n", mac, key, buf);
+  }
+  free(keyed);
+  return rv;
+}
+
 #define MAC1 "00:23:14:0a:f7:24"
 #define MAC1_UC "00:23:14:0A:F7:24"
 #define MAC1_APPENDED "00:23:14:0a:f7:24;cruft"
@@ -49,6 +71,8 @@ main (int argc, char *argv[])
     return 1;
   if (_check_hash(MAC1_WEIRD, KEY1, HASH1, HMAC1) != 0)
     return 1;
+  if (_check_keyed(MAC1_UC, KEY1, HMAC1) != 0)
+    return 1;
 
   return 0;
 }
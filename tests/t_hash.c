@@ -0,0 +1,94 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../hash.h"
+
+#define NKEYS 20000
+
+/* SipHash-2-4 reference vector, key 00..0f and message 00..0e */
+static int
+_check_siphash(void)
+{
+  uint64_t k[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+  uint8_t in[15];
+  int i;
+
+  for (i = 0; i < 15; i++)
+    in[i] = i;
+  if (hash_siphash(in, 15, k) != 0xa129ca6149be45e5ULL)
+    return !!fprintf(stderr, "bad siphash\n");
+  return 0;
+}
+
+static int
+_check_hash(struct hash *h)
+{
+  struct hash_entry *e;
+  char key[16];
+  int i, n;
+  int *v;
+
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    v = malloc(sizeof(int));
+    *v = i;
+    if (!hash_insert(h, key, strlen(key), v))
+      return !!fprintf(stderr, "insert %s failed\n", key);
+    /* read back an early key while the table is growing */
+    v = hash_read(h, "k0", 2);
+    if (!v || *v != 0)
+      return !!fprintf(stderr, "k0 lost after inserting %s\n", key);
+  }
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    v = hash_read(h, key, strlen(key));
+    if (!v || *v != i)
+      return !!fprintf(stderr, "read %s failed\n", key);
+  }
+  for (i = 0; i < NKEYS; i += 2) {
+    snprintf(key, sizeof(key), "k%d", i);
+    v = hash_extract(h, key, strlen(key));
+    if (!v || *v != i)
+      return !!fprintf(stderr, "extract %s failed\n", key);
+    free(v);
+  }
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    if (!hash_read(h, key, strlen(key)) != !(i & 1))
+      return !!fprintf(stderr, "%s wrong after extract\n", key);
+  }
+  for (n = 0, e = hash_first(h); e; e = hash_next(e))
+    n++;
+  if (n != NKEYS / 2)
+    return !!fprintf(stderr, "walked %d entries, expected %d\n", n, NKEYS / 2);
+
+  /* equal keys are read in insertion order */
+  v = malloc(sizeof(int));
+  *v = -1;
+  hash_insert(h, "k1", 2, v);
+  v = hash_extract(h, "k1", 2);
+  if (!v || *v != 1)
+    return !!fprintf(stderr, "duplicate key read out of order\n");
+  free(v);
+  v = hash_read(h, "k1", 2);
+  if (!v || *v != -1)
+    return !!fprintf(stderr, "duplicate key lost\n");
+
+  hash_destroy(h);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int rv = 0;
+
+  rv |= _check_siphash();
+  rv |= _check_hash(hash_create());
+  rv |= _check_hash(hash_createstriped(8));
+  return rv;
+}
@@ -0,0 +1,107 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../radsecproxy.h"
+#include "../hostport.h"
+#include "../debug.h"
+
+static const char *confs[] = {
+  "10.0.0.0/8",
+  "10.1.2.3",
+  "10.1.0.0/16",
+  "192.0.2.1:1812",
+  "192.0.2.0/24",
+  "0.0.0.0/0",
+  "[2001:db8::1]:1812",
+  "[2001:db8::]/32",
+  "[2001:db8:1::]/48",
+  "[::]/0",
+  NULL
+};
+
+static const char *addrs[] = {
+  "10.1.2.3", "10.1.2.4", "10.2.0.1", "11.0.0.1", "192.0.2.1", "192.0.2.9",
+  "2001:db8::1", "2001:db8:1::5", "2001:db9::1", "::ffff:10.1.2.3",
+  "::ffff:192.0.2.1", NULL
+};
+
+static struct list *
+_hostports(const char *s)
+{
+  struct list *hostports = NULL;
+  char *args[2];
+
+  args[0] = (char *) s;
+  args[1] = NULL;
+  if (!addhostport(&hostports, args, "1812", 1))
+    return NULL;
+  if (!resolvehostports(hostports, AF_UNSPEC, SOCK_DGRAM))
+    return NULL;
+  return hostports;
+}
+
+/* compares the index with calling addressmatches() on each list */
+static int
+_check(struct hostportindex *idx, struct list **lists, int n,
+       const char *a, uint16_t port, uint8_t checkport)
+{
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+  void *after = NULL, *got;
+  int i;
+
+  memset(&ss, 0, sizeof(ss));
+  if (inet_pton(AF_INET, a, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, a, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+  } else
+    return !!fprintf(stderr, "%s: bad address\n", a);
+
+  for (i = 0; i <= n; i++) {
+    if (i < n && !addressmatches(lists[i], (struct sockaddr *) &ss, checkport))
+      continue;
+    got = hostportindex_match(idx, (struct sockaddr *) &ss, checkport, after);
+    if (got != (i < n ? lists[i] : NULL))
+      return !!fprintf(stderr, "%s port %d: expected %s, got %p\n", a, port,
+                       i < n ? confs[i] : "none", got);
+    after = got;
+  }
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct hostportindex *idx;
+  struct list *lists[sizeof(confs) / sizeof(confs[0])];
+  int i, n, rv = 0;
+
+  debug_init("t_hostportindex");
+  idx = hostportindex_create();
+  if (!idx)
+    return 1;
+  for (n = 0; confs[n]; n++) {
+    lists[n] = _hostports(confs[n]);
+    if (!lists[n] || !hostportindex_add(idx, lists[n], lists[n]))
+      return !!fprintf(stderr, "%s: failed to add\n", confs[n]);
+  }
+
+  for (i = 0; addrs[i]; i++) {
+    rv |= _check(idx, lists, n, addrs[i], 1812, 0);
+    rv |= _check(idx, lists, n, addrs[i], 1812, 1);
+    rv |= _check(idx, lists, n, addrs[i], 1645, 1);
+  }
+
+  hostportindex_free(idx);
+  return rv;
+}
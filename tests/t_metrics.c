@@ -0,0 +1,91 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../radsecproxy.h"
+#include "../metrics.h"
+
+#define NTHREADS 12
+#define NINCS 10000
+
+static struct metrics *m;
+
+static void *
+_counter(void *arg)
+{
+  int i;
+
+  for (i = 0; i < NINCS; i++) {
+    metrics_inc(m, METRIC_REQUESTS_IN);
+    metrics_reply(m, i & 1 ? RAD_Access_Accept : RAD_Access_Reject);
+  }
+  return NULL;
+}
+
+static int
+_check_threads(void)
+{
+  pthread_t t[NTHREADS];
+  uint64_t v[METRICS_N];
+  int i;
+
+  for (i = 0; i < NTHREADS; i++)
+    if (pthread_create(t + i, NULL, _counter, NULL))
+      return !!fprintf(stderr, "pthread_create failed\n");
+  for (i = 0; i < NTHREADS; i++)
+    pthread_join(t[i], NULL);
+
+  metrics_read(m, v);
+  if (v[METRIC_REQUESTS_IN] != NTHREADS * NINCS)
+    return !!fprintf(stderr, "counted %llu requests, expected %d\n",
+                     (unsigned long long)v[METRIC_REQUESTS_IN], NTHREADS * NINCS);
+  if (v[METRIC_REPLIES_ACCEPT] != NTHREADS * NINCS / 2
+      || v[METRIC_REPLIES_REJECT] != NTHREADS * NINCS / 2)
+    return !!fprintf(stderr, "wrong reply counts\n");
+  return 0;
+}
+
+static int
+_check_rtt(void)
+{
+  struct timeval sent;
+  uint64_t v[METRICS_N];
+  int i;
+
+  gettimeofday(&sent, NULL);
+  metrics_rtt(m, &sent);
+  sent.tv_sec -= 1;
+  metrics_rtt(m, &sent);
+  sent.tv_sec -= 10;
+  metrics_rtt(m, &sent);
+
+  metrics_read(m, v);
+  if (v[METRIC_RTT_BUCKET] != 1)
+    return !!fprintf(stderr, "fast reply not in first bucket\n");
+  if (v[METRIC_RTT_BUCKET + METRICS_RTT_BUCKETS - 1] != 1)
+    return !!fprintf(stderr, "slow reply not in last bucket\n");
+  for (i = 1; i < METRICS_RTT_BUCKETS - 1; i++)
+    if (v[METRIC_RTT_BUCKET + i] && v[METRIC_RTT_BUCKET + i] != 1)
+      return !!fprintf(stderr, "wrong count in bucket %d\n", i);
+  if (v[METRIC_RTT_SUM] < 12000000 || v[METRIC_RTT_SUM] > 13000000)
+    return !!fprintf(stderr, "rtt sum %llu out of range\n", (unsigned long long)v[METRIC_RTT_SUM]);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int rv = 0;
+
+  m = metrics_create();
+  if (!m)
+    return !!fprintf(stderr, "metrics_create failed\n");
+  rv |= _check_threads();
+  rv |= _check_rtt();
+  metrics_free(m);
+  metrics_inc(NULL, METRIC_LOST);
+  return rv;
+}
@@ -0,0 +1,129 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Runs tools/naptr-eduroam.sh with a dig answering from canned records
+ * and parses its output as radsecproxy parses DynamicLookupCommand
+ * output. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../debug.h"
+#include "../gconfig.h"
+
+static const char *fakedig =
+  "#!/bin/sh\n"
+  "for a; do t=$q; q=$a; done\n"
+  "case \"$t $q\" in\n"
+  "'naptr example.org')\n"
+  "  echo 'example.org.\t\t7200\tIN\tNAPTR\t100 10 \"s\" \"x-eduroam:radius.tls\" \"\" _radsec._tcp.example.org.'\n"
+  "  echo 'example.org.\t\t7200\tIN\tNAPTR\t200 10 \"s\" \"x-other:radius.tls\" \"\" _other._tcp.example.org.'\n"
+  "  ;;\n"
+  "'srv _radsec._tcp.example.org')\n"
+  "  echo '_radsec._tcp.example.org. 3600\tIN\tSRV\t20 0 2083 radius2.example.org.'\n"
+  "  echo '_radsec._tcp.example.org. 3600\tIN\tSRV\t10 0 2084 radius1.example.org.'\n"
+  "  ;;\n"
+  "'naptr long.example')\n"
+  "  echo 'long.example.\t\t999999\tIN\tNAPTR\t100 10 \"s\" \"x-eduroam:radius.tls\" \"\" _radsec._tcp.long.example.'\n"
+  "  ;;\n"
+  "'srv _radsec._tcp.long.example')\n"
+  "  echo '_radsec._tcp.long.example. 999999\tIN\tSRV\t10 0 2083 radius.long.example.'\n"
+  "  ;;\n"
+  "esac\n";
+
+static char *server, *type, **hosts;
+
+static int
+_server_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val)
+{
+  free(server);
+  server = strdup(val);
+  return getgenericconfig(cf, block, "host", CONF_MSTR, &hosts, "type", CONF_STR, &type, NULL);
+}
+
+/* runs the script for realm and parses the output */
+static int
+_lookup(const char *script, const char *realm, long int *ttl)
+{
+  struct gconffile *cf = NULL;
+  char cmd[PATH_MAX + 64], out[4096];
+  size_t len;
+  FILE *p;
+  int ok;
+
+  snprintf(cmd, sizeof(cmd), "%s %s", script, realm);
+  p = popen(cmd, "r");
+  if (!p)
+    return 0;
+  len = fread(out, 1, sizeof(out) - 1, p);
+  out[len] = '\0';
+  if (pclose(p))
+    return 0;
+
+  free(server);
+  free(type);
+  freegconfmstr(hosts);
+  server = type = NULL;
+  hosts = NULL;
+  *ttl = LONG_MIN;
+  pushgconfdata(&cf, out);
+  ok = getgenericconfig(&cf, NULL, "Server", CONF_CBK, _server_cb, NULL, "TTL", CONF_LINT, ttl, NULL);
+  freegconf(&cf);
+  return ok;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char dir[] = "/tmp/t_naptr.XXXXXX", dig[64], path[PATH_MAX + 64], script[PATH_MAX];
+  const char *srcdir = getenv("srcdir");
+  long int ttl;
+  FILE *f;
+  int rv = 0;
+
+  debug_init("t_naptr");
+  if (!mkdtemp(dir))
+    return !!fprintf(stderr, "mkdtemp failed\n");
+  snprintf(dig, sizeof(dig), "%s/dig", dir);
+  f = fopen(dig, "w");
+  if (!f)
+    return !!fprintf(stderr, "cannot write %s\n", dig);
+  fputs(fakedig, f);
+  fclose(f);
+  chmod(dig, 0755);
+  snprintf(path, sizeof(path), "%s:%s", dir, getenv("PATH"));
+  setenv("PATH", path, 1);
+  snprintf(script, sizeof(script), "%s/../tools/naptr-eduroam.sh", srcdir ? srcdir : ".");
+
+  /* 1: hosts by priority, the lowest TTL of the records used */
+  if (!_lookup(script, "example.org", &ttl))
+    rv = !!fprintf(stderr, "lookup of example.org failed\n");
+  else {
+    if (!server || strcmp(server, "dynamic_radsec.example.org"))
+      rv = !!fprintf(stderr, "wrong server block %s\n", server ? server : "(none)");
+    if (!type || strcasecmp(type, "tls"))
+      rv = !!fprintf(stderr, "wrong type %s\n", type ? type : "(none)");
+    if (!hosts || !hosts[0] || !hosts[1] || hosts[2] ||
+        strcmp(hosts[0], "radius1.example.org:2084") || strcmp(hosts[1], "radius2.example.org:2083"))
+      rv = !!fprintf(stderr, "wrong hosts\n");
+    if (ttl != 3600)
+      rv = !!fprintf(stderr, "TTL %ld, expected 3600\n", ttl);
+  }
+
+  /* 2: TTLs over a week are capped */
+  if (!_lookup(script, "long.example", &ttl))
+    rv = !!fprintf(stderr, "lookup of long.example failed\n");
+  else if (ttl != 604800)
+    rv = !!fprintf(stderr, "TTL %ld, expected 604800\n", ttl);
+
+  /* 3: no records, no server */
+  if (_lookup(script, "none.example", &ttl))
+    rv = !!fprintf(stderr, "lookup of none.example did not fail\n");
+
+  unlink(dig);
+  rmdir(dir);
+  return rv;
+}
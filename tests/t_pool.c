@@ -0,0 +1,84 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../pool.h"
+
+#define NOBJS 10000
+
+static size_t sizes[] = { 1, 16, 24, 100, 256, 1000, 4000, 4096, 5000 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* objects allocated in main() and freed by another thread */
+static void *objs[NOBJS];
+
+static void *
+_freer(void *arg)
+{
+  int i;
+
+  for (i = 0; i < NOBJS; i++)
+    pool_free(objs[i], sizes[i % NSIZES]);
+  return NULL;
+}
+
+static int
+_check_sizes(void)
+{
+  void *p[NSIZES];
+  uint8_t *b;
+  size_t i;
+
+  for (i = 0; i < NSIZES; i++) {
+    p[i] = pool_zalloc(sizes[i]);
+    if (!p[i])
+      return !!fprintf(stderr, "pool_zalloc(%zu) failed\n", sizes[i]);
+    if (((uint8_t *)p[i])[sizes[i] - 1])
+      return !!fprintf(stderr, "pool_zalloc(%zu) not zeroed\n", sizes[i]);
+    memset(p[i], 0xff, sizes[i]);
+  }
+  for (i = 0; i < NSIZES; i++)
+    pool_free(p[i], sizes[i]);
+
+  for (i = 0; i < NSIZES; i++) {
+    b = pool_bufalloc(sizes[i]);
+    if (!b)
+      return !!fprintf(stderr, "pool_bufalloc(%zu) failed\n", sizes[i]);
+    memset(b, 0xff, sizes[i]);
+    pool_buffree(b);
+  }
+  return 0;
+}
+
+static int
+_check_threads(void)
+{
+  pthread_t t;
+  int i, round;
+
+  for (round = 0; round < 4; round++) {
+    for (i = 0; i < NOBJS; i++) {
+      objs[i] = pool_malloc(sizes[i % NSIZES]);
+      if (!objs[i])
+        return !!fprintf(stderr, "pool_malloc failed\n");
+      memset(objs[i], i, sizes[i % NSIZES]);
+    }
+    if (pthread_create(&t, NULL, _freer, NULL))
+      return !!fprintf(stderr, "pthread_create failed\n");
+    pthread_join(t, NULL);
+  }
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int rv = 0;
+
+  rv |= _check_sizes();
+  rv |= _check_threads();
+  return rv;
+}
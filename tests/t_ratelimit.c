@@ -0,0 +1,57 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../ratelimit.h"
+
+#define NTHREADS 8
+#define NTAKES 1000
+
+static struct ratelimit rl;
+static int taken[NTHREADS];
+
+static void *
+_taker(void *arg)
+{
+  int i, *n = arg;
+
+  for (i = 0; i < NTAKES; i++)
+    *n += ratelimit_take(&rl);
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t t[NTHREADS];
+  int i, n;
+
+  memset(&rl, 0, sizeof(rl));
+  for (i = 0; i < 100; i++)
+    if (!ratelimit_take(&rl))
+      return !!fprintf(stderr, "bucket without a limit was empty\n");
+
+  ratelimit_init(&rl, 10, 5);
+  for (i = 0; i < 5; i++)
+    if (!ratelimit_take(&rl))
+      return !!fprintf(stderr, "burst of 5 ran out after %d\n", i);
+  if (ratelimit_take(&rl))
+    return !!fprintf(stderr, "burst of 5 allowed 6\n");
+
+  /* one token a second, far slower than this runs */
+  ratelimit_init(&rl, 1, NTAKES);
+  rl.tat = 0;
+  for (i = 0; i < NTHREADS; i++)
+    if (pthread_create(t + i, NULL, _taker, taken + i))
+      return !!fprintf(stderr, "pthread_create failed\n");
+  for (n = i = 0; i < NTHREADS; i++) {
+    pthread_join(t[i], NULL);
+    n += taken[i];
+  }
+  if (n < NTAKES || n > NTAKES + 1)
+    return !!fprintf(stderr, "took %d tokens, expected %d\n", n, NTAKES);
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../radsecproxy.h"
+
+struct modattr *extractmodattr(char *nameval);
+int dorewritemodattr(struct tlv *attr, struct modattr *modattr);
+int dovendorrewriterm(struct tlv *attr, struct vendorrm *rmv, int nrmv);
+
+/* rewrite, input, expected output */
+static const char *cases[][3] = {
+  {"1:/^(.*)@example\\.org$/\\1/", "user@Example.ORG", "user"},
+  {"1:/^(.*)@example\\.org$/\\1/", "user@example.net", "user@example.net"},
+  {"1:/^(.*)@example\\.org$/\\1/", "user@exampleXorg", "user@exampleXorg"},
+  {"1:/^(.*)$/\\1@example.org/", "user", "user@example.org"},
+  {"1:/^host\\/(.*)$/\\1\\2/", "HOST/pc1", "pc1\\2"},
+  {"1:/^(.*)@(.*)$/\\2:\\1\\/", "user@example.org", "example.org:user\\"},
+  {"1:/^(a|b)(.*)$/x\\0\\2\\3/", "bcd", "x\\0cd\\3"},
+  {"1:/^nomatch$/x/", "user", "user"},
+  {NULL, NULL, NULL}
+};
+
+static int
+_check_modattr(void)
+{
+  char conf[64];
+  struct modattr *m;
+  struct tlv *attr;
+  int i, rv = 0;
+
+  for (i = 0; cases[i][0]; i++) {
+    strcpy(conf, cases[i][0]);
+    m = extractmodattr(conf);
+    if (!m)
+      return !!fprintf(stderr, "extractmodattr %s failed\n", cases[i][0]);
+    attr = maketlv(1, strlen(cases[i][1]), (void *)cases[i][1]);
+    if (!dorewritemodattr(attr, m))
+      return !!fprintf(stderr, "dorewritemodattr %s failed\n", cases[i][0]);
+    if (attr->l != strlen(cases[i][2]) || memcmp(attr->v, cases[i][2], attr->l))
+      rv = !!fprintf(stderr, "%s on %s gave %.*s, expected %s\n",
+                     cases[i][0], cases[i][1], attr->l, attr->v, cases[i][2]);
+    freetlv(attr);
+  }
+
+  /* regexec only sees the value up to the first NUL */
+  strcpy(conf, "1:/^(.*)@x$/\\1/");
+  m = extractmodattr(conf);
+  if (!m || m->match != MODATTR_SUFFIX)
+    return !!fprintf(stderr, "suffix form not recognised\n");
+  attr = maketlv(1, 5, "a\0b@x");
+  if (!dorewritemodattr(attr, m) || attr->l != 5)
+    rv = !!fprintf(stderr, "value with NUL was rewritten\n");
+  freetlv(attr);
+  return rv;
+}
+
+static int
+_check_vendorrm(void)
+{
+  struct vendorrm rmv[2];
+  uint8_t v[] = {0, 0, 0, 9, 1, 3, 'a', 2, 3, 'b', 3, 3, 'c'};
+  struct tlv *attr;
+
+  memset(rmv, 0, sizeof(rmv));
+  rmv[0].vendor = 9;
+  rmv[0].subattrs[0] = 1U << 2;
+  rmv[1].vendor = 311;
+  rmv[1].all = 1;
+
+  attr = maketlv(RAD_Attr_Vendor_Specific, sizeof(v), v);
+  if (dovendorrewriterm(attr, rmv, 2) || attr->l != 10 || attr->v[7] != 3)
+    return !!fprintf(stderr, "subattribute 2 of vendor 9 not removed\n");
+  attr->v[2] = 1;
+  attr->v[3] = 55;
+  if (!dovendorrewriterm(attr, rmv, 2))
+    return !!fprintf(stderr, "vendor 311 not removed\n");
+  attr->v[3] = 56;
+  if (dovendorrewriterm(attr, rmv, 2) || attr->l != 10)
+    return !!fprintf(stderr, "vendor 312 was modified\n");
+  freetlv(attr);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int rv = 0;
+
+  rv |= _check_modattr();
+  rv |= _check_vendorrm();
+  return rv;
+}
@@ -0,0 +1,85 @@
+/* Copyright (C) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../debug.h"
+#include "../workers.h"
+
+#define NWORKERS 4
+#define NFLOWS 8
+#define NITEMS 5000
+
+pthread_attr_t pthread_attr;
+
+struct testflow {
+  struct workflow flow;
+  int running, next, bad;
+};
+
+static struct testflow flows[NFLOWS];
+static struct workflow unordered;
+static int done;
+
+static void
+_ordered(void *arg, unsigned char *buf)
+{
+  struct testflow *f = arg;
+  int i = (int)(long)buf;
+
+  if (__sync_fetch_and_add(&f->running, 1))
+    f->bad = 1;
+  if (i != f->next)
+    f->bad = 1;
+  f->next = i + 1;
+  __sync_fetch_and_sub(&f->running, 1);
+}
+
+static void
+_unordered(void *arg, unsigned char *buf)
+{
+  __sync_fetch_and_add(&done, 1);
+}
+
+/* submits as the readers do, keeping what the workers cannot take yet */
+static void
+_submit(struct workflow *flow, void (*fn)(void *, unsigned char *), void *arg, long i)
+{
+  while (!workers_submit(flow, fn, arg, (unsigned char *)i))
+    workflow_drain(flow);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i, j, rv = 0;
+
+  debug_init("t_workers");
+  pthread_attr_init(&pthread_attr);
+  if (workers_init(NWORKERS) != NWORKERS || workers_count() != NWORKERS)
+    return !!fprintf(stderr, "workers_init failed\n");
+
+  for (j = 0; j < NFLOWS; j++)
+    workflow_init(&flows[j].flow, 1);
+  workflow_init(&unordered, 0);
+
+  for (i = 0; i < NITEMS; i++) {
+    for (j = 0; j < NFLOWS; j++)
+      _submit(&flows[j].flow, _ordered, flows + j, i);
+    _submit(&unordered, _unordered, NULL, i);
+  }
+
+  for (j = 0; j < NFLOWS; j++) {
+    workflow_destroy(&flows[j].flow);
+    if (flows[j].bad)
+      rv = !!fprintf(stderr, "flow %d ran out of order or at the same time\n", j);
+    if (flows[j].next != NITEMS)
+      rv = !!fprintf(stderr, "flow %d ran %d items, expected %d\n", j, flows[j].next, NITEMS);
+  }
+  workflow_destroy(&unordered);
+  if (done != NITEMS)
+    rv = !!fprintf(stderr, "unordered flow ran %d items, expected %d\n", done, NITEMS);
+  return rv;
+}
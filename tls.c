@@ -23,10 +23,12 @@
 #include <assert.h>
 #include "radsecproxy.h"
 #include "hostport.h"
+#include "evloop.h"
 
 #ifdef RADPROT_TLS
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
@@ -34,6 +36,7 @@ void *tlslistener(void *arg);
 int tlsconnect(struct server *server, int timeout, char *text);
 void *tlsclientrd(void *arg);
 int clientradputtls(struct server *server, unsigned char *rad);
+int clientradflushtls(struct server *server);
 void tlssetsrcres();
 
 static const struct protodefs protodefs = {
@@ -52,6 +55,7 @@ static const struct protodefs protodefs = {
     tlsconnect, /* connecter */
     tlsclientrd, /* clientconnreader */
     clientradputtls, /* clientradput */
+    clientradflushtls, /* clientradflush */
     NULL, /* addclient */
     NULL, /* addserverextra */
     tlssetsrcres, /* setsrcres */
@@ -118,6 +122,10 @@ int tlsconnect(struct server *server, int timeout, char *text) {
             debug(DBG_DBG, "tlsconnect: timeout");
             return 0;
         }
+        if (server->conf->retired) {
+            server->sock = -1;
+            return 0;
+        }
 
         debug(DBG_INFO, "tlsconnect: connecting to %s", server->conf->name);
         if ((server->sock = connecttcphostlist(server->conf->hostports, srcres)) < 0)
@@ -135,6 +143,7 @@ int tlsconnect(struct server *server, int timeout, char *text) {
         pthread_mutex_unlock(&server->conf->tlsconf->lock);
         if (!server->ssl)
             continue;
+        tlsusesession(server->ssl, server);
 
         SSL_set_fd(server->ssl, server->sock);
         if (sslconnecttimeout(server->ssl, 5) <= 0) {
@@ -144,14 +153,18 @@ int tlsconnect(struct server *server, int timeout, char *text) {
             continue;
         }
 
+        tlscounthandshake(server->ssl, server->conf->tlsconf, server->conf->name);
         cert = verifytlscert(server->ssl);
-        if (!cert)
+        if (!cert) {
+            tlsdropsession(server);
             continue;
+        }
         if (verifyconfcert(cert, server->conf)) {
             X509_free(cert);
             break;
         }
         X509_free(cert);
+        tlsdropsession(server);
     }
     debug(DBG_WARN, "tlsconnect: TLS connection to %s up", server->conf->name);
 
@@ -214,6 +227,9 @@ int sslreadtimeout(SSL *ssl, unsigned char *buf, int num, int timeout, pthread_m
                 }
 
                 SSL_shutdown(ssl);
+                /* SSL_shutdown() does nothing after a fatal error, but the
+                 * reader needs to see that the connection is gone */
+                SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
                 pthread_mutex_unlock(lock);
                 return -1;
             }
@@ -239,6 +255,7 @@ int sslreadtimeout(SSL *ssl, unsigned char *buf, int num, int timeout, pthread_m
                     }
                     /* ensure ssl connection is shutdown */
                     SSL_shutdown(ssl);
+                    SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
                     pthread_mutex_unlock(lock);
                     return -1;
             }
@@ -265,7 +282,7 @@ unsigned char *radtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
         pthread_mutex_unlock(lock);
         return NULL;
 	}
-	rad = malloc(len);
+	rad = pool_bufalloc(len);
 	if (!rad) {
 	    debug(DBG_ERR, "radtlsget: malloc failed");
 	    return NULL;
@@ -274,7 +291,7 @@ unsigned char *radtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
 
 	cnt = sslreadtimeout(ssl, rad + 4, len - 4, timeout, lock);
 	if (cnt < 1) {
-	    free(rad);
+	    pool_buffree(rad);
 	    return NULL;
 	}
 
@@ -282,6 +299,32 @@ unsigned char *radtlsget(SSL *ssl, int timeout, pthread_mutex_t *lock) {
     return rad;
 }
 
+/* writes to a socket that the kernel encrypts for, waiting while the
+ * socket buffer is full; returns num, or -1 on error */
+static int ktlswrite(int s, unsigned char *buf, int num) {
+    int cnt, len = 0;
+    struct pollfd fds[1];
+
+    while (len < num) {
+        cnt = write(s, buf + len, num - len);
+        if (cnt > 0) {
+            len += cnt;
+            continue;
+        }
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fds[0].fd = s;
+            fds[0].events = POLLOUT;
+            if (poll(fds, 1, -1) > 0 && !(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)))
+                continue;
+        }
+        debugerrno(errno, DBG_ERR, "dosslwrite: write failed");
+        return -1;
+    }
+    return num;
+}
+
 int dosslwrite(SSL *ssl, void *buf, int num, uint8_t may_block){
     int ret;
     unsigned long error;
@@ -301,6 +344,11 @@ int dosslwrite(SSL *ssl, void *buf, int num, uint8_t may_block){
         }
     }
 
+    /* with kernel TLS a partial write is simply continued, there is no
+     * record that SSL_write must be retried with */
+    if (tlsktlssend(ssl))
+        return ktlswrite(SSL_get_fd(ssl), buf, num);
+
     while ((ret = SSL_write(ssl, buf, num)) <= 0) {
         switch (SSL_get_error(ssl, ret)) {
             case SSL_ERROR_WANT_READ:
@@ -315,10 +363,36 @@ int dosslwrite(SSL *ssl, void *buf, int num, uint8_t may_block){
     return ret;
 }
 
-int clientradputtls(struct server *server, unsigned char *rad) {
+/* writes len bytes of requests to the server, called with the server
+ * lock held */
+static int tlswritelocked(struct server *server, unsigned char *buf, int len) {
     int cnt;
+
+    if (server->state != RSP_SERVER_STATE_CONNECTED)
+        return 0;
+    if ((cnt = dosslwrite(server->ssl, buf, len, 0)) <= 0)
+        return 0;
+    debug(DBG_DBG, "clientradflushtls: Sent %d bytes to TLS peer %s", cnt, server->conf->name);
+    return 1;
+}
+
+/* writes the requests buffered by clientradputtls(), called with the
+ * server lock held */
+static int tlsflushlocked(struct server *server) {
+    int len = server->wlen;
+
+    if (!len)
+        return 1;
+    server->wlen = 0;
+    return tlswritelocked(server, server->wbuf, len);
+}
+
+/* buffers the packet, clientwr() calls clientradflushtls() when no more
+ * requests are ready, so that they are written with a single SSL_write.
+ * A packet larger than the buffer is written on its own */
+int clientradputtls(struct server *server, unsigned char *rad) {
     size_t len;
-    struct clsrvconf *conf = server->conf;
+    int ret;
 
     pthread_mutex_lock(&server->lock);
     if (server->state != RSP_SERVER_STATE_CONNECTED) {
@@ -327,16 +401,36 @@ int clientradputtls(struct server *server, unsigned char *rad) {
     }
 
     len = RADLEN(rad);
-    if ((cnt = dosslwrite(server->ssl, rad, len, 0)) <= 0) {
+    if (!server->wbuf && !(server->wbuf = malloc(STREAM_WRITE_SIZE))) {
         pthread_mutex_unlock(&server->lock);
+        debug(DBG_ERR, "clientradputtls: malloc failed");
         return 0;
     }
-
-    debug(DBG_DBG, "clientradputtls: Sent %d bytes, Radius packet of length %d to TLS peer %s", cnt, len, conf->name);
+    if (server->wlen + len > STREAM_WRITE_SIZE && !tlsflushlocked(server)) {
+        pthread_mutex_unlock(&server->lock);
+        return 0;
+    }
+    if (len > STREAM_WRITE_SIZE) {
+        ret = tlswritelocked(server, rad, len);
+        pthread_mutex_unlock(&server->lock);
+        return ret;
+    }
+    memcpy(server->wbuf + server->wlen, rad, len);
+    server->wlen += len;
+    debug(DBG_DBG, "clientradputtls: Radius packet of length %d to TLS peer %s buffered", len, server->conf->name);
     pthread_mutex_unlock(&server->lock);
     return 1;
 }
 
+int clientradflushtls(struct server *server) {
+    int ret;
+
+    pthread_mutex_lock(&server->lock);
+    ret = tlsflushlocked(server);
+    pthread_mutex_unlock(&server->lock);
+    return ret;
+}
+
 void *tlsclientrd(void *arg) {
     struct server *server = (struct server *)arg;
     unsigned char *buf;
@@ -350,10 +444,13 @@ void *tlsclientrd(void *arg) {
                 debug (DBG_WARN, "tlscleintrd: connection to server %s lost", server->conf->name);
             else if (server->lostrqs)
                 debug (DBG_WARN, "tlsclientrd: server %s did not respond, closing connection.", server->conf->name);
-            if (server->dynamiclookuparg)
+            if (server->dynamiclookuparg || server->conf->retired)
+                break;
+            if (!tlsconnect(server, 0, "tlsclientrd"))
                 break;
-            tlsconnect(server, 0, "tlsclientrd");
         }
+        if (server->conf->retired)
+            break;
         if (server->dynamiclookuparg) {
             gettimeofday(&now, NULL);
             if (now.tv_sec - server->lastreply.tv_sec > IDLE_TIMEOUT) {
@@ -364,15 +461,18 @@ void *tlsclientrd(void *arg) {
         continue;
     }
 
-	replyh(server, buf);
+	replyhdispatch(server, buf);
 
     }
     debug(DBG_INFO, "tlsclientrd: exiting for %s", server->conf->name);
     pthread_mutex_lock(&server->lock);
     server->state = RSP_SERVER_STATE_FAILING;
-    SSL_shutdown(server->ssl);
-    shutdown(server->sock, SHUT_RDWR);
-    close(server->sock);
+    if (server->ssl)
+        SSL_shutdown(server->ssl);
+    if (server->sock >= 0) {
+        shutdown(server->sock, SHUT_RDWR);
+        close(server->sock);
+    }
 
     /* Wake up clientwr(). */
     server->clientrdgone = 1;
@@ -383,15 +483,39 @@ void *tlsclientrd(void *arg) {
     return NULL;
 }
 
+/* waits up to a second, without the client lock so that the reader may
+ * go on, for the socket fd to take more data. Returns 1 if it does, or
+ * if the connection is closing and there is no point waiting */
+static int tlswaitwritable(struct client *client, int fd) {
+    struct pollfd fds[1];
+    int closing;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLOUT;
+    if (poll(fds, 1, 1000) > 0)
+        return 1;
+    pthread_mutex_lock(&client->lock);
+    closing = !client->ssl;
+    pthread_mutex_unlock(&client->lock);
+    return closing;
+}
+
 void *tlsserverwr(void *arg) {
-    int cnt;
+    int cnt, len, fd, size = STREAM_WRITE_SIZE;
     struct client *client = (struct client *)arg;
     struct gqueue *replyq;
-    struct request *reply;
+    unsigned char *buf;
     char tmp[INET6_ADDRSTRLEN];
 
     debug(DBG_DBG, "tlsserverwr: starting for %s", addr2string(client->addr, tmp, sizeof(tmp)));
     replyq = client->replyq;
+    /* the socket stays open until the reader has joined us */
+    fd = SSL_get_fd(client->ssl);
+    buf = malloc(STREAM_WRITE_SIZE);
+    if (!buf) {
+        debug(DBG_ERR, "tlsserverwr: malloc failed");
+        pthread_exit(NULL);
+    }
     for (;;) {
         pthread_mutex_lock(&replyq->mutex);
         while (!list_first(replyq->entries)) {
@@ -402,26 +526,32 @@ void *tlsserverwr(void *arg) {
             } else
                 break;
         }
-
-        reply = (struct request *)list_shift(replyq->entries);
         pthread_mutex_unlock(&replyq->mutex);
 
+        /* the replies queued by now, and those coming within the
+         * WriteCoalesceDelay, are written at once */
+        len = coalescereplies(replyq, &buf, 0, &size, 1);
+
+        /* while the client does not read, wait with the replies in hand
+         * rather than drop them. The queue then fills up and the reader
+         * stops taking requests in queuewaitroom() */
+        while (len && !tlswaitwritable(client, fd))
+            ;
+
         pthread_mutex_lock(&client->lock);
         if (!client->ssl) {
             /* ssl might have changed while waiting */
-            if (reply)
-                freerq(reply);
             pthread_mutex_unlock(&client->lock);
+            free(buf);
             debug(DBG_DBG, "tlsserverwr: exiting as requested");
             pthread_exit(NULL);
         }
 
-        if ((cnt = dosslwrite(client->ssl, reply->replybuf, RADLEN(reply->replybuf), 0)) > 0) {
-            debug(DBG_DBG, "tlsserverwr: sent %d bytes, Radius packet of length %d to %s",
-                cnt, RADLEN(reply->replybuf), addr2string(client->addr, tmp, sizeof(tmp)));
+        if (len && (cnt = dosslwrite(client->ssl, buf, len, 0)) > 0) {
+            debug(DBG_DBG, "tlsserverwr: sent %d bytes of Radius packets to %s",
+                cnt, addr2string(client->addr, tmp, sizeof(tmp)));
         }
         pthread_mutex_unlock(&client->lock);
-    	freerq(reply);
     }
 }
 
@@ -439,6 +569,10 @@ void tlsserverrd(struct client *client) {
     }
 
     for (;;) {
+	if (!queuewaitroom(client->replyq, IDLE_TIMEOUT * 3)) {
+	    debug(DBG_ERR, "tlsserverrd: %s is not reading replies, closing connection", addr2string(client->addr, tmp, sizeof(tmp)));
+	    break;
+	}
 	buf = radtlsget(client->ssl, IDLE_TIMEOUT * 3, &client->lock);
 	if (!buf) {
 	    debug(DBG_ERR, "tlsserverrd: connection from %s lost", addr2string(client->addr, tmp, sizeof(tmp)));
@@ -447,12 +581,12 @@ void tlsserverrd(struct client *client) {
 	debug(DBG_DBG, "tlsserverrd: got Radius message from %s", addr2string(client->addr, tmp, sizeof(tmp)));
 	rq = newrequest();
 	if (!rq) {
-	    free(buf);
+	    pool_buffree(buf);
 	    continue;
 	}
 	rq->buf = buf;
 	rq->from = client;
-	if (!radsrv(rq)) {
+	if (!radsrvdispatch(rq)) {
 	    debug(DBG_ERR, "tlsserverrd: message authentication/validation failed, closing connection from %s", addr2string(client->addr, tmp, sizeof(tmp)));
 	    break;
 	}
@@ -475,7 +609,7 @@ void *tlsservernew(void *arg) {
     struct sockaddr_storage from;
     socklen_t fromlen = sizeof(from);
     struct clsrvconf *conf;
-    struct list_node *cur = NULL;
+    struct confcursor cur = {0, NULL};
     SSL *ssl = NULL;
     X509 *cert = NULL;
     SSL_CTX *ctx = NULL;
@@ -513,6 +647,7 @@ void *tlsservernew(void *arg) {
             debug(DBG_ERR, "tlsservernew: SSL_accept failed");
             goto exit;
         }
+        tlscounthandshake(ssl, conf->tlsconf, conf->name);
         cert = verifytlscert(ssl);
         if (!cert)
             goto exit;
@@ -535,6 +670,8 @@ void *tlsservernew(void *arg) {
                     enable_keepalive(s);
                 client->ssl = ssl;
                 client->addr = addr_copy((struct sockaddr *)&from);
+                if (evloop_addconn(client, s, ssl, IDLE_TIMEOUT * 3))
+                    pthread_exit(NULL);
                 tlsserverrd(client);
                 removeclient(client);
             } else
@@ -27,6 +27,10 @@
 #include <openssl/err.h>
 #include <openssl/md5.h>
 #include <openssl/x509v3.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+#include <openssl/core_names.h>
+#endif
 #include "debug.h"
 #include "hash.h"
 #include "util.h"
@@ -39,6 +43,12 @@ static struct hash *tlsconfs = NULL;
 static unsigned char cookie_secret[COOKIE_SECRET_LENGTH];
 static uint8_t cookie_secret_initialized = 0;
 
+/* how long sessions may be resumed, also how often ticket keys change */
+#define TLS_SESSION_LIFETIME 3600
+/* protects server->tlssession and the ticket keys */
+static pthread_mutex_t sessionlock = PTHREAD_MUTEX_INITIALIZER;
+static int sessionindex = -1;
+
 
 /* callbacks for making OpenSSL < 1.1 thread safe */
 #if OPENSSL_VERSION_NUMBER < 0x10100000
@@ -86,6 +96,7 @@ void sslinit() {
 #else
     OPENSSL_init_ssl(0, NULL);
 #endif
+    sessionindex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 }
 
 static int pem_passwd_cb(char *buf, int size, int rwflag, void *userdata) {
@@ -289,37 +300,145 @@ static X509_VERIFY_PARAM *createverifyparams(char **poids) {
     return pm;
 }
 
-static int tlsaddcacrl(SSL_CTX *ctx, struct tls *conf) {
-    STACK_OF(X509_NAME) *calist;
-    X509_STORE *x509_s;
+/* loads a new CA store with the CRL checking and policies of conf, and
+ * the client CA list to send with it */
+static int loadcastore(struct tls *conf, X509_STORE **store, STACK_OF(X509_NAME) **calist) {
     unsigned long error;
 
-    SSL_CTX_set_cert_store(ctx, X509_STORE_new());
-    if (!SSL_CTX_load_verify_locations(ctx, conf->cacertfile, conf->cacertpath)) {
+    *store = X509_STORE_new();
+    if (!*store || !X509_STORE_load_locations(*store, conf->cacertfile, conf->cacertpath)) {
 	while ((error = ERR_get_error()))
 	    debug(DBG_ERR, "SSL: %s", ERR_error_string(error, NULL));
 	debug(DBG_ERR, "tlsaddcacrl: Error updating TLS context %s", conf->name);
+	X509_STORE_free(*store);
 	return 0;
     }
 
-    calist = conf->cacertfile ? SSL_load_client_CA_file(conf->cacertfile) : NULL;
-    if (!conf->cacertfile || calist) {
+    *calist = conf->cacertfile ? SSL_load_client_CA_file(conf->cacertfile) : NULL;
+    if (!conf->cacertfile || *calist) {
 	if (conf->cacertpath) {
-	    if (!calist)
-		calist = sk_X509_NAME_new_null();
-	    if (!SSL_add_dir_cert_subjects_to_stack(calist, conf->cacertpath)) {
-		sk_X509_NAME_free(calist);
-		calist = NULL;
+	    if (!*calist)
+		*calist = sk_X509_NAME_new_null();
+	    if (!SSL_add_dir_cert_subjects_to_stack(*calist, conf->cacertpath)) {
+		sk_X509_NAME_free(*calist);
+		*calist = NULL;
 	    }
 	}
     }
-    if (!calist) {
+    if (!*calist) {
 	while ((error = ERR_get_error()))
 	    debug(DBG_ERR, "SSL: %s", ERR_error_string(error, NULL));
 	debug(DBG_ERR, "tlsaddcacrl: Error adding CA subjects in TLS context %s", conf->name);
+	X509_STORE_free(*store);
 	return 0;
     }
     ERR_clear_error(); /* add_dir_cert_subj returns errors on success */
+
+    if (conf->crlcheck)
+	X509_STORE_set_flags(*store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    if (conf->vpm)
+	X509_STORE_set1_param(*store, conf->vpm);
+    return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+/* CA stores by CACertificateFile, CACertificatePath and CRLCheck, so that
+ * tls blocks and contexts with the same CAs parse them only once */
+struct castore {
+    X509_STORE *store;
+    STACK_OF(X509_NAME) *calist;
+};
+static struct hash *castores = NULL;
+static pthread_mutex_t castoreslock = PTHREAD_MUTEX_INITIALIZER;
+
+/* releases what cs holds, but not cs itself */
+static void releasecastore(struct castore *cs) {
+    X509_STORE_free(cs->store);
+    sk_X509_NAME_pop_free(cs->calist, X509_NAME_free);
+}
+
+/* forgets all cached stores, contexts keep using those they have */
+static void flushcastores() {
+    struct hash_entry *entry;
+
+    pthread_mutex_lock(&castoreslock);
+    for (entry = hash_first(castores); entry; entry = hash_next(entry))
+	releasecastore((struct castore *)entry->data);
+    hash_destroy(castores);
+    castores = NULL;
+    pthread_mutex_unlock(&castoreslock);
+}
+#endif
+
+/* returns a reference to a CA store for conf and a copy of its client CA
+ * list, shared with other tls blocks unless reload says to read the CAs
+ * and CRLs again. Stores with policy OIDs are never shared */
+static int getcastore(struct tls *conf, uint8_t reload, X509_STORE **store, STACK_OF(X509_NAME) **calist) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+    struct castore *cs;
+    char *key;
+    int keylen;
+
+    if (conf->vpm)
+	return loadcastore(conf, store, calist);
+    keylen = asprintf(&key, "%s\n%s\n%d", conf->cacertfile ? conf->cacertfile : "",
+		      conf->cacertpath ? conf->cacertpath : "", conf->crlcheck);
+    if (keylen < 0) {
+	debug(DBG_ERR, "malloc failed");
+	return 0;
+    }
+
+    pthread_mutex_lock(&castoreslock);
+    if (!castores)
+	castores = hash_create();
+    cs = castores ? hash_read(castores, key, keylen) : NULL;
+    if (cs && reload) {
+	hash_extract(castores, key, keylen);
+	releasecastore(cs);
+	free(cs);
+	cs = NULL;
+    }
+    if (!cs) {
+	cs = malloc(sizeof(struct castore));
+	if (!cs || !loadcastore(conf, &cs->store, &cs->calist)) {
+	    free(cs);
+	    goto errexit;
+	}
+	if (!castores || !hash_insert(castores, key, keylen, cs)) {
+	    releasecastore(cs);
+	    free(cs);
+	    debug(DBG_ERR, "malloc failed");
+	    goto errexit;
+	}
+	debug(DBG_DBG, "getcastore: loaded CAs for TLS context %s", conf->name);
+    }
+    *calist = SSL_dup_CA_list(cs->calist);
+    if (!*calist) {
+	debug(DBG_ERR, "malloc failed");
+	goto errexit;
+    }
+    X509_STORE_up_ref(cs->store);
+    *store = cs->store;
+    pthread_mutex_unlock(&castoreslock);
+    free(key);
+    return 1;
+
+errexit:
+    pthread_mutex_unlock(&castoreslock);
+    free(key);
+    return 0;
+#else
+    return loadcastore(conf, store, calist);
+#endif
+}
+
+static int tlsaddcacrl(SSL_CTX *ctx, struct tls *conf, uint8_t reload) {
+    STACK_OF(X509_NAME) *calist;
+    X509_STORE *x509_s;
+
+    if (!getcastore(conf, reload, &x509_s, &calist))
+	return 0;
+    SSL_CTX_set_cert_store(ctx, x509_s);
     SSL_CTX_set_client_CA_list(ctx, calist);
 
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_cb);
@@ -327,18 +446,159 @@ static int tlsaddcacrl(SSL_CTX *ctx, struct tls *conf) {
     SSL_CTX_set_cookie_generate_cb(ctx, cookie_generate_cb);
     SSL_CTX_set_cookie_verify_cb(ctx, cookie_verify_cb);
 
-    if (conf->crlcheck || conf->vpm) {
-	x509_s = SSL_CTX_get_cert_store(ctx);
-	if (conf->crlcheck)
-	    X509_STORE_set_flags(x509_s, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-	if (conf->vpm)
-	    X509_STORE_set1_param(x509_s, conf->vpm);
-    }
-
     debug(DBG_DBG, "tlsaddcacrl: updated TLS context %s", conf->name);
     return 1;
 }
 
+/* stores a session we got as a client in the server it belongs to */
+static int newsession_cb(SSL *ssl, SSL_SESSION *session) {
+    struct server *server;
+
+    if (sessionindex < 0 || !(server = (struct server *)SSL_get_ex_data(ssl, sessionindex)))
+	return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+    if (!SSL_SESSION_is_resumable(session))
+	return 0;
+#endif
+    pthread_mutex_lock(&sessionlock);
+    if (server->tlssession)
+	SSL_SESSION_free(server->tlssession);
+    server->tlssession = session;
+    pthread_mutex_unlock(&sessionlock);
+    return 1;
+}
+
+/* must be called with sessionlock held, returns 0 if no key is available */
+static int ticketkeyrotate(struct tls *conf) {
+    struct tlsticketkey key;
+    time_t now = time(NULL);
+
+    if (conf->ticketkeys[0].created && now - conf->ticketkeys[0].created < TLS_SESSION_LIFETIME)
+	return 1;
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+	RAND_bytes(key.aeskey, sizeof(key.aeskey)) != 1 ||
+	RAND_bytes(key.hmackey, sizeof(key.hmackey)) != 1) {
+	debug(DBG_ERR, "ticketkeyrotate: failed to create session ticket key for TLS context %s", conf->name);
+	return conf->ticketkeys[0].created != 0;
+    }
+    key.created = now;
+    conf->ticketkeys[1] = conf->ticketkeys[0];
+    conf->ticketkeys[0] = key;
+    OPENSSL_cleanse(&key, sizeof(key));
+    debug(DBG_DBG, "ticketkeyrotate: new session ticket key for TLS context %s", conf->name);
+    return 1;
+}
+
+/* finds the key for a new (enc) or received ticket. Returns 1 if the ticket
+ * is good, 2 if it should be replaced by one with the current key, 0 if the
+ * key is unknown and -1 on error */
+static int ticketkeyget(struct tls *conf, unsigned char *name, int enc, struct tlsticketkey *key) {
+    int i, r = -1;
+
+    pthread_mutex_lock(&sessionlock);
+    if (ticketkeyrotate(conf)) {
+	if (enc) {
+	    *key = conf->ticketkeys[0];
+	    memcpy(name, key->name, sizeof(key->name));
+	    r = 1;
+	} else {
+	    r = 0;
+	    for (i = 0; i < 2; i++)
+		if (conf->ticketkeys[i].created && !memcmp(name, conf->ticketkeys[i].name, sizeof(key->name))) {
+		    *key = conf->ticketkeys[i];
+		    r = i ? 2 : 1;
+		    break;
+		}
+	}
+    }
+    pthread_mutex_unlock(&sessionlock);
+    return r;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+static int ticketkey_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc) {
+    OSSL_PARAM params[3];
+#else
+static int ticketkey_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc) {
+#endif
+    struct tls *conf = (struct tls *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    struct tlsticketkey key;
+    int r;
+
+    r = ticketkeyget(conf, name, enc, &key);
+    if (r < 1)
+	return r;
+    if (enc) {
+	if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+	    !EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aeskey, iv))
+	    r = -1;
+    } else if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aeskey, iv))
+	r = -1;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmackey, sizeof(key.hmackey));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (r > 0 && !EVP_MAC_CTX_set_params(hctx, params))
+	r = -1;
+#else
+    if (r > 0 && !HMAC_Init_ex(hctx, key.hmackey, sizeof(key.hmackey), EVP_sha256(), NULL))
+	r = -1;
+#endif
+    OPENSSL_cleanse(&key, sizeof(key));
+    return r;
+}
+
+/* offers the last session of the server, if any, for resumption */
+void tlsusesession(SSL *ssl, struct server *server) {
+    if (sessionindex < 0 || !SSL_set_ex_data(ssl, sessionindex, server))
+	return;
+    pthread_mutex_lock(&sessionlock);
+    if (server->tlssession && !SSL_set_session(ssl, server->tlssession))
+	debug(DBG_DBG, "tlsusesession: failed to set session for %s", server->conf->name);
+    pthread_mutex_unlock(&sessionlock);
+}
+
+void tlsdropsession(struct server *server) {
+    pthread_mutex_lock(&sessionlock);
+    if (server->tlssession) {
+	SSL_SESSION_free(server->tlssession);
+	server->tlssession = NULL;
+    }
+    pthread_mutex_unlock(&sessionlock);
+}
+
+void tlscounthandshake(SSL *ssl, struct tls *conf, const char *peer) {
+    uint64_t full, resumed;
+
+    if (SSL_session_reused(ssl)) {
+	resumed = __sync_add_and_fetch(&conf->resumedhandshakes, 1);
+	full = __sync_add_and_fetch(&conf->fullhandshakes, 0);
+    } else {
+	full = __sync_add_and_fetch(&conf->fullhandshakes, 1);
+	resumed = __sync_add_and_fetch(&conf->resumedhandshakes, 0);
+    }
+    debug(DBG_DBG, "tlscounthandshake: %s handshake with %s, TLS context %s has %llu resumed and %llu full handshakes",
+	  SSL_session_reused(ssl) ? "resumed" : "full", peer, conf->name,
+	  (unsigned long long)resumed, (unsigned long long)full);
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (conf->ktls)
+	debug(DBG_DBG, "tlscounthandshake: %s with %s, kernel TLS %s for sending and %s for receiving",
+	      SSL_get_cipher_name(ssl), peer,
+	      BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "used" : "not used",
+	      BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "used" : "not used");
+#endif
+}
+
+/* returns 1 if the kernel encrypts what is written to the socket of ssl,
+ * which may then be written to with write() */
+int tlsktlssend(SSL *ssl) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return 0;
+#endif
+}
+
 static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
     SSL_CTX *ctx = NULL;
     unsigned long error;
@@ -356,6 +616,12 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 #endif
 #ifdef DEBUG
 	SSL_CTX_set_info_callback(ctx, ssl_info_callback);
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	/* the record layer is handed to the kernel after the handshake if
+	 * it supports the negotiated cipher, else OpenSSL keeps it */
+	if (conf->ktls)
+	    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
 #endif
 	break;
 #endif
@@ -379,6 +645,30 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 	return NULL;
     }
 
+    /* sessions we get as a client are kept per server by newsession_cb,
+     * as a server we keep session ids and encrypt tickets with our own keys */
+    SSL_CTX_set_app_data(ctx, conf);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char *)conf->name,
+				   strlen(conf->name) < SSL_MAX_SID_CTX_LENGTH ? strlen(conf->name) : SSL_MAX_SID_CTX_LENGTH);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_LIFETIME);
+    SSL_CTX_sess_set_new_cb(ctx, newsession_cb);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* a peer closing without close_notify would otherwise make the session
+     * unusable for resumption */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    /* idle connections give back their read and write buffers, some
+     * 34 kB each, and get them again when there is something to do */
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketkey_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketkey_cb);
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     {
     long sslversion = SSLeay();
@@ -418,7 +708,7 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 	}
     }
 
-    if (!tlsaddcacrl(ctx, conf)) {
+    if (!tlsaddcacrl(ctx, conf, 0)) {
 	if (conf->vpm) {
 	    X509_VERIFY_PARAM_free(conf->vpm);
 	    conf->vpm = NULL;
@@ -453,7 +743,7 @@ SSL_CTX *tlsgetctx(uint8_t type, struct tls *t) {
 	if (t->tlsexpiry && t->tlsctx) {
 	    if (t->tlsexpiry < now.tv_sec) {
 		t->tlsexpiry = now.tv_sec + t->cacheexpiry;
-		tlsaddcacrl(t->tlsctx, t);
+		tlsaddcacrl(t->tlsctx, t, 1);
 	    }
 	}
 	if (!t->tlsctx) {
@@ -468,7 +758,7 @@ SSL_CTX *tlsgetctx(uint8_t type, struct tls *t) {
 	if (t->dtlsexpiry && t->dtlsctx) {
 	    if (t->dtlsexpiry < now.tv_sec) {
 		t->dtlsexpiry = now.tv_sec + t->cacheexpiry;
-		tlsaddcacrl(t->dtlsctx, t);
+		tlsaddcacrl(t->dtlsctx, t, 1);
 	    }
 	}
 	if (!t->dtlsctx) {
@@ -488,6 +778,9 @@ void tlsreloadcrls() {
     struct timeval now;
 
     debug (DBG_NOTICE, "reloading CRLs");
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+    flushcastores();
+#endif
 
     gettimeofday(&now, NULL);
 
@@ -497,14 +790,14 @@ void tlsreloadcrls() {
 	if (conf->tlsctx) {
 	    if (conf->tlsexpiry)
 		conf->tlsexpiry = now.tv_sec + conf->cacheexpiry;
-	    tlsaddcacrl(conf->tlsctx, conf);
+	    tlsaddcacrl(conf->tlsctx, conf, 0);
 	}
 #endif
 #ifdef RADPROT_DTLS
 	if (conf->dtlsctx) {
 	    if (conf->dtlsexpiry)
 		conf->dtlsexpiry = now.tv_sec + conf->cacheexpiry;
-	    tlsaddcacrl(conf->dtlsctx, conf);
+	    tlsaddcacrl(conf->dtlsctx, conf, 0);
 	}
 #endif
     }
@@ -741,6 +1034,7 @@ int verifyconfcert(X509 *cert, struct clsrvconf *conf) {
 int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
     struct tls *conf;
     long int expiry = LONG_MIN;
+    int ret = 0;
 
     debug(DBG_DBG, "conftls_cb called for %s", block);
 
@@ -760,6 +1054,7 @@ int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *v
 			  "CacheExpiry", CONF_LINT, &expiry,
 			  "CRLCheck", CONF_BLN, &conf->crlcheck,
 			  "PolicyOID", CONF_MSTR, &conf->policyoids,
+			  "KTLS", CONF_BLN, &conf->ktls,
 			  NULL
 	    )) {
 	debug(DBG_ERR, "conftls_cb: configuration error in block %s", val);
@@ -780,7 +1075,19 @@ int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *v
 	}
 	conf->cacheexpiry = expiry;
     }
+#if !defined(SSL_OP_ENABLE_KTLS) || defined(OPENSSL_NO_KTLS)
+    if (conf->ktls) {
+	debug(DBG_WARN, "conftls_cb: KTLS in block %s is not supported by this OpenSSL, ignoring", val);
+	conf->ktls = 0;
+    }
+#endif
 
+    /* TLS blocks in use are not changed when reloading the config */
+    if (tlsconfs && hash_read(tlsconfs, val, strlen(val))) {
+	debug(DBG_DBG, "conftls_cb: TLS block %s already loaded, keeping it", val);
+	ret = 1;
+	goto errexit;
+    }
     conf->name = stringcopy(val, 0);
     if (!conf->name) {
 	debug(DBG_ERR, "conftls_cb: malloc failed");
@@ -807,7 +1114,7 @@ errexit:
     free(conf->certkeypwd);
     freegconfmstr(conf->policyoids);
     free(conf);
-    return 0;
+    return ret;
 }
 
 int addmatchcertattr(struct clsrvconf *conf) {
@@ -9,6 +9,17 @@
 #define ASN1_STRING_length(o) ((o)->length)
 #endif
 
+struct server;
+
+/* key for encrypting session tickets; the previous key is kept so that
+ * tickets issued just before a change can still be used */
+struct tlsticketkey {
+    uint8_t name[16];
+    uint8_t aeskey[32];
+    uint8_t hmackey[32];
+    time_t created;
+};
+
 struct tls {
     char *name;
     char *cacertfile;
@@ -17,6 +28,7 @@ struct tls {
     char *certkeyfile;
     char *certkeypwd;
     uint8_t crlcheck;
+    uint8_t ktls;
     char **policyoids;
     uint32_t cacheexpiry;
     uint32_t tlsexpiry;
@@ -24,8 +36,10 @@ struct tls {
     X509_VERIFY_PARAM *vpm;
     SSL_CTX *tlsctx;
     SSL_CTX *dtlsctx;
-	SSL *dtlssslprep;
     pthread_mutex_t lock;
+    struct tlsticketkey ticketkeys[2];
+    uint64_t fullhandshakes;
+    uint64_t resumedhandshakes;
 };
 
 #if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
@@ -39,6 +53,10 @@ int addmatchcertattr(struct clsrvconf *conf);
 void tlsreloadcrls();
 int sslconnecttimeout(SSL *ssl, int timeout);
 int sslaccepttimeout (SSL *ssl, int timeout);
+void tlsusesession(SSL *ssl, struct server *server);
+void tlsdropsession(struct server *server);
+void tlscounthandshake(SSL *ssl, struct tls *conf, const char *peer);
+int tlsktlssend(SSL *ssl);
 #endif
 
 /* Local Variables: */
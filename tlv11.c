@@ -9,6 +9,7 @@
 #endif
 #include "list.h"
 #include "tlv11.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -16,15 +17,16 @@
 struct tlv *maketlv(uint8_t t, uint8_t l, void *v) {
     struct tlv *tlv;
 
-    tlv = malloc(sizeof(struct tlv));
+    tlv = pool_malloc(sizeof(struct tlv));
     if (!tlv)
 	return NULL;
     tlv->t = t;
     tlv->l = l;
+    tlv->flags = 0;
     if (l && v) {
 	tlv->v = malloc(l);
 	if (!tlv->v) {
-	    free(tlv);
+	    pool_free(tlv, sizeof(struct tlv));
 	    return NULL;
 	}
 	memcpy(tlv->v, v, l);
@@ -39,11 +41,42 @@ struct tlv *copytlv(struct tlv *in) {
 
 void freetlv(struct tlv *tlv) {
     if (tlv) {
-	free(tlv->v);
-	free(tlv);
+	if (!(tlv->flags & TLV_BORROWED))
+	    free(tlv->v);
+	if (!(tlv->flags & TLV_EMBEDDED))
+	    pool_free(tlv, sizeof(struct tlv));
     }
 }
 
+/* changes the value length, keeping the start of the value. A borrowed
+ * value is first copied so that the buffer it points into is untouched.
+ * Returns 0 if malloc fails */
+int resizetlv(struct tlv *tlv, uint8_t newlen) {
+    uint8_t *newv;
+
+    if (newlen == tlv->l)
+	return 1;
+    if (tlv->flags & TLV_BORROWED) {
+	if (newlen < tlv->l) {
+	    tlv->l = newlen;
+	    return 1;
+	}
+	newv = malloc(newlen);
+	if (!newv)
+	    return 0;
+	if (tlv->l)
+	    memcpy(newv, tlv->v, tlv->l);
+	tlv->flags &= ~TLV_BORROWED;
+    } else {
+	newv = realloc(tlv->v, newlen);
+	if (!newv)
+	    return 0;
+    }
+    tlv->v = newv;
+    tlv->l = newlen;
+    return 1;
+}
+
 int eqtlv(struct tlv *t1, struct tlv *t2) {
     if (!t1 || !t2)
 	return t1 == t2;
@@ -2,15 +2,21 @@
  * Copyright (c) 2010, NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+/* flags for tlvs parsed by buf2radmsg() that live in the message's block */
+#define TLV_BORROWED 1 /* v is not separately allocated, copy before growing */
+#define TLV_EMBEDDED 2 /* the tlv itself is not separately allocated */
+
 struct tlv {
     uint8_t t;
     uint8_t l;
+    uint8_t flags;
     uint8_t *v;
 };
 
 struct tlv *maketlv(uint8_t, uint8_t, void *);
 struct tlv *copytlv(struct tlv *);
 void freetlv(struct tlv *);
+int resizetlv(struct tlv *, uint8_t);
 int eqtlv(struct tlv *, struct tlv *);
 struct list *copytlvlist(struct list *);
 void freetlvlist(struct list *);
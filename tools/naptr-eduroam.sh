@@ -5,7 +5,10 @@
 # realm given as argument, and creates a server template based
 # on that. It currently ignores weight markers, but does sort
 # servers on priority marker, lowest number first.
-# For host command this is column 5, for dig it is column 1.
+# For host command this is column 5, for dig it is column 5 of the
+# answer section.
+# With dig, the lowest TTL of the records used is printed as a TTL line,
+# so that radsecproxy caches the result for that long.
 
 usage() {
     echo "Usage: ${0} <realm>"
@@ -19,19 +22,22 @@ DIGCMD=$(command -v dig)
 HOSTCMD=$(command -v host)
 PRINTCMD=$(command -v printf)
 
+# prints host lines and ttl lines, the latter are taken out below
 dig_it_srv() {
-    ${DIGCMD} +short srv $SRV_HOST | sort -n -k1 |
+    ${DIGCMD} +noall +answer srv $SRV_HOST | grep -w SRV | sort -n -k5 |
     while read line; do
-	set $line ; PORT=$3 ; HOST=$4
+	set $line ; TTL=$2 ; PORT=$7 ; HOST=$8
 	$PRINTCMD "\thost ${HOST%.}:${PORT}\n"
+	$PRINTCMD "ttl ${TTL}\n"
     done
 }
 
 dig_it_naptr() {
-    ${DIGCMD} +short naptr ${REALM} | grep x-eduroam:radius.tls | sort -n -k1 |
+    ${DIGCMD} +noall +answer naptr ${REALM} | grep -w NAPTR | grep x-eduroam:radius.tls | sort -n -k5 |
     while read line; do
-	set $line ; TYPE=$3 ; HOST=$6
+	set $line ; TTL=$2 ; TYPE=$7 ; HOST=${10}
 	if [ "$TYPE" = "\"s\"" -o "$TYPE" = "\"S\"" ]; then
+	    $PRINTCMD "ttl ${TTL}\n"
 	    SRV_HOST=${HOST%.}
 	    dig_it_srv
 	fi
@@ -58,7 +64,9 @@ host_it_naptr() {
 }
 
 if [ -x "${DIGCMD}" ]; then
-    SERVERS=$(dig_it_naptr)
+    ANSWER=$(dig_it_naptr)
+    SERVERS=$(echo "${ANSWER}" | grep -v '^ttl ')
+    TTL=$(echo "${ANSWER}" | sed -n 's/^ttl //p' | sort -n | head -n 1)
 elif [ -x "${HOSTCMD}" ]; then
     SERVERS=$(host_it_naptr)
 else
@@ -68,6 +76,11 @@ fi
 
 if [ -n "${SERVERS}" ]; then
     $PRINTCMD "server dynamic_radsec.${REALM} {\n${SERVERS}\n\ttype TLS\n}\n"
+    if [ -n "${TTL}" ]; then
+	# radsecproxy ignores TTLs over a week
+	[ "${TTL}" -gt 604800 ] && TTL=604800
+	$PRINTCMD "TTL ${TTL}\n"
+    fi
     exit 0
 fi
 
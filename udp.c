@@ -2,6 +2,8 @@
  * Copyright (c) 2012-2013, 2017, NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+#define _GNU_SOURCE
+
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -21,19 +23,22 @@
 #include <pthread.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include "radsecproxy.h"
 #include "hostport.h"
 
 #ifdef RADPROT_UDP
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
 void *udpserverrd(void *arg);
+void *udpserverwr(void *arg);
 int clientradputudp(struct server *server, unsigned char *rad);
 void addclientudp(struct client *client);
-void addserverextraudp(struct clsrvconf *conf);
+void addserverextraudp(struct server *server);
 void udpsetsrcres();
 void initextraudp();
 
@@ -53,6 +58,7 @@ static const struct protodefs protodefs = {
     NULL, /* connecter */
     NULL, /* clientconnreader */
     clientradputudp, /* clientradput */
+    NULL, /* clientradflush */
     addclientudp, /* addclient */
     addserverextraudp, /* addserverextra */
     udpsetsrcres, /* setsrcres */
@@ -61,12 +67,47 @@ static const struct protodefs protodefs = {
 
 static int client4_sock = -1;
 static int client6_sock = -1;
-static struct gqueue *server_replyq = NULL;
+
+/* per listener socket state, each socket has its own reader, writer and
+ * reply queue, and a list of the clients it has received from */
+struct udpshard {
+    int sock;
+    struct gqueue *replyq;
+    struct list *clients;
+    time_t nextexpiry; /* when to look for expired clients again */
+};
 
 static struct addrinfo *srcres = NULL;
 static uint8_t handle;
 static struct commonprotoopts *protoopts = NULL;
 
+#define UDP_REPLYBATCH_SIZE 32
+/* a client is forgotten when it has sent nothing for UDP_CLIENT_EXPIRY
+ * seconds, see udpexpireclients() */
+#define UDP_CLIENT_EXPIRY 60
+#define UDP_EXPIRY_INTERVAL 10
+
+#if defined(HAVE_RECVMMSG)
+#define UDP_BATCH_SIZE 32
+#define UDP_BATCH_SLOTSIZE 4096
+#define UDP_BATCH_HISTSIZE 6 /* 1, 2-3, 4-7, 8-15, 16-31, 32 */
+#define UDP_BATCH_STATS_INTERVAL 300
+
+/* datagrams are received into a preallocated ring of fixed size slots,
+ * one ring per reader thread */
+struct udpbatch {
+    int sock;
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iov[UDP_BATCH_SIZE];
+    struct sockaddr_storage from[UDP_BATCH_SIZE];
+    unsigned char slots[UDP_BATCH_SIZE][UDP_BATCH_SLOTSIZE];
+    unsigned long long histogram[UDP_BATCH_HISTSIZE];
+    time_t laststats;
+};
+
+static struct list *listenbatch = NULL;
+#endif
+
 const struct protodefs *udpinit(uint8_t h) {
     handle = h;
     return &protodefs;
@@ -80,7 +121,38 @@ static char **getlistenerargs() {
     return protoopts ? protoopts->listenargs : NULL;
 }
 
+/* called before the first socket reader starts, from udpsetsrcres() for
+ * the readers of the extra server connections started by addserver(),
+ * and from initextraudp() for the others. Only the first call does it */
+static void setlistenbatch() {
+    static uint8_t done;
+#if defined(HAVE_RECVMMSG)
+    char **args = protoopts ? protoopts->listenbatchargs : NULL;
+    struct list_node *entry;
+    struct hostportres *hp;
+#endif
+
+    if (done)
+	return;
+    done = 1;
+#if defined(HAVE_RECVMMSG)
+    if (!args)
+	return;
+    if (!addhostport(&listenbatch, args, protodefs.portdefault, 0))
+	debugx(1, DBG_ERR, "ListenUDPBatch: failed to parse addresses");
+    for (entry = list_first(listenbatch); entry; entry = list_next(entry)) {
+	hp = (struct hostportres *)entry->data;
+	if (!resolvehostport(hp, AF_UNSPEC, protodefs.socktype, 1))
+	    debugx(1, DBG_ERR, "ListenUDPBatch: failed to resolve %s", hp->host ? hp->host : "*");
+    }
+#else
+    if (protoopts && protoopts->listenbatchargs)
+	debug(DBG_WARN, "ListenUDPBatch: recvmmsg() not available, using normal receive");
+#endif
+}
+
 void udpsetsrcres() {
+    setlistenbatch();
     if (!srcres)
 	srcres =
             resolvepassiveaddrinfo(protoopts ? protoopts->sourcearg : NULL,
@@ -128,30 +200,113 @@ uint16_t port_get(struct sockaddr *sa) {
     return 0;
 }
 
+/* removes the clients of shard that sent nothing for UDP_CLIENT_EXPIRY
+ * seconds, looking at most every UDP_EXPIRY_INTERVAL seconds. Called by
+ * the reader of the shard, its socket timeout wakes it that often */
+static void udpexpireclients(struct udpshard *shard) {
+    struct list_node *node;
+    struct client *c;
+    time_t now = time(NULL);
+    uint32_t n;
+    char tmp[INET6_ADDRSTRLEN];
+
+    if (now < shard->nextexpiry)
+	return;
+    shard->nextexpiry = now + UDP_EXPIRY_INTERVAL;
+    for (node = list_first(shard->clients); node; node = list_next(node))
+	if (((struct client *)node->data)->expiry < now)
+	    break;
+    if (!node)
+	return;
+
+    /* take every client off the list once, putting back those to keep */
+    for (n = list_count(shard->clients); n; n--) {
+	c = (struct client *)list_shift(shard->clients);
+	if (c->expiry >= now && list_push(shard->clients, c))
+	    continue;
+	debug(DBG_DBG, "udpexpireclients: removing expired client (%s)", addr2string(c->addr, tmp, sizeof(tmp)));
+	workflow_drain(&c->flow);
+	removeudpclientfromreplyq(c);
+	c->replyq = NULL; /* stop removeclient() from removing the shard replyq */
+	removeclient(c);
+    }
+}
+
+/* returns the client for peer from on the shard socket, creating it if
+ * needed */
+static struct client *udpgetclient(struct udpshard *shard, struct clsrvconf *p, struct sockaddr *from) {
+    struct sockaddr *fromcopy;
+    struct list_node *node;
+    struct client *c, *client;
+    time_t now = time(NULL);
+
+    for (node = list_first(shard->clients); node; node = list_next(node)) {
+        c = (struct client *)node->data;
+        if (c->conf == p && addr_equal(from, c->addr)) {
+            c->expiry = now + UDP_CLIENT_EXPIRY;
+            return c;
+        }
+    }
+
+    fromcopy = addr_copy(from);
+    if (!fromcopy)
+        return NULL;
+    pthread_mutex_lock(p->lock);
+    client = addclient(p, 0);
+    if (!client) {
+        free(fromcopy);
+        pthread_mutex_unlock(p->lock);
+        return NULL;
+    }
+    client->sock = shard->sock;
+    client->addr = fromcopy;
+    client->expiry = now + UDP_CLIENT_EXPIRY;
+    client->replyq = shard->replyq;
+    pthread_mutex_unlock(p->lock);
+    if (!list_push(shard->clients, client)) {
+        debug(DBG_ERR, "radudpget: malloc failed");
+        client->replyq = NULL;
+        removeclient(client);
+        return NULL;
+    }
+    return client;
+}
+
+/* returns the connection to the server in conf that uses socket s */
+static struct server *udpsockserver(struct clsrvconf *conf, int s) {
+    struct server *server;
+
+    for (server = conf->servers; server; server = server->nextconn)
+	if (server->sock == s)
+	    return server;
+    debug(DBG_WARN, "udpsockserver: got reply from %s on a socket it does not use, ignoring", conf->name);
+    return NULL;
+}
+
 /* exactly one of client and server must be non-NULL */
+/* shard is only used, and must be non-NULL, when client is */
 /* return who we received from in *client or *server */
 /* return from in sa if not NULL */
-unsigned char *radudpget(int s, struct client **client, struct server **server) {
+unsigned char *radudpget(int s, struct udpshard *shard, struct client **client, struct server **server) {
     int cnt, len;
     unsigned char buf[4], *rad = NULL;
     struct sockaddr_storage from;
-    struct sockaddr *fromcopy;
     socklen_t fromlen = sizeof(from);
     struct clsrvconf *p;
-    struct list_node *node;
-    struct client *c = NULL;
-    struct timeval now;
     char tmp[INET6_ADDRSTRLEN];
 
     for (;;) {
         if (rad) {
-            free(rad);
+            pool_buffree(rad);
             rad = NULL;
         }
 
+        if (shard)
+            udpexpireclients(shard);
         cnt = recvfrom(s, buf, 4, MSG_PEEK | MSG_TRUNC, (struct sockaddr *)&from, &fromlen);
         if (cnt == -1) {
-            debug(DBG_ERR, "radudpget: recv failed - %s", strerror(errno));
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                debug(DBG_ERR, "radudpget: recv failed - %s", strerror(errno));
             continue;
         }
 
@@ -173,7 +328,7 @@ unsigned char *radudpget(int s, struct client **client, struct server **server)
             continue;
         }
 
-        rad = malloc(len);
+        rad = pool_bufalloc(len);
         if (!rad) {
             debug(DBG_ERR, "radudpget: malloc failed");
             if (recv(s, buf, 4, 0) == -1)
@@ -192,48 +347,14 @@ unsigned char *radudpget(int s, struct client **client, struct server **server)
             debug(DBG_DBG, "radudpget: packet was padded with %d bytes", cnt - len);
 
         if (client) {
-            *client = NULL;
-            pthread_mutex_lock(p->lock);
-            for (node = list_first(p->clients); node;) {
-                c = (struct client *)node->data;
-                node = list_next(node);
-                if (s != c->sock)
-                    continue;
-                gettimeofday(&now, NULL);
-                if (!*client && addr_equal((struct sockaddr *)&from, c->addr)) {
-                    c->expiry = now.tv_sec + 60;
-                    *client = c;
-                }
-                if (c->expiry >= now.tv_sec)
-                    continue;
-
-                debug(DBG_DBG, "radudpget: removing expired client (%s)", addr2string(c->addr, tmp, sizeof(tmp)));
-                removeudpclientfromreplyq(c);
-                c->replyq = NULL; /* stop removeclient() from removing common udp replyq */
-                removelockedclient(c);
-                break;
-            }
-            if (!*client) {
-                fromcopy = addr_copy((struct sockaddr *)&from);
-                if (!fromcopy) {
-                    pthread_mutex_unlock(p->lock);
-                    continue;
-                }
-                c = addclient(p, 0);
-                if (!c) {
-                    free(fromcopy);
-                    pthread_mutex_unlock(p->lock);
-                    continue;
-                }
-                c->sock = s;
-                c->addr = fromcopy;
-                gettimeofday(&now, NULL);
-                c->expiry = now.tv_sec + 60;
-                *client = c;
-            }
-            pthread_mutex_unlock(p->lock);
-        } else if (server)
-            *server = p->servers;
+            *client = udpgetclient(shard, p, (struct sockaddr *)&from);
+            if (!*client)
+                continue;
+        } else if (server) {
+            *server = udpsockserver(p, s);
+            if (!*server)
+                continue;
+        }
         break;
     }
     return rad;
@@ -256,76 +377,390 @@ int clientradputudp(struct server *server, unsigned char *rad) {
     return 0;
 }
 
+#if defined(HAVE_RECVMMSG)
+static struct udpbatch *udpbatchnew(int s) {
+    struct udpbatch *b;
+    int i;
+
+    b = malloc(sizeof(struct udpbatch));
+    if (!b) {
+	debug(DBG_ERR, "udpbatchnew: malloc failed");
+	return NULL;
+    }
+    memset(b, 0, sizeof(struct udpbatch));
+    b->sock = s;
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+	b->iov[i].iov_base = b->slots[i];
+	b->iov[i].iov_len = UDP_BATCH_SLOTSIZE;
+	b->msgs[i].msg_hdr.msg_name = &b->from[i];
+	b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    b->laststats = time(NULL);
+    return b;
+}
+
+static void udpbatchstats(struct udpbatch *b, int cnt) {
+    int i;
+    time_t now;
+
+    for (i = 0; i < UDP_BATCH_HISTSIZE - 1 && cnt >> (i + 1); i++);
+    b->histogram[i]++;
+
+    now = time(NULL);
+    if (now - b->laststats < UDP_BATCH_STATS_INTERVAL)
+	return;
+    debug(DBG_INFO, "udpbatch: socket %d batch sizes last %ld seconds: 1: %llu, 2-3: %llu, 4-7: %llu, 8-15: %llu, 16-31: %llu, 32: %llu",
+	  b->sock, (long)(now - b->laststats), b->histogram[0], b->histogram[1], b->histogram[2],
+	  b->histogram[3], b->histogram[4], b->histogram[5]);
+    memset(b->histogram, 0, sizeof(b->histogram));
+    b->laststats = now;
+}
+
+/* receives up to UDP_BATCH_SIZE datagrams with a single recvmmsg() call,
+ * blocking only for the first one. returns the number received, 0 if the
+ * socket timeout ran out */
+static int udpbatchrecv(struct udpbatch *b) {
+    int i, cnt;
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+	b->msgs[i].msg_hdr.msg_flags = 0;
+    }
+    for (;;) {
+	cnt = recvmmsg(b->sock, b->msgs, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+	if (cnt > 0)
+	    break;
+	if (cnt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return 0;
+	if (cnt == -1 && errno != EINTR)
+	    debug(DBG_ERR, "udpbatchrecv: recvmmsg failed - %s", strerror(errno));
+    }
+    udpbatchstats(b, cnt);
+    return cnt;
+}
+
+/* checks slot i of the last batch, returns the datagram in it, or NULL
+ * if it should be ignored. who we received from in *client or *server */
+static unsigned char *udpbatchget(struct udpbatch *b, int i, struct udpshard *shard, struct client **client, struct server **server) {
+    struct clsrvconf *p;
+    struct sockaddr *from = (struct sockaddr *)&b->from[i];
+    unsigned char *buf = b->slots[i];
+    int cnt = b->msgs[i].msg_len, len;
+    char tmp[INET6_ADDRSTRLEN];
+
+    p = client
+	? find_clconf(handle, from, NULL)
+	: find_srvconf(handle, from, NULL);
+    if (!p) {
+	debug(DBG_WARN, "udpbatchget: got packet from wrong or unknown UDP peer %s, ignoring", addr2string(from, tmp, sizeof(tmp)));
+	return NULL;
+    }
+    if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+	debug(DBG_WARN, "udpbatchget: packet larger than %d bytes, ignoring", UDP_BATCH_SLOTSIZE);
+	return NULL;
+    }
+    if (cnt < 20 || (len = RADLEN(buf)) < 20) {
+	debug(DBG_WARN, "udpbatchget: length too small");
+	return NULL;
+    }
+    debug(DBG_DBG, "udpbatchget: got %d bytes from %s", cnt, addr2string(from, tmp, sizeof(tmp)));
+    if (cnt < len) {
+	debug(DBG_WARN, "udpbatchget: packet smaller than length field in radius header");
+	return NULL;
+    }
+    if (cnt > len)
+	debug(DBG_DBG, "udpbatchget: packet was padded with %d bytes", cnt - len);
+
+    if (client) {
+	*client = udpgetclient(shard, p, from);
+	if (!*client)
+	    return NULL;
+    } else if (server) {
+	*server = udpsockserver(p, b->sock);
+	if (!*server)
+	    return NULL;
+    }
+    return buf;
+}
+
+/* returns a copy of the datagram in a batch slot for the workers */
+static unsigned char *udpbatchcopy(unsigned char *buf) {
+    unsigned char *copy;
+
+    copy = pool_bufalloc(RADLEN(buf));
+    if (!copy) {
+	debug(DBG_ERR, "udpbatchcopy: malloc failed");
+	return NULL;
+    }
+    memcpy(copy, buf, RADLEN(buf));
+    return copy;
+}
+
+static void udpclientrdbatch(int s) {
+    struct udpbatch *b;
+    struct server *server;
+    unsigned char *buf;
+    int i, cnt;
+
+    while (!(b = udpbatchnew(s)))
+	sleep(5);
+    for (;;) {
+	cnt = udpbatchrecv(b);
+	for (i = 0; i < cnt; i++) {
+	    server = NULL;
+	    buf = udpbatchget(b, i, NULL, NULL, &server);
+	    if (!buf)
+		continue;
+	    if (!workers_count())
+		replyhbuf(server, buf);
+	    else if ((buf = udpbatchcopy(buf)))
+		replyhdispatch(server, buf);
+	}
+    }
+}
+
+static void udpserverrdbatch(struct udpshard *shard) {
+    struct udpbatch *b;
+    struct request *rq;
+    struct client *client;
+    unsigned char *buf;
+    int i, cnt;
+
+    while (!(b = udpbatchnew(shard->sock)))
+	sleep(5);
+    for (;;) {
+	while (!queuewaitroom(shard->replyq, IDLE_TIMEOUT));
+	udpexpireclients(shard);
+	cnt = udpbatchrecv(b);
+	for (i = 0; i < cnt; i++) {
+	    client = NULL;
+	    buf = udpbatchget(b, i, shard, &client, NULL);
+	    if (!buf)
+		continue;
+	    rq = newrequest();
+	    if (!rq)
+		continue; /* malloc failed, drop */
+	    rq->from = client;
+	    rq->udpsock = shard->sock;
+	    if (!workers_count()) {
+		radsrvbuf(rq, buf);
+		continue;
+	    }
+	    rq->buf = udpbatchcopy(buf);
+	    if (!rq->buf) {
+		freerq(rq);
+		continue;
+	    }
+	    radsrvdispatch(rq);
+	}
+    }
+}
+
+/* returns 1 if the local address of socket s is listed in ListenUDPBatch */
+static int udpbatchsock(int s) {
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+
+    if (!listenbatch || getsockname(s, (struct sockaddr *)&sa, &salen))
+	return 0;
+    return addressmatches(listenbatch, (struct sockaddr *)&sa, 1);
+}
+#endif
+
 void *udpclientrd(void *arg) {
     struct server *server;
     unsigned char *buf;
     int *s = (int *)arg;
 
+#if defined(HAVE_RECVMMSG)
+    if (listenbatch)
+	udpclientrdbatch(*s);
+#endif
     for (;;) {
 	server = NULL;
-	buf = radudpget(*s, NULL, &server);
-	replyh(server, buf);
+	buf = radudpget(*s, NULL, NULL, &server);
+	replyhdispatch(server, buf);
     }
 }
 
+static struct udpshard *udpshardnew(int s) {
+    struct udpshard *shard;
+    struct timeval timeout = { UDP_EXPIRY_INTERVAL, 0 };
+    pthread_t th;
+
+    shard = malloc(sizeof(struct udpshard));
+    if (!shard)
+	debugx(1, DBG_ERR, "udpshardnew: malloc failed");
+    memset(shard, 0, sizeof(struct udpshard));
+    shard->sock = s;
+    shard->clients = list_create();
+    if (!shard->clients)
+	debugx(1, DBG_ERR, "udpshardnew: malloc failed");
+    shard->replyq = newqueue();
+    /* wake the reader to expire clients also when nothing comes */
+    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+	debugerrno(errno, DBG_WARN, "udpshardnew: setsockopt SO_RCVTIMEO failed");
+    if (pthread_create(&th, &pthread_attr, udpserverwr, (void *)shard->replyq))
+	debugx(1, DBG_ERR, "pthread_create failed");
+    pthread_detach(th);
+    return shard;
+}
+
 void *udpserverrd(void *arg) {
     struct request *rq;
+    struct udpshard *shard;
     int *sp = (int *)arg;
 
+    shard = udpshardnew(*sp);
+#if defined(HAVE_RECVMMSG)
+    if (udpbatchsock(*sp)) {
+	debug(DBG_INFO, "udpserverrd: using batched receive on socket %d", *sp);
+	udpserverrdbatch(shard);
+    }
+#endif
     for (;;) {
+	while (!queuewaitroom(shard->replyq, IDLE_TIMEOUT));
 	rq = newrequest();
 	if (!rq) {
 	    sleep(5); /* malloc failed */
 	    continue;
 	}
-	rq->buf = radudpget(*sp, &rq->from, NULL);
+	rq->buf = radudpget(*sp, shard, &rq->from, NULL);
 	rq->udpsock = *sp;
-    gettimeofday(&rq->created, NULL);
-	radsrv(rq);
+	rqreceived(rq);
+	radsrvdispatch(rq);
     }
     free(sp);
     return NULL;
 }
 
+/* replies taken off the reply queue in one go and their destinations */
+struct udpreplybatch {
+    int cnt;
+    struct request *replies[UDP_REPLYBATCH_SIZE];
+    struct sockaddr_storage to[UDP_REPLYBATCH_SIZE];
+#if defined(HAVE_SENDMMSG)
+    struct mmsghdr msgs[UDP_REPLYBATCH_SIZE];
+    struct iovec iov[UDP_REPLYBATCH_SIZE];
+    uint8_t sent[UDP_REPLYBATCH_SIZE];
+#endif
+};
+
+#if defined(HAVE_SENDMMSG)
+/* sends the replies with one sendmmsg() call per udpsock, keeping
+ * the queue order of the replies for each socket */
+static void udpsendreplies(struct udpreplybatch *b) {
+    int i, j, n, r, sock;
+
+    for (i = 0; i < b->cnt; i++)
+	b->sent[i] = !b->replies[i]->from;
+
+    for (i = 0; i < b->cnt; i++) {
+	if (b->sent[i])
+	    continue;
+	sock = b->replies[i]->udpsock;
+	for (n = 0, j = i; j < b->cnt; j++) {
+	    if (b->sent[j] || b->replies[j]->udpsock != sock)
+		continue;
+	    b->iov[n].iov_base = b->replies[j]->replybuf;
+	    b->iov[n].iov_len = RADLEN(b->replies[j]->replybuf);
+	    memset(&b->msgs[n], 0, sizeof(struct mmsghdr));
+	    b->msgs[n].msg_hdr.msg_name = &b->to[j];
+	    b->msgs[n].msg_hdr.msg_namelen = SOCKADDR_SIZE(b->to[j]);
+	    b->msgs[n].msg_hdr.msg_iov = &b->iov[n];
+	    b->msgs[n].msg_hdr.msg_iovlen = 1;
+	    b->sent[j] = 1;
+	    n++;
+	}
+	for (j = 0; j < n; j += r) {
+	    r = sendmmsg(sock, b->msgs + j, n - j, 0);
+	    if (r < 1) {
+		debug(DBG_WARN, "udpserverwr: send failed");
+		r = 1; /* skip the failing reply */
+	    }
+	}
+	debug(DBG_DBG, "udpserverwr: sent %d replies on socket %d", n, sock);
+    }
+}
+#else
+static void udpsendreplies(struct udpreplybatch *b) {
+    int i;
+
+    for (i = 0; i < b->cnt; i++)
+	if (b->replies[i]->from)
+	    if (sendto(b->replies[i]->udpsock, b->replies[i]->replybuf, RADLEN(b->replies[i]->replybuf), 0,
+		       (struct sockaddr *)&b->to[i], SOCKADDR_SIZE(b->to[i])) < 0)
+		debug(DBG_WARN, "udpserverwr: send failed");
+}
+#endif
+
 void *udpserverwr(void *arg) {
     struct gqueue *replyq = (struct gqueue *)arg;
     struct request *reply;
-    struct sockaddr_storage to;
+    struct udpreplybatch *b;
+    int i;
+
+    b = malloc(sizeof(struct udpreplybatch));
+    if (!b)
+	debugx(1, DBG_ERR, "udpserverwr: malloc failed");
 
     for (;;) {
 	pthread_mutex_lock(&replyq->mutex);
-	while (!(reply = (struct request *)list_shift(replyq->entries))) {
+	while (!list_first(replyq->entries)) {
 	    debug(DBG_DBG, "udp server writer, waiting for signal");
 	    pthread_cond_wait(&replyq->cond, &replyq->mutex);
 	    debug(DBG_DBG, "udp server writer, got signal");
 	}
-	/* do this with lock, udpserverrd may set from = NULL if from expires */
-	if (reply->from)
-	    memcpy(&to, reply->from->addr, SOCKADDRP_SIZE(reply->from->addr));
+	for (b->cnt = 0; b->cnt < UDP_REPLYBATCH_SIZE; b->cnt++) {
+	    reply = queueshift(replyq);
+	    if (!reply)
+		break;
+	    /* do this with lock, udpserverrd may set from = NULL if from expires */
+	    if (reply->from)
+		memcpy(&b->to[b->cnt], reply->from->addr, SOCKADDRP_SIZE(reply->from->addr));
+	    b->replies[b->cnt] = reply;
+	}
 	pthread_mutex_unlock(&replyq->mutex);
-	if (reply->from) {
-	    if (sendto(reply->udpsock, reply->replybuf, RADLEN(reply->replybuf), 0, (struct sockaddr *)&to, SOCKADDR_SIZE(to)) < 0)
-		debug(DBG_WARN, "udpserverwr: send failed");
+
+	udpsendreplies(b);
+	for (i = 0; i < b->cnt; i++) {
+	    debug(DBG_DBG, "udpserverwr: refcount %d", b->replies[i]->refcount);
+	    freerq(b->replies[i]);
 	}
-	debug(DBG_DBG, "udpserverwr: refcount %d", reply->refcount);
-	freerq(reply);
     }
 }
 
 void addclientudp(struct client *client) {
-    client->replyq = server_replyq;
+    /* the reply queue of the receiving socket is set by radudpget */
+    client->replyq = NULL;
 }
 
-void addserverextraudp(struct clsrvconf *conf) {
+void addserverextraudp(struct server *server) {
+    struct clsrvconf *conf = server->conf;
+    pthread_t clth;
+    int family;
+
     assert(list_first(conf->hostports) != NULL);
-    switch (((struct hostportres *)list_first(conf->hostports)->data)->addrinfo->ai_family) {
+    family = ((struct hostportres *)list_first(conf->hostports)->data)->addrinfo->ai_family;
+    if (conf->servers) {
+	/* another connection to the server needs its own source port so
+	 * that replies can be told apart from those to the first one */
+	server->sock = bindtoaddr(srcres, family, 0);
+	if (server->sock < 0)
+	    debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	if (pthread_create(&clth, &pthread_attr, udpclientrd, (void *)&server->sock))
+	    debugx(1, DBG_ERR, "pthread_create failed");
+	return;
+    }
+    switch (family) {
     case AF_INET:
 	if (client4_sock < 0) {
 	    client4_sock = bindtoaddr(srcres, AF_INET, 0);
 	    if (client4_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
 	}
-	conf->servers->sock = client4_sock;
+	server->sock = client4_sock;
 	break;
     case AF_INET6:
 	if (client6_sock < 0) {
@@ -333,7 +768,7 @@ void addserverextraudp(struct clsrvconf *conf) {
 	    if (client6_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
 	}
-	conf->servers->sock = client6_sock;
+	server->sock = client6_sock;
 	break;
     default:
 	debugx(1, DBG_ERR, "addserver: unsupported address family");
@@ -341,12 +776,13 @@ void addserverextraudp(struct clsrvconf *conf) {
 }
 
 void initextraudp() {
-    pthread_t cl4th, cl6th, srvth;
+    pthread_t cl4th, cl6th;
 
     if (srcres) {
 	freeaddrinfo(srcres);
 	srcres = NULL;
     }
+    setlistenbatch();
 
     if (client4_sock >= 0)
 	if (pthread_create(&cl4th, &pthread_attr, udpclientrd, (void *)&client4_sock))
@@ -354,12 +790,6 @@ void initextraudp() {
     if (client6_sock >= 0)
 	if (pthread_create(&cl6th, &pthread_attr, udpclientrd, (void *)&client6_sock))
 	    debugx(1, DBG_ERR, "pthread_create failed");
-
-    if (find_clconf_type(handle, NULL)) {
-	server_replyq = newqueue();
-	if (pthread_create(&srvth, &pthread_attr, udpserverwr, (void *)server_replyq))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-    }
 }
 #else
 const struct protodefs *udpinit(uint8_t h) {
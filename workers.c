@@ -0,0 +1,304 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+/* Readers only frame packets and submit them. Items of unordered flows
+ * are queued on the workers in turn. An ordered flow keeps its items
+ * itself and has a single run item that is queued on its home worker
+ * whenever it has items and is not already queued or running. A worker
+ * running it runs up to WORKERS_BATCH of the items and queues it again
+ * if there are more. A worker with an empty queue takes the first item
+ * of another's queue, so a flow moves as a whole and its items never run
+ * at the same time. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "debug.h"
+#include "pool.h"
+#include "workers.h"
+
+extern pthread_attr_t pthread_attr;
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t cond;
+    struct workitem *first, *last;
+    uint8_t waiting;
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static uint32_t nextworker = 0;
+static uint32_t queued = 0; /* items submitted and not started */
+static uint32_t idle = 0; /* workers waiting for work */
+
+static void workerpush(struct worker *w, struct workitem *item) {
+    struct worker *v;
+    int i;
+
+    item->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->last)
+	w->last->next = item;
+    else
+	__atomic_store_n(&w->first, item, __ATOMIC_RELAXED);
+    w->last = item;
+    if (w->waiting) {
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    /* w is busy, wake an idle worker to take it */
+    if (!__atomic_load_n(&idle, __ATOMIC_RELAXED))
+	return;
+    for (i = 0; i < nworkers; i++) {
+	v = workers + i;
+	if (v == w || !__atomic_load_n(&v->waiting, __ATOMIC_RELAXED))
+	    continue;
+	pthread_mutex_lock(&v->lock);
+	if (v->waiting) {
+	    pthread_cond_signal(&v->cond);
+	    pthread_mutex_unlock(&v->lock);
+	    return;
+	}
+	pthread_mutex_unlock(&v->lock);
+    }
+}
+
+/* call with w->lock held. Others peek at first without the lock */
+static struct workitem *workershift(struct worker *w) {
+    struct workitem *item = w->first;
+
+    if (item) {
+	__atomic_store_n(&w->first, item->next, __ATOMIC_RELAXED);
+	if (!w->first)
+	    w->last = NULL;
+    }
+    return item;
+}
+
+static struct workitem *workersteal(struct worker *w) {
+    struct workitem *item;
+    struct worker *v;
+    int i;
+
+    for (i = 1; i < nworkers; i++) {
+	v = workers + (w - workers + i) % nworkers;
+	if (!__atomic_load_n(&v->first, __ATOMIC_RELAXED))
+	    continue;
+	pthread_mutex_lock(&v->lock);
+	item = workershift(v);
+	pthread_mutex_unlock(&v->lock);
+	if (item)
+	    return item;
+    }
+    return NULL;
+}
+
+/* call with flow->lock held */
+static struct workitem *flowshift(struct workflow *flow) {
+    struct workitem *item = flow->first;
+
+    if (item) {
+	flow->first = item->next;
+	if (!flow->first)
+	    flow->last = NULL;
+    }
+    return item;
+}
+
+/* call with flow->lock held, once pending reached zero. Returns whether
+ * flow was released, then the lock is let go and flow is not touched */
+static int flowidle(struct workflow *flow) {
+    void (*done)(void *) = flow->done;
+
+    pthread_cond_broadcast(&flow->idle);
+    if (!done)
+	return 0;
+    pthread_mutex_unlock(&flow->lock);
+    done(flow->donearg);
+    return 1;
+}
+
+static void runitem(struct workitem *item) {
+    __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+    item->fn(item->arg, item->buf);
+    pool_free(item, sizeof(struct workitem));
+}
+
+/* flow may be released as soon as pending reaches zero and the lock is
+ * let go, so it is not touched after that */
+static void runflow(struct worker *w, struct workflow *flow) {
+    struct workitem *item;
+    uint8_t more;
+    int n;
+
+    pthread_mutex_lock(&flow->lock);
+    item = flowshift(flow);
+    pthread_mutex_unlock(&flow->lock);
+    for (n = 1;; n++) {
+	runitem(item);
+	pthread_mutex_lock(&flow->lock);
+	flow->pending--;
+	item = n < WORKERS_BATCH ? flowshift(flow) : NULL;
+	more = item || flow->first;
+	if (!more)
+	    flow->scheduled = 0;
+	if (!flow->pending && flowidle(flow))
+	    return;
+	pthread_mutex_unlock(&flow->lock);
+	if (!item)
+	    break;
+    }
+    if (more)
+	workerpush(w, &flow->run);
+}
+
+static void *workerloop(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct workflow *flow;
+    struct workitem *item;
+
+    for (;;) {
+	pthread_mutex_lock(&w->lock);
+	item = workershift(w);
+	pthread_mutex_unlock(&w->lock);
+	if (!item)
+	    item = workersteal(w);
+	if (!item) {
+	    pthread_mutex_lock(&w->lock);
+	    if (!w->first) {
+		__atomic_store_n(&w->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&idle, 1, __ATOMIC_RELAXED);
+		pthread_cond_wait(&w->cond, &w->lock);
+		__atomic_sub_fetch(&idle, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+	    }
+	    pthread_mutex_unlock(&w->lock);
+	    continue;
+	}
+
+	flow = item->flow;
+	if (!item->fn) {
+	    runflow(w, flow);
+	    continue;
+	}
+	runitem(item);
+	pthread_mutex_lock(&flow->lock);
+	if (!--flow->pending && flowidle(flow))
+	    continue;
+	pthread_mutex_unlock(&flow->lock);
+    }
+    return NULL;
+}
+
+int workers_init(int n) {
+    struct worker *w;
+    int i;
+
+    if (n <= 0)
+	return 0;
+    workers = calloc(n, sizeof(struct worker));
+    if (!workers)
+	debugx(1, DBG_ERR, "workers_init: malloc failed");
+    nworkers = n;
+    for (i = 0; i < n; i++) {
+	w = workers + i;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, &pthread_attr, workerloop, (void *)w))
+	    debugx(1, DBG_ERR, "workers_init: pthread_create failed");
+	pthread_detach(w->thread);
+    }
+    debug(DBG_INFO, "workers_init: started %d request workers", n);
+    return n;
+}
+
+int workers_count() {
+    return nworkers;
+}
+
+void workflow_init(struct workflow *flow, uint8_t ordered) {
+    memset(flow, 0, sizeof(struct workflow));
+    pthread_mutex_init(&flow->lock, NULL);
+    pthread_cond_init(&flow->idle, NULL);
+    flow->ordered = ordered;
+    flow->run.flow = flow;
+    if (nworkers)
+	flow->home = __atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED) % nworkers;
+}
+
+void workflow_drain(struct workflow *flow) {
+    pthread_mutex_lock(&flow->lock);
+    while (flow->pending)
+	pthread_cond_wait(&flow->idle, &flow->lock);
+    pthread_mutex_unlock(&flow->lock);
+}
+
+void workflow_release(struct workflow *flow, void (*done)(void *), void *arg) {
+    pthread_mutex_lock(&flow->lock);
+    if (flow->pending) {
+	flow->done = done;
+	flow->donearg = arg;
+	pthread_mutex_unlock(&flow->lock);
+	return;
+    }
+    pthread_mutex_unlock(&flow->lock);
+    done(arg);
+}
+
+void workflow_destroy(struct workflow *flow) {
+    workflow_drain(flow);
+    pthread_cond_destroy(&flow->idle);
+    pthread_mutex_destroy(&flow->lock);
+}
+
+int workers_submit(struct workflow *flow, void (*fn)(void *, unsigned char *), void *arg, unsigned char *buf) {
+    struct workitem *item;
+    uint8_t schedule = 0;
+
+    if (__atomic_load_n(&queued, __ATOMIC_RELAXED) >= WORKERS_MAXQUEUE)
+	return 0;
+    item = pool_malloc(sizeof(struct workitem));
+    if (!item) {
+	debug(DBG_ERR, "workers_submit: malloc failed");
+	return 0;
+    }
+    item->next = NULL;
+    item->fn = fn;
+    item->arg = arg;
+    item->buf = buf;
+    item->flow = flow;
+
+    pthread_mutex_lock(&flow->lock);
+    if (flow->ordered && flow->pending >= WORKERS_MAXFLOW) {
+	pthread_mutex_unlock(&flow->lock);
+	pool_free(item, sizeof(struct workitem));
+	return 0;
+    }
+    flow->pending++;
+    __atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED);
+    if (flow->ordered) {
+	if (flow->last)
+	    flow->last->next = item;
+	else
+	    flow->first = item;
+	flow->last = item;
+	if (!flow->scheduled)
+	    schedule = flow->scheduled = 1;
+    }
+    pthread_mutex_unlock(&flow->lock);
+
+    if (!flow->ordered)
+	workerpush(workers + __atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED) % nworkers, item);
+    else if (schedule)
+	workerpush(workers + flow->home, &flow->run);
+    return 1;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
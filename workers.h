@@ -0,0 +1,71 @@
+/* Copyright (c) 2018, NORDUnet A/S */
+/* See LICENSE for licensing information. */
+
+#include <pthread.h>
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+
+/* A pool of worker threads that socket readers hand what they read to,
+ * so that validating and forwarding packets from one socket or one busy
+ * peer is not limited to the core of its reader. Each worker has a queue
+ * of its own and takes work queued for the others when it has none.
+ * Work is submitted on a flow. The work of an ordered flow, such as the
+ * requests of a client, runs one item at a time and in the order it was
+ * submitted, on whichever worker picks the flow up. */
+#define WORKERS_MAXQUEUE 65536 /* items waiting in all the queues */
+#define WORKERS_MAXFLOW 1024 /* items waiting on one ordered flow */
+#define WORKERS_BATCH 16 /* items of an ordered flow run before it is requeued */
+
+struct workflow;
+
+struct workitem {
+    struct workitem *next;
+    void (*fn)(void *arg, unsigned char *buf); /* NULL for the run item of a flow */
+    void *arg;
+    unsigned char *buf;
+    struct workflow *flow;
+};
+
+struct workflow {
+    pthread_mutex_t lock; /* protects the fields below */
+    pthread_cond_t idle;
+    struct workitem *first, *last; /* waiting items of an ordered flow */
+    struct workitem run; /* queued on a worker while the ordered flow has items */
+    uint32_t pending; /* items submitted and not done */
+    uint8_t ordered;
+    uint8_t scheduled; /* run is queued or the items are running */
+    uint8_t home; /* worker that run is queued on */
+    void (*done)(void *arg); /* set by workflow_release() */
+    void *donearg;
+};
+
+/* starts n worker threads; with 0 packets are handled by the readers.
+ * Returns n */
+int workers_init(int n);
+
+/* returns the number of workers */
+int workers_count();
+
+void workflow_init(struct workflow *flow, uint8_t ordered);
+
+/* waits until the work submitted on flow is done, and releases flow */
+void workflow_destroy(struct workflow *flow);
+
+/* waits until the work submitted on flow is done */
+void workflow_drain(struct workflow *flow);
+
+/* calls done(arg) once the work submitted on flow is done, at once if it
+ * is, else in the worker that finishes the last item. done may release
+ * flow. Nothing more may be submitted on flow */
+void workflow_release(struct workflow *flow, void (*done)(void *), void *arg);
+
+/* queues fn(arg, buf) to run in a worker. Returns 0 if too much work is
+ * waiting, the caller then keeps arg and buf */
+int workers_submit(struct workflow *flow, void (*fn)(void *, unsigned char *), void *arg, unsigned char *buf);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */